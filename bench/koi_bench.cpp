@@ -0,0 +1,478 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "koi.hpp"
+#include "msg.hpp"
+#include "archive.hpp"
+#include "crypt.hpp"
+#include "sha1.hpp"
+#include "settings.hpp"
+#include "nexus.hpp"
+#include "sequence.hpp"
+#include "network.hpp"
+#include "masterstate.hpp"
+#include "clusterstate.hpp"
+#include "cluster.hpp"
+#include "elector.hpp"
+#include "transport.hpp"
+#include "clock.hpp"
+#include "logging.hpp"
+#include "strfmt.hpp"
+
+#define MINIZ_HEADER_FILE_ONLY
+#include "miniz.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <map>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+
+/*
+ * koi-bench: microbenchmarks for the wire path.
+ *
+ * Each benchmark is run until it has taken RUN_NSECS, RUNS times
+ * over, and the time per iteration of the fastest run is reported.
+ * Other load on the machine only ever makes a run slower, so the
+ * fastest run varies the least from one invocation to the next.
+ *
+ * The payloads are sized like those of a cluster of ten nodes with
+ * eight services each. The output is a JSON array with one object
+ * per benchmark, in a fixed order:
+ *
+ *   name   what was measured
+ *   bytes  the size of the data handled per iteration, 0 if it
+ *          does not apply; for messages, the encoded size
+ *   ns     nanoseconds per iteration
+ *
+ * Given a baseline (earlier output, -b), each object also gets the
+ * baseline time and the change from it in percent, and koi-bench
+ * exits with status 2 if any benchmark is slower than the threshold
+ * (-t, default 10 percent). Names given on the command line pick the
+ * benchmarks whose names start with them.
+ *
+ * usage: koi-bench [-b baseline] [-t percent] [names...]
+ */
+
+using namespace koi;
+
+namespace koi {
+	void force_reload_config() {} // stub implementation
+}
+
+namespace {
+	const char* PASS = "benchmark";
+	const int RUNS = 7;
+	const uint64_t RUN_NSECS = 20*1000*1000;
+	const int NODES = 10;
+	const int SERVICES = 8;
+
+	volatile uint64_t sink; // results end up here, so the work isn't optimized away
+
+	uint64_t nsecs() {
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * units::nano + ts.tv_nsec;
+	}
+
+	// runs the measured operation the given number of times
+	typedef boost::function<void (size_t)> body;
+
+	struct benchmark {
+		benchmark(const string& name, size_t bytes, const body& fn)
+			: _name(name), _bytes(bytes), _fn(fn) {}
+		string _name;
+		size_t _bytes;
+		body _fn;
+	};
+
+	// nanoseconds per iteration of the fastest run
+	double measure(const body& fn) {
+		size_t n = 1;
+		uint64_t t;
+		for (;;) {
+			t = nsecs();
+			fn(n);
+			t = nsecs() - t;
+			if (t >= RUN_NSECS / 10)
+				break;
+			n *= 2;
+		}
+		n = std::max(n, (size_t)(n * RUN_NSECS / std::max(t, (uint64_t)1)));
+
+		uint64_t best = UINT64_MAX;
+		for (int r = 0; r < RUNS; ++r) {
+			t = nsecs();
+			fn(n);
+			best = std::min(best, nsecs() - t);
+		}
+		return (double)best / n;
+	}
+
+	// ns by name from earlier output, one benchmark per line
+	bool read_baseline(const char* path, std::map<string, double>& to) {
+		FILE* f = fopen(path, "r");
+		if (!f)
+			return false;
+		char line[512];
+		while (fgets(line, sizeof(line), f)) {
+			char name[256];
+			double ns;
+			const char* n = strstr(line, "\"name\": \"");
+			const char* t = strstr(line, "\"ns\": ");
+			if (n && t && sscanf(n, "\"name\": \"%255[^\"]\"", name) == 1 && sscanf(t, "\"ns\": %lf", &ns) == 1)
+				to[name] = ns;
+		}
+		fclose(f);
+		return true;
+	}
+
+	uuid node_uuid(int i) {
+		boost::uuids::name_generator gen(boost::uuids::nil_uuid());
+		return gen(strfmt<32>("node%02d", i).str());
+	}
+
+	net::endpoint node_addr(int i) {
+		return net::endpoint(boost::asio::ip::address_v4(0x0a000001 + i), 42000);
+	}
+
+	/*
+	 * payloads
+	 */
+
+	message healthreport_msg(int i) {
+		message m(node_uuid(i), 1);
+		msg::healthreport* hr = m.set_body<msg::healthreport>();
+		hr->_name = strfmt<32>("node%02d", i).str();
+		hr->_uptime = 86400000;
+		hr->_state = i ? S_Slave : S_Master;
+		hr->_mode = R_Active;
+		hr->_maintenance = false;
+		hr->_service_action = Svc_Start;
+		for (int s = 0; s < SERVICES; ++s)
+			hr->_services.push_back(service_info(strfmt<32>("service%d", s).c_str(), "",
+			                                     i ? Svc_Started : Svc_Promoted, false,
+			                                     s < SERVICES/2 ? "" : "group1"));
+		hr->_load._valid = true;
+		hr->_load._loadavg = 35;
+		hr->_load._steal = 1;
+		hr->_load._memfree = 2048;
+		hr->_prepared = i == 1;
+		return m;
+	}
+
+	message stateupdate_msg() {
+		message m(node_uuid(NODES - 1), 1);
+		msg::stateupdate* su = m.set_body<msg::stateupdate>();
+		su->_uptime = 86400000;
+		su->_master_uuid = node_uuid(0);
+		su->_master_last_seen = clock::now();
+		su->_master_name = "node00";
+		su->_master_addr = node_addr(0);
+		for (int g = 0; g < 3; ++g) {
+			msg::stateupdate::group_master gm;
+			gm._group = strfmt<32>("group%d", g).str();
+			gm._uuid = node_uuid(g);
+			su->_groups.push_back(gm);
+		}
+		su->_prepare_uuid = node_uuid(1);
+		su->_epoch = 12;
+		return m;
+	}
+
+	message request_msg() {
+		message m(node_uuid(0), 1);
+		msg::request* rq = m.set_body<msg::request>();
+		rq->_cmd = "start";
+		rq->_args.push_back("node03");
+		rq->_args.push_back("service5");
+		return m;
+	}
+
+	std::vector<string> status_lines() {
+		std::vector<string> lines;
+		for (int i = 0; i < NODES; ++i)
+			lines.push_back(strfmt<128>("node%02d %s uptime 86400s weight 100 load 35%% mem 2048M",
+			                            i, i ? "Slave" : "Master").str());
+		return lines;
+	}
+
+	// like the reply to koi status, large enough to be compressed
+	message response_msg() {
+		message m(node_uuid(0), 1);
+		msg::response* r = m.set_body<msg::response>();
+		r->_response["nodes"] = status_lines();
+		r->_response["master"] = "node00";
+		r->_response["elector"] = "node09";
+		r->_response["maintenance"] = false;
+		r->_response["quorum"] = true;
+		r->_response["epoch"] = 12;
+		r->_response["since"] = clock::now();
+		return m;
+	}
+
+	message heartbeat_msg() {
+		message m(node_uuid(0), 1);
+		msg::heartbeat* hb = m.set_body<msg::heartbeat>();
+		hb->_name = "node00";
+		hb->_flags = NodeFlag_Runner | NodeFlag_Leader;
+		for (int i = 0; i < NODES; ++i)
+			hb->_nodes.push_back(msg::heartbeat::node(node_uuid(i), strfmt<32>("node%02d", i).str(),
+			                                          i == NODES - 1 ? NodeFlag_Elector : NodeFlag_Runner,
+			                                          node_addr(i)));
+		hb->_elector = node_uuid(NODES - 1);
+		hb->_master = node_uuid(0);
+		hb->_cluster_maintenance = false;
+		return m;
+	}
+
+	// a record shaped like a health report, written with chive directly
+	void write_record(archive& a) {
+		std::vector<string> services;
+		for (int s = 0; s < SERVICES; ++s)
+			services.push_back(strfmt<32>("service%d", s).str());
+		a << string("node03") << (uint64_t)86400000 << (int)S_Slave << node_uuid(3)
+		  << boost::posix_time::ptime(boost::gregorian::date(2012, 6, 1)) << services;
+	}
+
+	/*
+	 * measured operations
+	 */
+
+	void chive_encode(size_t n) {
+		archive a;
+		for (size_t i = 0; i < n; ++i) {
+			a.clear();
+			write_record(a);
+			a.done();
+			sink += a.size();
+		}
+	}
+
+	void chive_decode(const archive& a, size_t n) {
+		for (size_t i = 0; i < n; ++i) {
+			string name;
+			uint64_t uptime;
+			int state;
+			uuid id;
+			ptime seen;
+			std::vector<string> services;
+			reader r(a);
+			r >> name >> uptime >> state >> id >> seen >> services;
+			sink += uptime + services.size();
+		}
+	}
+
+	void msg_encode(const message& m, size_t n) {
+		std::vector<uint8_t> to;
+		for (size_t i = 0; i < n; ++i) {
+			msg::encode(to, &m, PASS);
+			sink += to.size();
+		}
+	}
+
+	// decoding decrypts in place, so each iteration copies the input
+	void msg_decode(const std::vector<uint8_t>& data, size_t n) {
+		std::vector<uint8_t> from;
+		for (size_t i = 0; i < n; ++i) {
+			message m;
+			from = data;
+			sink += msg::decode(&m, from, PASS);
+		}
+	}
+
+	void sha1(const std::vector<uint8_t>& data, size_t n) {
+		for (size_t i = 0; i < n; ++i)
+			sink += SHA1(&data.front(), data.size()).end().at32(0);
+	}
+
+	void crypt(bool encrypt, std::vector<uint8_t> data, size_t n) {
+		SHA1::digest key = SHA1((const uint8_t*)PASS, strlen(PASS)).end();
+		for (size_t i = 0; i < n; ++i) {
+			if (encrypt)
+				crypto::encrypt(&data.front(), data.size(), key._data32, 5);
+			else
+				crypto::decrypt(&data.front(), data.size(), key._data32, 5);
+			sink += data[0];
+		}
+	}
+
+	void compress(const std::vector<uint8_t>& data, size_t n) {
+		std::vector<uint8_t> to(mz_compressBound(data.size()));
+		for (size_t i = 0; i < n; ++i) {
+			unsigned long len = to.size();
+			mz_compress(&to.front(), &len, &data.front(), data.size());
+			sink += len;
+		}
+	}
+
+	void uncompress(const std::vector<uint8_t>& data, size_t size, size_t n) {
+		std::vector<uint8_t> to(size);
+		for (size_t i = 0; i < n; ++i) {
+			unsigned long len = to.size();
+			mz_uncompress(&to.front(), &len, &data.front(), data.size());
+			sink += len;
+		}
+	}
+
+	// the steady state: every node is known and unchanged
+	void clusterstate_update(clusterstate& cs, size_t n) {
+		const clusterstate::nodelist nodes = cs._nodes;
+		for (size_t i = 0; i < n; ++i) {
+			const clusterstate::node& u = nodes[i % nodes.size()];
+			sink += cs.update(u._id, u._name, u._flags, u._addrs.get());
+		}
+	}
+
+	void elector_handle(elector& e, std::vector<message>& reports, size_t n) {
+		for (size_t i = 0; i < n; ++i)
+			e.handle(reports[i % reports.size()]);
+		sink += e._runners.size();
+	}
+
+	// stands in for the UDP socket of the elector's nexus
+	struct null_transport : public transport {
+		virtual net::endpoint open(uint16_t port, const receiver& fn) {
+			return net::endpoint(boost::asio::ip::address_v4::loopback(), port ? port : 1);
+		}
+		virtual void close(const net::endpoint& local) {}
+		virtual void send(const net::endpoint& from, const net::endpoint& to, const std::vector<uint8_t>& data) {}
+	};
+}
+
+int main(int argc, char** argv) {
+	const char* baseline_path = 0;
+	double threshold = 10;
+	std::vector<string> names;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "-b") && i + 1 < argc)
+			baseline_path = argv[++i];
+		else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+			threshold = atof(argv[++i]);
+		else if (argv[i][0] != '-')
+			names.push_back(argv[i]);
+		else {
+			fprintf(stderr, "usage: %s [-b baseline] [-t percent] [names...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	std::map<string, double> baseline;
+	if (baseline_path && !read_baseline(baseline_path, baseline)) {
+		fprintf(stderr, "%s: cannot read %s\n", argv[0], baseline_path);
+		return 1;
+	}
+
+	logging::set_log_mode(logging::LogToConsole);
+	logging::set_log_level(logging::Error);
+
+	std::vector<benchmark> benchmarks;
+
+	archive record;
+	write_record(record);
+	record.done();
+	benchmarks.push_back(benchmark("chive/encode", record.size(), chive_encode));
+	benchmarks.push_back(benchmark("chive/decode", record.size(), boost::bind(chive_decode, boost::cref(record), _1)));
+
+	message messages[] = { healthreport_msg(1), stateupdate_msg(), request_msg(), response_msg(), heartbeat_msg() };
+	std::vector<uint8_t> encoded[ASIZE(messages)];
+	for (size_t i = 0; i < ASIZE(messages); ++i) {
+		const string type = msg::type_to_string(messages[i]._op);
+		msg::encode(encoded[i], &messages[i], PASS);
+		benchmarks.push_back(benchmark("msg/encode/" + type, encoded[i].size(), boost::bind(msg_encode, boost::cref(messages[i]), _1)));
+		benchmarks.push_back(benchmark("msg/decode/" + type, encoded[i].size(), boost::bind(msg_decode, boost::cref(encoded[i]), _1)));
+	}
+
+	// a full datagram, and the password hash done for every message
+	const std::vector<uint8_t> datagram(1400, 0x5a), nonce(24, 0x5a);
+	benchmarks.push_back(benchmark("sha1/24", nonce.size(), boost::bind(sha1, boost::cref(nonce), _1)));
+	benchmarks.push_back(benchmark("sha1/1400", datagram.size(), boost::bind(sha1, boost::cref(datagram), _1)));
+	benchmarks.push_back(benchmark("crypt/encrypt", datagram.size(), boost::bind(crypt, true, datagram, _1)));
+	benchmarks.push_back(benchmark("crypt/decrypt", datagram.size(), boost::bind(crypt, false, datagram, _1)));
+
+	archive status;
+	status << status_lines();
+	status.done();
+	const std::vector<uint8_t> plain(status.data(), status.data() + status.size());
+	std::vector<uint8_t> packed(mz_compressBound(plain.size()));
+	unsigned long packed_len = packed.size();
+	mz_compress(&packed.front(), &packed_len, &plain.front(), plain.size());
+	packed.resize(packed_len);
+	benchmarks.push_back(benchmark("miniz/compress", plain.size(), boost::bind(compress, boost::cref(plain), _1)));
+	benchmarks.push_back(benchmark("miniz/uncompress", packed.size(), boost::bind(uncompress, boost::cref(packed), plain.size(), _1)));
+
+	const int cluster_sizes[] = { 10, 50 };
+	clusterstate states[ASIZE(cluster_sizes)];
+	for (size_t s = 0; s < ASIZE(cluster_sizes); ++s) {
+		for (int i = 0; i < cluster_sizes[s]; ++i)
+			states[s].update(node_uuid(i), strfmt<32>("node%02d", i).str(), NodeFlag_Runner, node_addr(i));
+		benchmarks.push_back(benchmark(strfmt<64>("clusterstate/update/%d", cluster_sizes[s]).str(), 0,
+		                               boost::bind(clusterstate_update, boost::ref(states[s]), _1)));
+	}
+
+	settings cfg;
+	cfg._name = "bench";
+	cfg._uuid = node_uuid(NODES - 1);
+	cfg._elector = true;
+	cfg._journal_size = 0;
+	null_transport null;
+	net::io_service io;
+	nexus route(io, cfg, &null);
+	elector e(route);
+	e.init(clock::now());
+	e.start();
+	std::vector<message> reports;
+	for (int i = 0; i < NODES; ++i) {
+		reports.push_back(healthreport_msg(i));
+		reports.back()._from = node_addr(i);
+	}
+	benchmarks.push_back(benchmark("elector/handle", 0, boost::bind(elector_handle, boost::ref(e), boost::ref(reports), _1)));
+
+	std::vector<string> regressions;
+	bool first = true;
+	printf("[\n");
+	FOREACH(const benchmark& b, benchmarks) {
+		bool selected = names.empty();
+		FOREACH(const string& n, names)
+			selected = selected || b._name.compare(0, n.size(), n) == 0;
+		if (!selected)
+			continue;
+
+		const double ns = measure(b._fn);
+		printf("%s  {\"name\": \"%s\", \"bytes\": %u, \"ns\": %.1f",
+		       first ? "" : ",\n", b._name.c_str(), (unsigned)b._bytes, ns);
+		const auto base = baseline.find(b._name);
+		if (base != baseline.end()) {
+			const double change = (ns - base->second) * 100 / base->second;
+			printf(", \"baseline\": %.1f, \"change\": %.1f", base->second, change);
+			if (change > threshold)
+				regressions.push_back(strfmt<128>("%s is %.1f%% slower than the baseline", b._name.c_str(), change).str());
+		}
+		printf("}");
+		fflush(stdout);
+		first = false;
+	}
+	printf("\n]\n");
+	fflush(stdout);
+	FOREACH(const string& r, regressions)
+		fprintf(stderr, "%s: %s\n", argv[0], r.c_str());
+
+	e.stop();
+	return regressions.empty() ? 0 : 2;
+}
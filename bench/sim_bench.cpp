@@ -0,0 +1,201 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "koi.hpp"
+#include "sim.hpp"
+#include "clock.hpp"
+#include "logging.hpp"
+#include "strfmt.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <boost/bind.hpp>
+
+/*
+ * koi-sim: failover scenarios on a simulated cluster, see test/sim.hpp.
+ *
+ * Each scenario starts a cluster of the given size on the virtual
+ * clock, waits for it to settle, then injects its fault. It reports,
+ * in seconds of cluster time:
+ *
+ *   election    from startup until the first master is promoted
+ *   failover    from the fault until another master is promoted,
+ *               0 if the master was not affected
+ *   convergence from the fault (or startup) until the live nodes
+ *               agree on the nodes, the elector and the master
+ *   heal        from ending the partition until all nodes agree
+ *
+ * along with the real time the scenario took. The output is a JSON
+ * array with one object per scenario. A step that did not finish
+ * within five minutes of cluster time is -1, one that does not apply
+ * is null.
+ *
+ * usage: koi-sim [-s seed] [-l loss] [nodes...]
+ */
+
+using namespace koi;
+
+namespace koi {
+	void force_reload_config() {} // stub implementation
+}
+
+namespace {
+	const uint64_t TIMEOUT = 300*units::micro;
+	const double NA = -2;
+
+	bool has_master(const sim_cluster& c) {
+		return c.master() >= 0;
+	}
+
+	bool other_master(const sim_cluster& c, int old) {
+		const int m = c.master();
+		return m >= 0 && m != old;
+	}
+
+	bool converged(const sim_cluster& c) {
+		return c.converged();
+	}
+
+	uint64_t wall_usecs() {
+		timeval tv;
+		gettimeofday(&tv, 0);
+		return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+
+	// seconds of cluster time from since until done, -1 on timeout
+	double time_until(sim_cluster& c, const boost::function<bool ()>& done, uint64_t since) {
+		if (!c.run_until(done, TIMEOUT))
+			return -1;
+		return (clock::usecs() - since) / 1e6;
+	}
+
+	string seconds(double s) {
+		if (s == NA)
+			return "null";
+		return strfmt<32>("%.3f", s).str();
+	}
+
+	struct result {
+		result() : _election(-1), _failover(NA), _convergence(-1), _heal(NA) {}
+		double _election;
+		double _failover;
+		double _convergence;
+		double _heal;
+	};
+
+	enum Fault { F_None, F_Master, F_Elector, F_Partition };
+	const char* fault_names[] = { "startup", "master_crash", "elector_crash", "master_partition" };
+
+	result run(Fault fault, size_t nodes, uint32_t seed, double loss) {
+		result r;
+		sim_cluster c(nodes, seed);
+		c._net._loss = loss;
+		const uint64_t started = clock::usecs();
+		for (size_t i = 0; i < nodes; ++i)
+			c.start(i);
+
+		r._election = time_until(c, boost::bind(has_master, boost::cref(c)), started);
+		if (r._election < 0)
+			return r;
+		const double settled = time_until(c, boost::bind(converged, boost::cref(c)), started);
+		if (fault == F_None || settled < 0) {
+			r._convergence = settled;
+			return r;
+		}
+
+		const int master = c.master();
+		const int elector = c.elector();
+		const uint64_t t0 = clock::usecs();
+		switch (fault) {
+		case F_Master:
+			c.crash(master);
+			break;
+		case F_Elector:
+			c.crash(elector);
+			break;
+		case F_Partition:
+			// the master alone on one side, the rest keep a majority
+			c.partition(std::vector<size_t>(1, master));
+			break;
+		case F_None:
+		default:
+			break;
+		}
+
+		if (fault == F_Elector && elector != master)
+			r._failover = 0;
+		else if ((r._failover = time_until(c, boost::bind(other_master, boost::cref(c), master), t0)) < 0)
+			return r;
+		if ((r._convergence = time_until(c, boost::bind(converged, boost::cref(c)), t0)) < 0)
+			return r;
+
+		if (fault == F_Partition) {
+			// two masters now, one has to go
+			const uint64_t t1 = clock::usecs();
+			c.heal();
+			r._heal = time_until(c, boost::bind(converged, boost::cref(c)), t1);
+		}
+		return r;
+	}
+}
+
+int main(int argc, char** argv) {
+	uint32_t seed = 1;
+	double loss = 0;
+	std::vector<size_t> sizes;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "-s") && i + 1 < argc)
+			seed = (uint32_t)atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-l") && i + 1 < argc)
+			loss = atof(argv[++i]);
+		else if (atoi(argv[i]) > 0)
+			sizes.push_back((size_t)atoi(argv[i]));
+		else {
+			fprintf(stderr, "usage: %s [-s seed] [-l loss] [nodes...]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (sizes.empty()) {
+		const size_t defaults[] = { 5, 10, 25, 50 };
+		sizes.assign(defaults, defaults + ASIZE(defaults));
+	}
+
+	logging::set_log_mode(logging::LogToConsole);
+	logging::set_log_level(logging::Error);
+	clock::set(clock::read());
+
+	printf("[\n");
+	bool first = true;
+	FOREACH(size_t n, sizes) {
+		for (int f = F_None; f <= F_Partition; ++f) {
+			const uint64_t started = wall_usecs();
+			const result r = run((Fault)f, n, seed, loss);
+			printf("%s  {\"scenario\": \"%s\", \"nodes\": %u, \"loss\": %g, \"seed\": %u, "
+			       "\"election\": %s, \"failover\": %s, \"convergence\": %s, \"heal\": %s, \"wall\": %.3f}",
+			       first ? "" : ",\n", fault_names[f], (unsigned)n, loss, (unsigned)seed,
+			       seconds(r._election).c_str(), seconds(r._failover).c_str(),
+			       seconds(r._convergence).c_str(), seconds(r._heal).c_str(),
+			       (wall_usecs() - started) / 1e6);
+			fflush(stdout);
+			first = false;
+		}
+	}
+	printf("\n]\n");
+	clock::reset();
+	return 0;
+}
@@ -16,6 +16,7 @@
 */
 #include "koi.hpp"
 #include "msg.hpp"
+#include "trace.hpp"
 #include <unistd.h>
 
 #include <boost/program_options.hpp>
@@ -50,6 +51,7 @@ ostream & operator<<(ostream & o, const vector<T>& v) {
 
 #include "variant_printer.hpp"
 #include "cli_command.hpp"
+#include "clock.hpp"
 
 namespace koi {
 	void force_reload_config() {} // stub implementation
@@ -70,7 +72,7 @@ namespace {
 			  _io_service(io_service),
 			  _socket(io_service),
 			  _server(server),
-			  _starttime(microsec_clock::universal_time()),
+			  _starttime(clock::now()),
 			  _id(id),
 			  _cluster_id(cluster_id),
 			  _pass(pass) {
@@ -134,14 +136,22 @@ namespace {
 
 			ptime resend_time;
 			ptime now;
+			_sent_at = clock::now();
 			while (sending()) {
-				now = microsec_clock::universal_time();
+				now = clock::now();
 				_server = _command->prepare(m, _server);
 				resend_time = now + seconds(2);
 				send_message(m, _server);
 
 				while (sending() && (now < resend_time)) {
-					if (command_timeout > 0 && (now - _starttime > seconds(command_timeout))) {
+					const int patience = _command->patience();
+					if (patience > 0 && now - _sent_at > milliseconds(patience)) {
+						command_ptr next = _command->expired(_complete);
+						if (!next)
+							break;
+						continue_with(next);
+					}
+					if (patience == 0 && command_timeout > 0 && (now - _starttime > seconds(command_timeout))) {
 						cerr << "Request timed out.\n";
 						interrupted = true;
 						break;
@@ -151,7 +161,7 @@ namespace {
 
 					usleep(1000);
 
-					now = microsec_clock::universal_time();
+					now = clock::now();
 				}
 			}
 			return interrupted ?  1 : _complete;
@@ -183,13 +193,17 @@ namespace {
 				return; // ignore
 
 			command_ptr next = _command->handle(m, _response_endpoint, _complete);
-			if (next) {
-				_command = next;
-				message mg(_id, _cluster_id);
-				_server = _command->prepare(mg, _server);
-				send_message(mg, _server);
-				_complete = -1;
-			}
+			if (next)
+				continue_with(next);
+		}
+
+		void continue_with(const command_ptr& next) {
+			_command = next;
+			_sent_at = clock::now();
+			message mg(_id, _cluster_id);
+			_server = _command->prepare(mg, _server);
+			send_message(mg, _server);
+			_complete = -1;
 		}
 
 		int               _complete;
@@ -200,6 +214,7 @@ namespace {
 		net::endpoint     _response_endpoint;
 		command_ptr       _command;
 		ptime             _starttime;
+		ptime             _sent_at; // to the current command
 		uuid              _id;
 		uint8_t           _cluster_id;
 		string            _pass;
@@ -275,6 +290,12 @@ int main(int argc, char* argv[]) {
 		command_list commands;
 		commands
 			.add("local", "", "Local node status information.")
+			.add("timeouts", "", "Service script durations and timeouts.")
+			.add("usage", "", "Service script CPU, memory and context switches.")
+			.add("output", "[node [service [event]]]", "Recent output of service scripts.")
+			.add("journal", "[node [since [until]]]", "State transitions journaled by a node, times in seconds ago.")
+			.add<trace_command>("trace", "[epoch]", "Failover phases on all nodes as Chrome trace JSON.")
+			.add<metrics_command>("metrics", "[node [prefix]]", "Node metrics in the Prometheus text format.")
 			.add("status", "[node]", "Node/cluster status information.")
 			.add<tree_command>("tree", "", "Cluster status formatted as a tree.")
 			.add("reconfigure", "[node]", "Reload the configuration file.")
@@ -285,7 +306,8 @@ int main(int argc, char* argv[]) {
 			.add("start", "[node]", "Start services on a stopped node.")
 			.add("stop", "[node]", "Demote and stop services on a node.")
 			.add("recover", "[node]", "Recover any failed nodes.")
-			.add("failures", "", "List recent failures.");
+			.add("failures", "", "List recent failures.")
+			.add("stats", "", "Elector decision engine statistics.");
 
 		if (vm.count("help")) {
 			cout.setf(ios::left, ios::adjustfield);
@@ -44,6 +44,12 @@ struct command {
 
 	virtual command_ptr handle(const message& msg, const net::endpoint& from, int& retval);
 
+	// milliseconds to wait for a reply before expired() is called,
+	// 0 to wait until the command times out
+	virtual int patience() const { return 0; }
+	// the command to continue with when no reply came, if any
+	virtual command_ptr expired(int& retval) { return command_ptr(); }
+
 	string _cmd;
 	vector<string> _args;
 };
@@ -113,6 +119,8 @@ struct tree_command : public command {
 				ret += " (executing: " + inf._event + ")";
 			if (inf._failed)
 				ret += " [FAILED]";
+			if (inf._group.size())
+				ret += " [group: " + inf._group + "]";
 			return ret;
 		}
 	};
@@ -312,6 +320,124 @@ struct redirect_command : public tree_command {
 	net::endpoint _redirect;
 };
 
+// Prints the metrics one per line, as node_exporter would read them.
+struct metrics_command : public command {
+	metrics_command(const char* cmd, const vector<string>& args) : command(cmd, args), _redirected(false) {
+	}
+
+	virtual net::endpoint prepare(message& m, net::endpoint to) {
+		return command::prepare(m, _redirected ? _redirect : to);
+	}
+
+	virtual command_ptr handle(const message& m, const net::endpoint& from, int& retval) {
+		if (m._op != msg::base::Response)
+			return command::handle(m, from, retval);
+		const msg::response* rs = m.body<msg::response>();
+		auto r = rs->_response.find("redirect");
+		if (r != rs->_response.end()) {
+			boost::shared_ptr<metrics_command> p(new metrics_command(_cmd.c_str(), get<vector<string>>(rs->_response.find("args")->second)));
+			p->_redirect = parse_endpoint(get<string>(r->second).c_str(), KOI_DEFAULT_CLUSTER_PORT);
+			p->_redirected = true;
+			retval = -1;
+			return p;
+		}
+		auto i = rs->_response.find("metrics");
+		if (i == rs->_response.end())
+			return command::handle(m, from, retval);
+		FOREACH(const string& line, get<vector<string>>(i->second))
+			cout << line << endl;
+		retval = 0;
+		return command_ptr();
+	}
+
+	net::endpoint _redirect;
+	bool _redirected;
+};
+
+// Collects the failover marks of all nodes: the node asked first
+// also lists its peers, which are then asked one at a time. Prints
+// the marks as Chrome trace JSON.
+struct trace_command : public command {
+	struct collected {
+		collected() : _asked_peers(false) {}
+		vector<failover_trace::mark> _marks;
+		vector<net::endpoint> _pending;
+		bool _asked_peers;
+	};
+
+	trace_command(const char* cmd, const vector<string>& args)
+		: command(cmd, args), _collected(new collected), _redirected(false) {
+	}
+
+	trace_command(const trace_command& from, const net::endpoint& to)
+		: command(from), _collected(from._collected), _to(to), _redirected(true) {
+	}
+
+	virtual net::endpoint prepare(message& m, net::endpoint to) {
+		msg::request* rpc = m.set_body<msg::request>();
+		rpc->_cmd = _cmd;
+		rpc->_args = _args;
+		return _redirected ? _to : to;
+	}
+
+	virtual command_ptr handle(const message& m, const net::endpoint& from, int& retval) {
+		if (m._op != msg::base::Response)
+			return command::handle(m, from, retval);
+		const msg::response* rs = m.body<msg::response>();
+		auto t = rs->_response.find("trace");
+		if (t == rs->_response.end())
+			return command::handle(m, from, retval);
+		if (_redirected && from != _to) {
+			retval = -1; // late reply from the previous node
+			return command_ptr();
+		}
+
+		const uint64_t epoch = _args.empty() ? 0 : strtoull(_args[0].c_str(), 0, 10);
+		FOREACH(const string& s, get<vector<string>>(t->second)) {
+			failover_trace::mark mk;
+			if (failover_trace::mark::parse(s, mk) && (epoch == 0 || mk._epoch == epoch))
+				_collected->_marks.push_back(mk);
+		}
+
+		auto p = rs->_response.find("peers");
+		if (!_collected->_asked_peers && p != rs->_response.end()) {
+			_collected->_asked_peers = true;
+			FOREACH(const string& s, get<vector<string>>(p->second))
+				_collected->_pending.push_back(parse_endpoint(s.c_str(), KOI_DEFAULT_CLUSTER_PORT));
+		}
+
+		return next_peer(retval);
+	}
+
+	// a peer that doesn't answer, e.g. the old master after a
+	// failover, is skipped
+	virtual int patience() const {
+		return _redirected ? 1000 : 0;
+	}
+
+	virtual command_ptr expired(int& retval) {
+		cerr << "No reply from " << to_string(_to) << ", skipping it.\n";
+		return next_peer(retval);
+	}
+
+	command_ptr next_peer(int& retval) {
+		if (!_collected->_pending.empty()) {
+			const net::endpoint next = _collected->_pending.back();
+			_collected->_pending.pop_back();
+			retval = -1;
+			return command_ptr(new trace_command(*this, next));
+		}
+
+		cout << failover_trace::chrome_json(_collected->_marks);
+		retval = 0;
+		return command_ptr();
+	}
+
+	boost::shared_ptr<collected> _collected;
+	net::endpoint _to;
+	bool _redirected;
+};
+
 
 namespace {
 	inline string value_for_entry(const string& key, const msg::rpc_variant& val) {
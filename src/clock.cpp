@@ -0,0 +1,127 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "koi.hpp"
+#include "clock.hpp"
+
+#include <time.h>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace boost::posix_time;
+
+namespace koi {
+	namespace clock {
+		namespace {
+			struct timeline {
+				timeline() : _wall(microsec_clock::universal_time()), _mono(monotonic()) {}
+
+				static uint64_t monotonic() {
+					struct timespec ts;
+					clock_gettime(CLOCK_MONOTONIC, &ts);
+					return (uint64_t)ts.tv_sec * units::micro + ts.tv_nsec / units::milli;
+				}
+
+				ptime at(uint64_t mono) const {
+					return _wall + microseconds(mono - _mono);
+				}
+
+				const ptime _wall;
+				const uint64_t _mono;
+			};
+
+			const timeline& base() {
+				static const timeline t;
+				return t;
+			}
+
+			ptime virtual_now(not_a_date_time);
+
+			// wall time minus now() time, zero under the virtual clock
+			time_duration wall_offset() {
+				if (!virtual_now.is_special())
+					return time_duration(0, 0, 0);
+				return wall() - read();
+			}
+
+			// min_date_time stands for never
+			bool is_never(const ptime& t) {
+				return t.is_special() || t == ptime(boost::date_time::min_date_time);
+			}
+
+			// set by tick(), so only the main loop thread has one
+			__thread bool cached = false;
+			__thread uint64_t cached_mono = 0;
+		}
+
+		ptime now() {
+			if (!virtual_now.is_special())
+				return virtual_now;
+			if (cached)
+				return base().at(cached_mono);
+			return read();
+		}
+
+		ptime read() {
+			if (!virtual_now.is_special())
+				return virtual_now;
+			return base().at(timeline::monotonic());
+		}
+
+		ptime wall() {
+			return microsec_clock::universal_time();
+		}
+
+		ptime to_wall(const ptime& t) {
+			return is_never(t) ? t : t + wall_offset();
+		}
+
+		ptime from_wall(const ptime& t) {
+			return is_never(t) ? t : t - wall_offset();
+		}
+
+		uint64_t usecs(const ptime& t) {
+			static const ptime epoch(boost::gregorian::date(1970, 1, 1));
+			return (t - epoch).total_microseconds();
+		}
+
+		void tick() {
+			cached = true;
+			cached_mono = timeline::monotonic();
+		}
+
+		void refresh() {
+			if (cached)
+				cached_mono = timeline::monotonic();
+		}
+
+		void set(const ptime& t) {
+			virtual_now = t;
+		}
+
+		void advance(uint64_t usec) {
+			if (!virtual_now.is_special())
+				virtual_now += microseconds(usec);
+		}
+
+		void reset() {
+			virtual_now = ptime(not_a_date_time);
+		}
+
+		bool is_virtual() {
+			return !virtual_now.is_special();
+		}
+	}
+}
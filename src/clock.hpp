@@ -0,0 +1,60 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#pragma once
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+namespace koi {
+	/*
+	 * Time for timeouts, intervals and uptimes.
+	 *
+	 * now() follows CLOCK_MONOTONIC from a base taken from the wall
+	 * clock at startup, so the ptimes look like ordinary UTC times
+	 * but never jump when NTP steps the system clock. The main loop
+	 * calls tick() at the start of every iteration, and until the
+	 * next tick now() returns that same time on the main thread, so
+	 * everything handled in one iteration agrees on the time. Other
+	 * threads, and code that waits for something to happen, read the
+	 * clock with read().
+	 *
+	 * wall() is the system time, for values shown to operators.
+	 * Since each node's now() has its own base, times sent to other
+	 * nodes go out as wall times with to_wall() and come back with
+	 * from_wall().
+	 *
+	 * Tests can replace the clock with a virtual one that only moves
+	 * when told to.
+	 */
+	namespace clock {
+		ptime now();
+		ptime read(); // bypasses the cached time
+		ptime wall();
+		ptime to_wall(const ptime& t); // the system time at now() time t
+		ptime from_wall(const ptime& t);
+		uint64_t usecs(const ptime& t); // since the epoch
+		inline uint64_t usecs() { return usecs(now()); }
+
+		void tick(); // start of a main loop iteration
+		void refresh(); // update the cached time, for loops waiting inside an iteration
+
+		// virtual clock, for tests
+		void set(const ptime& t);
+		void advance(uint64_t usec);
+		void reset(); // back to the system clock
+		bool is_virtual();
+	}
+}
@@ -50,6 +50,13 @@ const char* koi::nodeflags_to_string(int flags) {
 	return fval[flags];
 }
 
+const char* koi::cluster_mode_to_string(int mode) {
+	const char* names[] = { "Servant", "Candidate", "Leader" };
+	if (mode < 0 || mode >= (int)ASIZE(names))
+		return "Unknown";
+	return names[mode];
+}
+
 cluster::cluster(nexus& route, settings& cfg)
 	: _state(),
 	  _network(route, cfg._cluster_id),
@@ -79,14 +86,18 @@ void cluster::clear_callbacks() {
 }
 
 bool cluster::settings_changed(const settings& newcfg, const settings& oldcfg) {
-	if (newcfg._transport != oldcfg._transport) {
-		LOG_INFO("Transport has changed: \"%s\" -> \"%s\"",
-		         oldcfg._transport.c_str(), newcfg._transport.c_str());
-		return false;
-	}
-
 	_network._netid = newcfg._cluster_id;
 
+	if (oldcfg._elector && !newcfg._elector && _mode != Servant) {
+		LOG_INFO("Elector disabled: giving up cluster leadership.");
+		const bool was_leader = (_mode == Leader);
+		_mode = Servant;
+		_leader = nil_uuid();
+		clear(NodeFlag_Leader);
+		if (was_leader)
+			_on_down(this);
+	}
+
 	return true;
 }
 
@@ -27,6 +27,7 @@ namespace koi {
 	};
 
 	const char* nodeflags_to_string(int flags);
+	const char* cluster_mode_to_string(int mode);
 
 	struct cluster {
 		typedef boost::function<void (cluster*)> action;
@@ -16,16 +16,66 @@
 */
 #include "koi.hpp"
 #include "cmd.hpp"
+#include "os.hpp"
+#include "clock.hpp"
 
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <unistd.h>
 
 using namespace std;
 using namespace boost;
 using namespace boost::posix_time;
 
 namespace {
+	using namespace koi;
+
+	// the logger takes locks another thread may have held at fork(),
+	// so the child writes its warnings straight to stderr
+	void child_warn(const char* fmt, ...) {
+		char buf[128];
+		va_list ap;
+		va_start(ap, fmt);
+		int len = vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+		va_end(ap);
+		if (len < 0)
+			return;
+		len = std::min(len, (int)sizeof(buf) - 2);
+		buf[len++] = '\n';
+		ssize_t r = write(2, buf, len);
+		(void)r;
+	}
+
+	// runs in the forked child: failures are reported, the script still runs
+	void apply_limits(const process_limits& l) {
+		if (l._nice != process_limits::NICE_UNSET && setpriority(PRIO_PROCESS, 0, l._nice) != 0)
+			child_warn("Unable to set nice level %d", l._nice);
+		if (l._ionice_class != 0 && !os::set_io_priority(l._ionice_class, l._ionice_level))
+			child_warn("Unable to set io priority %d:%d", l._ionice_class, l._ionice_level);
+		if (l._cpu_seconds != 0) {
+			// soft limit sends SIGXCPU, the hard limit a second later SIGKILL
+			struct rlimit rl = { (rlim_t)l._cpu_seconds, (rlim_t)l._cpu_seconds + 1 };
+			if (setrlimit(RLIMIT_CPU, &rl) != 0)
+				child_warn("Unable to limit cpu time to %ds", (int)l._cpu_seconds);
+		}
+		if (l._address_space != 0) {
+			struct rlimit rl = { (rlim_t)l._address_space, (rlim_t)l._address_space };
+			if (setrlimit(RLIMIT_AS, &rl) != 0)
+				child_warn("Unable to limit address space");
+		}
+		if (!l._affinity.empty() && !os::set_cpu_affinity(l._affinity))
+			child_warn("Unable to set cpu affinity");
+	}
+
+	// like a shell: a process killed by a signal, e.g. by the cpu
+	// limit, fails with 128 + the signal
+	int exit_code(int status) {
+		if (WIFSIGNALED(status))
+			return 128 + WTERMSIG(status);
+		return WEXITSTATUS(status);
+	}
 
 	void childishellspawn(char* const* argv) {
 		stringstream cmdline;
@@ -46,10 +96,15 @@ namespace koi {
 		stdout_pipe[0] = -1;
 		stdout_pipe[1] = -1;
 		started_at = ptime(min_date_time);
+		finished_at = ptime(min_date_time);
+		exited = false;
+		memset(&usage, 0, sizeof(usage));
 	}
 
 	void command::begin(char* const* argv, const char* workdir) {
 		exitcode = 0;
+		exited = false;
+		finished_at = ptime(min_date_time);
 		stdout_pipe[0] = -1;
 		stdout_pipe[1] = -1;
 
@@ -65,6 +120,8 @@ namespace koi {
 			signal(SIGUSR1, SIG_IGN);
 			signal(SIGUSR2, SIG_IGN);
 
+			apply_limits(limits);
+
 			execvp(argv[0], argv);
 
 			// If we got here, it means the command didn't execute
@@ -72,7 +129,7 @@ namespace koi {
 			exit(-1);
 		}
 		else if (pid != -1) {
-			started_at = microsec_clock::universal_time();
+			started_at = clock::read();
 		}
 		else {
 			LOG_ERROR("Unable to fork: %s", argv[0]);
@@ -81,6 +138,8 @@ namespace koi {
 
 	void command::begin_grab_stdout(char* const* argv, const char* workdir) {
 		exitcode = 0;
+		exited = false;
+		finished_at = ptime(min_date_time);
 		if (pipe(stdout_pipe) < 0) {
 			LOG_ERROR("can't make pipe");
 			exit(-1);
@@ -104,6 +163,8 @@ namespace koi {
 			signal(SIGUSR1, SIG_IGN);
 			signal(SIGUSR2, SIG_IGN);
 
+			apply_limits(limits);
+
 			execvp(argv[0], argv);
 
 			// If we got here, it means the command didn't execute
@@ -113,7 +174,7 @@ namespace koi {
 		// parent
 		else if (pid != -1) {
 			close(stdout_pipe[1]);
-			started_at = microsec_clock::universal_time();
+			started_at = clock::read();
 		}
 		else {
 			LOG_ERROR("Unable to fork: %s", argv[0]);
@@ -122,6 +183,8 @@ namespace koi {
 
 	void command::begin_pipe_stdout_to(char* const* argv, const char* workdir, int inpipe) {
 		exitcode = 0;
+		exited = false;
+		finished_at = ptime(min_date_time);
 		if (inpipe <= 0) {
 			begin(argv, workdir);
 			return;
@@ -142,6 +205,8 @@ namespace koi {
 			signal(SIGUSR1, SIG_IGN);
 			signal(SIGUSR2, SIG_IGN);
 
+			apply_limits(limits);
+
 			execvp(argv[0], argv);
 
 			// If we got here, it means the command didn't execute
@@ -149,7 +214,7 @@ namespace koi {
 			exit(-1);
 		}
 		else if (pid != -1) {
-			started_at = microsec_clock::universal_time();
+			started_at = clock::read();
 		}
 		else {
 			LOG_ERROR("Unable to fork: %s", argv[0]);
@@ -167,6 +232,7 @@ namespace koi {
 	void command::fake_succeeded() {
 		pid = 0;
 		exitcode = 0;
+		exited = false;
 	}
 
 	bool command::query_complete() {
@@ -174,9 +240,11 @@ namespace koi {
 			return true;
 
 		int status = 0;
-		bool done = waitpid(pid, &status, WNOHANG) == pid;
+		bool done = wait4(pid, &status, WNOHANG, &usage) == pid;
 		if (done) {
-			exitcode = WEXITSTATUS(status);
+			exitcode = exit_code(status);
+			exited = WIFEXITED(status);
+			finished_at = clock::read();
 			pid = 0;
 		}
 		return done;
@@ -188,8 +256,10 @@ namespace koi {
 
 		int status = 0;
 
-		if (waitpid(pid, &status, 0) == pid) {
-			exitcode = WEXITSTATUS(status);
+		if (wait4(pid, &status, 0, &usage) == pid) {
+			exitcode = exit_code(status);
+			exited = WIFEXITED(status);
+			finished_at = clock::read();
 			pid = 0;
 			return true;
 		}
@@ -206,16 +276,22 @@ namespace koi {
 	}
 
 	bool command::termkill(size_t sleep_usec) {
-		if (!this->kill(SIGTERM)) {
-			return this->kill(SIGKILL);
-		}
-		else {
+		if (this->kill(SIGTERM)) {
 			usleep(sleep_usec);
-			if (!query_complete()) {
-				return this->kill(SIGKILL);
-			}
+			if (query_complete())
+				return true;
+		}
+		if (!this->kill(SIGKILL))
+			return false;
+		// reap it, so that its usage and finish time are recorded, but
+		// don't wait on a process stuck in the kernel: it stays active
+		// and the caller reaps it later
+		for (int i = 0; i < 10; ++i) {
+			if (query_complete())
+				return true;
+			usleep(10*1000);
 		}
-		return true;
+		return false;
 	}
 
 
@@ -16,6 +16,8 @@
 */
 #pragma once
 
+#include <sys/resource.h>
+
 namespace koi {
 	struct command {
 		command();
@@ -40,6 +42,10 @@ namespace koi {
 		int stdout_pipe[2]; // pipe to read from process
 
 		ptime started_at;
+		ptime finished_at; // when the process was reaped
+		bool exited; // reaped after a normal exit, not a signal
+		struct rusage usage; // resources used by the reaped process
+		process_limits limits; // applied to the next process started
 	};
 
 	bool execute_command(char* const* argv, const char* workdir, int* exitcode);
@@ -34,6 +34,10 @@
 #include "sha1.hpp"
 #include "archive.hpp"
 #include "masterstate.hpp"
+#include "os.hpp"
+#include "clock.hpp"
+#include "journal.hpp"
+#include "metrics.hpp"
 
 using namespace std;
 using namespace boost;
@@ -68,6 +72,51 @@ namespace koi {
 				return a->second._uptime > b->second._uptime;
 			return a->second._last_seen < b->second._last_seen;
 		}
+
+		struct by_score {
+			by_score(const elector::scoring_fn& fn) : _score(fn) {}
+			bool operator()(const irunner& a, const irunner& b) const {
+				const int64_t sa = _score(a->second);
+				const int64_t sb = _score(b->second);
+				if (sa != sb)
+					return sa > sb;
+				return runner_electability(a, b);
+			}
+			const elector::scoring_fn& _score;
+		};
+
+		// prepared runners promote faster
+		struct prepared_first {
+			prepared_first(const elector::scoring_fn& fn) : _score(fn) {}
+			bool operator()(const irunner& a, const irunner& b) const {
+				if (a->second._prepared != b->second._prepared)
+					return a->second._prepared;
+				return by_score(_score)(a, b);
+			}
+			const elector::scoring_fn& _score;
+		};
+
+		// below this much available memory, the score drops sharply
+		const uint32_t LOW_MEMORY_MB = 256;
+
+		int64_t uptime_score(const elector::runner_info&) {
+			return 0;
+		}
+
+		// the node weight, scaled down by cpu load and steal, and by
+		// memory pressure. Runners that don't report their load rank
+		// as if fully loaded.
+		int64_t load_score(const elector::runner_info& r) {
+			const load_info& l = r._load;
+			int64_t score = (int64_t)l._weight * 1000;
+			if (!l._valid)
+				return score / 2;
+			score = score * 100 / (100 + l._loadavg);
+			score = score * (100 - std::min<uint32_t>(l._steal, 100)) / 100;
+			if (l._memfree < LOW_MEMORY_MB)
+				score = score * l._memfree / LOW_MEMORY_MB;
+			return score;
+		}
 	}
 
 	elector::runner_info::runner_info()
@@ -81,7 +130,9 @@ namespace koi {
 		  _maintenance(false),
 		  _service_action(Svc_Stop),
 		  _endpoints(),
-		  _services() {
+		  _services(),
+		  _load(),
+		  _prepared(false) {
 	}
 
 	bool elector::runner_info::alive(uint64_t master_dead_time, ptime const& now) const {
@@ -104,7 +155,26 @@ namespace koi {
 
 	bool elector::runner_info::promoted_service() const {
 		FOREACH(const auto& s, _services)
-			if (s._state >= Svc_Demoting)
+			if (s._state >= Svc_Demoting && s._group.empty())
+				return true;
+		return false;
+	}
+
+	bool elector::runner_info::group_ready(const string& group) const {
+		bool found = false;
+		FOREACH(const auto& s, _services) {
+			if (s._group != group)
+				continue;
+			if (s._failed || s._state < Svc_Started)
+				return false;
+			found = true;
+		}
+		return found;
+	}
+
+	bool elector::runner_info::group_promoted(const string& group) const {
+		FOREACH(const auto& s, _services)
+			if (s._group == group && s._state >= Svc_Demoting)
 				return true;
 		return false;
 	}
@@ -125,6 +195,26 @@ namespace koi {
 		_mode = R_Active;
 	}
 
+	elector::stats::stats()
+		: _passes(0),
+		  _evaluations(0),
+		  _cpu_time(0),
+		  _decisions(0),
+		  _last_latency(0),
+		  _max_latency(0),
+		  _total_latency(0) {
+	}
+
+	bool elector::scoring(const string& name, scoring_fn& fn) {
+		if (name == "uptime")
+			fn = &uptime_score;
+		else if (name == "load")
+			fn = &load_score;
+		else
+			return false;
+		return true;
+	}
+
 	string elector::failure_info::to_string() const {
 		stringstream ss;
 		ss << _time << ": " << _name << " (" << _uuid << ")";
@@ -137,9 +227,26 @@ namespace koi {
 		_manual_master_mode = false;
 		_master = _runners.end();
 		_target_master = _runners.end();
+		_prepare_target = _runners.end();
 		_failures.reserve(MAX_FAILURES);
 
 		_state_sum = 0;
+		_dirty = true;
+		_dirty_since = clock::now();
+		_next_check = min_date_time;
+		_state_dirty = false;
+		_had_quorum = false;
+		_was_maintenance = false;
+		_epoch = 0;
+		_failing_over = false;
+		_set_scoring(route.cfg()._election_scoring);
+	}
+
+	void elector::_set_scoring(const string& name) {
+		if (!scoring(name, _scoring)) {
+			LOG_WARN("Unknown election scoring '%s', using uptime.", name.c_str());
+			scoring("uptime", _scoring);
+		}
 	}
 
 	elector::~elector() {
@@ -148,7 +255,7 @@ namespace koi {
 
 	bool elector::init(const ptime& starttime) {
 		_starttime = starttime;
-		_leadertime = microsec_clock::universal_time();
+		_leadertime = clock::now();
 		_lost_quorum = false;
 
 		load_state();
@@ -156,11 +263,11 @@ namespace koi {
 		return true;
 	}
 
-	bool elector::settings_changed(const settings& newcfg, const settings&) {
-		if (newcfg._elector == false) {
-			LOG_INFO("Elector disabled forces restart");
-			return false;
-		}
+	bool elector::settings_changed(const settings& newcfg, const settings& oldcfg) {
+		// if the elector is disabled, the cluster gives up leadership
+		// which stops the elector
+		if (newcfg._election_scoring != oldcfg._election_scoring)
+			_set_scoring(newcfg._election_scoring);
 		return true;
 	}
 
@@ -172,6 +279,8 @@ namespace koi {
 			         to_string(i->first).c_str(),
 			         state_to_string(i->second._state),
 			         state_to_string(newstate));
+			_emitter._nexus.get_journal().append(journal::Ev_Elector, i->second._uuid,
+			                                     i->second._state, newstate, i->second._name);
 			i->second._state = newstate;
 
 			if (newstate == S_Disconnected) {
@@ -183,6 +292,21 @@ namespace koi {
 		}
 	}
 
+	void elector::_trace(failover_trace::Phase phase, const ptime& when) {
+		_emitter._nexus.get_trace().add(_epoch, phase, clock::usecs(when), _emitter._nexus.cfg()._name);
+	}
+
+	// starts the epoch of the election that replaces the master
+	void elector::_master_lost(const ptime& now) {
+		if (_failing_over)
+			return;
+		_epoch = clock::usecs();
+		_failing_over = true;
+		metrics::get_counter("koi_elector_failovers_total", "Masters lost to a failure or disconnect.").add();
+		_trace(failover_trace::Ph_ReportLost, _master->second._last_seen);
+		_trace(failover_trace::Ph_Disconnected, now);
+	}
+
 	bool elector::_repromote_master() {
 		bool dirty = false;
 		if (_master == _runners.end() &&
@@ -211,6 +335,8 @@ namespace koi {
 						LOG_INFO("%s (%s) not seen for %d seconds. Mark as offline.",
 						         i->second._name.c_str(), to_string(i->first).c_str(),
 						         (int)(_emitter._nexus.cfg()._master_dead_time/1e6));
+						if (i == _master)
+							_master_lost(now);
 						transition_runner(i, S_Disconnected);
 						dirty = true;
 					}
@@ -222,6 +348,8 @@ namespace koi {
 						++nfailed;
 						LOG_TRACE("Found failed services on %s (%s), mark as failed",
 						          i->second._name.c_str(), to_string(i->first).c_str());
+						if (i == _master && i->second._state != S_Failed)
+							_master_lost(now);
 						transition_runner(i, S_Failed);
 						dirty = true;
 					}
@@ -267,14 +395,14 @@ namespace koi {
 
 		if (!_emitter._nexus.has_quorum()) {
 			_lost_quorum = true;
-			_leadertime = microsec_clock::universal_time();
+			_leadertime = clock::now();
 			return true;
 		}
 
 		if (_lost_quorum) {
 			LOG_TRACE("Gain of quorum.");
 			_lost_quorum = false;
-			_leadertime = microsec_clock::universal_time();
+			_leadertime = clock::now();
 		}
 
 		if (in_maintenance_mode ()) {
@@ -342,7 +470,7 @@ namespace koi {
 		if (!_find_candidates(now, candidates))
 			return false;
 
-		std::sort(candidates.begin(), candidates.end(), runner_electability);
+		std::sort(candidates.begin(), candidates.end(), prepared_first(_scoring));
 
 		auto winner = candidates.begin();
 
@@ -369,18 +497,228 @@ namespace koi {
 
 		for (auto i = toremove.begin(); i != toremove.end(); ++i) {
 			auto x = *i;
+			if (_handoff._active && (x == _handoff._from || x == _handoff._to)) {
+				LOG_INFO("Handoff cancelled: %s dropped.", x->second._name.c_str());
+				_handoff._active = false;
+			}
 			LOG_INFO("Dropping %s (%s): Marked as disconnected/failed for at least 30 minutes.",
 			         x->second._name.c_str(),
 			         lexical_cast<string>(x->first).c_str());
 			FOREACH(net::endpoint e, x->second._endpoints) {
 				_emitter.remove_receiver(e);
 			}
+			if (x == _prepare_target)
+				_prepare_target = _runners.end();
+			for (auto g = _group_masters.begin(); g != _group_masters.end();) {
+				if (g->second == x)
+					_group_masters.erase(g++);
+				else
+					++g;
+			}
 			_runners.erase(x);
 			dirty = true;
 		}
 		return dirty;
 	}
 
+	// With a master in place, the runner that would win the next
+	// election is told to prepare its services, so that a failover
+	// only needs the final promotion step.
+	bool elector::_choose_prepare_target(const ptime& now) {
+		runners::iterator target = _runners.end();
+		if (_master != _runners.end() && !_handoff._active) {
+			vector<runners::iterator> candidates;
+			_find_candidates(now, candidates);
+			candidates.erase(std::remove(candidates.begin(), candidates.end(), _master), candidates.end());
+			if (!candidates.empty())
+				target = *std::min_element(candidates.begin(), candidates.end(), by_score(_scoring));
+		}
+
+		if (target == _prepare_target)
+			return false;
+
+		if (target != _runners.end())
+			LOG_INFO("Preparing %s (%s) for promotion.",
+			         target->second._name.c_str(), to_string(target->first).c_str());
+		_prepare_target = target;
+		return true;
+	}
+
+	// Each resource group gets its own master, elected among the
+	// runners where all of the group's services are running. Group
+	// masters are spread over the runners, and avoid rules keep
+	// groups apart when there are enough runners to do so.
+	bool elector::_elect_groups(const ptime& now) {
+		const settings& cfg = _emitter._nexus.cfg();
+		bool dirty = false;
+
+		// forget groups that are no longer configured
+		for (auto i = _group_masters.begin(); i != _group_masters.end();) {
+			if (cfg.group(i->first) == 0) {
+				LOG_INFO("Group %s: removed.", i->first.c_str());
+				_group_masters.erase(i++);
+				dirty = true;
+			}
+			else {
+				++i;
+			}
+		}
+
+		const bool allowed = _group_election_allowed();
+
+		FOREACH(const group_config& g, cfg._groups) {
+			auto gm = _group_masters.find(g._name);
+			if (gm != _group_masters.end()) {
+				const runner_info& r = gm->second->second;
+				if (r.alive(cfg._master_dead_time, now) &&
+				    r._state >= S_Slave &&
+				    r._mode == R_Active &&
+				    r.group_ready(g._name))
+					continue;
+				LOG_INFO("Group %s: master %s (%s) lost.", g._name.c_str(),
+				         r._name.c_str(), to_string(r._uuid).c_str());
+				_group_masters.erase(gm);
+				dirty = true;
+			}
+
+			if (!allowed)
+				continue;
+
+			auto m = _find_group_master(now, g);
+			if (m != _runners.end()) {
+				LOG_INFO("Group %s: electing %s (%s) as master.", g._name.c_str(),
+				         m->second._name.c_str(), to_string(m->first).c_str());
+				_group_masters[g._name] = m;
+				dirty = true;
+			}
+		}
+		return dirty;
+	}
+
+	// same gates as the master election, without its side effects
+	bool elector::_group_election_allowed() const {
+		const settings& cfg = _emitter._nexus.cfg();
+		return _emitter._nexus.has_quorum() &&
+			!in_maintenance_mode() &&
+			_emitter.uptime(_starttime) >= cfg._elector_initial_promotion_delay/units::milli &&
+			_emitter.uptime(_leadertime) >= cfg._elector_startup_tolerance/units::milli;
+	}
+
+	elector::runners::iterator elector::_find_group_master(const ptime& now, const group_config& g) {
+		const settings& cfg = _emitter._nexus.cfg();
+
+		// a runner that already has the group promoted keeps it; wait
+		// for runners that still have it promoted to demote first
+		bool demoting = false;
+		for (auto i = _runners.begin(); i != _runners.end(); ++i) {
+			const runner_info& r = i->second;
+			if (r._state <= S_Disconnected || !r.group_promoted(g._name))
+				continue;
+			if (r.electable(now, 0) && r.group_ready(g._name))
+				return i;
+			demoting = true;
+		}
+		if (demoting)
+			return _runners.end();
+
+		vector<runners::iterator> candidates;
+		for (auto i = _runners.begin(); i != _runners.end(); ++i)
+			if (i->second.electable(now, cfg._runner_failure_promotion_timeout) &&
+			    i->second.group_ready(g._name))
+				candidates.push_back(i);
+		if (candidates.empty())
+			return _runners.end();
+
+		// prefer runners that don't break avoid rules, then runners
+		// with fewer masterships, then by score
+		auto best = candidates.end();
+		bool best_violates = true;
+		int best_count = 0;
+		by_score better(_scoring);
+		for (auto c = candidates.begin(); c != candidates.end(); ++c) {
+			const bool violates = _violates_avoid(*c, g);
+			const int count = _masterships(*c);
+			if (best == candidates.end() ||
+			    (violates != best_violates && !violates) ||
+			    (violates == best_violates && count < best_count) ||
+			    (violates == best_violates && count == best_count && better(*c, *best))) {
+				best = c;
+				best_violates = violates;
+				best_count = count;
+			}
+		}
+		if (best_violates)
+			LOG_WARN("Group %s: no runner satisfies the avoid rules.", g._name.c_str());
+		return *best;
+	}
+
+	int elector::_masterships(runners::iterator i) const {
+		int n = (i == _master) ? 1 : 0;
+		FOREACH(const auto& gm, _group_masters)
+			if (gm.second == i)
+				++n;
+		return n;
+	}
+
+	bool elector::_violates_avoid(runners::iterator i, const group_config& g) const {
+		if (i == _master && g.avoids("master"))
+			return true;
+		FOREACH(const auto& gm, _group_masters) {
+			if (gm.second != i || gm.first == g._name)
+				continue;
+			if (g.avoids(gm.first))
+				return true;
+			const group_config* other = _emitter._nexus.cfg().group(gm.first);
+			if (other && other->avoids(g._name))
+				return true;
+		}
+		return false;
+	}
+
+	void elector::_begin_handoff(runners::iterator from, runners::iterator to) {
+		LOG_INFO("Handoff: demoting %s (%s), %s (%s) is promoted when demotion completes.",
+		         from->second._name.c_str(), to_string(from->first).c_str(),
+		         to->second._name.c_str(), to_string(to->first).c_str());
+		_handoff._active = true;
+		_handoff._from = from;
+		_handoff._to = to;
+		_handoff._started = clock::now();
+
+		// send demote order
+		save_state();
+		_emitter.immediate_tick();
+	}
+
+	// Promote the handoff target once the old master has reported
+	// that it has no promoted services left, or is gone.
+	bool elector::_check_handoff() {
+		if (!_handoff._active)
+			return false;
+
+		const runner_info& from = _handoff._from->second;
+		if (from._state > S_Disconnected &&
+		    (from._state > S_Slave || from.promoted_service()))
+			return false;
+
+		_handoff._active = false;
+		if (_target_master != _handoff._to || _master != _runners.end()) {
+			LOG_INFO("Handoff superseded.");
+			return false;
+		}
+
+		const time_duration td = clock::now() - _handoff._started;
+		LOG_INFO("Handoff: %s demoted in %d ms.",
+		         from._name.c_str(), (int)td.total_milliseconds());
+
+		if (!_emitter._nexus.has_quorum() || !_elect_target_master())
+			return false;
+
+		// send promote order
+		save_state();
+		_emitter.immediate_tick();
+		return true;
+	}
+
 	void elector::start() {
 		_emitter.start();
 	}
@@ -389,13 +727,55 @@ namespace koi {
 		_emitter.stop();
 	}
 
+	void elector::mark_dirty() {
+		if (!_dirty) {
+			_dirty = true;
+			_dirty_since = clock::now();
+		}
+	}
+
 	void elector::update() {
 		_emitter.update();
+		++_stats._passes;
+
+		ptime now = clock::now();
+
+		// inputs that don't arrive as health reports
+		const bool quorum = _emitter._nexus.has_quorum();
+		if (quorum != _had_quorum || in_maintenance_mode() != _was_maintenance) {
+			_had_quorum = quorum;
+			_was_maintenance = in_maintenance_mode();
+			mark_dirty();
+		}
+
+		if (_dirty || now > _next_check) {
+			const uint64_t cpu0 = os::thread_cpu_time();
+			const bool triggered = _dirty;
+			_dirty = false;
+
+			_evaluate(now);
+
+			_stats._cpu_time += os::thread_cpu_time() - cpu0;
+			++_stats._evaluations;
+			if (triggered) {
+				const uint64_t latency = (clock::now() - _dirty_since).total_microseconds();
+				++_stats._decisions;
+				_stats._last_latency = latency;
+				_stats._total_latency += latency;
+				_stats._max_latency = (std::max)(_stats._max_latency, latency);
+			}
+		}
 
+		if (_state_dirty) {
+			_state_dirty = false;
+			save_state();
+		}
+	}
+
+	void elector::_evaluate(const ptime& now) {
 		// elect master that is already master
 		dirtyflag dirty = _repromote_master();
 
-		ptime now = microsec_clock::universal_time();
 		// service information
 		int npromoted = 0, nfailed = 0;
 		dirty= _check_runner_health(now, npromoted, nfailed);
@@ -403,14 +783,57 @@ namespace koi {
 		// deelect disconnected master
 		dirty= _check_master_health();
 
+		// promote the next master of a planned switchover
+		dirty= _check_handoff();
+
 		// elect master if needed/allowed
 		dirty= _election(now, npromoted);
 
 		// forget runners that have been disconnected for some time
 		dirty= _forget_old_runners(now);
 
-		if (dirty.get())
-			save_state();
+		// masters of the resource groups
+		dirty= _elect_groups(now);
+
+		// warm up the expected next master
+		dirty= _choose_prepare_target(now);
+
+		if (dirty.get()) {
+			// decisions can enable further decisions; evaluate
+			// again on the next pass until nothing changes
+			_state_dirty = true;
+			mark_dirty();
+		}
+
+		_next_check = _next_deadline(now);
+	}
+
+	// Earliest time at which an expiring timeout can change the
+	// outcome of the election checks, if no input changes before.
+	ptime elector::_next_deadline(const ptime& now) const {
+		struct local {
+			static void at(ptime& next, const ptime& now, const ptime& t) {
+				if (t >= now && t < next)
+					next = t;
+			}
+		};
+
+		const settings& cfg = _emitter._nexus.cfg();
+		ptime next(pos_infin);
+
+		// uptimes are compared in whole milliseconds
+		local::at(next, now, _starttime + microseconds(cfg._elector_initial_promotion_delay) + milliseconds(1));
+		local::at(next, now, _leadertime + microseconds(cfg._elector_startup_tolerance) + milliseconds(1));
+
+		FOREACH(const auto& i, _runners) {
+			const runner_info& r = i.second;
+			if (r._state > S_Disconnected)
+				local::at(next, now, r._last_seen + microseconds(cfg._master_dead_time));
+			else
+				local::at(next, now, r._last_seen + seconds(60*30));
+			local::at(next, now, r._last_failed + microseconds(cfg._runner_failure_promotion_timeout));
+		}
+		return next;
 	}
 
 	bool elector::elect_node(runners::iterator const& i) {
@@ -418,17 +841,25 @@ namespace koi {
 			if (i->second._state == S_Master) {
 				LOG_TRACE("%s (%s) is Master by popular opinion.",
 				          i->second._name.c_str(), to_string(i->first).c_str());
-				_master = i;
-				_target_master = _runners.end();
-				return true;
 			}
 			else if (i->second._state == S_Slave) {
 				LOG_TRACE("%s (%s) is unilaterally promoted to Master.",
 				          i->second._name.c_str(), to_string(i->first).c_str());
-				_master = i;
-				_target_master = _runners.end();
-				return true;
 			}
+			else {
+				return false;
+			}
+			if (i != _master) {
+				// a new epoch, unless it began when the master was lost
+				if (!_failing_over)
+					_epoch = clock::usecs();
+				_failing_over = false;
+				metrics::get_counter("koi_elector_elections_total", "Masters elected.").add();
+				_trace(failover_trace::Ph_Elected, clock::now());
+			}
+			_master = i;
+			_target_master = _runners.end();
+			return true;
 		}
 		return false;
 	}
@@ -446,8 +877,17 @@ namespace koi {
 
 		auto i = _runners.find(sender_uuid);
 		runner_info* inf = 0;
+		bool relevant = true; // did anything the election depends on change?
 		if (i != _runners.end()) {
 			inf = &(i->second);
+			relevant = inf->_state != hr->_state ||
+				inf->_mode != hr->_mode ||
+				inf->_maintenance != hr->_maintenance ||
+				inf->_prepared != hr->_prepared ||
+				inf->_services.size() != hr->_services.size();
+			for (size_t s = 0; !relevant && s < hr->_services.size(); ++s)
+				relevant = inf->_services[s]._state != hr->_services[s]._state ||
+					inf->_services[s]._failed != hr->_services[s]._failed;
 			inf->_endpoints.insert(from);
 			_emitter.add_receiver(from);
 			transition_runner(i, hr->_state);
@@ -461,7 +901,7 @@ namespace koi {
 			inf->_state = hr->_state;
 			inf->_last_failed = ptime(min_date_time);
 		}
-		inf->_last_seen = microsec_clock::universal_time();
+		inf->_last_seen = clock::now();
 		if (inf->_state == S_Failed)
 			inf->_last_failed = inf->_last_seen;
 		inf->_uuid = sender_uuid;
@@ -471,10 +911,18 @@ namespace koi {
 		inf->_maintenance = hr->_maintenance;
 		inf->_service_action = hr->_service_action;
 		inf->_services = hr->_services;
+		inf->_load = hr->_load;
+		inf->_prepared = hr->_prepared;
 		if (inf->_services.size() != hr->_services.size())
 			LOG_TRACE("Service count mismatch!");
 
-		save_state();
+		if (_handoff._active && _handoff._from->first == sender_uuid) {
+			_check_handoff();
+		}
+
+		if (relevant)
+			mark_dirty();
+		_state_dirty = true;
 	}
 
 	void elector::rpc_status(msg::request* rq,
@@ -499,7 +947,17 @@ namespace koi {
 			response["master"] = local::nil_or_uuid(_master, _runners.end());
 			response["target"] = local::nil_or_uuid(_target_master, _runners.end());
 			response["manual-master"] = _manual_master_mode;
+			if (_handoff._active) {
+				response["handoff-from"] = _handoff._from->second._uuid;
+				response["handoff-to"] = _handoff._to->second._uuid;
+			}
 			response["maintenance"] = _emitter._nexus.cfg()._cluster_maintenance;
+			response["prepare-target"] = local::nil_or_uuid(_prepare_target, _runners.end());
+			FOREACH(const group_config& g, _emitter._nexus.cfg()._groups) {
+				auto gm = _group_masters.find(g._name);
+				strfmt<80> rgroup("group-%s", g._name.c_str());
+				response[rgroup.c_str()] = (gm != _group_masters.end()) ? gm->second->second._uuid : nil_uuid();
+			}
 			int c = 0;
 
 			FOREACH(const auto& i, _runners) {
@@ -516,12 +974,20 @@ namespace koi {
 				response[rcuuid.c_str()] = inf._uuid;
 				response[rcstate.c_str()] = (int)inf._state;
 				response[rcmode.c_str()] = (int)inf._mode;
-				response[rcseen.c_str()] = inf._last_seen;
-				response[rclastfailed.c_str()] = inf._last_failed;
+				response[rcseen.c_str()] = clock::to_wall(inf._last_seen);
+				response[rclastfailed.c_str()] = clock::to_wall(inf._last_failed);
 
 				strfmt<50> rcaction("%x-target-action", c);
 				response[rcaction.c_str()] = (int)inf._service_action;
 
+				strfmt<50> rcprepared("%x-prepared", c);
+				response[rcprepared.c_str()] = inf._prepared;
+
+				strfmt<50> rcload("%x-load", c);
+				strfmt<50> rcscore("%x-score", c);
+				response[rcload.c_str()] = inf._load.to_string();
+				response[rcscore.c_str()] = (int)_scoring(inf);
+
 				vector<string> svcstate;
 				FOREACH(const auto& s, inf._services)
 					svcstate.push_back(s.to_string());
@@ -553,7 +1019,7 @@ namespace koi {
 				response[rcaddr.c_str()] = to_string(n._addrs.get());
 				response[rcuuid.c_str()] = n._id;
 				response[rcflags.c_str()] = nodeflags_to_string(n._flags);
-				response[rcseen.c_str()] = n._last_seen;
+				response[rcseen.c_str()] = clock::to_wall(n._last_seen);
 				response[rcmode.c_str()] = (int)R_Active;
 				response[rcstate.c_str()] = (n._id == _emitter._nexus.cfg()._uuid) ? S_Elector : S_Other;
 				++c;
@@ -592,6 +1058,7 @@ namespace koi {
 		LOG_WARN("Leaving manual master mode.");
 		response["msg"] = "Leaving manual master mode.";
 		_manual_master_mode = false;
+		mark_dirty();
 	}
 
 	void elector::rpc_failures(msg::request*, msg::response::values& response) {
@@ -627,6 +1094,18 @@ namespace koi {
 		}
 	}
 
+	void elector::rpc_stats(msg::request*, msg::response::values& response) {
+		const stats& s = _stats;
+		response["passes"] = (int)s._passes;
+		response["evaluations"] = (int)s._evaluations;
+		response["cpu-ms"] = (int)(s._cpu_time / units::milli);
+		response["cpu-us-per-evaluation"] = (int)(s._evaluations ? s._cpu_time / s._evaluations : 0);
+		response["decisions"] = (int)s._decisions;
+		response["decision-latency-us"] = (int)s._last_latency;
+		response["decision-latency-max-us"] = (int)s._max_latency;
+		response["decision-latency-avg-us"] = (int)(s._decisions ? s._total_latency / s._decisions : 0);
+	}
+
 	bool elector::in_maintenance_mode() const {
 		return _emitter._nexus.cfg()._cluster_maintenance;
 	}
@@ -671,10 +1150,15 @@ namespace koi {
 			return false;
 
 		_manual_master_mode = false;
+		_handoff._active = false;
 		_target_master = i;
+		mark_dirty();
 		if (_target_master != _master) {
+			auto from = _master;
 			_master = _runners.end();
 			LOG_TRACE("%s: matched, switching master", name);
+			if (from != _runners.end() && from->second._state > S_Disconnected)
+				_begin_handoff(from, i);
 		}
 		else {
 			LOG_TRACE("%s: matched current master", name);
@@ -686,6 +1170,8 @@ namespace koi {
 		if (_master != _runners.end()) {
 			LOG_INFO("Switching to manual master mode; demoting any current master.");
 			_manual_master_mode = true;
+			_handoff._active = false;
+			mark_dirty();
 			_master = _runners.end();
 			return true;
 		}
@@ -711,6 +1197,17 @@ namespace koi {
 			su->_master_name = "";
 			su->_master_addr = net::endpoint();
 		}
+
+		su->_prepare_uuid = (_prepare_target != _runners.end()) ? _prepare_target->second._uuid : nil_uuid();
+		su->_epoch = _epoch;
+
+		su->_groups.clear();
+		FOREACH(const auto& gm, _group_masters) {
+			msg::stateupdate::group_master g;
+			g._group = gm.first;
+			g._uuid = gm.second->second._uuid;
+			su->_groups.push_back(g);
+		}
 	}
 
 	void elector::save_state() {
@@ -17,6 +17,7 @@
 #pragma once
 
 #include <map>
+#include <boost/function.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
 #include "emitter.hpp"
@@ -24,6 +25,7 @@
 #include "net.hpp"
 #include "service_info.hpp"
 #include "mru.hpp"
+#include "trace.hpp"
 
 namespace koi {
 	/*
@@ -75,17 +77,28 @@ namespace koi {
 			endpoints     _endpoints;
 
 			servicelist _services;
+			load_info   _load;
+			bool        _prepared; // ready for a fast promotion
 
 			bool alive(uint64_t master_dead_time, const ptime& now) const;
 			bool electable(const ptime& now, uint64_t promotion_timeout) const;
 
-			bool promoted_service() const;
+			bool promoted_service() const; // in the default group
 			bool failed_service() const;
+			bool group_ready(const string& group) const; // all services in the group are running
+			bool group_promoted(const string& group) const;
 
 			void read(const masterstate& state);
 		};
 
 		typedef std::map<uuid, runner_info> runners;
+		typedef std::map<string, runners::iterator> group_masters;
+
+		// Ranks election candidates, higher is better. Candidates with
+		// equal scores are ordered by uptime. Selected by the
+		// cluster.election_scoring setting.
+		typedef boost::function<int64_t (const runner_info&)> scoring_fn;
+		static bool scoring(const string& name, scoring_fn& fn);
 
 		struct failure_info {
 			ptime   _time;
@@ -99,6 +112,30 @@ namespace koi {
 
 		typedef std::vector<failure_info> failures;
 
+		// decision engine statistics
+		struct stats {
+			stats();
+
+			uint64_t _passes; // calls to update()
+			uint64_t _evaluations; // passes that ran the election checks
+			uint64_t _cpu_time; // spent in evaluations, in microseconds
+			uint64_t _decisions; // evaluations triggered by an input change
+			uint64_t _last_latency; // input change -> evaluation done, in microseconds
+			uint64_t _max_latency;
+			uint64_t _total_latency;
+		};
+
+		// planned switchover: the old master is told to demote, and
+		// the new master is promoted when the old one reports back
+		struct handoff {
+			handoff() : _active(false) {}
+
+			bool              _active;
+			runners::iterator _from;
+			runners::iterator _to;
+			ptime             _started;
+		};
+
 		elector(nexus& route);
 		~elector();
 
@@ -106,12 +143,16 @@ namespace koi {
 		void start();
 		void stop();
 		void update();
+		void mark_dirty();
 		bool settings_changed(const settings& newcfg, const settings& oldcfg);
 
 		void handle(message& m);
 
 		void on_tick(message* m);
 
+		void _set_scoring(const string& name);
+		void _evaluate(const ptime& now);
+		ptime _next_deadline(const ptime& now) const;
 		bool _repromote_master();
 		bool _check_runner_health(const ptime& now, int& npromoted, int& nfailed);
 		bool _check_master_health();
@@ -121,7 +162,17 @@ namespace koi {
 		bool _find_candidates(ptime now, std::vector<runners::iterator>& candidates);
 		bool _election(ptime now, int npromoted);
 		bool _forget_old_runners(const ptime& now);
+		bool _elect_groups(const ptime& now);
+		bool _choose_prepare_target(const ptime& now);
+		bool _group_election_allowed() const;
+		runners::iterator _find_group_master(const ptime& now, const group_config& g);
+		int _masterships(runners::iterator i) const;
+		bool _violates_avoid(runners::iterator i, const group_config& g) const;
+		void _begin_handoff(runners::iterator from, runners::iterator to);
+		bool _check_handoff();
 		void transition_runner(runners::iterator i, State newstate);
+		void _trace(failover_trace::Phase phase, const ptime& when);
+		void _master_lost(const ptime& now);
 		bool promote_node(const char* name);
 		bool demote_master();
 		bool elect_node(runners::iterator const& i);
@@ -136,6 +187,7 @@ namespace koi {
 		void rpc_elect(msg::request* rq, msg::response::values& response);
 		void rpc_failures(msg::request* rq, msg::response::values& response);
 		void rpc_maintenance(msg::request* rq, msg::response::values& response);
+		void rpc_stats(msg::request* rq, msg::response::values& response);
 
 		bool in_maintenance_mode() const;
 
@@ -150,11 +202,27 @@ namespace koi {
 		runners::iterator _master; // this node IS master
 		runners::iterator _target_master; //this node should be master
 		bool              _manual_master_mode; // the master has been demoted; manual promotion is required
+		handoff           _handoff;
+		group_masters     _group_masters; // resource group -> master
+		runners::iterator _prepare_target; // expected next master, told to prepare
 		ptime             _starttime;
 		ptime             _leadertime;
 		ptime             _last_state_save;
 		uint32_t          _state_sum;
 		bool              _lost_quorum;
+
+		// the election checks only run when an input has changed
+		// (_dirty) or a timeout may have expired (_next_check)
+		bool              _dirty;
+		ptime             _dirty_since;
+		ptime             _next_check;
+		bool              _state_dirty; // save_state() at the end of update()
+		bool              _had_quorum;
+		bool              _was_maintenance;
+		stats             _stats;
+		scoring_fn        _scoring;
+		uint64_t          _epoch; // of the election that chose _master, 0 before the first
+		bool              _failing_over; // the master was lost and no new one is elected yet
 	};
 
 }
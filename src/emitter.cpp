@@ -17,6 +17,7 @@
 #include "koi.hpp"
 #include "emitter.hpp"
 #include "nexus.hpp"
+#include "clock.hpp"
 
 #include <boost/bind.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
@@ -30,16 +31,19 @@ namespace koi {
 	emitter::emitter(nexus& route, uint64_t tick_interval) :
 		_nexus(route),
 		_receivers(),
-		_timer(route.io()),
-		_last_tick(),
+		_timer(0),
+		_holdoff_timer(0),
+		_last_tick(min_date_time),
 		_tick_interval(tick_interval),
+		_holdoff(0),
 		_current_tick(0),
-		_active(false) {
-		_timer.expires_at(posix_time::pos_infin);
+		_active(false),
+		_in_tick(false),
+		_holdoff_pending(false) {
 	}
 
 	emitter::~emitter() {
-		_timer.cancel();
+		stop();
 	}
 
 	void emitter::add_receiver(const net::endpoint& ep) {
@@ -57,14 +61,16 @@ namespace koi {
 	void emitter::start() {
 		_active = true;
 
-		_timer.expires_from_now(posix_time::microseconds(_tick_interval));
-		_timer.async_wait(bind(&emitter::_process_tick, this, _1));
+		_nexus.timers().cancel(_timer);
+		_timer = _nexus.timers().schedule_every(_tick_interval, bind(&emitter::_process_tick, this));
 	}
 
 	void emitter::stop() {
 		_active = false;
-		_timer.cancel();
-		_timer.expires_at(posix_time::pos_infin);
+		_nexus.timers().cancel(_timer);
+		_nexus.timers().cancel(_holdoff_timer);
+		_timer = _holdoff_timer = 0;
+		_holdoff_pending = false;
 	}
 
 	void emitter::update() {
@@ -72,28 +78,53 @@ namespace koi {
 	}
 
 	uint64_t emitter::uptime(ptime starttime) const {
-		return (microsec_clock::universal_time() - starttime).total_milliseconds();
+		return (clock::now() - starttime).total_milliseconds();
 	}
 
 	void emitter::immediate_tick() {
 		if (!_receivers.empty()) {
+			_last_tick = clock::now();
 			message m(_nexus.cfg()._uuid, _nexus.cfg()._cluster_id);
+			_in_tick = true;
 			_on_tick(&m);
+			_in_tick = false;
 			FOREACH(const net::endpoint& to, _receivers) {
 				_nexus.send(m, to);
 			}
 		}
 	}
 
-	void emitter::_process_tick(const error_code& error) {
-		if (error)
+	// Tick now unless a tick went out less than _holdoff ago, in which
+	// case one tick is sent when the holdoff expires no matter how
+	// many requests arrive in between.
+	void emitter::request_tick() {
+		if (!_active || _holdoff_pending)
 			return;
 
+		const ptime now = clock::now();
+		if (!_in_tick && now - _last_tick >= microseconds(_holdoff)) {
+			immediate_tick();
+			return;
+		}
+
+		// a request from inside _on_tick wants the state it just
+		// changed reported, which the current tick may have missed
+		_holdoff_pending = true;
+		const uint64_t wait = std::max<int64_t>((_last_tick + microseconds(_holdoff) - now).total_microseconds(), 0);
+		_holdoff_timer = _nexus.timers().schedule(wait, bind(&emitter::_process_holdoff, this));
+	}
+
+	void emitter::_process_tick() {
+		if (_active) {
+			immediate_tick();
+		}
+	}
+
+	void emitter::_process_holdoff() {
+		_holdoff_timer = 0;
+		_holdoff_pending = false;
 		if (_active) {
 			immediate_tick();
-			_last_tick = posix_time::microsec_clock::universal_time();
 		}
-		_timer.expires_from_now(posix_time::microseconds(_tick_interval));
-		_timer.async_wait(bind(&emitter::_process_tick, this, _1));
 	}
 }
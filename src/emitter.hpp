@@ -16,15 +16,12 @@
 */
 #pragma once
 #include <set>
-#include <boost/asio/deadline_timer.hpp>
 
 #include "net.hpp"
 #include "msg.hpp"
+#include "timer_wheel.hpp"
 
 namespace koi {
-	using boost::system::error_code;
-	using boost::asio::deadline_timer;
-
 	struct nexus;
 
 	/*
@@ -56,17 +53,23 @@ namespace koi {
 		uint64_t uptime(ptime starttime) const;
 
 		void immediate_tick();
+		void request_tick();
 
-		void _process_tick(const error_code& error);
+		void _process_tick();
+		void _process_holdoff();
 
 		nexus&                      _nexus;
 		endpoints                   _receivers;
-		deadline_timer              _timer;
+		timer_wheel::timer_id       _timer; // periodic tick while active
+		timer_wheel::timer_id       _holdoff_timer;
 		on_tick_callback            _on_tick;
 		ptime                       _last_tick; // last time we sent a tick
 		uint64_t                    _tick_interval; // interval with which we send, in microseconds
+		uint64_t                    _holdoff; // minimum time between requested ticks, in microseconds
 		uint32_t                    _current_tick;
 		bool                        _active;
+		bool                        _in_tick; // inside _on_tick
+		bool                        _holdoff_pending; // a requested tick is waiting for the holdoff
 	};
 
 }
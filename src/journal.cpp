@@ -0,0 +1,260 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "koi.hpp"
+#include "journal.hpp"
+#include "clock.hpp"
+#include "msg.hpp"
+#include "masterstate.hpp"
+#include "sequence.hpp"
+#include "clusterstate.hpp"
+#include "network.hpp"
+#include "cluster.hpp"
+#include "service_info.hpp"
+#include "strfmt.hpp"
+
+#include <boost/lexical_cast.hpp>
+#include <boost/uuid/uuid_io.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace koi {
+	const uint32_t journal::VERSION;
+
+	namespace {
+		const char MAGIC[8] = { 'K', 'O', 'I', 'J', 'R', 'N', 'L', 0 };
+
+		size_t file_size(uint32_t capacity) {
+			return sizeof(journal::header) + (size_t)capacity * sizeof(journal::record);
+		}
+
+		bool valid(const journal::header* h, size_t size) {
+			return memcmp(h->_magic, MAGIC, sizeof(MAGIC)) == 0 &&
+				h->_version == journal::VERSION &&
+				h->_record_size == sizeof(journal::record) &&
+				h->_count <= h->_capacity &&
+				size >= file_size(h->_capacity);
+		}
+
+		void collect(const journal::header* h, uint64_t from, uint64_t to,
+		             std::vector<journal::record>& out) {
+			const journal::record* r = reinterpret_cast<const journal::record*>(h + 1);
+			const uint32_t count = __atomic_load_n(&h->_count, __ATOMIC_ACQUIRE);
+			for (uint32_t i = 0; i < count; ++i)
+				if (r[i]._time >= from && r[i]._time < to)
+					out.push_back(r[i]);
+		}
+
+		const char* event_name(int event) {
+			switch (event) {
+			case journal::Ev_Runner: return "runner";
+			case journal::Ev_Elector: return "elector";
+			case journal::Ev_Cluster: return "cluster";
+			case journal::Ev_Service: return "service";
+			default: return "unknown";
+			}
+		}
+
+		const char* value_name(int event, int value) {
+			switch (event) {
+			case journal::Ev_Runner:
+			case journal::Ev_Elector:
+				return state_to_string((State)value);
+			case journal::Ev_Cluster:
+				return cluster_mode_to_string(value);
+			case journal::Ev_Service:
+				if (value >= Svc_Failed && value <= Svc_Promoted)
+					return service_state_string((ServiceState)value);
+				return "Unknown";
+			default:
+				return "Unknown";
+			}
+		}
+	}
+
+	journal::journal()
+		: _capacity(0), _fd(-1), _header(0), _records(0) {
+		static_assert(sizeof(record) == 64, "journal records are 64 bytes");
+		static_assert(sizeof(header) == 64, "journal header is 64 bytes");
+	}
+
+	journal::~journal() {
+		close();
+	}
+
+	bool journal::open(const string& path, uint32_t capacity) {
+		close();
+		_path = path;
+		_capacity = capacity;
+		if (capacity == 0)
+			return false;
+
+		_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (_fd < 0) {
+			LOG_WARN("Journal %s: %s", path.c_str(), strerror(errno));
+			return false;
+		}
+
+		struct stat st;
+		if (fstat(_fd, &st) != 0) {
+			LOG_WARN("Journal %s: %s", path.c_str(), strerror(errno));
+			close();
+			return false;
+		}
+
+		if (st.st_size == 0)
+			return _map(_fd, true);
+
+		// keep appending to the journal from the last run, unless its
+		// format or capacity has changed
+		if ((size_t)st.st_size == file_size(capacity) && _map(_fd, false)) {
+			if (valid(_header, st.st_size) && _header->_capacity == capacity)
+				return true;
+			LOG_INFO("Journal %s has another format or size, starting a new one", path.c_str());
+		}
+		return _rotate();
+	}
+
+	void journal::close() {
+		if (_header) {
+			munmap(_header, file_size(_header->_capacity));
+			_header = 0;
+			_records = 0;
+		}
+		if (_fd >= 0) {
+			::close(_fd);
+			_fd = -1;
+		}
+	}
+
+	bool journal::_map(int fd, bool create) {
+		const size_t size = file_size(_capacity);
+		if (create && ftruncate(fd, size) != 0) {
+			LOG_WARN("Journal %s: %s", _path.c_str(), strerror(errno));
+			close();
+			return false;
+		}
+		void* p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED) {
+			LOG_WARN("Journal %s: %s", _path.c_str(), strerror(errno));
+			close();
+			return false;
+		}
+		_header = static_cast<header*>(p);
+		_records = reinterpret_cast<record*>(_header + 1);
+		if (create) {
+			memset(_header, 0, sizeof(header));
+			memcpy(_header->_magic, MAGIC, sizeof(MAGIC));
+			_header->_version = VERSION;
+			_header->_record_size = sizeof(record);
+			_header->_capacity = _capacity;
+		}
+		return true;
+	}
+
+	bool journal::_rotate() {
+		uint32_t seq = 0;
+		if (_header && valid(_header, file_size(_capacity)))
+			seq = _header->_seq;
+
+		const string path = _path;
+		const uint32_t capacity = _capacity;
+		close();
+		_path = path;
+		_capacity = capacity;
+
+		const string old = path + ".1";
+		if (rename(path.c_str(), old.c_str()) != 0 && errno != ENOENT)
+			LOG_WARN("Journal %s: %s", old.c_str(), strerror(errno));
+
+		_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (_fd < 0) {
+			LOG_WARN("Journal %s: %s", path.c_str(), strerror(errno));
+			return false;
+		}
+		if (!_map(_fd, true))
+			return false;
+		_header->_seq = seq;
+		return true;
+	}
+
+	void journal::append(Event event, const uuid& subject, int from, int to, const string& name) {
+		if (!_header)
+			return;
+		if (_header->_count >= _header->_capacity && !_rotate())
+			return;
+
+		record& r = _records[_header->_count];
+		memset(&r, 0, sizeof(r));
+		r._time = clock::usecs();
+		r._seq = _header->_seq++;
+		r._event = event;
+		r._from = from;
+		r._to = to;
+		memcpy(r._subject, subject.data, sizeof(r._subject));
+		strncpy(r._name, name.c_str(), sizeof(r._name) - 1);
+
+		// the record is complete before the count includes it
+		__atomic_store_n(&_header->_count, _header->_count + 1, __ATOMIC_RELEASE);
+	}
+
+	std::vector<journal::record> journal::query(uint64_t from, uint64_t to) const {
+		std::vector<record> out;
+
+		const string old = _path + ".1";
+		int fd = ::open(old.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd >= 0) {
+			struct stat st;
+			if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(header)) {
+				void* p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+				if (p != MAP_FAILED) {
+					const header* h = static_cast<const header*>(p);
+					if (valid(h, st.st_size))
+						collect(h, from, to, out);
+					munmap(p, st.st_size);
+				}
+			}
+			::close(fd);
+		}
+
+		if (_header)
+			collect(_header, from, to, out);
+		return out;
+	}
+
+	string journal::to_string(const record& r) {
+		char name[sizeof(r._name) + 1];
+		memcpy(name, r._name, sizeof(r._name));
+		name[sizeof(r._name)] = 0;
+
+		uuid subject;
+		memcpy(subject.data, r._subject, sizeof(r._subject));
+
+		const time_t t = (time_t)(r._time / 1000000);
+		struct tm tid;
+		localtime_r(&t, &tid);
+		char tbuf[32];
+		strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &tid);
+
+		return strfmt<256>("%s.%06u %u %s %s %s: %s -> %s",
+		                   tbuf, (unsigned)(r._time % 1000000), r._seq,
+		                   event_name(r._event),
+		                   boost::lexical_cast<string>(subject).c_str(), name,
+		                   value_name(r._event, r._from), value_name(r._event, r._to)).str();
+	}
+}
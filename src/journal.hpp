@@ -0,0 +1,92 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+namespace koi {
+	/*
+	 * Append-only record of cluster state transitions.
+	 *
+	 * Each node keeps its journal in a file of fixed-size records
+	 * that is mapped into memory, so appending is a memcpy and the
+	 * file can be read by other tools while koinode runs. A record
+	 * becomes visible once the header count covers it. When the file
+	 * is full it is renamed to <path>.1, replacing the one before,
+	 * and a new file is started, so at most two files are kept.
+	 *
+	 * Times are clock::usecs(), which never go backwards while the
+	 * node runs. Records are only appended from the main loop.
+	 */
+	struct journal : private boost::noncopyable {
+		enum Event {
+			Ev_Runner = 1, // this runner changed state
+			Ev_Elector = 2, // the elector moved a runner to a new state
+			Ev_Cluster = 3, // cluster mode or leader changed, subject is the leader
+			Ev_Service = 4 // a service on this runner changed state
+		};
+
+		struct record {
+			uint64_t _time; // usecs
+			uint32_t _seq;
+			uint16_t _event;
+			uint16_t _reserved;
+			int32_t  _from;
+			int32_t  _to;
+			uint8_t  _subject[16]; // node uuid
+			char     _name[24]; // node or service name, nul-padded
+		};
+
+		struct header {
+			char     _magic[8];
+			uint32_t _version;
+			uint32_t _record_size;
+			uint32_t _capacity; // records
+			uint32_t _count; // records written
+			uint32_t _seq; // of the next record
+			uint8_t  _reserved[36];
+		};
+
+		static const uint32_t VERSION = 1;
+
+		journal();
+		~journal();
+
+		bool open(const string& path, uint32_t capacity);
+		void close();
+		bool is_open() const { return _header != 0; }
+
+		void append(Event event, const uuid& subject, int from, int to, const string& name = string());
+
+		// records with from <= _time < to, oldest first, including the
+		// previous file
+		std::vector<record> query(uint64_t from, uint64_t to) const;
+
+		static string to_string(const record& r);
+
+		bool _map(int fd, bool create);
+		bool _rotate();
+
+		string   _path;
+		uint32_t _capacity;
+		int      _fd;
+		header*  _header;
+		record*  _records;
+	};
+}
@@ -16,7 +16,7 @@
 */
 #pragma once
 
-#define KOI_VERSION 5
+#define KOI_VERSION 9
 
 #include <stdlib.h>
 #include <stdint.h>
@@ -26,14 +26,34 @@
 #include <time.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <algorithm>
+
+#include "mpsc.hpp"
 
 #define KOI_CONTEXT koi::logging::log_context(__FILE__, __LINE__, __FUNCTION__)
 
 // Stub is needed since pthreads
 // don't know about C++ objects
 extern "C" void* logproxy_run(void* p) {
-	auto data = static_cast<koi::logging::logproxy::threadlocal*>(p);
-	data->proxy->run(data);
+	static_cast<koi::logging::logproxy*>(p)->run();
+	return 0;
+}
+
+namespace koi {
+	namespace logging {
+		void writer_run();
+	}
+}
+
+extern "C" void* logwriter_run(void* p) {
+	koi::logging::writer_run();
 	return 0;
 }
 
@@ -48,30 +68,42 @@ namespace {
 		}
 	}
 
-	void syslog_write(int priority, const char* str, va_list arglist) {
+	void syslog_write(int priority, const char* str) {
 		if (!_syslog_open) {
 			openlog("koi", LOG_CONS, LOG_USER);
 			_syslog_open = true;
 		}
-		::vsyslog (priority, str, arglist);
+		::syslog(priority, "%s", str);
 	}
 
 	void logfile_close() {
 		if (_logfile) {
 			fclose(_logfile);
+			_logfile = 0;
 		}
 	}
 
-	void logfile_write(const char* fil, int lin, const char* str, va_list arglist) {
+	bool logfile_open() {
 		if (!_logfile) {
 			_logfile = fopen("koi.log", "w");
 			atexit(logfile_close);
 		}
-		if (_logfile) {
-			fprintf(_logfile, "%s(%d): ", fil, lin);
-			vfprintf(_logfile, str, arglist);
-			fprintf(_logfile, "\n");
-		}
+		return _logfile != 0;
+	}
+
+	// The log threads only do I/O, so they run under SCHED_OTHER even
+	// when started from a main loop that is in real-time mode.
+	int start_thread(pthread_t* thread, void* (*fn)(void*), void* arg) {
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+		struct sched_param param;
+		param.sched_priority = 0;
+		pthread_attr_setschedparam(&attr, &param);
+		const int ret = pthread_create(thread, &attr, fn, arg);
+		pthread_attr_destroy(&attr);
+		return ret;
 	}
 }
 
@@ -92,6 +124,16 @@ namespace koi {
 			}
 		};
 
+		struct proxy_lock {
+			proxy_lock(pthread_mutex_t& m) : _m(m) {
+				pthread_mutex_lock(&_m);
+			}
+			~proxy_lock() {
+				pthread_mutex_unlock(&_m);
+			}
+			pthread_mutex_t& _m;
+		};
+
 		void set_log_mode(int flags) {
 			log_lock ll;
 			modeflags = flags;
@@ -107,116 +149,426 @@ namespace koi {
 			loglevel = level;
 		}
 
+		namespace {
+			std::atomic<uint64_t> _rate_interval(50000); // usecs per message, 0 for no limit
+			std::atomic<uint64_t> _rate_tolerance(50000 * 99); // burst - 1 intervals
 
-		logproxy::logproxy() {
-			inpipe = -1;
+			uint64_t coarse_usec() {
+				struct timespec ts;
+				clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+				return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+			}
+		}
+
+		void set_rate_limit(uint32_t rate, uint32_t burst) {
+			const uint64_t interval = rate ? 1000000 / rate : 0;
+			_rate_interval = interval;
+			_rate_tolerance = interval * (burst ? burst - 1 : 0);
+		}
+
+		// generic cell rate algorithm: _tat moves one interval ahead
+		// for every message, and a message may go out as long as
+		// _tat isn't more than the burst ahead of now
+		bool rate_limit::allow() {
+			const uint64_t interval = _rate_interval.load(std::memory_order_relaxed);
+			if (interval == 0)
+				return true;
+			const uint64_t tolerance = _rate_tolerance.load(std::memory_order_relaxed);
+			const uint64_t now = coarse_usec();
+			uint64_t tat = _tat.load(std::memory_order_relaxed);
+			for (;;) {
+				if (tat > now + tolerance) {
+					_suppressed.fetch_add(1, std::memory_order_relaxed);
+					return false;
+				}
+				if (_tat.compare_exchange_weak(tat, std::max(tat, now) + interval, std::memory_order_relaxed))
+					return true;
+			}
+		}
+
+		uint32_t rate_limit::take_suppressed() {
+			if (_suppressed.load(std::memory_order_relaxed) == 0)
+				return 0;
+			return _suppressed.exchange(0, std::memory_order_relaxed);
+		}
+
+
+		logproxy::logproxy()
+			: _log_lines(true), _epoll(-1), _wakeup(-1), _running(false), _stop(false), _serial(0) {
+			pthread_mutex_init(&_lock, 0);
 		}
 
 		logproxy::~logproxy() {
 			close();
+			pthread_mutex_destroy(&_lock);
 		}
 
 		// log context has been lost at this point
-		void logproxy::_eject(const char* str) {
-			log_context("", -1, "").info("%s", str);
-		}
-
-		// copy complete lines from buf1 to buf2,
-		// then write the completed lines to the log
-		char* logproxy::_consume(char* wptr, ssize_t amt, char*const buf1, char*const buf2) {
-			char* rptr = buf1;
-			while ((rptr - buf1) < amt) {
-				char next = *rptr;
-				if (next == '\n') {
-					if (wptr > buf2) {
-						*wptr = 0;
-						_eject(buf2);
+		void logproxy::_eject(const source& src, const char* str) {
+			if (_on_line)
+				_on_line(src._tag, str);
+			if (_log_lines.load(std::memory_order_relaxed))
+				log_context("", -1, "", const_cast<rate_limit*>(&src._limit)).info("[%s] %s", src._tag.c_str(), str);
+		}
+
+		// split what was read into lines, keeping an incomplete
+		// line until the rest of it arrives
+		void logproxy::_consume(source& src, const char* buf, ssize_t amt) {
+			for (const char* rptr = buf; rptr < buf + amt; ++rptr) {
+				if (*rptr == '\n') {
+					if (src._len > 0) {
+						src._line[src._len] = 0;
+						_eject(src, src._line);
 					}
-					wptr = buf2;
+					src._len = 0;
 				}
 				else {
-					if (wptr >= buf2 + PROXY_BUFSIZE - 1) {
-						*wptr = 0;
-						_eject(buf2);
-						wptr = buf2;
+					if (src._len >= PROXY_BUFSIZE - 1) {
+						src._line[src._len] = 0;
+						_eject(src, src._line);
+						src._len = 0;
 					}
-					*wptr++ = next;
+					src._line[src._len++] = *rptr;
 				}
-				++rptr;
 			}
-			return wptr;
 		}
 
-		// loop, reading from the given end of the pipe until it is closed,
-		// writing every line we get to the log
-		void logproxy::run(logproxy::threadlocal* data) {
-			char* wptr = data->buf2;
-			for (;;) {
-				ssize_t amt = read(data->outpipe, data->buf1, PROXY_BUFSIZE);
-				if (amt <= 0) {
-					if (amt < 0) {
-						KOI_CONTEXT.error("Error in read() on fd %d. %s", data->outpipe, strerror(errno));
-					}
+		void logproxy::_remove(source* src) {
+			if (src->_len > 0) {
+				src->_line[src->_len] = 0;
+				_eject(*src, src->_line);
+			}
+			epoll_ctl(_epoll, EPOLL_CTL_DEL, src->_fd, 0);
+			::close(src->_fd);
+			{
+				proxy_lock pl(_lock);
+				_sources.erase(src);
+				if (src->_retired)
+					_retired.erase(std::remove(_retired.begin(), _retired.end(), src), _retired.end());
+			}
+			delete src;
+		}
+
+		// Marks the oldest pipe with the tag for closing, once the tag
+		// has MAX_SOURCES_PER_TAG open. Only the thread closes pipes,
+		// since it may be reading from this one. Called with _lock.
+		bool logproxy::_retire_oldest(const std::string& tag) {
+			size_t count = 0;
+			source* oldest = 0;
+			FOREACH(source* src, _sources) {
+				if (src->_retired || src->_tag != tag)
+					continue;
+				++count;
+				if (!oldest || src->_serial < oldest->_serial)
+					oldest = src;
+			}
+			if (count < MAX_SOURCES_PER_TAG || !oldest)
+				return false;
+			oldest->_retired = true;
+			_retired.push_back(oldest);
+			return true;
+		}
+
+		void logproxy::_remove_retired() {
+			std::vector<source*> retired;
+			{
+				proxy_lock pl(_lock);
+				retired.swap(_retired);
+			}
+			FOREACH(source* src, retired)
+				_remove(src);
+		}
+
+		// loop until stopped, writing every line that arrives on any
+		// of the pipes to the log; a pipe is closed and forgotten
+		// once every process writing to it has exited, or when it is
+		// retired to make room for a new one
+		void logproxy::run() {
+			char buf[PROXY_BUFSIZE];
+			struct epoll_event events[16];
+			while (!_stop.load(std::memory_order_acquire)) {
+				const int n = epoll_wait(_epoll, events, ASIZE(events), -1);
+				if (n < 0) {
+					if (errno == EINTR)
+						continue;
+					KOI_CONTEXT.error("Error in epoll_wait(). %s", strerror(errno));
 					break;
 				}
-
-				wptr = _consume(wptr, amt, data->buf1, data->buf2);
+				for (int i = 0; i < n; ++i) {
+					source* src = static_cast<source*>(events[i].data.ptr);
+					if (!src) {
+						uint64_t count;
+						if (read(_wakeup, &count, sizeof(count)) < 0) {}
+						continue;
+					}
+					const ssize_t amt = read(src->_fd, buf, sizeof(buf));
+					if (amt > 0) {
+						_consume(*src, buf, amt);
+					}
+					else if (amt == 0 || (errno != EAGAIN && errno != EINTR)) {
+						if (amt < 0)
+							KOI_CONTEXT.error("Error in read() on fd %d. %s", src->_fd, strerror(errno));
+						_remove(src);
+					}
+				}
+				// after the events, none of which may point to a removed pipe
+				_remove_retired();
 			}
-			::close(data->outpipe);
-			delete data;
 		}
 
-		// Create a pipe to a thread that writes
-		// everything it gets to the log. It can
-		// then be passed to child processes to replace
-		// stdout/stderr.
+		// Start the thread that reads the pipes. The pipes of
+		// a stopped proxy are kept and picked up again.
 		bool logproxy::create() {
-			int pip[2];
-
-			close();
+			if (_running)
+				return true;
+
+			if (_epoll == -1) {
+				_epoll = epoll_create1(EPOLL_CLOEXEC);
+				_wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+				if (_epoll == -1 || _wakeup == -1) {
+					KOI_CONTEXT.error("Failed to create epoll instance for subprocess logging. %s", strerror(errno));
+					close();
+					return false;
+				}
+				struct epoll_event ev;
+				ev.events = EPOLLIN;
+				ev.data.ptr = 0;
+				epoll_ctl(_epoll, EPOLL_CTL_ADD, _wakeup, &ev);
+			}
 
-			if (pipe(pip) == -1) {
-				KOI_CONTEXT.error("Failed to create pipe for subprocess logging.");
+			_stop = false;
+			if (start_thread(&_thread, &logproxy_run, this) != 0) {
+				KOI_CONTEXT.error("Failed to start subprocess logging thread.");
 				return false;
 			}
+			_running = true;
+			return true;
+		}
 
-			inpipe = pip[1];
-
-			threadlocal* data = new threadlocal;
-			data->proxy = this;
-			data->outpipe = pip[0];
-			memset(data->buf1, 0, PROXY_BUFSIZE);
-			memset(data->buf2, 0, PROXY_BUFSIZE);
-
-			pthread_t proxythread;
-			pthread_attr_t detach;
-			pthread_attr_init(&detach);
-			pthread_attr_setdetachstate(&detach, PTHREAD_CREATE_DETACHED);
-			pthread_create(&proxythread, &detach, &logproxy_run, data);
-			pthread_attr_destroy(&detach);
+		void logproxy::stop() {
+			if (!_running)
+				return;
+			_stop = true;
+			const uint64_t one = 1;
+			if (write(_wakeup, &one, sizeof(one)) < 0) {}
+			pthread_join(_thread, 0);
+			_running = false;
+		}
 
-			return true;
+		void logproxy::restart() {
+			stop();
+			create();
 		}
 
 		void logproxy::close() {
-			if (inpipe != -1) {
-				::close(inpipe);
-				inpipe = -1;
+			stop();
+			std::set<source*> sources;
+			{
+				proxy_lock pl(_lock);
+				sources.swap(_sources);
+				_retired.clear();
+			}
+			FOREACH(source* src, sources) {
+				::close(src->_fd);
+				delete src;
+			}
+			if (_epoll != -1) {
+				::close(_epoll);
+				_epoll = -1;
 			}
+			if (_wakeup != -1) {
+				::close(_wakeup);
+				_wakeup = -1;
+			}
+		}
+
+		// Create a pipe whose output is logged, tagged with the
+		// given name. The returned end is meant to replace
+		// stdout/stderr of a child process; the caller closes it
+		// once the child has been started.
+		int logproxy::open(const std::string& tag) {
+			if (!_running && !create())
+				return -1;
+
+			int pip[2];
+			if (pipe2(pip, O_CLOEXEC) == -1) {
+				KOI_CONTEXT.error("Failed to create pipe for subprocess logging.");
+				return -1;
+			}
+			fcntl(pip[0], F_SETFL, O_NONBLOCK);
+
+			source* src = new source;
+			src->_fd = pip[0];
+			src->_tag = tag;
+			src->_len = 0;
+			src->_retired = false;
+			bool retiring = false;
+			{
+				proxy_lock pl(_lock);
+				src->_serial = _serial++;
+				retiring = _retire_oldest(tag);
+				_sources.insert(src);
+			}
+			if (retiring) {
+				KOI_CONTEXT.warn("[%s] Processes still hold the output of %d earlier runs, no longer reading the oldest",
+				                 tag.c_str(), (int)MAX_SOURCES_PER_TAG);
+				const uint64_t one = 1;
+				if (write(_wakeup, &one, sizeof(one)) < 0) {}
+			}
+
+			struct epoll_event ev;
+			ev.events = EPOLLIN;
+			ev.data.ptr = src;
+			if (epoll_ctl(_epoll, EPOLL_CTL_ADD, src->_fd, &ev) == -1) {
+				KOI_CONTEXT.error("Failed to watch pipe for subprocess logging. %s", strerror(errno));
+				{
+					proxy_lock pl(_lock);
+					_sources.erase(src);
+				}
+				::close(pip[0]);
+				::close(pip[1]);
+				delete src;
+				return -1;
+			}
+			return pip[1];
+		}
+
+		size_t logproxy::sources() const {
+			proxy_lock pl(_lock);
+			return _sources.size();
 		}
 
 		namespace {
-			const char* timenowstring(char* buf) {
-				time_t t;
+			static const size_t TEXT_SIZE = 2048;
+			static const size_t RING_SIZE = 1024;
+			static const size_t WRITE_BATCH = 64;
+
+			// a log message, formatted by the thread that logged it
+			struct record {
+				LogLevels   _level;
+				const char* _file; // __FILE__, so never freed
+				int         _line;
+				time_t      _time;
+				char        _text[TEXT_SIZE];
+			};
+
+			typedef mpsc_ring<record, RING_SIZE> log_ring;
+
+			log_ring* _ring = 0; // allocated by the first start_writer()
+			int _wakeup = -1; // eventfd the writer sleeps on
+			pthread_t _writer_thread;
+			std::atomic<bool> _writer_running(false);
+			std::atomic<bool> _writer_stop(false);
+			std::atomic<bool> _writer_sleeping(false);
+			std::atomic<uint64_t> _pushed(0);
+			std::atomic<uint64_t> _written(0);
+			std::atomic<uint64_t> _dropped(0);
+			std::atomic<uint64_t> _total_suppressed(0);
+			bool _in_child = false; // forked, the writer thread didn't come along
+
+			void wake_writer() {
+				const uint64_t one = 1;
+				if (write(_wakeup, &one, sizeof(one)) < 0) {}
+			}
+
+			void writer_forked() {
+				_in_child = true;
+				pthread_mutex_init(&_log_mutex, 0);
+			}
+
+			const char* timestring(time_t t, char* buf) {
 				struct tm tid;
-				::time(&t);
 				::localtime_r(&t, &tid);
 				strftime (buf, 30, "%x %X", &tid);
 				return buf;
 			}
+
+			int console_color(LogLevels level) {
+				switch (level) {
+				case Trace: return CYAN;
+				case Warn: return YELLOW;
+				case Error: return RED;
+				default: return 0;
+				}
+			}
+
+			int syslog_priority(LogLevels level) {
+				switch (level) {
+				case Trace: return LOG_DEBUG;
+				case Warn: return LOG_WARNING;
+				case Error: return LOG_ERR;
+				default: return LOG_INFO;
+				}
+			}
+
+			void writev_all(int fd, struct iovec* iov, int count) {
+				while (count > 0) {
+					ssize_t n = ::writev(fd, iov, count);
+					if (n < 0) {
+						if (errno == EINTR)
+							continue;
+						return;
+					}
+					while (count > 0 && (size_t)n >= iov->iov_len) {
+						n -= iov->iov_len;
+						++iov;
+						--count;
+					}
+					if (count > 0) {
+						iov->iov_base = (char*)iov->iov_base + n;
+						iov->iov_len -= n;
+					}
+				}
+			}
+
+			// with the log lock held: write to each sink, one
+			// writev per sink for the whole batch
+			void write_records(const record* records, size_t n) {
+				static char lines[WRITE_BATCH][TEXT_SIZE + 128];
+				struct iovec iov[WRITE_BATCH];
+
+				if (modeflags & LogToSyslog) {
+					for (size_t i = 0; i < n; ++i)
+						syslog_write(syslog_priority(records[i]._level), records[i]._text);
+				}
+
+				if (modeflags & LogToConsole) {
+					char tbuf[30];
+					time_t tcached = (time_t)-1;
+					for (size_t i = 0; i < n; ++i) {
+						const record& r = records[i];
+						if (r._time != tcached)
+							timestring(tcached = r._time, tbuf);
+						const int color = console_color(r._level);
+						int len;
+						if (color && colors)
+							len = snprintf(lines[i], sizeof(lines[i]), "\e[%dm%s %s(%d): %s\e[0m\n", color, tbuf, r._file, r._line, r._text);
+						else if (color || r._line >= 0)
+							len = snprintf(lines[i], sizeof(lines[i]), "%s %s(%d): %s\n", tbuf, r._file, r._line, r._text);
+						else
+							len = snprintf(lines[i], sizeof(lines[i]), "%s %s\n", tbuf, r._text);
+						iov[i].iov_base = lines[i];
+						iov[i].iov_len = std::min((size_t)len, sizeof(lines[i]) - 1);
+					}
+					fflush(stdout);
+					writev_all(fileno(stdout), iov, (int)n);
+				}
+
+				if ((modeflags & LogToFile) && logfile_open()) {
+					for (size_t i = 0; i < n; ++i) {
+						const record& r = records[i];
+						const int len = snprintf(lines[i], sizeof(lines[i]), "%s(%d): %s\n", r._file, r._line, r._text);
+						iov[i].iov_base = lines[i];
+						iov[i].iov_len = std::min((size_t)len, sizeof(lines[i]) - 1);
+					}
+					fflush(_logfile);
+					writev_all(fileno(_logfile), iov, (int)n);
+				}
+			}
 		}
 
-		log_context::log_context(const char* fil, int lin, const char* fun) : _file(fil), _line(lin), _fun(fun) {
+		log_context::log_context(const char* fil, int lin, const char* fun, rate_limit* site)
+			: _file(fil), _line(lin), _fun(fun), _site(site) {
 			static const char* prefixes[] = {
 				"../src/",
 				"src/"
@@ -226,146 +578,181 @@ namespace koi {
 					_file += strlen(prefixes[i]);
 		}
 
+		void log_context::trace(const char* fmt, ...) {
+			if (loglevel > Trace)
+				return;
+			va_list va_args;
+			va_start(va_args, fmt);
+			_log(Trace, fmt, va_args);
+			va_end(va_args);
+		}
+
 		void log_context::info(const char* fmt, ...) {
 			if (loglevel > Info)
 				return;
-
-			log_lock ll;
-
-			if (modeflags & LogToSyslog) {
-				va_list va_args;
-				va_start(va_args, fmt);
-				syslog_write(LOG_INFO, fmt, va_args);
-				va_end(va_args);
-			}
-
-			if (modeflags & LogToConsole) {
-				char tmp[2048];
-				va_list va_args;
-				va_start(va_args, fmt);
-				vsnprintf(tmp, sizeof(tmp), fmt, va_args);
-				va_end(va_args);
-
-				char tbuf[30];
-				if (_line >= 0)
-					fprintf(stdout, "%s %s(%d): %s\n", timenowstring(tbuf), _file, _line, tmp);
-				else
-					fprintf(stdout, "%s %s\n", timenowstring(tbuf), tmp);
-
-				fflush(stdout);
-			}
-
-			if (modeflags & LogToFile) {
-				va_list va_args;
-				va_start(va_args, fmt);
-				logfile_write(_file, _line, fmt, va_args);
-				va_end(va_args);
-			}
+			va_list va_args;
+			va_start(va_args, fmt);
+			_log(Info, fmt, va_args);
+			va_end(va_args);
 		}
 
-		void log_context::trace(const char* fmt, ...) {
-			if (loglevel > Trace)
+		void log_context::warn(const char* fmt, ...) {
+			if (loglevel > Warn)
 				return;
+			va_list va_args;
+			va_start(va_args, fmt);
+			_log(Warn, fmt, va_args);
+			va_end(va_args);
+		}
 
-			log_lock ll;
+		void log_context::error(const char* fmt, ...) {
+			va_list va_args;
+			va_start(va_args, fmt);
+			_log(Error, fmt, va_args);
+			va_end(va_args);
+		}
 
-			if (modeflags & LogToSyslog) {
-				va_list va_args;
-				va_start(va_args, fmt);
-				syslog_write(LOG_DEBUG, fmt, va_args);
-				va_end(va_args);
+		void log_context::_log(LogLevels level, const char* fmt, va_list args) {
+			// errors are never suppressed
+			if (_site && level < Error && !_site->allow()) {
+				_total_suppressed.fetch_add(1, std::memory_order_relaxed);
+				return;
 			}
 
-			if (modeflags & LogToConsole) {
-				char tmp[2048];
-				va_list va_args;
-				va_start(va_args, fmt);
-				vsnprintf(tmp, sizeof(tmp), fmt, va_args);
-				va_end(va_args);
-
-				char tbuf[30];
-				if (colors)
-					fprintf(stdout, "\e[%dm%s %s(%d): %s\e[0m\n", CYAN, timenowstring(tbuf), _file, _line, tmp);
-				else
-					fprintf(stdout, "%s %s(%d): %s\n", timenowstring(tbuf), _file, _line, tmp);
+			record r;
+			r._level = level;
+			r._file = _file;
+			r._line = _line;
+			r._time = ::time(0);
+			const int len = vsnprintf(r._text, sizeof(r._text), fmt, args);
+			const uint32_t suppressed = _site ? _site->take_suppressed() : 0;
+			if (suppressed && len >= 0 && (size_t)len < sizeof(r._text))
+				snprintf(r._text + len, sizeof(r._text) - len, " (%u similar messages suppressed)", suppressed);
+
+			if (_writer_running.load(std::memory_order_acquire) && !_in_child) {
+				if (_ring->push(r)) {
+					_pushed.fetch_add(1, std::memory_order_relaxed);
+					if (_writer_sleeping.load(std::memory_order_acquire))
+						wake_writer();
+				}
+				else {
+					_dropped.fetch_add(1, std::memory_order_relaxed);
+				}
+				return;
 			}
 
-			if (modeflags & LogToFile) {
-				va_list va_args;
-				va_start(va_args, fmt);
-				logfile_write(_file, _line, fmt, va_args);
-				va_end(va_args);
-			}
+			log_lock ll;
+			write_records(&r, 1);
 		}
 
-		void log_context::warn(const char* fmt, ...) {
-			if (loglevel > Warn)
-				return;
-
+		void start_writer() {
 			log_lock ll;
-
-			if (modeflags & LogToSyslog) {
-				va_list va_args;
-				va_start(va_args, fmt);
-				syslog_write(LOG_WARNING, fmt, va_args);
-				va_end(va_args);
+			if (_writer_running)
+				return;
+			if (!_ring)
+				_ring = new log_ring;
+			if (_wakeup == -1)
+				_wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+			// open the log file first, so that it is closed after
+			// the writer has written out what is queued at exit
+			if (modeflags & LogToFile)
+				logfile_open();
+
+			static bool registered = false;
+			if (!registered) {
+				pthread_atfork(0, 0, writer_forked);
+				atexit(stop_writer);
+				registered = true;
 			}
 
-			if (modeflags & LogToConsole) {
-				char tmp[2048];
-				va_list va_args;
-				va_start(va_args, fmt);
-				vsnprintf(tmp, sizeof(tmp), fmt, va_args);
-				va_end(va_args);
+			_writer_stop = false;
+			if (start_thread(&_writer_thread, &logwriter_run, 0) != 0)
+				return;
+			_writer_running = true;
+		}
 
-				char tbuf[30];
-				if (colors)
-					fprintf(stdout, "\e[%dm%s %s(%d): %s\e[0m\n", YELLOW, timenowstring(tbuf), _file, _line, tmp);
-				else
-					fprintf(stdout, "%s %s(%d): %s\n", timenowstring(tbuf), _file, _line, tmp);
+		// drains what is queued before returning
+		void stop_writer() {
+			if (!_writer_running || _in_child)
+				return;
+			_writer_running = false;
+			_writer_stop = true;
+			wake_writer();
+			pthread_join(_writer_thread, 0);
 
-				fflush(stdout);
+			// anything pushed as the writer was stopping
+			log_lock ll;
+			record r;
+			while (_ring->pop(r)) {
+				write_records(&r, 1);
+				_written.fetch_add(1, std::memory_order_release);
 			}
+		}
 
-			if (modeflags & LogToFile) {
-				va_list va_args;
-				va_start(va_args, fmt);
-				logfile_write(_file, _line, fmt, va_args);
-				va_end(va_args);
+		void flush() {
+			if (!_writer_running || _in_child)
+				return;
+			while (_written.load(std::memory_order_acquire) < _pushed.load(std::memory_order_acquire)) {
+				wake_writer();
+				usleep(1000);
 			}
 		}
 
-		void log_context::error(const char* fmt, ...) {
-			log_lock ll;
-
-			if (modeflags & LogToSyslog) {
-				va_list va_args;
-				va_start(va_args, fmt);
-				syslog_write(LOG_ERR, fmt, va_args);
-				va_end(va_args);
-			}
+		writer_stats stats() {
+			writer_stats st;
+			st._running = _writer_running;
+			st._queued = _ring ? _ring->size() : 0;
+			st._written = _written;
+			st._dropped = _dropped;
+			st._suppressed = _total_suppressed;
+			return st;
+		}
 
-			if (modeflags & LogToConsole) {
-				char tmp[2048];
-				va_list va_args;
-				va_start(va_args, fmt);
-				vsnprintf(tmp, sizeof(tmp), fmt, va_args);
-				va_end(va_args);
+		// runs in the writer thread: takes everything queued, writes it
+		// to each sink in one go, then sleeps until woken or a timeout
+		// in case a wakeup was missed
+		void writer_run() {
+			static record batch[WRITE_BATCH];
+			uint64_t reported = 0;
+			for (;;) {
+				size_t n = 0, popped = 0;
+				const uint64_t dropped = _dropped.load(std::memory_order_relaxed);
+				if (dropped != reported) {
+					record& r = batch[n++];
+					r._level = Warn;
+					r._file = "logging.cpp";
+					r._line = __LINE__;
+					r._time = ::time(0);
+					snprintf(r._text, sizeof(r._text), "Log ring full: %llu messages dropped.",
+					         (unsigned long long)(dropped - reported));
+					reported = dropped;
+				}
+				while (n < WRITE_BATCH && _ring->pop(batch[n])) {
+					++n;
+					++popped;
+				}
 
-				char tbuf[30];
-				if (colors)
-					fprintf(stdout, "\e[%dm%s %s(%d): %s\e[0m\n", RED, timenowstring(tbuf), _file, _line, tmp);
-				else
-					fprintf(stdout, "%s %s(%d): %s\n", timenowstring(tbuf), _file, _line, tmp);
+				if (n > 0) {
+					{
+						log_lock ll;
+						write_records(batch, n);
+					}
+					_written.fetch_add(popped, std::memory_order_release);
+					continue;
+				}
 
-				fflush(stdout);
-			}
+				if (_writer_stop.load(std::memory_order_acquire) && _ring->size() == 0)
+					break;
 
-			if (modeflags & LogToFile) {
-				va_list va_args;
-				va_start(va_args, fmt);
-				logfile_write(_file, _line, fmt, va_args);
-				va_end(va_args);
+				_writer_sleeping.store(true, std::memory_order_release);
+				if (_ring->size() == 0 && !_writer_stop.load(std::memory_order_acquire)) {
+					struct pollfd pfd = { _wakeup, POLLIN, 0 };
+					poll(&pfd, 1, 100);
+					uint64_t count;
+					if (read(_wakeup, &count, sizeof(count)) < 0) {}
+				}
+				_writer_sleeping.store(false, std::memory_order_release);
 			}
 		}
 
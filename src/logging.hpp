@@ -16,6 +16,14 @@
 */
 #pragma once
 
+#include <stdarg.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <set>
+#include <vector>
+#include <boost/function.hpp>
+
 #define KOI_CHECK_PRINTF(fmt, idx) __attribute__ ((format (printf, fmt, idx)))
 
 namespace koi {
@@ -40,47 +48,136 @@ namespace koi {
 		void set_log_mode(int flags = LogToConsole);
 		void set_log_level(LogLevels level);
 
+		extern LogLevels loglevel;
+		inline bool enabled(LogLevels level) {
+			return level >= loglevel;
+		}
+
+		// Token bucket for one log call site: up to burst messages
+		// at once, refilled at rate messages per second. Messages
+		// over the limit are counted, and the count is added to the
+		// next message that gets through.
+		struct rate_limit {
+			constexpr rate_limit() : _tat(0), _suppressed(0) {}
+
+			bool allow();
+			uint32_t take_suppressed();
+
+			std::atomic<uint64_t> _tat; // usecs, when the bucket is full again
+			std::atomic<uint32_t> _suppressed;
+		};
+
+		void set_rate_limit(uint32_t rate, uint32_t burst); // rate 0 for no limit
+
 		void cprintf(int color, const char* fmt, ...) KOI_CHECK_PRINTF(2, 3);
 
+		// Once the writer is started, log messages are formatted by
+		// the thread that logs them and queued on a lock-free ring;
+		// one writer thread timestamps them and writes each batch to
+		// the sinks with writev. When the ring is full messages are
+		// dropped and counted. Before start_writer(), after
+		// stop_writer() and in forked children every message is
+		// written as it is logged.
+		struct writer_stats {
+			bool     _running;
+			uint64_t _queued;
+			uint64_t _written;
+			uint64_t _dropped;
+			uint64_t _suppressed; // by the rate limits
+		};
+
+		void start_writer();
+		void stop_writer(); // writes out what is queued first
+		void flush(); // waits until what is queued has been written
+		writer_stats stats();
+
 		struct log_context {
-			log_context(const char* fil, int lin, const char* fun);
+			log_context(const char* fil, int lin, const char* fun, rate_limit* site = 0);
 			void trace(const char* fmt, ...) KOI_CHECK_PRINTF(2, 3);
 			void info(const char* fmt, ...) KOI_CHECK_PRINTF(2, 3);
 			void warn(const char* fmt, ...) KOI_CHECK_PRINTF(2, 3);
 			void error(const char* fmt, ...) KOI_CHECK_PRINTF(2, 3);
+			void _log(LogLevels level, const char* fmt, va_list args);
 
 			const char* _file;
 			int _line;
 			const char* _fun;
+			rate_limit* _site;
 		};
 
 
+		// Logs the output of child processes. Each child gets its
+		// own pipe from open(), and one thread watches all of them
+		// with epoll, logging each line tagged with the name the
+		// pipe was opened with.
 		struct logproxy {
 			static const int PROXY_BUFSIZE = 4096;
-
-			struct threadlocal {
-				logproxy* proxy;
-				int outpipe;
-				char buf1[PROXY_BUFSIZE]; // space for two lines
-				char buf2[PROXY_BUFSIZE];
+			// pipes kept open per tag; a command that leaves a
+			// daemon holding its output keeps its pipe open, so
+			// the oldest is retired past this
+			static const size_t MAX_SOURCES_PER_TAG = 8;
+
+			// called on the proxy thread with the tag and each line
+			typedef boost::function<void(const std::string&, const char*)> line_callback;
+
+			struct source {
+				int         _fd; // read end
+				std::string _tag; // service:event
+				rate_limit  _limit; // on logging its lines
+				size_t      _len; // of the incomplete line
+				uint64_t    _serial; // order of opening
+				bool        _retired; // handed to the thread to close
+				char        _line[PROXY_BUFSIZE];
 			};
 
 			logproxy();
 			~logproxy();
-			bool create();
-			void close();
-			void run(threadlocal* data);
-
-			int inpipe;
-
-			char* _consume(char* wptr, ssize_t amt, char*const buf1, char*const buf2);
-			void _eject(const char* str);
+			bool create(); // start the thread
+			void stop(); // stop the thread, keeping the pipes
+			void restart();
+			void close(); // stop and close all pipes
+			int open(const std::string& tag); // write end of a new pipe
+			size_t sources() const; // open pipes
+			void run();
+
+			void _consume(source& src, const char* buf, ssize_t amt);
+			void _eject(const source& src, const char* str);
+			void _remove(source* src);
+			bool _retire_oldest(const std::string& tag);
+			void _remove_retired();
+
+			line_callback      _on_line; // set before the thread starts
+			std::atomic<bool>  _log_lines; // write lines to the log
+			int                _epoll;
+			int                _wakeup; // eventfd, wakes the thread to stop
+			pthread_t          _thread;
+			bool               _running;
+			std::atomic<bool>  _stop;
+			std::set<source*>  _sources;
+			std::vector<source*> _retired; // still in _sources until the thread removes them
+			uint64_t           _serial;
+			mutable pthread_mutex_t _lock; // guards _sources and _retired
 		};
 
 	}
 }
 
-#define LOG_TRACE koi::logging::log_context(__FILE__, __LINE__, __FUNCTION__).trace
-#define LOG_INFO koi::logging::log_context(__FILE__, __LINE__, __FUNCTION__).info
-#define LOG_WARN koi::logging::log_context(__FILE__, __LINE__, __FUNCTION__).warn
-#define LOG_ERROR koi::logging::log_context(__FILE__, __LINE__, __FUNCTION__).error
+// Log calls below KOI_LOG_MIN_LEVEL are compiled out, and the level
+// set at runtime is checked before any arguments are evaluated.
+#ifndef KOI_LOG_MIN_LEVEL
+#define KOI_LOG_MIN_LEVEL 0
+#endif
+
+// one rate limit per call site
+#define KOI_LOG_SITE() ([]() -> koi::logging::rate_limit* { static koi::logging::rate_limit _koi_log_site; return &_koi_log_site; }())
+
+// a for statement runs the call at most once and, unlike an if,
+// cannot capture an else that follows the macro
+#define KOI_LOG(level, method) \
+	for (bool _koi_log = (level) >= KOI_LOG_MIN_LEVEL && koi::logging::enabled(level); _koi_log; _koi_log = false) \
+		koi::logging::log_context(__FILE__, __LINE__, __FUNCTION__, KOI_LOG_SITE()).method
+
+#define LOG_TRACE KOI_LOG(koi::logging::Trace, trace)
+#define LOG_INFO KOI_LOG(koi::logging::Info, info)
+#define LOG_WARN KOI_LOG(koi::logging::Warn, warn)
+#define LOG_ERROR KOI_LOG(koi::logging::Error, error)
@@ -0,0 +1,231 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "koi.hpp"
+#include "metrics.hpp"
+#include "strfmt.hpp"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <boost/shared_ptr.hpp>
+
+namespace koi {
+	namespace metrics {
+		const int histogram::BUCKETS;
+		const uint64_t histogram::BOUNDS[histogram::BUCKETS] = {
+			1, 5, 10, 50, 100, 500,
+			1000, 5000, 10000, 50000, 100000, 500000,
+			1000000, 5000000, 10000000, 60000000, 300000000
+		};
+
+		histogram::histogram() : _count(0), _sum(0) {
+			for (int i = 0; i <= BUCKETS; ++i)
+				_buckets[i] = 0;
+		}
+
+		void histogram::observe(uint64_t usec) {
+			int i = 0;
+			while (i < BUCKETS && usec > BOUNDS[i])
+				++i;
+			_buckets[i].fetch_add(1, std::memory_order_relaxed);
+			_count.fetch_add(1, std::memory_order_relaxed);
+			_sum.fetch_add(usec, std::memory_order_relaxed);
+		}
+
+		namespace {
+			enum Kind { K_Counter, K_Gauge, K_Histogram };
+			const char* kind_names[] = { "counter", "gauge", "histogram" };
+
+			struct family {
+				string _help;
+				Kind _kind;
+				std::map<string, boost::shared_ptr<counter> > _counters; // by labels
+				std::map<string, boost::shared_ptr<gauge> > _gauges;
+				std::map<string, boost::shared_ptr<histogram> > _histograms;
+			};
+
+			struct registry {
+				registry() : _next_collector(1) {
+					pthread_mutex_init(&_lock, 0);
+				}
+
+				family& get(const char* name, const char* help, Kind kind) {
+					auto i = _families.find(name);
+					if (i == _families.end()) {
+						family& f = _families[name];
+						f._help = help;
+						f._kind = kind;
+						return f;
+					}
+					if (i->second._kind != kind)
+						LOG_ERROR("Metric %s is a %s, not a %s", name, kind_names[i->second._kind], kind_names[kind]);
+					return i->second;
+				}
+
+				pthread_mutex_t _lock;
+				std::map<string, family> _families; // by name
+				std::map<int, collector> _collectors;
+				int _next_collector;
+			};
+
+			registry& the_registry() {
+				static registry r;
+				return r;
+			}
+
+			struct registry_lock {
+				registry_lock(registry& r) : _r(r) { pthread_mutex_lock(&_r._lock); }
+				~registry_lock() { pthread_mutex_unlock(&_r._lock); }
+				registry& _r;
+			};
+
+			template <typename T>
+			T& find_or_add(std::map<string, boost::shared_ptr<T> >& m, const string& labels) {
+				boost::shared_ptr<T>& p = m[labels];
+				if (!p)
+					p.reset(new T);
+				return *p;
+			}
+
+			string series(const string& name, const string& labels, const string& extra = string()) {
+				if (labels.empty() && extra.empty())
+					return name;
+				if (labels.empty())
+					return name + "{" + extra + "}";
+				if (extra.empty())
+					return name + "{" + labels + "}";
+				return name + "{" + labels + "," + extra + "}";
+			}
+
+			string seconds(uint64_t usec) {
+				return strfmt<32>("%g", (double)usec / 1e6).str();
+			}
+		}
+
+		string label(const char* name, const string& value) {
+			string ret(name);
+			ret += "=\"";
+			FOREACH(char c, value) {
+				if (c == '"' || c == '\\')
+					ret += '\\';
+				if (c == '\n')
+					ret += "\\n";
+				else
+					ret += c;
+			}
+			return ret + "\"";
+		}
+
+		string label(const char* name, int value) {
+			return strfmt<64>("%s=\"%d\"", name, value).str();
+		}
+
+		counter& get_counter(const char* name, const char* help, const string& labels) {
+			registry& r = the_registry();
+			registry_lock lock(r);
+			return find_or_add(r.get(name, help, K_Counter)._counters, labels);
+		}
+
+		gauge& get_gauge(const char* name, const char* help, const string& labels) {
+			registry& r = the_registry();
+			registry_lock lock(r);
+			return find_or_add(r.get(name, help, K_Gauge)._gauges, labels);
+		}
+
+		histogram& get_histogram(const char* name, const char* help, const string& labels) {
+			registry& r = the_registry();
+			registry_lock lock(r);
+			return find_or_add(r.get(name, help, K_Histogram)._histograms, labels);
+		}
+
+		int on_collect(const collector& fn) {
+			registry& r = the_registry();
+			registry_lock lock(r);
+			r._collectors[r._next_collector] = fn;
+			return r._next_collector++;
+		}
+
+		void remove_collector(int id) {
+			registry& r = the_registry();
+			registry_lock lock(r);
+			r._collectors.erase(id);
+		}
+
+		std::vector<string> prometheus(const string& prefix) {
+			registry& r = the_registry();
+			std::map<int, collector> collectors;
+			{
+				registry_lock lock(r);
+				collectors = r._collectors;
+			}
+			// outside the lock, since collectors set gauges
+			FOREACH(const auto& c, collectors)
+				c.second();
+
+			registry_lock lock(r);
+			std::vector<string> out;
+			FOREACH(const auto& fi, r._families) {
+				const string& name = fi.first;
+				const family& f = fi.second;
+				if (name.compare(0, prefix.size(), prefix) != 0)
+					continue;
+				out.push_back("# HELP " + name + " " + f._help);
+				out.push_back("# TYPE " + name + " " + kind_names[f._kind]);
+				FOREACH(const auto& c, f._counters)
+					out.push_back(strfmt<512>("%s %llu", series(name, c.first).c_str(),
+					                          (unsigned long long)c.second->value()).str());
+				FOREACH(const auto& g, f._gauges)
+					out.push_back(strfmt<512>("%s %lld", series(name, g.first).c_str(),
+					                          (long long)g.second->value()).str());
+				FOREACH(const auto& h, f._histograms) {
+					uint64_t total = 0;
+					for (int i = 0; i <= histogram::BUCKETS; ++i) {
+						total += h.second->_buckets[i].load(std::memory_order_relaxed);
+						const string le = (i < histogram::BUCKETS) ? seconds(histogram::BOUNDS[i]) : "+Inf";
+						out.push_back(strfmt<512>("%s %llu",
+						                          series(name + "_bucket", h.first, "le=\"" + le + "\"").c_str(),
+						                          (unsigned long long)total).str());
+					}
+					out.push_back(series(name + "_sum", h.first) + " " + seconds(h.second->_sum.load(std::memory_order_relaxed)));
+					out.push_back(strfmt<512>("%s %llu", series(name + "_count", h.first).c_str(),
+					                          (unsigned long long)h.second->_count.load(std::memory_order_relaxed)).str());
+				}
+			}
+			return out;
+		}
+
+		bool write_textfile(const string& path) {
+			// node_exporter may read at any time, so write a new file
+			// and move it into place
+			const string tmp = path + ".tmp";
+			FILE* f = fopen(tmp.c_str(), "w");
+			if (!f) {
+				LOG_WARN("Metrics file %s: %s", tmp.c_str(), strerror(errno));
+				return false;
+			}
+			FOREACH(const string& line, prometheus())
+				fprintf(f, "%s\n", line.c_str());
+			const bool ok = (fclose(f) == 0);
+			if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+				LOG_WARN("Metrics file %s: %s", path.c_str(), strerror(errno));
+				unlink(tmp.c_str());
+				return false;
+			}
+			return true;
+		}
+	}
+}
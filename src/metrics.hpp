@@ -0,0 +1,82 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include <boost/function.hpp>
+
+namespace koi {
+	/*
+	 * Counters, gauges and histograms, exported in the Prometheus
+	 * text format through the metrics RPC and the node.metrics_file
+	 * textfile for node_exporter.
+	 *
+	 * get_*() registers a metric the first time it is asked for and
+	 * returns the same one after that; the references stay valid for
+	 * the life of the process. Looking a metric up takes a lock, so
+	 * code on hot paths keeps the reference. Updating it does not,
+	 * and may be done from any thread.
+	 *
+	 * Labels are given preformatted, as from label().
+	 */
+	namespace metrics {
+		struct counter {
+			counter() : _value(0) {}
+			void add(uint64_t n = 1) { _value.fetch_add(n, std::memory_order_relaxed); }
+			void set(uint64_t v) { _value.store(v, std::memory_order_relaxed); } // for collectors copying a count kept elsewhere
+			uint64_t value() const { return _value.load(std::memory_order_relaxed); }
+			std::atomic<uint64_t> _value;
+		};
+
+		struct gauge {
+			gauge() : _value(0) {}
+			void set(int64_t v) { _value.store(v, std::memory_order_relaxed); }
+			int64_t value() const { return _value.load(std::memory_order_relaxed); }
+			std::atomic<int64_t> _value;
+		};
+
+		// Durations in microseconds, exported in seconds.
+		struct histogram {
+			static const int BUCKETS = 17;
+			static const uint64_t BOUNDS[BUCKETS]; // upper bounds, usecs
+
+			histogram();
+			void observe(uint64_t usec);
+
+			std::atomic<uint64_t> _buckets[BUCKETS + 1]; // the last is +Inf
+			std::atomic<uint64_t> _count;
+			std::atomic<uint64_t> _sum; // usecs
+		};
+
+		string label(const char* name, const string& value);
+		string label(const char* name, int value);
+
+		counter& get_counter(const char* name, const char* help, const string& labels = string());
+		gauge& get_gauge(const char* name, const char* help, const string& labels = string());
+		histogram& get_histogram(const char* name, const char* help, const string& labels = string());
+
+		// called before each export, to bring gauges up to date
+		typedef boost::function<void ()> collector;
+		int on_collect(const collector& fn); // returns an id for remove_collector
+		void remove_collector(int id);
+
+		std::vector<string> prometheus(const string& prefix = string()); // lines for names starting with prefix
+		bool write_textfile(const string& path);
+	}
+}
@@ -0,0 +1,89 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#pragma once
+
+#include <atomic>
+#include <utility>
+#include <stdint.h>
+
+namespace koi {
+	// Bounded multiple producer, single consumer ring buffer. Any
+	// number of threads may push while one thread pops, without
+	// locking: each slot carries a sequence number that tells the
+	// producers whether it is free and the consumer whether it has
+	// been filled. N must be a power of two.
+	template <typename T, size_t N>
+	struct mpsc_ring {
+		static_assert((N & (N - 1)) == 0, "mpsc_ring size must be a power of two");
+
+		mpsc_ring() : _head(0), _tail(0) {
+			for (size_t i = 0; i < N; ++i)
+				_cells[i]._seq.store(i, std::memory_order_relaxed);
+		}
+
+		// any thread: false if the ring is full
+		bool push(const T& item) {
+			size_t pos = _tail.load(std::memory_order_relaxed);
+			cell* c;
+			for (;;) {
+				c = &_cells[pos & (N - 1)];
+				const intptr_t dif = (intptr_t)c->_seq.load(std::memory_order_acquire) - (intptr_t)pos;
+				if (dif == 0) {
+					if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (dif < 0) {
+					return false;
+				}
+				else {
+					pos = _tail.load(std::memory_order_relaxed);
+				}
+			}
+			c->_item = item;
+			c->_seq.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+
+		// consumer: false if the ring is empty, or the next
+		// slot is claimed but not yet filled
+		bool pop(T& item) {
+			const size_t pos = _head.load(std::memory_order_relaxed);
+			cell& c = _cells[pos & (N - 1)];
+			if ((intptr_t)c._seq.load(std::memory_order_acquire) - (intptr_t)(pos + 1) < 0)
+				return false;
+			item = std::move(c._item);
+			c._seq.store(pos + N, std::memory_order_release);
+			_head.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+
+		size_t size() const {
+			const size_t head = _head.load(std::memory_order_acquire);
+			return _tail.load(std::memory_order_acquire) - head;
+		}
+
+		struct cell {
+			std::atomic<size_t> _seq;
+			T _item;
+		};
+
+		cell _cells[N];
+		std::atomic<size_t> _head; // next slot to pop
+		char _pad[64]; // keep the consumer and producers off the same cache line
+		std::atomic<size_t> _tail; // next slot to claim
+	};
+}
@@ -23,10 +23,12 @@
 #include "hex.hpp"
 #include "strfmt.hpp"
 #include "static_vector.hpp"
+#include "metrics.hpp"
+#include "clock.hpp"
 
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_int.hpp>
-#include <boost/random/variate_generator.hpp>
+#include <unistd.h>
 #include <boost/lexical_cast.hpp>
 #include <boost/variant.hpp>
 
@@ -110,7 +112,14 @@ namespace {
 			a << si._name
 			  << si._event
 			  << (int)si._state
-			  << si._failed;
+			  << si._failed
+			  << si._group;
+		a << hr->_load._valid
+		  << hr->_load._loadavg
+		  << hr->_load._steal
+		  << hr->_load._memfree
+		  << hr->_load._weight
+		  << hr->_prepared;
 	}
 
 	void read_archive(reader& r, healthreport* hr) {
@@ -145,23 +154,36 @@ namespace {
 			r >> inf._name
 			  >> inf._event
 			  >> sstate
-			  >> inf._failed;
+			  >> inf._failed
+			  >> inf._group;
 			if (validate_service_state(sstate) < 0)
 				throw msg_error("Invalid service state: %d", sstate);
 
 			inf._state = (koi::ServiceState)sstate;
 			hr->_services.push_back(inf);
 		}
+		r >> hr->_load._valid
+		  >> hr->_load._loadavg
+		  >> hr->_load._steal
+		  >> hr->_load._memfree
+		  >> hr->_load._weight
+		  >> hr->_prepared;
 	}
 
 	void write_archive(archive& a, const stateupdate* su) {
 		a << su->_uptime
 		  << su->_master_uuid;
 		if (!su->_master_uuid.is_nil()) {
-			a << su->_master_last_seen
+			a << clock::to_wall(su->_master_last_seen)
 			  << su->_master_name
 			  << su->_master_addr;
 		}
+		a << (int)su->_groups.size();
+		FOREACH(const auto& g, su->_groups)
+			a << g._group
+			  << g._uuid;
+		a << su->_prepare_uuid
+		  << su->_epoch;
 	}
 
 	void read_archive(reader& r, stateupdate* su) {
@@ -171,12 +193,24 @@ namespace {
 			r >> su->_master_last_seen
 			  >> su->_master_name
 			  >> su->_master_addr;
+			su->_master_last_seen = clock::from_wall(su->_master_last_seen);
 		}
 		else {
 			su->_master_last_seen = ptime(min_date_time);
 			su->_master_name = "";
 			su->_master_addr = net::endpoint();
 		}
+		su->_groups.clear();
+		uint32_t ngroups;
+		r >> ngroups;
+		for (size_t i = 0; i < (size_t)ngroups; ++i) {
+			stateupdate::group_master g;
+			r >> g._group
+			  >> g._uuid;
+			su->_groups.push_back(g);
+		}
+		r >> su->_prepare_uuid
+		  >> su->_epoch;
 	}
 
 	void write_archive(archive& a, const heartbeat* hb) {
@@ -192,7 +226,7 @@ namespace {
 			  << hb->_cluster_maintenance
 			  << (int)hb->_nodes.size();
 			FOREACH(heartbeat::node const& n, hb->_nodes) {
-				a << n._id << n._name << n._last_seen << n._flags << n._addrs;
+				a << n._id << n._name << clock::to_wall(n._last_seen) << n._flags << n._addrs;
 			}
 		}
 	}
@@ -213,6 +247,7 @@ namespace {
 			for (int i = 0; i < nnodes; ++i) {
 				heartbeat::node n;
 				r >> n._id >> n._name >> n._last_seen >> n._flags >> n._addrs;
+				n._last_seen = clock::from_wall(n._last_seen);
 				hb->_nodes.push_back(n);
 			}
 		}
@@ -306,27 +341,65 @@ namespace {
 		read_archive(r, b);
 	}
 
-	// this only works because koi is single-threaded..
-	static static_vector<uint8_t, MAX_MSG_LEN*10> compression_buffer;
-	void perhaps_compress(vector<uint8_t>& to, const archive& a);
-	void perhaps_decompress(vector<uint8_t>& from);
+	void perhaps_compress(vector<uint8_t>& to, const archive& a, msg::codec& c);
+	void perhaps_decompress(vector<uint8_t>& from, msg::codec& c);
+
+	// looked up once, encode and decode run for every message
+	struct wire_metrics {
+		wire_metrics() {
+			for (int i = 0; i < msg::base::NumOps; ++i) {
+				const string type = metrics::label("type", msg::type_to_string((msg::base::Type)i));
+				_encode[i] = &metrics::get_histogram("koi_message_encode_seconds",
+				                                     "Time to encode, compress and encrypt a message.", type);
+				_decode[i] = &metrics::get_histogram("koi_message_decode_seconds",
+				                                     "Time to decrypt, decompress and decode a message.", type);
+			}
+			_decrypt_failures = &metrics::get_counter("koi_message_decrypt_failures_total",
+			                                          "Received messages that failed to decrypt.");
+			_decode_errors = &metrics::get_counter("koi_message_decode_errors_total",
+			                                       "Received messages that could not be decoded.");
+			_compress_in = &metrics::get_counter("koi_message_compress_input_bytes_total",
+			                                     "Bytes of messages large enough to be compressed.");
+			_compress_out = &metrics::get_counter("koi_message_compress_output_bytes_total",
+			                                      "Bytes of those messages after compression.");
+		}
+
+		metrics::histogram* _encode[msg::base::NumOps];
+		metrics::histogram* _decode[msg::base::NumOps];
+		metrics::counter* _decrypt_failures;
+		metrics::counter* _decode_errors;
+		metrics::counter* _compress_in;
+		metrics::counter* _compress_out;
+	};
+
+	wire_metrics& wire() {
+		static wire_metrics w;
+		return w;
+	}
 
+	int random_nonce(msg::codec& c) {
+		boost::uniform_int<> dist(0, INT_MAX);
+		return dist(c._nonces);
+	}
 
-	void perhaps_compress(vector<uint8_t>& to, const archive& a) {
+	void perhaps_compress(vector<uint8_t>& to, const archive& a, msg::codec& c) {
 		if (a.size() > COMPRESSION_THRESHOLD) {
-			compression_buffer.resize_max();
-			unsigned long outsize = compression_buffer.size();
-			int zip_ret = mz_compress(&compression_buffer.front(), &outsize, a.data(), a.size());
+			c._buffer.resize_max();
+			unsigned long outsize = c._buffer.size();
+			int zip_ret = mz_compress(&c._buffer.front(), &outsize, a.data(), a.size());
 			if ((zip_ret == MZ_OK) && (outsize < MAX_MSG_LEN - 4)) {
 				if (debug_mode) {
 					LOG_TRACE("compressed from %d to %d bytes", (int)a.size(), (int)outsize);
 				}
 
-				compression_buffer.resize(outsize);
+				wire()._compress_in->add(a.size());
+				wire()._compress_out->add(outsize);
+
+				c._buffer.resize(outsize);
 				to.clear();
 				const uint8_t h[] = {0x80, 0, 0, 0};
 				to.insert(to.end(), h, h+4);
-				to.insert(to.end(), compression_buffer.begin(), compression_buffer.end());
+				to.insert(to.end(), c._buffer.begin(), c._buffer.end());
 			}
 			else {
 				LOG_ERROR("Failed to compress message: %s (%lu > %d bytes).", (zip_ret==MZ_OK)?"":mz_error(zip_ret), (unsigned long)outsize, MAX_MSG_LEN);
@@ -340,23 +413,23 @@ namespace {
 		}
 	}
 
-	void perhaps_decompress(vector<uint8_t>& from) {
+	void perhaps_decompress(vector<uint8_t>& from, msg::codec& c) {
 		if ((from[0] == 0x80) &&
 		    (from[1] == 0) &&
 		    (from[2] == 0) &&
 		    (from[3] == 0)) {
-			compression_buffer.resize_max();
-			unsigned long decomp_size = compression_buffer.size();
-			int zip_ret = mz_uncompress(&compression_buffer.front(), &decomp_size, &(from[4]), from.size()-4);
+			c._buffer.resize_max();
+			unsigned long decomp_size = c._buffer.size();
+			int zip_ret = mz_uncompress(&c._buffer.front(), &decomp_size, &(from[4]), from.size()-4);
 			if (zip_ret != MZ_OK) {
 				throw msg_error("Failed to decompress message: %s", mz_error(zip_ret));
 			}
 			if (debug_mode) {
 				LOG_TRACE("decompressed from %d to %d bytes", (int)from.size()-4, (int)decomp_size);
 			}
-			compression_buffer.resize(decomp_size);
+			c._buffer.resize(decomp_size);
 			from.clear();
-			from.insert(from.end(), compression_buffer.begin(), compression_buffer.end());
+			from.insert(from.end(), c._buffer.begin(), c._buffer.end());
 		}
 	}
 }
@@ -435,7 +508,26 @@ namespace koi {
 	}
 
 	namespace msg {
+		// seeded differently in each process and codec
+		codec::codec()
+			: _nonces((uint32_t)clock::usecs(clock::wall()) ^ (uint32_t)getpid() ^ (uint32_t)(uintptr_t)this) {
+		}
+
+		static codec& shared_codec() {
+			static codec c;
+			return c;
+		}
+
 		bool encode(vector<uint8_t>& to, const message* msg, const string& pass) {
+			return encode(to, msg, pass, shared_codec());
+		}
+
+		bool decode(message* msg, vector<uint8_t>& from, const string& pass) {
+			return decode(msg, from, pass, shared_codec());
+		}
+
+		bool encode(vector<uint8_t>& to, const message* msg, const string& pass, codec& c) {
+			const uint64_t started = clock::usecs(clock::read());
 			try {
 				to.resize(0);
 
@@ -471,19 +563,16 @@ namespace koi {
 					throw msg_error("%s", "Invalid archive");
 
 				if (debug_mode) {
-					string repr = a.to_string();
-					LOG_TRACE("encode: %s [%d bytes]", repr.c_str(), a.size());
+					LOG_TRACE("encode: %s [%d bytes]", a.to_string().c_str(), a.size());
 				}
 
-				perhaps_compress(to, a);
+				perhaps_compress(to, a, c);
 
 				// pad to 4 byte interval
 				bytevector_pad4(to);
 
 				// generate nonce
-				static boost::mt19937 random_engine;
-				static boost::variate_generator<boost::mt19937&, boost::uniform_int<>> mkrandom(random_engine, boost::uniform_int<>(0, INT_MAX));
-				int nonce = mkrandom();
+				int nonce = random_nonce(c);
 				string nonces = pass + lexical_cast<string>(nonce);
 
 				// encrypt w pass + nonce
@@ -496,6 +585,7 @@ namespace koi {
 				if (to.size() > MAX_MSG_LEN)
 					throw msg_error("length > max: %d > %d", (int)to.size(), MAX_MSG_LEN);
 
+				wire()._encode[msg->_op]->observe(clock::usecs(clock::read()) - started);
 				return true;
 			}
 			catch (archive_error const& e) {
@@ -508,7 +598,8 @@ namespace koi {
 			}
 		}
 
-		bool decode(message* msg, vector<uint8_t>& from, const string& pass) {
+		bool decode(message* msg, vector<uint8_t>& from, const string& pass, codec& c) {
+			const uint64_t started = clock::usecs(clock::read());
 			try {
 				if (from.size() > MAX_MSG_LEN)
 					throw msg_error("length > max: %d > %d", (int)from.size(), MAX_MSG_LEN);
@@ -519,10 +610,12 @@ namespace koi {
 
 				// decrypt
 				SHA1::digest pwd = hashpass(nonces.c_str());
-				if (!crypto::decrypt(&from.front(), from.size(), pwd._data32, 5))
+				if (!crypto::decrypt(&from.front(), from.size(), pwd._data32, 5)) {
+					wire()._decrypt_failures->add();
 					throw msg_error("Decrypt failed for size %d", (int)from.size());
+				}
 
-				perhaps_decompress(from);
+				perhaps_decompress(from, c);
 
 				archive a(from);
 				reader r(a);
@@ -534,8 +627,7 @@ namespace koi {
 				}
 
 				if (debug_mode) {
-					string repr = a.to_string();
-					LOG_TRACE("decode: %s", repr.c_str());
+					LOG_TRACE("decode: %s", a.to_string().c_str());
 				}
 
 				r >> msg->_version;
@@ -574,13 +666,16 @@ namespace koi {
 					throw msg_error("Invalid message type: %d", msg->_op);
 				}
 
+				wire()._decode[msg->_op]->observe(clock::usecs(clock::read()) - started);
 				return true;
 			}
 			catch (archive_error const& e) {
+				wire()._decode_errors->add();
 				LOG_ERROR("Assert when unspooling archive: %s (%s : %zu)", e.what(), e.type, e.size);
 				return false;
 			}
 			catch (std::exception const& e) {
+				wire()._decode_errors->add();
 				LOG_ERROR("Decode error: %s", e.what());
 				return false;
 			}
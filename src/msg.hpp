@@ -19,10 +19,12 @@
 #include <boost/uuid/nil_generator.hpp>
 #include <map>
 #include <boost/variant.hpp>
+#include <boost/random/mersenne_twister.hpp>
 
 #include "service_info.hpp"
 #include "archive.hpp"
 #include "mru.hpp"
+#include "static_vector.hpp"
 
 namespace koi {
 	archive& operator<<(archive& a, const net::endpoint& ep);
@@ -58,6 +60,7 @@ namespace koi {
 			uint8_t _cluster_id;
 			uuid _sender_uuid;
 			net::endpoint _from;
+			uint64_t _rx_time; // kernel receive time in usecs since the epoch, 0 if unknown, not sent
 			boost::shared_ptr<msg::base> _body;
 
 			template <typename Body>
@@ -74,14 +77,16 @@ namespace koi {
 			            _op(base::NumOps),
 			            _cluster_id(0),
 			            _sender_uuid(boost::uuids::nil_uuid()),
-			            _from() {}
+			            _from(),
+			            _rx_time(0) {}
 			message(const uuid& uuid, uint8_t cluster_id)
 				: _version(koi::version),
 				  _seqnr(0),
 				  _op(base::NumOps),
 				  _cluster_id(cluster_id),
 				  _sender_uuid(uuid),
-				  _from() {
+				  _from(),
+				  _rx_time(0) {
 			}
 			message(const uuid& uuid, uint8_t cluster_id, base::Type op)
 				: _version(koi::version),
@@ -89,12 +94,14 @@ namespace koi {
 				  _op(op),
 				  _cluster_id(cluster_id),
 				  _sender_uuid(uuid),
-				  _from() {
+				  _from(),
+				  _rx_time(0) {
 			}
 		};
 
 		struct healthreport : public base {
 			// sent from runner to elector
+			healthreport() : _prepared(false) {}
 			virtual ~healthreport() {}
 
 			string _name;
@@ -106,6 +113,9 @@ namespace koi {
 
 			typedef std::vector<service_info> services;
 			services _services;
+
+			load_info _load;
+			bool _prepared; // ready to be promoted, see service_manager::prepared
 		};
 
 		struct stateupdate : public base {
@@ -119,6 +129,21 @@ namespace koi {
 			ptime _master_last_seen;
 			string _master_name;
 			net::endpoint _master_addr;
+
+			// masters of the resource groups; groups without
+			// a master are left out
+			struct group_master {
+				string _group;
+				uuid _uuid;
+			};
+			typedef std::vector<group_master> group_masters;
+			group_masters _groups;
+
+			// runner that should prepare for promotion, or nil
+			uuid _prepare_uuid;
+
+			// election that chose the master, see trace.hpp
+			uint64_t _epoch;
 		};
 
 		struct request : public base {
@@ -243,10 +268,26 @@ namespace koi {
 
 #undef MessageBodyMethods
 
+		enum { MAX_MSG_LEN = 8000 };
+		// chive lists hold at most 0xfff bytes, and each string in
+		// a list takes up to two bytes of chunk header
+		enum { MAX_LIST_LEN = 0xfff - 64, LIST_ITEM_OVERHEAD = 2 };
+
+		// Scratch space and nonce generator for encode and decode.
+		// A codec must only be used by one thread at a time.
+		struct codec {
+			codec();
+
+			static_vector<uint8_t, MAX_MSG_LEN*10> _buffer; // compressed or decompressed message
+			boost::mt19937 _nonces;
+		};
+
+		bool encode(std::vector<uint8_t>& to, const message* msg, const string& pass, codec& c);
+		bool decode(message* msg, std::vector<uint8_t>& from, const string& pass, codec& c);
+
+		// these share one codec, for programs that only use one thread
 		bool encode(std::vector<uint8_t>& to, const message* msg, const string& pass);
 		bool decode(message* msg, std::vector<uint8_t>& from, const string& pass);
-
-		enum { MAX_MSG_LEN = 8000 };
 	}
 
 	using msg::message;
@@ -23,6 +23,7 @@
 #include "network.hpp"
 #include "nexus.hpp"
 #include "clusterstate.hpp"
+#include "metrics.hpp"
 
 using namespace std;
 using namespace boost;
@@ -77,10 +78,15 @@ void network::sendto(const uuid& to, const uuid& ID, const string& name, int fla
 }
 
 void network::handle(message& m) {
+	static metrics::counter& rejected = metrics::get_counter("koi_sequence_rejections_total",
+	                                                         "Heartbeats dropped as old or repeated.");
 	if (_sequence.check(m._sender_uuid, m._seqnr)) {
 		_endpoints[m._sender_uuid] = m._from;
 		_in_queue.push_back(m);
 	}
+	else {
+		rejected.add();
+	}
 }
 
 
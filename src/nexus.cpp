@@ -23,11 +23,24 @@
 #include "clusterstate.hpp"
 #include "cluster.hpp"
 #include "settings.hpp"
+#include "realtime.hpp"
+#include "spsc.hpp"
+#include "timer_wheel.hpp"
+#include "journal.hpp"
+#include "trace.hpp"
+#include "metrics.hpp"
+#include "watchdog.hpp"
+#include "transport.hpp"
+#include "clock.hpp"
+#include "strfmt.hpp"
 
 #include <boost/uuid/uuid_generators.hpp>
 #include <boost/uuid/uuid_io.hpp>
 #include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <pthread.h>
+#include <sys/socket.h>
 
 using namespace std;
 using namespace boost;
@@ -39,43 +52,214 @@ namespace koi {
 	namespace {
 		typedef list<message> messagequeue;
 		typedef vector<net::endpoint> linklist;
+
+		// datagrams read per readiness notification, so that a flood
+		// on one socket cannot hold up the rest of the io service
+		static const int ReceiveBatch = 64;
+
+		// number of cluster updates a replaced socket keeps receiving
+		// after a port change, so that peers have time to learn the
+		// new address from our heartbeats
+		static const int RetireTicks = 2 * cluster::Limit;
+
+		linklist parse_links(const string& transport, uint16_t port) {
+			linklist links;
+			stringvec tsv = split(transport, ",; ");
+			for (size_t i = 0; i < tsv.size(); ++i)
+				links.push_back(parse_endpoint(tsv[i].c_str(), port));
+			return links;
+		}
+
+		bool has_link(const linklist& links, const net::endpoint& ep) {
+			return find(links.begin(), links.end(), ep) != links.end();
+		}
 	}
 
+	// a bound socket and its receive buffer
+	struct listener {
+		listener(net::io_service& io) : _sock(io), _remote(), _buffer(msg::MAX_MSG_LEN) {}
+
+		net::socket _sock;
+		net::endpoint _remote;
+		vector<uint8_t> _buffer;
+	};
+
+	typedef boost::shared_ptr<listener> listener_ptr;
+
+	namespace {
+		// messages and bytes by type, counted on the thread that owns
+		// the socket
+		struct traffic {
+			traffic() {
+				for (int i = 0; i < msg::base::NumOps; ++i) {
+					const string type = metrics::label("type", msg::type_to_string((msg::base::Type)i));
+					_rx_msgs[i] = &metrics::get_counter("koi_messages_received_total", "Messages received from this cluster, by type.", type);
+					_rx_bytes[i] = &metrics::get_counter("koi_received_bytes_total", "Bytes of messages received from this cluster, by type.", type);
+					_tx_msgs[i] = &metrics::get_counter("koi_messages_sent_total", "Messages sent, by type, once per destination.", type);
+					_tx_bytes[i] = &metrics::get_counter("koi_sent_bytes_total", "Bytes of messages sent, by type.", type);
+				}
+			}
+
+			metrics::counter* _rx_msgs[msg::base::NumOps];
+			metrics::counter* _rx_bytes[msg::base::NumOps];
+			metrics::counter* _tx_msgs[msg::base::NumOps];
+			metrics::counter* _tx_bytes[msg::base::NumOps];
+		};
+
+		traffic& wire_traffic() {
+			static traffic t;
+			return t;
+		}
+	}
+
+	// a message waiting for the I/O thread to encode and send it
+	struct outgoing {
+		message _msg;
+		linklist _to;
+	};
+
+	struct nexus_impl;
+}
+
+// Stub is needed since pthreads
+// don't know about C++ objects
+extern "C" void* nexus_io_run(void* p);
+
+namespace koi {
 	struct nexus_impl {
-		nexus_impl(nexus& route, net::io_service& io, const settings& conf)
+		nexus_impl(nexus& route, net::io_service& io, const settings& conf, transport* t)
 			: _io(io),
-			  _sock(io),
 			  _cfg(conf),
-			  _cluster(route, _cfg) {
+			  _timers(clock::usecs()),
+			  _cluster_timer(0),
+			  _cluster(route, _cfg),
+			  _journal_mode(cluster::Servant),
+			  _journal_leader(boost::uuids::nil_uuid()),
+			  _metrics_timer(0),
+			  _listen_port(conf._port),
+			  _transport(t),
+			  _threaded(conf._io_thread && !t),
+			  _io_running(false),
+			  _tx_pending(false),
+			  _rx_dropped(0),
+			  _tx_dropped(0) {
+			_metrics_collector = metrics::on_collect(bind(&nexus_impl::collect_metrics, this));
+		}
+
+		~nexus_impl() {
+			metrics::remove_collector(_metrics_collector);
+			stop_io_thread();
+			if (_transport)
+				_transport->close(_local);
 		}
 
+		// Stops the I/O thread for the lifetime of the pause, so that
+		// the main thread can change sockets and settings it uses.
+		struct io_pause {
+			io_pause(nexus_impl& n) : _n(n), _running(n._io_running) {
+				if (_running)
+					_n.stop_io_thread();
+			}
+			~io_pause() {
+				if (_running)
+					_n.start_io_thread();
+			}
+			nexus_impl& _n;
+			bool _running;
+		};
+
+		listener_ptr open_listener(const net::endpoint& listen);
 		void init_socket(const net::endpoint& listen);
-		void handle_receive_from(const error_code& err, size_t nbytes);
-		bool parse_message(message& to);
+		void open_transport(uint16_t port);
+		bool rebind(uint16_t port);
+		void retire_listener(const ptime& now);
+		void join_links(net::socket& sock);
+		void start_receive(listener_ptr l);
+		void handle_receive(listener_ptr l, const error_code& err);
+		bool read_datagram(listener& l, uint64_t& rx_time);
+		void accept(vector<uint8_t>& data, const net::endpoint& from, uint64_t rx_time);
 		bool settings_changed(const settings& newcfg, const settings& oldcfg);
 		void rpc_response(const net::endpoint& to,
 		                  const msg::response::values& data);
 		void update();
+		void schedule_cluster_update();
+		void open_journal();
+		void journal_cluster();
+		vector<string> journal_lines(uint64_t from, uint64_t to, size_t max_bytes) const;
+		void schedule_metrics();
+		void collect_metrics();
+		void write_metrics();
+
+		// node.io_thread: one thread owns the sockets, decodes what it
+		// receives and encodes what it sends; messages pass to and
+		// from the main loop over lock-free rings
+		net::io_service& net_io() { return _threaded ? _net_io : _io; }
+		void start_io_thread();
+		void stop_io_thread();
+		void io_run();
+		void transmit(const message& m, const linklist& to);
+		void drain_tx();
+		void send_now(const message& m, const linklist& to, vector<uint8_t>& buffer, msg::codec& codec);
+		void receive(const message& m);
+		string io_stats() const;
+
+		net::socket& sock() { return _listener->_sock; }
 
 		net::io_service& _io;
-		net::socket _sock;
+		net::io_service _net_io; // before the listeners, which use it
 		settings _cfg;
+		timer_wheel _timers; // before the runner and elector, whose emitters use it
+		timer_wheel::timer_id _cluster_timer;
+		journal _journal; // before the runner and elector, which append to it
+		failover_trace _trace;
 		cluster _cluster;
+		cluster::Mode _journal_mode; // cluster mode and leader last journaled
+		uuid _journal_leader;
+		timer_wheel::timer_id _metrics_timer; // writes node.metrics_file
+		int _metrics_collector;
 		boost::shared_ptr<runner> _runner;
 		boost::shared_ptr<elector> _elector;
-		net::endpoint _in_remote;
-		vector<uint8_t> _in_buffer;
+		listener_ptr _listener;
+		listener_ptr _retired; // previous listener, closed at _retire_at
+		ptime _retire_at;
+		uint16_t _listen_port; // configured port, _cfg._port is the bound port
+		transport* _transport; // carries the datagrams instead of the socket, if set
+		net::endpoint _local; // our address on _transport
 		vector<uint8_t> _out_buffer;
+		msg::codec _codec;
 		linklist _links;
 		messagequeue _in_queue;
+
+		bool _threaded;
+		bool _io_running;
+		boost::scoped_ptr<net::io_service::work> _net_work;
+		pthread_t _net_thread;
+		spsc_ring<message, 1024> _rx; // I/O thread -> main loop
+		spsc_ring<outgoing, 1024> _tx; // main loop -> I/O thread
+		std::atomic<bool> _tx_pending; // a drain_tx is posted to the I/O thread
+		std::atomic<uint32_t> _rx_dropped;
+		std::atomic<uint32_t> _tx_dropped;
+		vector<uint8_t> _net_out_buffer; // owned by the I/O thread
+		msg::codec _net_codec; // owned by the I/O thread, which also decodes
 	};
+}
 
-	nexus::nexus(net::io_service& ioservice, const settings& conf)
-		: _impl(new nexus_impl(*this, ioservice, conf)) {
+extern "C" void* nexus_io_run(void* p) {
+	static_cast<koi::nexus_impl*>(p)->io_run();
+	return 0;
+}
+
+namespace koi {
+
+	nexus::nexus(net::io_service& ioservice, const settings& conf, transport* t)
+		: _impl(new nexus_impl(*this, ioservice, conf, t)) {
 		_redirecting_rpc.insert("start");
 		_redirecting_rpc.insert("stop");
 		_redirecting_rpc.insert("recover");
 		_redirecting_rpc.insert("reconfigure");
+		_redirecting_rpc.insert("output");
+		_redirecting_rpc.insert("journal");
+		_redirecting_rpc.insert("metrics");
 
 		_elector_rpc["status"] = elector_rpcfn(&elector::rpc_status);
 		_elector_rpc["tree"] = _elector_rpc["status"];
@@ -84,38 +268,53 @@ namespace koi {
 		_elector_rpc["elect"] = elector_rpcfn(&elector::rpc_elect);
 		_elector_rpc["failures"] = elector_rpcfn(&elector::rpc_failures);
 		_elector_rpc["maintenance"] = elector_rpcfn(&elector::rpc_maintenance);
+		_elector_rpc["stats"] = elector_rpcfn(&elector::rpc_stats);
 		_runner_rpc["start"] = runner_rpcfn(&runner::rpc_start);
 		_runner_rpc["stop"] = runner_rpcfn(&runner::rpc_stop);
-
-		_impl->init_socket(net::endpoint(net::ipaddr(), conf._port));
+		_runner_rpc["timeouts"] = runner_rpcfn(&runner::rpc_timeouts);
+		_runner_rpc["usage"] = runner_rpcfn(&runner::rpc_usage);
+		_runner_rpc["output"] = runner_rpcfn(&runner::rpc_output);
+
+		if (t)
+			_impl->open_transport(conf._port);
+		else
+			_impl->init_socket(net::endpoint(net::ipaddr(), conf._port));
 	}
 
 	nexus::~nexus() {
 		if (_impl) {
+			_impl->stop_io_thread();
 			_impl->_cluster.clear_callbacks();
 		}
 	}
 
-	void nexus_impl::init_socket(const net::endpoint& listen) {
+	listener_ptr nexus_impl::open_listener(const net::endpoint& listen) {
 		const uint16_t max_inc = 1000;
 		uint16_t inc = 0;
+		listener_ptr l(new listener(net_io()));
 		net::endpoint actual(listen);
 		for (;;) {
 			boost::system::error_code ec;
-			_sock.open(actual.protocol(), ec);
+			l->_sock.open(actual.protocol(), ec);
 			if (!ec) {
 				if (_cfg._reuse_address) {
-					_sock.set_option(asio::ip::udp::socket::reuse_address(true));
+					l->_sock.set_option(asio::ip::udp::socket::reuse_address(true));
 				}
-				_sock.bind(actual, ec);
+				realtime::apply_socket(l->_sock.native_handle(), _cfg);
+#ifdef SO_TIMESTAMPNS
+				const int on = 1;
+				if (setsockopt(l->_sock.native_handle(), SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) != 0)
+					LOG_WARN("Unable to set SO_TIMESTAMPNS, receive delays are not measured: %s", strerror(errno));
+#endif
+				l->_sock.bind(actual, ec);
 			}
 			if (ec) {
 				if (inc < max_inc && _cfg._incremental_port) {
 					LOG_INFO("Address %s already in use; trying to increment port by 1",
 					         to_string(actual).c_str());
 					actual.port(listen.port() + (++inc));
-					if (_sock.is_open())
-						_sock.close(ec);
+					if (l->_sock.is_open())
+						l->_sock.close(ec);
 					continue;
 				}
 				else {
@@ -125,37 +324,151 @@ namespace koi {
 			}
 			break;
 		}
+		return l;
+	}
+
+	void nexus_impl::init_socket(const net::endpoint& listen) {
+		_listener = open_listener(listen);
+		_cfg._port = _listener->_sock.local_endpoint().port();
+		start_receive(_listener);
+	}
+
+	void nexus_impl::open_transport(uint16_t port) {
+		_local = _transport->open(port, bind(&nexus_impl::accept, this, _1, _2, _3));
+		if (_local.port() == 0)
+			throw runtime_error("Address already in use.");
+		_cfg._port = _local.port();
+	}
+
+	// Bind a new socket to port and make it the primary socket. The
+	// old socket keeps receiving until retire_listener() closes it.
+	bool nexus_impl::rebind(uint16_t port) {
+		if (_transport) {
+			_transport->close(_local);
+			open_transport(port);
+			_listen_port = port;
+			return true;
+		}
 
-		_cfg._port = actual.port();
+		listener_ptr l;
+		try {
+			l = open_listener(net::endpoint(net::ipaddr(), port));
+		}
+		catch (const runtime_error& e) {
+			LOG_ERROR("Failed to rebind to port %d: %s", (int)port, e.what());
+			return false;
+		}
+
+		if (_retired) {
+			error_code ec;
+			_retired->_sock.close(ec);
+		}
 
+		join_links(l->_sock);
+		start_receive(l);
 
-		_in_buffer.resize(msg::MAX_MSG_LEN);
-		_sock.async_receive_from(asio::buffer(_in_buffer), _in_remote,
-		                         bind(&nexus_impl::handle_receive_from, this,
-		                              asio::placeholders::error,
-		                              asio::placeholders::bytes_transferred));
+		LOG_INFO("Rebound: port %d -> %d",
+		         (int)_cfg._port, (int)l->_sock.local_endpoint().port());
+
+		_retired = _listener;
+		_retire_at = clock::now() + microseconds(RetireTicks * _cfg._cluster_update_interval);
+		_listener = l;
+		_listen_port = port;
+		_cfg._port = l->_sock.local_endpoint().port();
+		return true;
 	}
 
-	void nexus_impl::handle_receive_from(const error_code& err, size_t nbytes) {
-		if (!err) {
-			_in_buffer.resize(nbytes);
+	void nexus_impl::retire_listener(const ptime& now) {
+		if (_retired && now >= _retire_at) {
+			io_pause pause(*this);
+			LOG_TRACE("Closing retired socket on port %d.",
+			          (int)_retired->_sock.local_endpoint().port());
+			error_code ec;
+			_retired->_sock.close(ec);
+			_retired.reset();
+		}
+	}
 
-			message m;
-			if (parse_message(m) && m._cluster_id == _cfg._cluster_id) {
-				_in_queue.push_back(m);
+	void nexus_impl::join_links(net::socket& sock) {
+		using namespace boost::asio;
+		FOREACH(const net::endpoint& remote, _links) {
+			if (net::is_multicast(remote.address())) {
+				sock.set_option(ip::multicast::enable_loopback(true));
+				sock.set_option(ip::multicast::join_group(remote.address()));
 			}
 		}
+	}
+
+	// waits for the socket to become readable, the datagrams are
+	// read with recvmsg to get their kernel receive timestamps
+	void nexus_impl::start_receive(listener_ptr l) {
+		l->_sock.async_receive(asio::null_buffers(),
+		                       bind(&nexus_impl::handle_receive, this, l,
+		                            asio::placeholders::error));
+	}
+
+	void nexus_impl::handle_receive(listener_ptr l, const error_code& err) {
+		if (err == asio::error::operation_aborted || !l->_sock.is_open())
+			return;
+
+		uint64_t rx_time;
+		for (int n = 0; !err && n < ReceiveBatch && read_datagram(*l, rx_time); ++n)
+			accept(l->_buffer, l->_remote, rx_time);
+
+		start_receive(l);
+	}
 
-		_in_buffer.resize(msg::MAX_MSG_LEN);
-		_sock.async_receive_from(asio::buffer(_in_buffer), _in_remote,
-		                         bind(&nexus_impl::handle_receive_from, this,
-		                              asio::placeholders::error,
-		                              asio::placeholders::bytes_transferred));
+	// decodes a datagram and queues it for the main loop if it is
+	// for this cluster
+	void nexus_impl::accept(vector<uint8_t>& data, const net::endpoint& from, uint64_t rx_time) {
+		const size_t nbytes = data.size();
+		message m;
+		m._from = from;
+		if (msg::decode(&m, data, _cfg._pass, _threaded ? _net_codec : _codec) && m._cluster_id == _cfg._cluster_id) {
+			m._rx_time = rx_time;
+			wire_traffic()._rx_msgs[m._op]->add();
+			wire_traffic()._rx_bytes[m._op]->add(nbytes);
+			receive(m);
+		}
 	}
 
-	bool nexus_impl::parse_message(message& to) {
-		to._from = _in_remote;
-		return msg::decode(&to, _in_buffer, _cfg._pass);
+	// reads one datagram into the listener without blocking, false
+	// if none is waiting
+	bool nexus_impl::read_datagram(listener& l, uint64_t& rx_time) {
+		l._buffer.resize(msg::MAX_MSG_LEN);
+		iovec iov;
+		iov.iov_base = &l._buffer[0];
+		iov.iov_len = l._buffer.size();
+		char control[CMSG_SPACE(sizeof(timespec))];
+		msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_name = l._remote.data();
+		mh.msg_namelen = l._remote.capacity();
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+
+		const ssize_t n = ::recvmsg(l._sock.native_handle(), &mh, MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				LOG_ERROR("recvmsg error: %d %s", errno, strerror(errno));
+			return false;
+		}
+		l._remote.resize(mh.msg_namelen);
+		l._buffer.resize(n);
+
+		rx_time = 0;
+#ifdef SO_TIMESTAMPNS
+		for (cmsghdr* c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+			if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+				timespec ts;
+				memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+				rx_time = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+			}
+		}
+#endif
+		return true;
 	}
 
 	bool nexus_impl::settings_changed(const settings& newcfg, const settings& oldcfg) {
@@ -164,14 +477,28 @@ namespace koi {
 			return false;
 		}
 
-		if (_sock.local_endpoint() != net::endpoint(net::ipaddr(), newcfg._port)) {
-			string e0 = lexical_cast<string>(_sock.local_endpoint());
-			string e1 = lexical_cast<string>(net::endpoint(net::ipaddr(), newcfg._port));
-			LOG_TRACE("Local endpoint has changed: %s -> %s.", e0.c_str(), e1.c_str());
+		if (newcfg._io_thread != oldcfg._io_thread) {
+			LOG_TRACE("I/O thread change forces restart.");
 			return false;
 		}
 
+		if (newcfg._port != _listen_port) {
+			LOG_TRACE("Local port has changed: %d -> %d.", (int)_listen_port, (int)newcfg._port);
+			rebind(newcfg._port);
+		}
+
+		const uint16_t port = _cfg._port;
 		_cfg = newcfg;
+		_cfg._port = port;
+
+		if (_cluster_timer && newcfg._cluster_update_interval != oldcfg._cluster_update_interval)
+			schedule_cluster_update();
+
+		if (newcfg._journal != oldcfg._journal || newcfg._journal_size != oldcfg._journal_size)
+			open_journal();
+
+		if (newcfg._metrics_file != oldcfg._metrics_file || newcfg._metrics_interval != oldcfg._metrics_interval)
+			schedule_metrics();
 
 		if (!_cluster.settings_changed(newcfg, oldcfg))
 			return false;
@@ -185,27 +512,190 @@ namespace koi {
 		return true;
 	}
 
+	// the first update runs right away, as the cluster starts
+	// out without any known nodes
+	void nexus_impl::schedule_cluster_update() {
+		_timers.cancel(_cluster_timer);
+		_cluster_timer = _timers.schedule_every(_cfg._cluster_update_interval,
+		                                        bind(&cluster::update, &_cluster), 0);
+	}
+
+	void nexus_impl::open_journal() {
+		if (_cfg._journal_size == 0) {
+			_journal.close();
+			return;
+		}
+		const string path = _cfg._journal.empty() ? string(KOI_VARLIB "/") + _cfg._name + ".journal" : _cfg._journal;
+		if (_journal.open(path, _cfg._journal_size))
+			LOG_TRACE("Journal: %s", path.c_str());
+	}
+
+	void nexus_impl::journal_cluster() {
+		if (_cluster._mode != _journal_mode || _cluster._leader != _journal_leader) {
+			_journal.append(journal::Ev_Cluster, _cluster._leader, _journal_mode, _cluster._mode);
+			_journal_mode = _cluster._mode;
+			_journal_leader = _cluster._leader;
+		}
+	}
+
+	// the latest records in range that fit in max_bytes
+	vector<string> nexus_impl::journal_lines(uint64_t from, uint64_t to, size_t max_bytes) const {
+		const vector<journal::record> records = _journal.query(from, to);
+		vector<string> lines;
+		size_t bytes = 0;
+		for (auto i = records.rbegin(); i != records.rend(); ++i) {
+			string line = journal::to_string(*i);
+			if (bytes + line.size() + msg::LIST_ITEM_OVERHEAD > max_bytes)
+				break;
+			bytes += line.size() + msg::LIST_ITEM_OVERHEAD;
+			lines.push_back(line);
+		}
+		if (lines.size() < records.size())
+			lines.push_back(strfmt<64>("... %u earlier records", (unsigned)(records.size() - lines.size())).str());
+		std::reverse(lines.begin(), lines.end());
+		return lines;
+	}
+
+	void nexus_impl::schedule_metrics() {
+		_timers.cancel(_metrics_timer);
+		_metrics_timer = 0;
+		if (!_cfg._metrics_file.empty())
+			_metrics_timer = _timers.schedule_every(_cfg._metrics_interval,
+			                                        bind(&nexus_impl::write_metrics, this), 0);
+	}
+
+	// counts kept elsewhere, copied in before each export
+	void nexus_impl::collect_metrics() {
+		const logging::writer_stats ls = logging::stats();
+		metrics::get_counter("koi_log_messages_written_total", "Log messages written.").set(ls._written);
+		metrics::get_counter("koi_log_messages_dropped_total", "Log messages dropped because the log writer fell behind.").set(ls._dropped);
+		metrics::get_counter("koi_log_messages_suppressed_total", "Log messages suppressed by the per call site rate limit.").set(ls._suppressed);
+		metrics::get_counter("koi_io_dropped_total", "Messages dropped between the I/O thread and the main loop.",
+		                     metrics::label("dir", "rx")).set(_rx_dropped);
+		metrics::get_counter("koi_io_dropped_total", "Messages dropped between the I/O thread and the main loop.",
+		                     metrics::label("dir", "tx")).set(_tx_dropped);
+		metrics::get_gauge("koi_cluster_nodes", "Nodes in the cluster state.").set(_cluster._state._nodes.size());
+		metrics::get_gauge("koi_timers", "Timers pending on the main loop.").set(_timers.size());
+	}
+
+	void nexus_impl::write_metrics() {
+		metrics::write_textfile(_cfg._metrics_file);
+	}
+
 	void nexus_impl::rpc_response(const net::endpoint& to,
 	                              const msg::response::values& data) {
 		message m(_cfg._uuid, _cfg._cluster_id);
 		auto rs = m.set_body<msg::response>();
 		rs->_response = data;
+		transmit(m, linklist(1, to));
+	}
+
+	void nexus_impl::receive(const message& m) {
+		if (!_threaded) {
+			_in_queue.push_back(m);
+		}
+		else if (!_rx.push(m)) {
+			++_rx_dropped;
+		}
+	}
+
+	void nexus_impl::transmit(const message& m, const linklist& to) {
+		if (!_io_running) {
+			send_now(m, to, _out_buffer, _codec);
+			return;
+		}
 
-		_out_buffer.reserve(msg::MAX_MSG_LEN);
-		if (msg::encode(_out_buffer, &m, _cfg._pass)) {
+		outgoing o;
+		o._msg = m;
+		o._to = to;
+		if (!_tx.push(o)) {
+			++_tx_dropped;
+			return;
+		}
+		if (!_tx_pending.exchange(true))
+			_net_io.post(bind(&nexus_impl::drain_tx, this));
+	}
+
+	void nexus_impl::drain_tx() {
+		_tx_pending = false;
+		outgoing o;
+		while (_tx.pop(o))
+			send_now(o._msg, o._to, _net_out_buffer, _net_codec);
+	}
+
+	void nexus_impl::send_now(const message& m, const linklist& to, vector<uint8_t>& buffer, msg::codec& codec) {
+		buffer.reserve(msg::MAX_MSG_LEN);
+		if (!msg::encode(buffer, &m, _cfg._pass, codec)) {
+			LOG_ERROR("Failed to encode %s message.", msg::type_to_string(m._op));
+			return;
+		}
+		FOREACH(const net::endpoint& remote, to) {
+			if (koi::debug_mode) {
+				LOG_TRACE("%s: %d bytes to %s",
+				          msg::type_to_string(m._op),
+				          (int)buffer.size(),
+				          to_string(remote).c_str());
+			}
 			error_code ec;
-			_sock.send_to(asio::buffer(_out_buffer), to, 0, ec);
+			if (_transport)
+				_transport->send(_local, remote, buffer);
+			else
+				sock().send_to(asio::buffer(buffer), remote, 0, ec);
 			if (ec) {
 				LOG_ERROR("send_to error: %d %s", ec.value(), ec.message().c_str());
-				// TODO: handle / recover
+				// TODO: handle/recover
+			}
+			else {
+				wire_traffic()._tx_msgs[m._op]->add();
+				wire_traffic()._tx_bytes[m._op]->add(buffer.size());
 			}
 		}
-		else {
-			LOG_ERROR("Failed to encode message when sending response to %s.",
-			          to_string(to).c_str());
+	}
+
+	void nexus_impl::start_io_thread() {
+		if (!_threaded || _io_running)
+			return;
+		_net_io.reset();
+		_net_work.reset(new net::io_service::work(_net_io));
+		if (pthread_create(&_net_thread, 0, &nexus_io_run, this) != 0) {
+			LOG_ERROR("Failed to start the I/O thread, receiving on the main loop.");
+			_net_work.reset();
+			return;
+		}
+		_io_running = true;
+	}
+
+	void nexus_impl::stop_io_thread() {
+		if (!_io_running)
+			return;
+		_net_work.reset();
+		_net_io.stop();
+		pthread_join(_net_thread, 0);
+		_io_running = false;
+	}
+
+	void nexus_impl::io_run() {
+		for (;;) {
+			try {
+				_net_io.run();
+				break;
+			}
+			catch (const std::exception& e) {
+				LOG_ERROR("I/O thread: %s", e.what());
+			}
 		}
 	}
 
+	string nexus_impl::io_stats() const {
+		if (!_threaded)
+			return "main loop";
+		strfmt<128> stats("%s, rx %d queued %d dropped, tx %d queued %d dropped",
+		                  _io_running ? "thread" : "thread (stopped)",
+		                  (int)_rx.size(), (int)_rx_dropped,
+		                  (int)_tx.size(), (int)_tx_dropped);
+		return stats.c_str();
+	}
+
 	const settings& nexus::cfg() const {
 		return _impl->_cfg;
 	}
@@ -218,6 +708,22 @@ namespace koi {
 		return _impl->_io;
 	}
 
+	timer_wheel& nexus::timers() const {
+		return _impl->_timers;
+	}
+
+	journal& nexus::get_journal() const {
+		return _impl->_journal;
+	}
+
+	failover_trace& nexus::get_trace() const {
+		return _impl->_trace;
+	}
+
+	runner* nexus::get_runner() const {
+		return _impl->_runner.get();
+	}
+
 	net::endpoint nexus::get_elector() const {
 		return _impl->_cluster.get_elector();
 	}
@@ -246,8 +752,10 @@ namespace koi {
 			// TODO: outbound interface, IPV6 support..
 			//if (_local.protocol() == net::endpoint::protocol_type::v4())
 			//    _sock.set_option(ip::multicast::outbound_interface(_local.address().to_v4()));
-			_impl->_sock.set_option(ip::multicast::enable_loopback(true));
-			_impl->_sock.set_option(ip::multicast::join_group(remote.address()));
+			if (!_impl->_transport) {
+				_impl->sock().set_option(ip::multicast::enable_loopback(true));
+				_impl->sock().set_option(ip::multicast::join_group(remote.address()));
+			}
 
 			LOG_INFO("Link: multicast %s", to_string(remote).c_str());
 		}
@@ -257,87 +765,79 @@ namespace koi {
 	}
 
 	void nexus::remove_link(const net::endpoint& remote) {
+		using namespace boost::asio;
 		for (auto i = _impl->_links.begin(), e = _impl->_links.end(); i != e; ++i) {
 			if (*i == remote) {
 				_impl->_links.erase(i);
+				if (net::is_multicast(remote.address()) && !_impl->_transport) {
+					error_code ec;
+					_impl->sock().set_option(ip::multicast::leave_group(remote.address()), ec);
+					if (ec) {
+						LOG_WARN("Failed to leave multicast group %s: %s",
+						         to_string(remote).c_str(), ec.message().c_str());
+					}
+				}
 				break;
 			}
 		}
 	}
 
 	void nexus::init_links() {
-		const uint16_t port = _impl->_cfg._port;
-		const string& ts = _impl->_cfg._transport;
-		// parse string...
-		stringvec tsv = split(ts, ",; ");
+		linklist links = parse_links(_impl->_cfg._transport, _impl->_cfg._port);
+		FOREACH(const net::endpoint& e0, links)
+			add_link(e0);
+	}
 
-		net::endpoint e0;
-		for (size_t i = 0; i < tsv.size(); ++i) {
-			e0 = parse_endpoint(tsv[i].c_str(), port);
+	void nexus::update_links(const string& old_transport, uint16_t old_port) {
+		linklist before = parse_links(old_transport, old_port);
+		linklist after = parse_links(_impl->_cfg._transport, _impl->_cfg._port);
 
-			add_link(e0);
+		FOREACH(const net::endpoint& e0, before) {
+			if (!has_link(after, e0)) {
+				LOG_INFO("Link removed: %s", to_string(e0).c_str());
+				remove_link(e0);
+			}
+		}
+		FOREACH(const net::endpoint& e0, after) {
+			if (!has_link(_impl->_links, e0))
+				add_link(e0);
 		}
 	}
 
+	const vector<net::endpoint>& nexus::links() const {
+		return _impl->_links;
+	}
 
 	void nexus::send(const message& m) {
-		_impl->_out_buffer.reserve(msg::MAX_MSG_LEN);
-		if (msg::encode(_impl->_out_buffer, &m, _impl->_cfg._pass)) {
-			FOREACH(net::endpoint const& remote, _impl->_links) {
-				if (!net::is_multicast(remote.address()) || m._op == msg::base::HeartBeat) {
-					if (koi::debug_mode) {
-						LOG_TRACE("%s: %d bytes to %s",
-						          msg::type_to_string(m._op),
-						          (int)_impl->_out_buffer.size(),
-						          to_string(remote).c_str());
-					}
-					error_code ec;
-					_impl->_sock.send_to(asio::buffer(_impl->_out_buffer), remote, 0, ec);
-					if (ec) {
-						LOG_ERROR("send_to error: %d %s", ec.value(), ec.message().c_str());
-						// TODO: handle/recover
-					}
-				}
-			}
+		linklist to;
+		FOREACH(net::endpoint const& remote, _impl->_links) {
+			if (!net::is_multicast(remote.address()) || m._op == msg::base::HeartBeat)
+				to.push_back(remote);
 		}
+		_impl->transmit(m, to);
 	}
 
 	void nexus::send(const message& m, const net::endpoint& to) {
-		_impl->_out_buffer.reserve(msg::MAX_MSG_LEN);
-		if (msg::encode(_impl->_out_buffer, &m, _impl->_cfg._pass)) {
-			if (koi::debug_mode) {
-				LOG_TRACE("%s: %d bytes to %s",
-				          msg::type_to_string(m._op),
-				          (int)_impl->_out_buffer.size(),
-				          to_string(to).c_str());
-			}
-			error_code ec;
-			_impl->_sock.send_to(asio::buffer(_impl->_out_buffer), to, 0, ec);
-
-			if (ec) {
-				LOG_ERROR("send_to error: %d %s", ec.value(), ec.message().c_str());
-				// TODO: handle/recover
-			}
-		}
+		_impl->transmit(m, linklist(1, to));
 	}
 
-	pair<bool, net::endpoint> nexus::redirect_to(const string& nodename) {
+	const nexus::node* nexus::find_node(const string& nodename) const {
 		FOREACH(const node& n, nodes()) {
 			if (nodename == n._name) {
-				return make_pair(true, n._addrs.get());
+				return &n;
 			}
 		}
 		try {
 			uuid uid = string_generator()(nodename);
 			FOREACH(const node& n, nodes()) {
 				if (uid == n._id) {
-					return make_pair(true, n._addrs.get());
+					return &n;
 				}
 			}
 		}
 		catch (runtime_error& e) {
 		}
-		return make_pair(false, net::endpoint());
+		return 0;
 	}
 
 	void nexus::handle(message& m) {
@@ -351,17 +851,23 @@ namespace koi {
 
 		bool handled = false;
 
+		// the first argument names the target node, which
+		// strips its own name when the request reaches it
 		if (_redirecting_rpc.count(rq->_cmd) && !rq->_args.empty()) {
-			auto tgt = redirect_to(rq->_args.front());
-			if (tgt.first) {
-				data["redirect"] = to_string(tgt.second);
-				data["cmd"] = rq->_cmd;
-				data["args"] = vector<string>(++rq->_args.begin(), rq->_args.end());
+			const node* tgt = find_node(rq->_args.front());
+			if (!tgt) {
+				LOG_WARN("Unknown target node: %s", rq->_args.front().c_str());
+				handled = true;
+			}
+			else if (tgt->_id == _impl->_cfg._uuid) {
+				rq->_args.erase(rq->_args.begin());
 			}
 			else {
-				LOG_WARN("Unknown target node: %s", rq->_args.front().c_str());
+				data["redirect"] = to_string(tgt->_addrs.get());
+				data["cmd"] = rq->_cmd;
+				data["args"] = rq->_args;
+				handled = true;
 			}
-			handled = true;
 		}
 
 		if (!handled) {
@@ -397,6 +903,7 @@ namespace koi {
 			data["cluster"] = _impl->_cluster._state.to_string();
 			if (_impl->_runner) {
 				data["state"] = _impl->_runner->_state;
+				data["timeouts"] = _impl->_runner->_services.timeouts(msg::MAX_LIST_LEN);
 			}
 			else if (_impl->_elector) {
 				data["state"] = S_Elector;
@@ -404,6 +911,50 @@ namespace koi {
 			else {
 				data["state"] = S_Other;
 			}
+			data["realtime"] = realtime::current().to_string();
+			data["io"] = _impl->io_stats();
+			data["stalls"] = watchdog::summary();
+			return true;
+		}
+		else if (rq->_cmd == "journal") {
+			// since and until are in seconds before now
+			const uint64_t now = clock::usecs();
+			uint64_t from = 0, to = now + 1;
+			if (rq->_args.size() > 0)
+				from = now - std::min(now, (uint64_t)strtoull(rq->_args[0].c_str(), 0, 10) * units::micro);
+			if (rq->_args.size() > 1)
+				to = now + 1 - std::min(now, (uint64_t)strtoull(rq->_args[1].c_str(), 0, 10) * units::micro);
+			data["journal"] = _impl->journal_lines(from, to, msg::MAX_LIST_LEN);
+			return true;
+		}
+		else if (rq->_cmd == "metrics") {
+			const string prefix = rq->_args.empty() ? "" : rq->_args[0];
+			vector<string> lines = metrics::prometheus(prefix);
+			size_t bytes = 0, n = 0;
+			for (; n < lines.size() && bytes + lines[n].size() + msg::LIST_ITEM_OVERHEAD <= msg::MAX_LIST_LEN; ++n)
+				bytes += lines[n].size() + msg::LIST_ITEM_OVERHEAD;
+			if (n < lines.size()) {
+				const size_t more = lines.size() - n;
+				lines.resize(n);
+				lines.push_back(strfmt<64>("# ... %u more lines, ask for a prefix", (unsigned)more).str());
+			}
+			data["metrics"] = lines;
+			return true;
+		}
+		else if (rq->_cmd == "trace") {
+			// args: [epoch]
+			// koi trace asks the peers for their marks as well
+			const uint64_t epoch = rq->_args.empty() ? 0 : strtoull(rq->_args[0].c_str(), 0, 10);
+			data["trace"] = _impl->_trace.marks(epoch, msg::MAX_LIST_LEN);
+			// only nodes heard from lately, a node that is down would
+			// only hold up koi trace
+			const ptime now = clock::now();
+			const time_duration connected = microseconds(3 * _impl->_cfg._cluster_update_interval);
+			vector<string> peers;
+			FOREACH(const node& n, nodes())
+				if (n._id != _impl->_cfg._uuid && now - n._last_seen <= connected)
+					peers.push_back(to_string(n._addrs.get()));
+			data["peers"] = peers;
 			return true;
 		}
 		return false;
@@ -492,23 +1043,43 @@ namespace koi {
 		_impl->_cluster._on_down = bind(&nexus::down, this, _1);
 		_impl->_cluster._on_state_change = bind(&nexus::state_change, this, _1);
 
+		_impl->open_journal();
+		_impl->schedule_metrics();
+
 		if (_impl->_cfg._runner) {
-			auto r = boost::shared_ptr<runner>(new runner(*this));
-			if (!r->init()) {
-				LOG_ERROR("Runner initialization error");
+			if (!start_runner())
 				return false;
-			}
-			r->start();
-			_impl->_runner = r;
 		}
 
-		_cluster_t = min_date_time;
-		_starttime = microsec_clock::universal_time();
+		_starttime = clock::now();
+		_impl->schedule_cluster_update();
 
 		init_links();
+		_impl->start_io_thread();
 		return true;
 	}
 
+	bool nexus::start_runner() {
+		auto r = boost::shared_ptr<runner>(new runner(*this));
+		if (!r->init()) {
+			LOG_ERROR("Runner initialization error");
+			return false;
+		}
+		r->start();
+		_impl->_runner = r;
+		_impl->_cluster.set(NodeFlag_Runner);
+		return true;
+	}
+
+	void nexus::stop_runner() {
+		if (_impl->_runner) {
+			_impl->_runner->stop();
+			_impl->_runner.reset();
+		}
+		_impl->_cluster.clear(NodeFlag_Runner);
+		_impl->_cluster.clear(NodeFlag_Failed);
+	}
+
 	void nexus::up(cluster* c) {
 		// cluster becomes leader: start elector service if not already started
 		// TODO: possibly delay this until no
@@ -555,12 +1126,18 @@ namespace koi {
 	}
 
 	void nexus_impl::update() {
+		journal_cluster();
+
 		if (_elector) {
+			WATCHDOG_PHASE("elector.update");
 			_elector->update();
 		}
 
 		if (_runner) {
-			_runner->update();
+			{
+				WATCHDOG_PHASE("runner.update");
+				_runner->update();
+			}
 
 			if (_runner->_state != S_Failed) {
 				if (_cluster.flags() & NodeFlag_Failed) {
@@ -580,29 +1157,51 @@ namespace koi {
 		// TODO: handle RPC requests/responses here
 		messagequeue processing;
 		processing.splice(processing.end(), _impl->_in_queue);
-		FOREACH(message& m, processing)
-			_route(m);
+		message rx;
+		while (_impl->_rx.pop(rx))
+			processing.push_back(rx);
+		{
+			WATCHDOG_PHASE("nexus.route");
+			FOREACH(message& m, processing) {
+				watchdog::received(m._rx_time);
+				_route(m);
+			}
+		}
 
-		ptime now(microsec_clock::universal_time());
-		if (now - _cluster_t >= microseconds(_impl->_cfg._cluster_update_interval)) {
-			_impl->_cluster.update();
-			_cluster_t = now;
+		{
+			WATCHDOG_PHASE("nexus.timers");
+			_impl->_timers.advance(clock::usecs());
 		}
 
+		_impl->retire_listener(clock::now());
+
 		_impl->update();
 	}
 
 	bool nexus::settings_changed(const settings& newcfg) {
+		nexus_impl::io_pause pause(*_impl);
 		settings old = _impl->_cfg;
+		if (!_impl->settings_changed(newcfg, old))
+			return false;
+
+		if (old._transport != newcfg._transport || old._port != _impl->_cfg._port) {
+			LOG_INFO("New transports: %s", newcfg._transport.c_str());
+			update_links(old._transport, old._port);
+		}
+
 		if (old._runner != newcfg._runner) {
 			LOG_WARN("Runner %s", newcfg._runner ? "enabled" : "disabled");
-			return false;
+			if (newcfg._runner)
+				return start_runner();
+			stop_runner();
 		}
-		if (old._transport != newcfg._transport) {
-			LOG_WARN("New transports: %s", newcfg._transport.c_str());
-			return false;
+		else if (_impl->_runner && old._services_folder != newcfg._services_folder) {
+			LOG_WARN("Services folder changed: %s -> %s. Restarting runner.",
+			         old._services_folder.c_str(), newcfg._services_folder.c_str());
+			stop_runner();
+			return start_runner();
 		}
-		return _impl->settings_changed(newcfg, old);
+		return true;
 	}
 
 	const nexus::nodelist& nexus::nodes() const {
@@ -29,6 +29,10 @@ namespace koi {
 	struct runner;
 	struct cluster;
 	struct masterstate;
+	struct timer_wheel;
+	struct journal;
+	struct failover_trace;
+	struct transport;
 
 	struct nexus : private boost::noncopyable {
 		typedef boost::function<void (elector*, msg::request*, msg::response::values&)> elector_rpcfn;
@@ -38,12 +42,16 @@ namespace koi {
 		typedef std::set<string> stringset;
 		typedef boost::scoped_ptr<nexus_impl> pimpl;
 
-		nexus(net::io_service& ioservice, const settings& conf);
+		nexus(net::io_service& ioservice, const settings& conf, transport* t = 0); // t replaces the UDP socket
 		~nexus();
 
 		const settings& cfg() const;
 		settings& cfg();
 		net::io_service& io() const;
+		timer_wheel& timers() const;
+		journal& get_journal() const;
+		failover_trace& get_trace() const;
+		runner* get_runner() const; // 0 unless the node is a runner
 		net::endpoint get_elector() const;
 		masterstate get_masterstate() const;
 		void set_masterstate(const masterstate& ms);
@@ -51,6 +59,8 @@ namespace koi {
 
 		void add_link(const net::endpoint& remote);
 		void remove_link(const net::endpoint& remote);
+		void update_links(const string& old_transport, uint16_t old_port);
+		const std::vector<net::endpoint>& links() const;
 
 		void send(const message& m);
 		void send(const message& m, const net::endpoint& to);
@@ -62,6 +72,9 @@ namespace koi {
 		bool init();
 		void init_links();
 
+		bool start_runner();
+		void stop_runner();
+
 		void _route(message& m);
 
 		void up(cluster* c);
@@ -75,9 +88,9 @@ namespace koi {
 		bool rpc_runner(msg::request* rq, msg::response::values& data);
 		bool rpc_recover(msg::request* rq, msg::response::values& data);
 
-		std::pair<bool, net::endpoint> redirect_to(const string& nodename);
-
 		typedef msg::heartbeat::node node;
+
+		const node* find_node(const string& nodename) const; // by name or uuid, 0 if unknown
 		typedef std::vector<node> nodelist;
 		const nodelist& nodes() const;
 
@@ -85,7 +98,6 @@ namespace koi {
 		elector_rpc_functions _elector_rpc;
 		runner_rpc_functions  _runner_rpc;
 		stringset             _redirecting_rpc;
-		ptime                 _cluster_t;
 		ptime                 _starttime;
 	};
 
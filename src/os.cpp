@@ -17,6 +17,14 @@
 #include "koi.hpp"
 #include "os.hpp"
 
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
 using namespace std;
 
 namespace koi {
@@ -29,6 +37,116 @@ namespace koi {
 			setenv(var, val, true);
 		}
 
+		uint64_t thread_cpu_time() {
+			struct timespec ts;
+			if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+				return 0;
+			return (uint64_t)ts.tv_sec*units::micro + (uint64_t)ts.tv_nsec/units::milli;
+		}
+
+		bool loadavg(double& load1) {
+			FILE* f = fopen("/proc/loadavg", "r");
+			if (!f)
+				return false;
+			const bool ok = fscanf(f, "%lf", &load1) == 1;
+			fclose(f);
+			return ok;
+		}
+
+		bool cpu_times(uint64_t& total, uint64_t& steal) {
+			FILE* f = fopen("/proc/stat", "r");
+			if (!f)
+				return false;
+			// cpu user nice system idle iowait irq softirq steal
+			unsigned long long t[8] = { 0 };
+			const int n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+			                     &t[0], &t[1], &t[2], &t[3], &t[4], &t[5], &t[6], &t[7]);
+			fclose(f);
+			if (n < 4)
+				return false;
+			total = 0;
+			for (int i = 0; i < n; ++i)
+				total += t[i];
+			steal = (n == 8) ? t[7] : 0;
+			return true;
+		}
+
+		bool available_memory(uint64_t& bytes) {
+			FILE* f = fopen("/proc/meminfo", "r");
+			if (!f)
+				return false;
+			char line[128];
+			unsigned long long kb;
+			bool ok = false;
+			while (fgets(line, sizeof(line), f)) {
+				if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+					bytes = kb * 1024;
+					ok = true;
+					break;
+				}
+			}
+			fclose(f);
+			return ok;
+		}
+
+		int cpu_count() {
+			const long n = sysconf(_SC_NPROCESSORS_ONLN);
+			return (n > 0) ? (int)n : 1;
+		}
+
+		bool set_cpu_affinity(const std::vector<int>& cpus) {
+#ifdef __linux__
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			FOREACH(int cpu, cpus)
+				if (cpu >= 0 && cpu < CPU_SETSIZE)
+					CPU_SET(cpu, &set);
+			if (CPU_COUNT(&set) == 0)
+				return false;
+			return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+			return false;
+#endif
+		}
+
+		bool set_io_priority(int ioclass, int level) {
+#if defined(__linux__) && defined(SYS_ioprio_set)
+			const int IOPRIO_WHO_PROCESS = 1;
+			const int IOPRIO_CLASS_SHIFT = 13;
+			if (ioclass < 1 || ioclass > 3 || level < 0 || level > 7)
+				return false;
+			return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (ioclass << IOPRIO_CLASS_SHIFT) | level) == 0;
+#else
+			return false;
+#endif
+		}
+
+		bool parse_cpu_list(const string& list, std::vector<int>& cpus) {
+			cpus.clear();
+			const char* p = list.c_str();
+			while (*p) {
+				char* end = 0;
+				const long first = strtol(p, &end, 10);
+				if (end == p || first < 0)
+					return false;
+				long last = first;
+				p = end;
+				if (*p == '-') {
+					last = strtol(p + 1, &end, 10);
+					if (end == p + 1 || last < first)
+						return false;
+					p = end;
+				}
+				for (long cpu = first; cpu <= last; ++cpu)
+					cpus.push_back((int)cpu);
+				if (*p == ',')
+					++p;
+				else if (*p)
+					return false;
+			}
+			return !cpus.empty();
+		}
+
 
 		namespace path {
 			const char* basename(const char* full_path) {
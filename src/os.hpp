@@ -21,6 +21,22 @@ namespace koi {
 		const char* environ(const char* var);
 		void set_environ(const char* var, const char* val);
 
+		// cpu time used by the calling thread, in microseconds
+		uint64_t thread_cpu_time();
+
+		// system load metrics, read from /proc
+		// all return false if the information is unavailable
+		bool loadavg(double& load1); // 1 minute load average
+		bool cpu_times(uint64_t& total, uint64_t& steal); // in clock ticks since boot
+		bool available_memory(uint64_t& bytes);
+		int cpu_count();
+
+		// scheduling of the calling process
+		// all return false if unsupported or not permitted
+		bool set_cpu_affinity(const std::vector<int>& cpus);
+		bool set_io_priority(int ioclass, int level); // 1 realtime, 2 best-effort, 3 idle
+		bool parse_cpu_list(const string& list, std::vector<int>& cpus); // "0-3,6"
+
 		namespace path {
 			const char* basename(const char* full_path);
 			const char* extension(const char* full_path);
@@ -0,0 +1,207 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "koi.hpp"
+#include "realtime.hpp"
+#include "strfmt.hpp"
+
+#include <errno.h>
+#include <string.h>
+#include <sched.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+namespace {
+	koi::realtime::status g_status;
+
+	// Stack and heap that koinode can use without taking a page fault
+	// once memory is locked.
+	const size_t PREFAULT_STACK = 256*1024;
+	const size_t PREFAULT_HEAP = 4*1024*1024;
+
+	void prefault_stack() {
+		volatile char stack[PREFAULT_STACK];
+		for (size_t i = 0; i < PREFAULT_STACK; i += 4096)
+			stack[i] = 0;
+	}
+
+	// glibc defaults, put back when leaving real-time mode
+	const int DEFAULT_TRIM_THRESHOLD = 128*1024;
+	const int DEFAULT_MMAP_MAX = 65536;
+
+	void prefault_heap() {
+#ifdef __GLIBC__
+		// keep freed memory in the heap instead of returning it to the
+		// system, and don't serve allocations from fresh mmaps
+		mallopt(M_TRIM_THRESHOLD, -1);
+		mallopt(M_MMAP_MAX, 0);
+#endif
+		char* heap = (char*)malloc(PREFAULT_HEAP);
+		if (heap) {
+			for (size_t i = 0; i < PREFAULT_HEAP; i += 4096)
+				heap[i] = 0;
+			free(heap);
+		}
+	}
+
+#ifndef SCHED_RESET_ON_FORK
+#define SCHED_RESET_ON_FORK 0
+#endif
+
+	int policy_for(const string& name) {
+		return (name == "rr") ? SCHED_RR : SCHED_FIFO;
+	}
+
+	void failed(const char* what) {
+		g_status._error = koi::strfmt<256>("%s: %s", what, strerror(errno)).c_str();
+		LOG_WARN("Real-time mode: %s", g_status._error.c_str());
+	}
+}
+
+namespace koi {
+	namespace realtime {
+		status::status()
+			: _requested(false), _memory_locked(false), _scheduled(false), _socket(false) {
+		}
+
+		bool status::complete() const {
+			return !_requested || (_memory_locked && _scheduled && _socket);
+		}
+
+		string status::to_string() const {
+			if (!_requested)
+				return "off";
+			stringstream ss;
+			ss << (complete() ? "on" : "incomplete")
+			   << " (memory " << (_memory_locked ? "locked" : "unlocked")
+			   << ", scheduling " << (_scheduled ? "real-time" : "normal")
+			   << ", socket " << (_socket ? "prioritized" : "normal") << ")";
+			if (!_error.empty())
+				ss << ": " << _error;
+			return ss.str();
+		}
+
+		const status& current() {
+			return g_status;
+		}
+
+		bool enter(const settings& cfg) {
+			g_status._requested = cfg._realtime;
+			if (!cfg._realtime)
+				return true;
+
+			if (!g_status._memory_locked) {
+				if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+					prefault_stack();
+					prefault_heap();
+					g_status._memory_locked = true;
+				}
+				else {
+					failed("mlockall");
+				}
+			}
+
+			sched_param param;
+			memset(&param, 0, sizeof(param));
+			const int policy = policy_for(cfg._realtime_policy);
+			param.sched_priority = cfg._realtime_priority;
+			// service scripts are forked from the main loop and
+			// must not inherit the real-time policy
+			if (sched_setscheduler(0, policy | SCHED_RESET_ON_FORK, &param) == 0)
+				g_status._scheduled = true;
+			else
+				failed("sched_setscheduler");
+
+			if (g_status.complete())
+				LOG_INFO("Real-time mode: %s", g_status.to_string().c_str());
+			return g_status._memory_locked && g_status._scheduled;
+		}
+
+		void leave() {
+			if (g_status._scheduled) {
+				sched_param param;
+				memset(&param, 0, sizeof(param));
+				sched_setscheduler(0, SCHED_OTHER, &param);
+			}
+			if (g_status._memory_locked) {
+				munlockall();
+#ifdef __GLIBC__
+				mallopt(M_TRIM_THRESHOLD, DEFAULT_TRIM_THRESHOLD);
+				mallopt(M_MMAP_MAX, DEFAULT_MMAP_MAX);
+#endif
+			}
+			g_status = status();
+		}
+
+		bool apply_socket(int fd, const settings& cfg) {
+			if (!cfg._realtime)
+				return true;
+
+			bool ok = true;
+#ifdef SO_PRIORITY
+			if (cfg._socket_priority >= 0 &&
+			    setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &cfg._socket_priority, sizeof(cfg._socket_priority)) != 0) {
+				failed("SO_PRIORITY");
+				ok = false;
+			}
+#endif
+#ifdef SO_BUSY_POLL
+			if (cfg._busy_poll > 0 &&
+			    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &cfg._busy_poll, sizeof(cfg._busy_poll)) != 0) {
+				failed("SO_BUSY_POLL");
+				ok = false;
+			}
+#endif
+			g_status._socket = ok;
+			return ok;
+		}
+
+		bool changed(const settings& from, const settings& to) {
+			return from._realtime != to._realtime ||
+				from._realtime_policy != to._realtime_policy ||
+				from._realtime_priority != to._realtime_priority ||
+				from._socket_priority != to._socket_priority ||
+				from._busy_poll != to._busy_poll;
+		}
+
+		bool check() {
+			if (!g_status._requested)
+				return true;
+
+			// the policy can be changed from outside, e.g. by chrt
+			if (g_status._scheduled) {
+				const int policy = sched_getscheduler(0) & ~SCHED_RESET_ON_FORK;
+				if (policy != SCHED_FIFO && policy != SCHED_RR) {
+					g_status._scheduled = false;
+					g_status._error = "scheduling policy was reset";
+				}
+			}
+
+			static bool reported = false;
+			if (!g_status.complete()) {
+				if (!reported)
+					LOG_WARN("Real-time mode not in effect: %s", g_status.to_string().c_str());
+				reported = true;
+				return false;
+			}
+			reported = false;
+			return true;
+		}
+	}
+}
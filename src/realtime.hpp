@@ -0,0 +1,52 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#pragma once
+
+namespace koi {
+	/*
+	 * Opt-in real-time mode for koinode (node.realtime).
+	 *
+	 * Memory is locked and prefaulted so that heartbeat handling never
+	 * waits for a page-in, the main loop runs under SCHED_FIFO or
+	 * SCHED_RR, and the cluster socket gets SO_PRIORITY and
+	 * optionally SO_BUSY_POLL. Each part is applied on a best effort
+	 * basis; the status records which parts took effect, and check()
+	 * reports when the mode is (or has become) incomplete.
+	 */
+	namespace realtime {
+		struct status {
+			status();
+
+			bool complete() const;
+			string to_string() const;
+
+			bool   _requested;
+			bool   _memory_locked;
+			bool   _scheduled;
+			bool   _socket;
+			string _error; // why the last part failed
+		};
+
+		const status& current();
+
+		bool enter(const settings& cfg); // lock memory and set the scheduling policy
+		void leave();
+		bool apply_socket(int fd, const settings& cfg);
+		bool changed(const settings& from, const settings& to); // the new settings need a restart to take effect
+		bool check(); // false if real-time mode was requested but isn't in effect
+	}
+}
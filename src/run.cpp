@@ -31,6 +31,12 @@ using namespace boost;
 using boost::system::error_code;
 
 #include "nexus.hpp"
+#include "os.hpp"
+#include "realtime.hpp"
+#include "timer_wheel.hpp"
+#include "clock.hpp"
+#include "metrics.hpp"
+#include "watchdog.hpp"
 #include "archive.hpp"
 #include "masterstate.hpp"
 #include "sequence.hpp"
@@ -78,6 +84,30 @@ namespace {
 		LOG_TRACE("Installing reconfig signal handler for signal: SIGUSR1.");
 		signal(SIGUSR1, reconfig_signal_handler);
 	}
+
+	// Pin the main loop to node.reserve_cpu. Service scripts get the
+	// other cpus, see settings::limits_for.
+	void reserve_cpu(const settings& cfg) {
+		static int reserved = -1;
+		if (cfg._reserve_cpu == reserved)
+			return;
+
+		vector<int> cpus;
+		if (cfg._reserve_cpu >= 0)
+			cpus.push_back(cfg._reserve_cpu);
+		else
+			for (int cpu = 0; cpu < os::cpu_count(); ++cpu)
+				cpus.push_back(cpu);
+
+		if (os::set_cpu_affinity(cpus)) {
+			if (cfg._reserve_cpu >= 0)
+				LOG_INFO("Reserved cpu %d for the main loop.", cfg._reserve_cpu);
+			reserved = cfg._reserve_cpu;
+		}
+		else {
+			LOG_WARN("Unable to reserve cpu %d for the main loop.", cfg._reserve_cpu);
+		}
+	}
 }
 
 namespace koi {
@@ -111,6 +141,8 @@ namespace koi {
 
 	int run(settings& cfg, const vector<string>& configs) {
 		install_signal_handlers();
+		logging::start_writer();
+		watchdog::start();
 		int ret = 0;
 
 		try {
@@ -120,6 +152,9 @@ namespace koi {
 
 				net::io_service io;
 
+				if (cfg._realtime)
+					realtime::enter(cfg);
+
 				LOG_INFO("Starting Nexus...");
 				nexus router(io, cfg);
 
@@ -128,18 +163,51 @@ namespace koi {
 					throw std::runtime_error("Failed to initialize node.");
 				}
 
+				reserve_cpu(cfg);
+				watchdog::set_threshold(cfg.stall_threshold());
+				realtime::check();
+				ptime next_realtime_check = clock::now();
+
+				metrics::histogram& iteration = metrics::get_histogram("koi_mainloop_iteration_seconds",
+				                                                       "Time spent in a main loop iteration, not counting the sleep.");
 				LOG_INFO("Entering mainloop");
 				while (!interrupted) {
-					io.poll();
+					clock::tick();
+					{
+						WATCHDOG_PHASE("io.poll");
+						io.poll();
+					}
+
+					{
+						WATCHDOG_PHASE("nexus.update");
+						router.update();
+					}
 
-					router.update();
+					if (cfg._realtime) {
+						const ptime now = clock::now();
+						if (now >= next_realtime_check) {
+							realtime::check();
+							next_realtime_check = now + posix_time::seconds(10);
+						}
+					}
 
-					usleep((useconds_t)cfg._mainloop_sleep_time);
+					// sleep until the next timer is due, but no longer
+					// than the configured time so sockets get polled
+					const uint64_t now = clock::usecs(clock::read());
+					iteration.observe(now - clock::usecs());
+					const uint64_t next = router.timers().next_deadline();
+					uint64_t sleep_time = cfg._mainloop_sleep_time;
+					if (next != timer_wheel::NEVER)
+						sleep_time = std::min(sleep_time, (next > now) ? next - now : 0);
+					if (sleep_time > 0)
+						usleep((useconds_t)sleep_time);
 
 					if (reload_config) {
 						reload_config = 0;
+						const settings before(cfg);
 						if (reload(cfg, configs)) {
-							const bool trivial = router.settings_changed(cfg);
+							const bool trivial = router.settings_changed(cfg) &&
+								!realtime::changed(before, cfg);
 							if (!trivial || cfg._force_restart) {
 								LOG_WARN("Configuration changes requires node restart.");
 								ret = RestartNode;
@@ -147,13 +215,18 @@ namespace koi {
 							}
 							else {
 								LOG_INFO("Configuration changes applied without restart.");
+								reserve_cpu(cfg);
+								watchdog::set_threshold(cfg.stall_threshold());
 							}
 						}
 					}
 				}
 				LOG_INFO("Exiting mainloop with status 0x%x", ret);
+				// stopping the services is expected to take a while
+				watchdog::set_threshold(0);
 
 				io.stop();
+				realtime::leave();
 			} while (ret == RestartNode);
 		}
 		catch (const archive_error& e) {
@@ -171,6 +244,8 @@ namespace koi {
 
 
 		LOG_INFO("><:;;x>");
+		watchdog::stop();
+		logging::stop_writer();
 		return ret;
 	}
 
@@ -22,6 +22,10 @@
 #include <boost/uuid/nil_generator.hpp>
 #include <boost/uuid/uuid_io.hpp>
 #include "masterstate.hpp"
+#include "os.hpp"
+#include "clock.hpp"
+#include "journal.hpp"
+#include "trace.hpp"
 
 using namespace std;
 using namespace boost;
@@ -34,19 +38,26 @@ namespace koi {
 		_master_uuid = uuids::nil_uuid();
 		_uptime = 0;
 		_maintenance = false;
+		_epoch = 0;
 	}
 
 	runner::runner(nexus& route)
 		: _emitter(route, route.cfg()._runner_tick_interval),
 		  _elector() {
 		_emitter._on_tick = bind(&runner::on_tick, this, _1);
+		_emitter._holdoff = route.cfg()._runner_report_holdoff;
 		_state = S_Disconnected;
 		_mode = R_Passive;
 		_enabled = true;
 		_warned_elector_lost = false;
 		_quorum_lost = false;
+		_demote_pending = false;
+		_services_digest = 0;
+		_cpu_total = 0;
+		_cpu_steal = 0;
 		_failcount = 0;
 		_last_transition = ptime(min_date_time);
+		_promoted_epoch = 0;
 	}
 
 	runner::~runner() {
@@ -54,22 +65,18 @@ namespace koi {
 	}
 
 	bool runner::init() {
-		_starttime = microsec_clock::universal_time();
+		_starttime = clock::now();
 		return true;
 	}
 
-	bool runner::settings_changed(const settings& newcfg, const settings& oldcfg) {
-		if (newcfg._runner == false) {
-			LOG_INFO("Runner -> Elector forces restart");
-			return false;
-		}
+	bool runner::settings_changed(const settings& newcfg, const settings&) {
+		// enabling/disabling the runner and moving the services
+		// folder is handled by the nexus, which restarts the runner
 
-		if (oldcfg._services_folder != newcfg._services_folder) {
-			LOG_INFO("Services folder change forces restart");
-			return false;
-		}
+		_emitter._holdoff = newcfg._runner_report_holdoff;
+		_services.update_groups(newcfg);
 
-		// force service manager to start new log proxy
+		// restart the thread logging service output
 		_services.toggle_logproxy();
 
 		return true;
@@ -90,6 +97,8 @@ namespace koi {
 	void runner::stop() {
 		LOG_INFO("Stopping runner.");
 
+		_services.set_promoted_groups(std::set<string>());
+		_services.prepare(false);
 		_services.demote();
 		_services.wait_for_demote(in_maintenance_mode());
 
@@ -122,6 +131,8 @@ namespace koi {
 				if (_state == S_Master) {
 					transition(S_Slave, "Elector gone. Demoting self.");
 				}
+				_services.set_promoted_groups(std::set<string>());
+				_services.prepare(false);
 			}
 			else if (now - _elector._last_seen > microseconds(cfg._runner_elector_lost_time)) {
 				if (!_warned_elector_lost) {
@@ -136,14 +147,16 @@ namespace koi {
 			}
 
 			// loss of quorum
-			if (_state > S_Slave && !_emitter._nexus.has_quorum()) {
+			if ((_state > S_Slave || !_services._promoted_groups.empty()) && !_emitter._nexus.has_quorum()) {
 				if (!_quorum_lost) {
 					_quorum_lost = true;
 					_quorum_lost_time = now;
 					LOG_WARN("Loss of quorum! Number of visible nodes below %d limit.", cfg._cluster_quorum);
 				}
 				else if (now - _quorum_lost_time > microseconds(cfg._quorum_demote_time)) {
-					transition(S_Slave, "Quorum lost. Demoting self.");
+					if (_state > S_Slave)
+						transition(S_Slave, "Quorum lost. Demoting self.");
+					_services.set_promoted_groups(std::set<string>());
 				}
 			}
 			else if (_quorum_lost) {
@@ -242,7 +255,7 @@ namespace koi {
 	void runner::_check_service_status() {
 		// run service status check (if the time has come)
 		const ServicesStatus status = _services.update(
-			service_events(_emitter._nexus.cfg()), _state,
+			service_events(_emitter._nexus.cfg(), &_emitter._nexus.get_journal()), _state,
 			_emitter._nexus.cfg()._status_interval,
 			_emitter._nexus.cfg()._state_update_interval,
 			in_maintenance_mode());
@@ -256,10 +269,18 @@ namespace koi {
 		else if (_state > S_Live && (status < Status_Promotable)) {
 			transition(S_Live, "Node is not promotable");
 		}
+
+		if (_state == S_Master && status == Status_Promoted &&
+		    _elector._master_uuid == _emitter._nexus.cfg()._uuid &&
+		    _promoted_epoch != _elector._epoch) {
+			_promoted_epoch = _elector._epoch;
+			_emitter._nexus.get_trace().add(_elector._epoch, failover_trace::Ph_Promoted,
+			                                clock::usecs(), _emitter._nexus.cfg()._name);
+		}
 	}
 
 	void runner::update() {
-		const ptime now = microsec_clock::universal_time();
+		const ptime now = clock::now();
 
 		// update receivers based on ports elector
 		{
@@ -284,6 +305,21 @@ namespace koi {
 			_check_recovery(now);
 		}
 		_check_service_status();
+
+		// report service state changes without waiting for the tick
+		const uint32_t digest = _services.digest();
+		if (digest != _services_digest) {
+			_services_digest = digest;
+			_emitter.request_tick();
+		}
+
+		// the elector waits for this report before promoting the
+		// next master, so don't wait for the tick
+		if (_demote_pending && !_services.promoted()) {
+			LOG_INFO("Services demoted; reporting to elector.");
+			_demote_pending = false;
+			_emitter.immediate_tick();
+		}
 	}
 
 	void runner::handle(message& m) {
@@ -313,10 +349,23 @@ namespace koi {
                         }
 		}
 
+		if (su->_master_uuid == _emitter._nexus.cfg()._uuid &&
+		    (su->_master_uuid != _elector._master_uuid || su->_epoch != _elector._epoch))
+			_emitter._nexus.get_trace().add(su->_epoch, failover_trace::Ph_StateUpdate,
+			                                clock::usecs(), _emitter._nexus.cfg()._name);
+
 		_elector._uuid = m._sender_uuid;
-		_elector._last_seen = microsec_clock::universal_time();
+		_elector._last_seen = clock::now();
 		_elector._master_uuid = su->_master_uuid;
 		_elector._uptime = su->_uptime;
+		_elector._epoch = su->_epoch;
+
+		std::set<string> groups;
+		FOREACH(const auto& g, su->_groups)
+			if (g._uuid == _emitter._nexus.cfg()._uuid)
+				groups.insert(g._group);
+		_services.set_promoted_groups(groups);
+		_services.prepare(su->_prepare_uuid == _emitter._nexus.cfg()._uuid);
 
 		if (_elector._uuid != _emitter._nexus.cfg()._uuid) {
 			// Update the masterstate, so that in case of failover,
@@ -344,11 +393,46 @@ namespace koi {
 
 		_services.report(hr);
 
+		_sample_load();
+		hr->_load = _load;
+		hr->_prepared = _services.prepared();
+
 		FOREACH(const auto& si, hr->_services)
 			if (si._failed)
 				transition(S_Failed, "discovered failed services");
 	}
 
+	void runner::_sample_load() {
+		_load._weight = _emitter._nexus.cfg()._node_weight;
+
+		// only load scoring looks at the rest, so don't read /proc
+		// on every tick for nothing
+		if (_emitter._nexus.cfg()._election_scoring != "load") {
+			_load._valid = false;
+			_cpu_total = _cpu_steal = 0;
+			return;
+		}
+
+		double load1;
+		uint64_t total, steal, avail;
+		if (!os::loadavg(load1) ||
+		    !os::cpu_times(total, steal) ||
+		    !os::available_memory(avail)) {
+			_load._valid = false;
+			return;
+		}
+
+		_load._valid = true;
+		_load._loadavg = (uint32_t)(load1 * 100.0 / os::cpu_count());
+		_load._memfree = (uint32_t)(avail >> 20);
+		// steal is measured between samples; keep the previous
+		// value if no ticks have passed since
+		if (total > _cpu_total && steal >= _cpu_steal && _cpu_total != 0)
+			_load._steal = (uint32_t)((steal - _cpu_steal) * 100 / (total - _cpu_total));
+		_cpu_total = total;
+		_cpu_steal = steal;
+	}
+
 	void runner::forget_failure() {
 		_services.forget_failure();
 		if (_state == S_Failed)
@@ -361,6 +445,8 @@ namespace koi {
 
 		LOG_INFO("Transition[%s -> %s]: %s", state_to_string(_state),
 		         state_to_string(new_state), why);
+		_emitter._nexus.get_journal().append(journal::Ev_Runner, _emitter._nexus.cfg()._uuid,
+		                                     _state, new_state, _emitter._nexus.cfg()._name);
 
 		// update services
 		switch (new_state) {
@@ -395,8 +481,13 @@ namespace koi {
 			break;
 		}
 
+		if (_state == S_Master && new_state < S_Master)
+			_demote_pending = true;
+
 		_state = new_state;
-		_last_transition = microsec_clock::universal_time();
+		_last_transition = clock::now();
+
+		_emitter.request_tick();
 	}
 
 	void runner::switch_mode(RunnerMode new_mode, const char* why) {
@@ -440,4 +531,21 @@ namespace koi {
 			out["msg"] = "Failcount reset.";
 		}
 	}
+
+	void runner::rpc_timeouts(msg::request*, msg::response::values& out) {
+		out["adaptive"] = _emitter._nexus.cfg()._adaptive_timeouts;
+		out["timeouts"] = _services.timeouts(msg::MAX_LIST_LEN);
+	}
+
+	void runner::rpc_usage(msg::request*, msg::response::values& out) {
+		out["usage"] = _services.usage(msg::MAX_LIST_LEN);
+	}
+
+	// args: [service [event]]
+	// the reply is kept to a size that compresses into one message
+	void runner::rpc_output(msg::request* rq, msg::response::values& out) {
+		const string service = (rq->_args.size() > 0) ? rq->_args[0] : "";
+		const string event = (rq->_args.size() > 1) ? rq->_args[1] : "";
+		out["output"] = _services.output(service, event, msg::MAX_LIST_LEN);
+	}
 }
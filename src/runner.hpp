@@ -57,6 +57,7 @@ namespace koi {
 			uuid          _master_uuid;
 			uint64_t      _uptime;
 			bool          _maintenance;
+			uint64_t      _epoch; // of the election that chose the master
 		};
 
 
@@ -85,6 +86,9 @@ namespace koi {
 		void rpc_start(msg::request* rq, msg::response::values& out);
 		void rpc_stop(msg::request* rq, msg::response::values& out);
 		void rpc_recover(msg::request* rq, msg::response::values& out);
+		void rpc_timeouts(msg::request* rq, msg::response::values& out);
+		void rpc_usage(msg::request* rq, msg::response::values& out);
+		void rpc_output(msg::request* rq, msg::response::values& out);
 
 		void _check_timeouts(const ptime& now);
 		void _log_transition_state();
@@ -92,6 +96,7 @@ namespace koi {
 		void _update_elector_state(const ptime& now);
 		void _check_recovery(const ptime& now);
 		void _check_service_status();
+		void _sample_load();
 
 		emitter         _emitter;
 		elector_info    _elector;
@@ -104,7 +109,13 @@ namespace koi {
 		bool            _warned_elector_lost;
 		ptime           _starttime;
 		bool            _enabled; // if false, go to <=Stopped
+		uint64_t        _promoted_epoch; // last election whose promotion was traced
 		ptime           _quorum_lost_time;
 		bool            _quorum_lost;
+		bool            _demote_pending; // report to elector as soon as demotion completes
+		uint32_t        _services_digest; // service states in the last check
+		load_info       _load; // last sampled load metrics
+		uint64_t        _cpu_total; // cpu ticks at the last load sample
+		uint64_t        _cpu_steal;
 	};
 }
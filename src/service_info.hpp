@@ -75,21 +75,43 @@ namespace koi {
 		return (state < 0 || state > Svc_Promoted) ? -1 : state;
 	}
 
+	// runner load metrics, reported to the elector
+	struct load_info {
+		bool     _valid; // false if the runner could not read its metrics
+		uint32_t _loadavg; // 1 minute load average per cpu, in percent
+		uint32_t _steal; // cpu steal since the previous sample, in percent
+		uint32_t _memfree; // available memory, in megabytes
+		uint32_t _weight; // node.weight of the runner
+
+		load_info() : _valid(false), _loadavg(0), _steal(0), _memfree(0), _weight(100) {}
+
+		string to_string() const {
+			std::stringstream ss;
+			ss << "weight " << _weight;
+			if (_valid)
+				ss << ", load " << _loadavg << "%, steal " << _steal << "%, free " << _memfree << "M";
+			return ss.str();
+		}
+	};
+
 	struct service_info {
 		string _name;
 		string _event; // currently executing event
 		ServiceState _state;
 		bool _failed;
+		string _group; // resource group, empty for the default group
 
-		service_info() : _name(), _event(), _state(Svc_Stopped), _failed(false) {}
-		service_info(const char* name, const char* event, ServiceState state, bool failed) :
-			_name(name), _event(event), _state(state), _failed(failed) {
+		service_info() : _name(), _event(), _state(Svc_Stopped), _failed(false), _group() {}
+		service_info(const char* name, const char* event, ServiceState state, bool failed, const char* group = "") :
+			_name(name), _event(event), _state(state), _failed(failed), _group(group) {
 		}
 
 		string to_string() const {
 			std::stringstream ss;
 			ss << _name << ":" << service_state_string(_state) << ":" << _event
 			   << (_failed ? ":-" : ":+");
+			if (!_group.empty())
+				ss << ":" << _group;
 			return ss.str();
 		}
 	};
@@ -97,11 +119,13 @@ namespace koi {
 	inline service_info parse_service_info(const string& str) {
 		service_info inf;
 		stringvec sv = split(str, ":");
-		if (sv.size() == 4) {
+		if (sv.size() == 4 || sv.size() == 5) {
 			inf._name = sv[0];
 			inf._state = service_state_from_string(sv[1]);
 			inf._event = sv[2];
 			inf._failed = sv[3] == "-";
+			if (sv.size() == 5)
+				inf._group = sv[4];
 		}
 		else {
 			inf._name = str;
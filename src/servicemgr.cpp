@@ -20,8 +20,16 @@
 #include "cmd.hpp"
 #include "os.hpp"
 #include "globber.hpp"
+#include "clock.hpp"
+#include "journal.hpp"
+#include "metrics.hpp"
+#include "watchdog.hpp"
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int.hpp>
+#include <boost/bind.hpp>
 #include <signal.h>
+#include <unistd.h>
 
 using namespace std;
 using namespace boost;
@@ -67,6 +75,149 @@ namespace {
 }
 
 namespace koi {
+	duration_histogram::duration_histogram() : _count(0), _max(0) {
+		memset(_buckets, 0, sizeof(_buckets));
+	}
+
+	void duration_histogram::add(uint64_t usec) {
+		int b = 0;
+		for (uint64_t ms = usec / units::milli; ms > 0 && b < BUCKETS-1; ms >>= 1)
+			++b;
+		++_buckets[b];
+		++_count;
+		_max = std::max(_max, usec);
+
+		if (_count >= HALVE_AT) {
+			_count = 0;
+			for (int i = 0; i < BUCKETS; ++i) {
+				_buckets[i] /= 2;
+				_count += _buckets[i];
+			}
+		}
+	}
+
+	uint64_t duration_histogram::percentile(int p) const {
+		if (_count == 0)
+			return 0;
+		const uint64_t rank = ((uint64_t)_count * p + 99) / 100;
+		uint64_t seen = 0;
+		for (int i = 0; i < BUCKETS; ++i) {
+			seen += _buckets[i];
+			if (seen >= rank && seen > 0)
+				return std::min(((uint64_t)1 << i) * units::milli, _max);
+		}
+		return _max;
+	}
+
+	string duration_histogram::to_string() const {
+		stringstream ss;
+		ss << "n=" << _count
+		   << " p50=" << percentile(50)/units::milli << "ms"
+		   << " p99=" << percentile(99)/units::milli << "ms"
+		   << " max=" << _max/units::milli << "ms";
+		return ss.str();
+	}
+
+	namespace {
+		uint64_t timeval_usec(const timeval& tv) {
+			return (uint64_t)tv.tv_sec * units::micro + tv.tv_usec;
+		}
+	}
+
+	resource_usage::resource_usage()
+		: _runs(0), _utime(0), _stime(0), _maxrss(0), _nvcsw(0), _nivcsw(0) {
+	}
+
+	void resource_usage::add(const struct rusage& ru) {
+		++_runs;
+		_utime += timeval_usec(ru.ru_utime);
+		_stime += timeval_usec(ru.ru_stime);
+		_maxrss = std::max(_maxrss, ru.ru_maxrss);
+		_nvcsw += ru.ru_nvcsw;
+		_nivcsw += ru.ru_nivcsw;
+	}
+
+	string resource_usage::to_string() const {
+		stringstream ss;
+		ss << "runs=" << _runs
+		   << " user=" << _utime/units::milli << "ms"
+		   << " sys=" << _stime/units::milli << "ms"
+		   << " maxrss=" << _maxrss << "KB"
+		   << " csw=" << _nvcsw << "/" << _nivcsw;
+		return ss.str();
+	}
+
+	output_buffer::output_buffer() : _limit(100) {
+		pthread_mutex_init(&_lock, 0);
+	}
+
+	output_buffer::~output_buffer() {
+		pthread_mutex_destroy(&_lock);
+	}
+
+	void output_buffer::add(const string& tag, const char* line) {
+		char tbuf[16];
+		const time_t t = ::time(0);
+		struct tm tid;
+		::localtime_r(&t, &tid);
+		strftime(tbuf, sizeof(tbuf), "%X", &tid);
+
+		pthread_mutex_lock(&_lock);
+		if (_limit > 0) {
+			std::deque<string>& lines = _buffers[tag];
+			lines.push_back(string(tbuf) + " " + line);
+			while (lines.size() > _limit)
+				lines.pop_front();
+		}
+		pthread_mutex_unlock(&_lock);
+	}
+
+	void output_buffer::set_limit(size_t lines) {
+		pthread_mutex_lock(&_lock);
+		_limit = lines;
+		FOREACH(auto& b, _buffers) {
+			while (b.second.size() > _limit)
+				b.second.pop_front();
+		}
+		pthread_mutex_unlock(&_lock);
+	}
+
+	// Each matching service:event gets an equal share of max_bytes,
+	// filled with its newest lines after its header and marker.
+	std::vector<string> output_buffer::lines(const string& service, const string& event, size_t max_bytes) const {
+		std::vector<string> ret;
+		pthread_mutex_lock(&_lock);
+		std::vector<buffers::const_iterator> matching;
+		for (auto b = _buffers.begin(); b != _buffers.end(); ++b) {
+			const size_t colon = b->first.rfind(':');
+			if (!service.empty() && b->first.compare(0, colon, service) != 0)
+				continue;
+			if (!event.empty() && b->first.compare(colon + 1, string::npos, event) != 0)
+				continue;
+			if (!b->second.empty())
+				matching.push_back(b);
+		}
+		FOREACH(const auto& b, matching) {
+			const size_t share = max_bytes / matching.size();
+			const string header = "== " + b->first + " ==";
+			size_t bytes = header.size() + MARKER_LEN + 2*msg::LIST_ITEM_OVERHEAD;
+			auto first = b->second.end();
+			while (first != b->second.begin() && bytes + (first - 1)->size() + msg::LIST_ITEM_OVERHEAD <= share) {
+				--first;
+				bytes += first->size() + msg::LIST_ITEM_OVERHEAD;
+			}
+			ret.push_back(header);
+			if (first != b->second.begin()) {
+				stringstream ss;
+				ss << "... " << (first - b->second.begin()) << " earlier lines";
+				ret.push_back(ss.str());
+			}
+			ret.insert(ret.end(), first, b->second.end());
+		}
+		pthread_mutex_unlock(&_lock);
+		return ret;
+	}
+
 	const int service_manager::service::NO_PRIORITY = -1;
 	const size_t service_manager::TERMINATE_TIMEOUT = 1000*1000; // usecs
 
@@ -77,6 +228,12 @@ namespace koi {
 		strmcpy(services_workingdir, workingdir, sizeof(services_workingdir));
 		_last_check = ptime(min_date_time);
 		_target_action = Svc_Stop;
+		_prepare = false;
+		_status_interval = 10*units::micro;
+		_max_concurrency = 0;
+		_status_jitter = 0;
+		_run_queue.clear();
+		_logproxy._on_line = bind(&output_buffer::add, &_output, _1, _2);
 		_logproxy.create();
 		if (!os::path::makepath(services_workingdir)) {
 			LOG_ERROR("%s does not exist, this is fatal!", services_workingdir);
@@ -88,6 +245,8 @@ namespace koi {
 		LOG_TRACE("Terminating service manager.");
 		stop();
 		wait_for_shutdown();
+		// the proxy thread adds lines to _output
+		_logproxy.close();
 		LOG_TRACE("Service manager terminated.");
 	}
 
@@ -123,24 +282,99 @@ namespace koi {
 					   << to_simple_string(td)
 					   << "]";
 			}
+
+			if (details) {
+				uint64_t cpu = 0;
+				FOREACH(const auto& u, s._usage)
+					cpu += u.second.cpu();
+				if (cpu >= units::milli)
+					ss << "(cpu " << cpu/units::milli << "ms)";
+			}
 		}
 		return ss.str();
 	}
 
+	namespace {
+		const size_t MORE_LEN = 32; // kept for the "... N more" line
+
+		// drops the lines that don't fit in max_bytes of a chive list
+		void fit_lines(std::vector<string>& lines, size_t max_bytes) {
+			size_t bytes = MORE_LEN, n = 0;
+			for (; n < lines.size() && bytes + lines[n].size() + msg::LIST_ITEM_OVERHEAD <= max_bytes; ++n)
+				bytes += lines[n].size() + msg::LIST_ITEM_OVERHEAD;
+			if (n < lines.size()) {
+				stringstream ss;
+				ss << "... " << (lines.size() - n) << " more";
+				lines.resize(n);
+				lines.push_back(ss.str());
+			}
+		}
+	}
+
+	std::vector<string> service_manager::timeouts(size_t max_bytes) const {
+		std::vector<string> ret;
+		FOREACH(const auto& svc, _services) {
+			const service& s = svc.second;
+			const char* events[] = { "start", "stop", "status", "promote", "demote", "failed", "prepare" };
+			for (size_t i = 0; i < ASIZE(events); ++i) {
+				const service_event* e = s._events._settings ? s._events(events[i]) : 0;
+				auto d = s._durations.find(events[i]);
+				if (!e || d == s._durations.end())
+					continue;
+				const uint64_t t = s.timeout_for(e);
+				stringstream ss;
+				ss << s._name << ":" << events[i] << " " << d->second.to_string()
+				   << " timeout=" << t/units::milli << "ms"
+				   << ((t != e->_timeout) ? " (adaptive)" : "");
+				ret.push_back(ss.str());
+			}
+		}
+		fit_lines(ret, max_bytes);
+		return ret;
+	}
+
+	std::vector<string> service_manager::usage(size_t max_bytes) const {
+		std::vector<string> ret;
+		FOREACH(const auto& svc, _services) {
+			FOREACH(const auto& u, svc.second._usage) {
+				stringstream ss;
+				ss << svc.second._name << ":" << u.first << " " << u.second.to_string();
+				ret.push_back(ss.str());
+			}
+		}
+		fit_lines(ret, max_bytes);
+		return ret;
+	}
+
+	std::vector<string> service_manager::output(const string& name, const string& event, size_t max_bytes) const {
+		return _output.lines(name, event, max_bytes);
+	}
+
 	void service_manager::toggle_logproxy() {
-		_logproxy.close();
-		_logproxy.create();
+		_logproxy.restart();
 	}
 
 	ServicesStatus service_manager::update(const service_events& events, State state, uint64_t status_interval, uint64_t state_update_interval, bool maintenance_mode) {
-		ptime now = microsec_clock::universal_time();
+		ptime now = clock::now();
 		bool disabled_earlier = is_disabled();
 
 		// Update environment variables used by services
 		::setenv("KOI_IS_PROMOTED", (_target_action == Svc_Promote) ? "1" : "0", 1);
 		::setenv("KOI_STATE", state_to_string(state), 1);
 
-		// run monitor checks if it's time
+		FOREACH(auto& svc, _services)
+			svc.second.reap_killed();
+
+		_status_interval = status_interval;
+		if (events._settings) {
+			_max_concurrency = events._settings->_service_max_concurrency;
+			_status_jitter = events._settings->_service_status_jitter;
+			_output.set_limit(events._settings->_service_output_lines);
+			_logproxy._log_lines = events._settings->_service_log_output;
+		}
+
+		// rescan services and report once per interval, the status
+		// checks themselves are scheduled per service
 		if (now - _last_check > microseconds(status_interval)) {
 			_last_check = now;
 
@@ -151,6 +385,9 @@ namespace koi {
 				return Status_Error;
 			}
 		}
+		else if (!maintenance_mode && !verify_states(now)) {
+			return Status_Error;
+		}
 
 		ServicesStatus ret = _calculate_service_status();
 
@@ -227,8 +464,39 @@ namespace koi {
 		_target_action = Svc_Fail;
 	}
 
+	void service_manager::prepare(bool enable) {
+		if (enable == _prepare)
+			return;
+		LOG_INFO("service manager: %s", enable ? "prepare" : "unprepare");
+		_prepare = enable;
+		if (!enable) {
+			FOREACH(auto& svc, _services) {
+				service& s = svc.second;
+				s._prepared = false;
+				if (s._running.is_active() && s._event && s._event->_name == "prepare") {
+					s._running.termkill(TERMINATE_TIMEOUT);
+					s.unrun();
+				}
+			}
+		}
+	}
+
+	// true if there are services to prepare, and all of them are
+	bool service_manager::prepared() const {
+		bool any = false;
+		FOREACH(const auto& svc, _services) {
+			const service& s = svc.second;
+			if (!(s._service_flags & service::HAS_PREPARE) || !s.group().empty())
+				continue;
+			if (!s._prepared)
+				return false;
+			any = true;
+		}
+		return any;
+	}
+
 	bool service_manager::status(service_events const& events) {
-		const ptime now = microsec_clock::universal_time();
+		const ptime now = clock::now();
 		update_list(events);
 		const bool ok = verify_states(now);
 		const string ssum = status_summary(now);
@@ -318,16 +586,28 @@ namespace koi {
 		}
 	}
 
+	// Status checks are spread over the interval: each service is
+	// checked when its own (jittered) time comes, through a run queue
+	// that caps the number of commands running at once. Running status
+	// commands are followed up on every call.
 	bool service_manager::verify_states(ptime now) {
 		bool allwell = true;
 		for (auto i = _services.begin(); i != _services.end(); ++i) {
 			service& s = i->second;
 			bool spawned_action;
-			if (s._running.is_active()) {
+			const bool due = now >= s._next_status;
+			if (_update_prepare(now, s)) {
+				continue;
+			}
+			else if (s._running.is_active()) {
+				if (!due && s.in_transition())
+					continue;
+
 				if (!s._running.query_complete()) {
-					LOG_TRACE("%s:%s is blocking status check...", s._name.c_str(), s._event->_name.c_str());
+					if (due)
+						LOG_TRACE("%s:%s is blocking status check...", s._name.c_str(), s._event->_name.c_str());
 
-					if (now - s._running.started_at > microseconds(s._event->_timeout)) {
+					if (now - s._running.started_at > microseconds(s.timeout())) {
 						string t = to_simple_string(now - s._running.started_at);
 						LOG_WARN("Command '%s' timed out after %s", s._event->_name.c_str(),
 						         t.c_str());
@@ -340,7 +620,8 @@ namespace koi {
 				else if (check_exitcode(s, spawned_action)) {
 					if (!spawned_action) {
 						s.unrun();
-						s.status(_logproxy.inpipe);
+						if (due)
+							_queue_status(s);
 					}
 				}
 				else {
@@ -348,20 +629,76 @@ namespace koi {
 					allwell = false;
 				}
 			}
-			else {
-				s.status(_logproxy.inpipe);
+			else if (due) {
+				_queue_status(s);
 			}
 		}
+
+		_run_status_queue(now);
 		return allwell;
 	}
 
+	void service_manager::_queue_status(service& s) {
+		if (!s._queued) {
+			s._queued = true;
+			_run_queue.push_back(s._name);
+		}
+	}
+
+	size_t service_manager::_running_commands() const {
+		size_t n = 0;
+		FOREACH(const auto& s, _services)
+			if (s.second._running.is_active())
+				++n;
+		return n;
+	}
+
+	// uniformly within +/- jitter percent of the interval
+	// seeded per process, so that the nodes of a cluster don't
+	// draw the same jitter and check their services in lockstep
+	uint64_t service_manager::_jittered(uint64_t interval) const {
+		static boost::mt19937 random_engine((uint32_t)getpid() ^ (uint32_t)clock::usecs(clock::wall()));
+		const uint64_t j = interval * (uint64_t)_status_jitter / 100;
+		if (j == 0)
+			return interval;
+		boost::uniform_int<uint64_t> dist(0, 2*j);
+		return interval - j + dist(random_engine);
+	}
+
+	// launch queued status checks in order, while below the
+	// concurrency limit. State changes are never held back by it.
+	void service_manager::_run_status_queue(const ptime& now) {
+		size_t running = _running_commands();
+		while (!_run_queue.empty() &&
+		       (_max_concurrency == 0 || running < _max_concurrency)) {
+			const string name = _run_queue.front();
+			_run_queue.pop_front();
+
+			auto i = _services.find(name);
+			if (i == _services.end())
+				continue;
+
+			service& s = i->second;
+			s._queued = false;
+			s._next_status = now + microseconds(_jittered(_status_interval));
+			if (s._running.is_active())
+				continue;
+
+			_set_service_env(s);
+			s.status(&_logproxy);
+			if (s._running.is_active())
+				++running;
+		}
+	}
+
 	void service_manager::_service_failed(service& s) {
 		s.report_fail();
-		s.fail(_logproxy.inpipe);
+		s.fail(&_logproxy);
 	}
 
 	void service_manager::wait_for_demote(bool maintenance_mode) {
-		ptime begin_wait = microsec_clock::universal_time();
+		WATCHDOG_PHASE("service.wait_for_demote");
+		ptime begin_wait = clock::now();
 
 		bool at_target_state, empty_loop, first_loop = true;
 
@@ -369,7 +706,8 @@ namespace koi {
 			return;
 
 		do {
-			if (microsec_clock::universal_time() - begin_wait > seconds(360)) {
+			clock::refresh();
+			if (clock::now() - begin_wait > seconds(360)) {
 				LOG_ERROR("Timeout: demote is taking too long!");
 				break;
 			}
@@ -400,14 +738,16 @@ namespace koi {
 	}
 
 	void service_manager::wait_for_shutdown() {
-		ptime begin_wait = microsec_clock::universal_time();
+		WATCHDOG_PHASE("service.wait_for_shutdown");
+		ptime begin_wait = clock::now();
 
 		bool at_target_state;
 		bool empty_loop;
 		bool first_loop = true;
 		do {
+			clock::refresh();
 			// TODO: make configurable
-			if (microsec_clock::universal_time() - begin_wait > seconds(360)) {
+			if (clock::now() - begin_wait > seconds(360)) {
 				FOREACH(auto& svc, _services) {
 					service& s = svc.second;
 					if (s._running.is_active()) {
@@ -453,7 +793,7 @@ namespace koi {
 				LOG_ERROR("%s:%s does not match node state %s",
 				          s._name.c_str(),
 				          service_state_string(s._state),
-				          service_action_string(_target_action));
+				          service_action_string(target_for(s)));
 				spawned_action = true;
 				return _update_service_state(s);
 			}
@@ -490,7 +830,7 @@ namespace koi {
 			break;
 		}
 
-		return matches(s._state, _target_action);
+		return matches(s._state, target_for(s));
 	}
 
 	bool service_manager::complete_transition(ptime now, service& s) {
@@ -519,7 +859,7 @@ namespace koi {
 			}
 			else {
 				// check for timeouts
-				if (now - s._running.started_at > microseconds(s._event->_timeout)) {
+				if (now - s._running.started_at > microseconds(s.timeout())) {
 					const string t = to_simple_string(now - s._running.started_at);
 					LOG_WARN("Command '%s' timeout after: %s",
 					         s._event->_name.c_str(),
@@ -530,7 +870,7 @@ namespace koi {
 					return false;
 				}
 				// check for overriding actions (is starting -> should be stopping)
-				switch (_target_action) {
+				switch (target_for(s)) {
 				case Svc_Stop:
 				case Svc_Fail: {
 					if (s._state == Svc_Starting) {
@@ -539,7 +879,7 @@ namespace koi {
 						s.unrun();
 						s.transition(Svc_Started);
 						LOG_WARN("Forcing stop");
-						s.stop(_logproxy.inpipe);
+						s.stop(&_logproxy);
 					}
 				} break;
 				default: break;
@@ -559,7 +899,7 @@ namespace koi {
 	}
 
 	bool service_manager::_update_failed_service(service& s) {
-		if (!s.fail(_logproxy.inpipe)) {
+		if (!s.fail(&_logproxy)) {
 			LOG_TRACE("fail() failed");
 			return false;
 		}
@@ -567,8 +907,8 @@ namespace koi {
 	}
 
 	bool service_manager::_update_stopped_service(service& s) {
-		if (_target_action > Svc_Stop) {
-			if (allow_start(s) && !s.start(_logproxy.inpipe)) {
+		if (target_for(s) > Svc_Stop) {
+			if (allow_start(s) && !s.start(&_logproxy)) {
 				LOG_TRACE("start() failed");
 				return false;
 			}
@@ -577,14 +917,15 @@ namespace koi {
 	}
 
 	bool service_manager::_update_started_service(service& s) {
-		if (_target_action == Svc_Stop || _target_action == Svc_Fail) {
-			if (allow_stop(s) && !s.stop(_logproxy.inpipe)) {
+		const ServiceAction target = target_for(s);
+		if (target == Svc_Stop || target == Svc_Fail) {
+			if (allow_stop(s) && !s.stop(&_logproxy)) {
 				LOG_TRACE("stop() failed");
 				return false;
 			}
 		}
-		else if (_target_action == Svc_Promote) {
-			if (allow_promote(s) && !s.promote(_logproxy.inpipe)) {
+		else if (target == Svc_Promote) {
+			if (allow_promote(s) && !s.promote(&_logproxy)) {
 				LOG_TRACE("promote() failed");
 				return false;
 			}
@@ -593,11 +934,12 @@ namespace koi {
 	}
 
 	bool service_manager::_update_promoted_service(service& s) {
-		if (_target_action == Svc_Demote ||
-		    _target_action == Svc_Start ||
-		    _target_action == Svc_Stop ||
-		    _target_action == Svc_Fail) {
-			if (allow_demote(s) && !s.demote(_logproxy.inpipe)) {
+		const ServiceAction target = target_for(s);
+		if (target == Svc_Demote ||
+		    target == Svc_Start ||
+		    target == Svc_Stop ||
+		    target == Svc_Fail) {
+			if (allow_demote(s) && !s.demote(&_logproxy)) {
 				LOG_TRACE("demote() failed");
 				return false;
 			}
@@ -606,6 +948,7 @@ namespace koi {
 	}
 
 	bool service_manager::_update_service_state(service& s) {
+		_set_service_env(s);
 		if (s.is_failed())
 			return _update_failed_service(s);
 		switch (s._state) {
@@ -618,8 +961,46 @@ namespace koi {
 		return true;
 	}
 
+	// prepare runs outside the state machine: the service stays
+	// Started, and a failed or timed out prepare only means that the
+	// service isn't prepared. Returns true if s was preparing.
+	bool service_manager::_update_prepare(const ptime& now, service& s) {
+		if (!s._running.is_active() || !s._event || s._event->_name != "prepare")
+			return false;
+
+		if (s._running.query_complete()) {
+			s._prepared = (s._running.exitcode == 0);
+			if (s._prepared)
+				LOG_INFO("%s: prepared", s._name.c_str());
+			else
+				LOG_WARN("%s:prepare returned %d", s._name.c_str(), s._running.exitcode);
+			s.unrun();
+		}
+		else if (now - s._running.started_at > microseconds(s.timeout())) {
+			LOG_WARN("%s:prepare timed out", s._name.c_str());
+			s._running.termkill(TERMINATE_TIMEOUT);
+			s.unrun();
+			s._prepared = false;
+		}
+		return true;
+	}
+
+	bool service_manager::_should_prepare(const service& s) const {
+		return _prepare &&
+			(s._service_flags & service::HAS_PREPARE) &&
+			!s._prepared &&
+			s._state == Svc_Started &&
+			!s.is_failed() &&
+			!s._running.is_active() &&
+			s.group().empty() &&
+			target_for(s) != Svc_Promote;
+	}
+
 	bool service_manager::_update_service(const ptime& now, service& s) {
-		if (s.in_transition()) {
+		if (_update_prepare(now, s)) {
+			return true;
+		}
+		else if (s.in_transition()) {
 			return complete_transition(now, s);
 		}
 		else if (s._running.is_active() && s._running.query_complete()) {
@@ -635,15 +1016,19 @@ namespace koi {
 				return false;
 			}
 		}
-		else if (s._state != Svc_Failed && !resolves(s._state, _target_action)) {
+		else if (s._state != Svc_Failed && !resolves(s._state, target_for(s))) {
 			return _update_service_state(s);
 		}
+		else if (_should_prepare(s)) {
+			_set_service_env(s);
+			return s.prepare(&_logproxy);
+		}
 
 		return true;
 	}
 
 	bool service_manager::update_states(uint64_t state_update_interval, bool force) {
-		ptime now = microsec_clock::universal_time();
+		ptime now = clock::now();
 		if (!force && (now - _last_update_states < microseconds(state_update_interval)))
 			return true;
 		_last_update_states = now;
@@ -651,9 +1036,16 @@ namespace koi {
 		//string ts = to_simple_string(now);
 		//LOG_TRACE("%s: [target-state: %s]", ts.c_str(), state_string(_target_state));
 
+		// a service that completes its transition within the pass can
+		// unblock the next priority, so go on until nothing changes
 		bool allwell = true;
-		FOREACH(auto& s, _services) {
-			allwell = _update_service(now, s.second) && allwell;
+		for (size_t pass = 0; pass <= _services.size(); ++pass) {
+			const uint32_t before = digest();
+			FOREACH(auto& s, _services) {
+				allwell = _update_service(now, s.second) && allwell;
+			}
+			if (digest() == before)
+				break;
 		}
 		return allwell;
 	}
@@ -668,6 +1060,7 @@ namespace koi {
 			inf._state = s._state;
 			inf._event = s._event->_name;
 			inf._failed = s.is_failed();
+			inf._group = s.group();
 			hr->_services.push_back(inf);
 		}
 	}
@@ -680,12 +1073,76 @@ namespace koi {
 		return false;
 	}
 
+	// true if any service in the default group is promoted or
+	// changing promotion state
+	bool service_manager::promoted() const {
+		FOREACH(const auto& s, _services) {
+			if (s.second._state >= Svc_Demoting && s.second.group().empty())
+				return true;
+		}
+		return false;
+	}
+
+	// Services in a resource group are promoted on the runner that
+	// the elector picked as group master, and only started elsewhere.
+	// The rest follow the runner state.
+	ServiceAction service_manager::target_for(const service& s) const {
+		if (_target_action < Svc_Start)
+			return _target_action;
+		const string group = s.group();
+		if (group.empty())
+			return _target_action;
+		if (_promoted_groups.find(group) != _promoted_groups.end())
+			return Svc_Promote;
+		return (_target_action == Svc_Promote) ? Svc_Demote : _target_action;
+	}
+
+	bool service_manager::set_promoted_groups(const std::set<string>& groups) {
+		if (groups == _promoted_groups)
+			return false;
+		FOREACH(const auto& g, groups)
+			if (_promoted_groups.find(g) == _promoted_groups.end())
+				LOG_INFO("service manager: promote group %s", g.c_str());
+		FOREACH(const auto& g, _promoted_groups)
+			if (groups.find(g) == groups.end())
+				LOG_INFO("service manager: demote group %s", g.c_str());
+		_promoted_groups = groups;
+		return true;
+	}
+
+	void service_manager::update_groups(const settings& cfg) {
+		FOREACH(auto& svc, _services) {
+			service& s = svc.second;
+			const string group = cfg.group_for(s._name);
+			if (group != s._group)
+				LOG_INFO("%s: group '%s' was '%s'", s._name.c_str(), group.c_str(), s._group.c_str());
+			s._group = group;
+		}
+	}
+
+	// scripts see the target of their own group
+	void service_manager::_set_service_env(const service& s) const {
+		const string group = s.group();
+		::setenv("KOI_IS_PROMOTED", (target_for(s) == Svc_Promote) ? "1" : "0", 1);
+		::setenv("KOI_GROUP", group.c_str(), 1);
+	}
+
+	// changes when any service changes state or fails
+	uint32_t service_manager::digest() const {
+		uint32_t h = 2166136261u;
+		FOREACH(const auto& s, _services) {
+			h = (h ^ (uint32_t)s.second._state) * 16777619u;
+			h = (h ^ (uint32_t)s.second.is_failed()) * 16777619u;
+		}
+		return h;
+	}
+
 	bool service_manager::allow_start(const service& a) const {
 		if (a._priority == service::NO_PRIORITY)
 			return true;
 		for (services::const_iterator i = _services.begin(); i != _services.end(); ++i) {
 			const service& b = i->second;
-			if (a._name == b._name)
+			if (a._name == b._name || a.group() != b.group())
 				continue;
 			if ((a._priority > b._priority) &&
 			    (b._state < Svc_Started))
@@ -699,7 +1156,7 @@ namespace koi {
 			return true;
 		for (services::const_iterator i = _services.begin(); i != _services.end(); ++i) {
 			const service& b = i->second;
-			if (a._name == b._name)
+			if (a._name == b._name || a.group() != b.group())
 				continue;
 			if ((a._priority < b._priority) &&
 			    (b._state > Svc_Stopped))
@@ -713,7 +1170,7 @@ namespace koi {
 			return true;
 		for (services::const_iterator i = _services.begin(); i != _services.end(); ++i) {
 			const service& b = i->second;
-			if (a._name == b._name)
+			if (a._name == b._name || a.group() != b.group())
 				continue;
 			if ((a._priority > b._priority) &&
 			    (b._state < Svc_Promoted))
@@ -727,7 +1184,7 @@ namespace koi {
 			return true;
 		for (services::const_iterator i = _services.begin(); i != _services.end(); ++i) {
 			const service& b = i->second;
-			if (a._name == b._name)
+			if (a._name == b._name || a.group() != b.group())
 				continue;
 			if ((a._priority < b._priority) &&
 			    (b._state > Svc_Started))
@@ -743,6 +1200,9 @@ namespace koi {
 	                                      _path(),
 	                                      _priority(NO_PRIORITY),
 	                                      _promotable(false),
+	                                      _prepared(false),
+	                                      _queued(false),
+	                                      _next_status(min_date_time),
 	                                      _state(Svc_Stopped),
 	                                      _service_flags(0) {
 	}
@@ -752,8 +1212,12 @@ namespace koi {
 		                                _event(events("none")),
 		                                _name(name),
 		                                _path(path),
+		                                _group(events._settings ? events._settings->group_for(name) : string()),
 		                                _priority(NO_PRIORITY),
 		                                _promotable(false),
+		                                _prepared(false),
+		                                _queued(false),
+		                                _next_status(min_date_time),
 		                                _state(Svc_Stopped),
 		                                _service_flags(0) {
 	}
@@ -779,6 +1243,7 @@ namespace koi {
 			new_info |= (os::path::isexec(combine_path(tmp, root.c_str(), "promote")) ? HAS_PROMOTE : 0);
 			new_info |= (os::path::isexec(combine_path(tmp, root.c_str(), "demote")) ? HAS_DEMOTE : 0);
 			new_info |= (os::path::isexec(combine_path(tmp, root.c_str(), "failed")) ? HAS_FAIL : 0);
+			new_info |= (os::path::isexec(combine_path(tmp, root.c_str(), "prepare")) ? HAS_PREPARE : 0);
 
 			// note this calls exists(), not isexec()
 			new_info |= (os::path::exists(combine_path(tmp, root.c_str(), "disabled")) ? IS_DISABLED : 0);
@@ -803,7 +1268,7 @@ namespace koi {
 		if (changes != 0) {
 			const char* flagNames[] = {
 				"start", "stop", "status", "promote", "demote",
-				"fail", "single", "isfailed", "disabled"
+				"fail", "prepare", "single", "isfailed", "disabled"
 			};
 			stringstream ss;
 			for (size_t i = 0; i < ASIZE(flagNames); ++i) {
@@ -834,13 +1299,75 @@ namespace koi {
 		_service_flags |= IS_FAILED;
 	}
 
+	void service_manager::service::record_run() {
+		record(_event, _running);
+	}
+
+	void service_manager::service::record(const service_event* e, command& c) {
+		if (c.finished_at == ptime(min_date_time) || !e || e->_name == "none")
+			return;
+		_usage[e->_name].add(c.usage);
+
+		const time_duration td = c.finished_at - c.started_at;
+		const uint64_t usec = td.is_negative() ? 0 : td.total_microseconds();
+		// commands killed on timeout don't say how long they would have
+		// taken, but count them as taking the whole timeout so that an
+		// estimate which is too low can grow again
+		const uint64_t limit = timeout_for(e);
+		if (c.exited && !td.is_negative() && usec <= e->_timeout)
+			_durations[e->_name].add(usec);
+		else if (!c.exited && usec >= limit)
+			_durations[e->_name].add(limit);
+
+		const string event = metrics::label("event", e->_name);
+		metrics::get_histogram("koi_service_script_seconds", "Run time of service scripts, by event.", event).observe(usec);
+		metrics::get_counter("koi_service_script_exits_total", "Service scripts that finished, by event and exit code.",
+		                     event + "," + (c.exited ? metrics::label("code", c.exitcode) : metrics::label("code", "killed"))).add();
+
+		c.finished_at = ptime(min_date_time);
+		c.exited = false;
+	}
+
+	void service_manager::service::reap_killed() {
+		for (auto i = _killed.begin(); i != _killed.end();) {
+			if (i->second.query_complete()) {
+				record(i->first, i->second);
+				i = _killed.erase(i);
+			}
+			else {
+				++i;
+			}
+		}
+	}
+
+	uint64_t service_manager::service::timeout() const {
+		return timeout_for(_event);
+	}
+
+	uint64_t service_manager::service::timeout_for(const service_event* event) const {
+		if (!event)
+			return 0;
+		const settings* cfg = _events._settings;
+		if (!cfg || !cfg->_adaptive_timeouts)
+			return event->_timeout;
+		auto i = _durations.find(event->_name);
+		if (i == _durations.end() || i->second._count < cfg->_adaptive_timeout_samples)
+			return event->_timeout;
+		const uint64_t t = i->second.percentile(cfg->_adaptive_timeout_percentile) * cfg->_adaptive_timeout_factor;
+		return std::min(std::max(t, cfg->_adaptive_timeout_min), event->_timeout);
+	}
+
 	void service_manager::service::unrun() {
+		if (_running.is_active())
+			_killed.push_back(std::make_pair(_event, _running));
+		else
+			record_run();
 		_running.pid = 0;
 		_running.exitcode = 0;
 		_event = _events("none");
 	}
 
-	bool service_manager::service::launch_command(const char* c, int inpipe) {
+	bool service_manager::service::launch_command(const char* c, logging::logproxy* log) {
 		string wd(services_workingdir);
 		char av0[512] = {0};
 		char av1[128] = {0};
@@ -857,13 +1384,21 @@ namespace koi {
 		if (!single_script()) {
 			wd = _path;
 		}
+		record_run();
 		_event = _events(c);
+		_running.limits = _events._settings ? _events._settings->limits_for(_name, c) : process_limits();
 		LOG_TRACE("Executing: %s (%s)", av0, av1);
-		_running.begin_pipe_stdout_to(av, wd.c_str(), inpipe);
+		if (!_running.limits.empty())
+			LOG_TRACE("Limits: %s", _running.limits.to_string().c_str());
+		const int out = log ? log->open(_name + ":" + c) : -1;
+		WATCHDOG_PHASE("service.launch");
+		_running.begin_pipe_stdout_to(av, wd.c_str(), out);
+		if (out >= 0)
+			::close(out);
 		return true;
 	}
 
-	bool service_manager::service::start(int inpipe) {
+	bool service_manager::service::start(logging::logproxy* log) {
 		if (_running.is_active()) {
 			LOG_WARN("%s:start(): action running: %s", _name.c_str(), _event->_name.c_str());
 			return true; // defer action
@@ -879,7 +1414,7 @@ namespace koi {
 		if (_state < Svc_Starting) {
 			if (_service_flags & HAS_START) {
 				transition(Svc_Starting);
-				if (!launch_command("start", inpipe)) {
+				if (!launch_command("start", log)) {
 					LOG_WARN("Failed to execute %s%s", _path.c_str(), "/start");
 					return false;
 				}
@@ -890,7 +1425,7 @@ namespace koi {
 		}
 		return true;
 	}
-	bool service_manager::service::stop(int inpipe) {
+	bool service_manager::service::stop(logging::logproxy* log) {
 		if (_running.is_active()) {
 			LOG_WARN("%s:stop(): action running: %s", _name.c_str(),
 			         (_event ? _event->_name.c_str() : "none"));
@@ -900,7 +1435,8 @@ namespace koi {
 			// don't wait for it to complete
 			if (_event && (_event->_name == "start" ||
 			               _event->_name == "promote" ||
-			               _event->_name == "status")) {
+			               _event->_name == "status" ||
+			               _event->_name == "prepare")) {
 				LOG_WARN("%s:stop(): aborting running action: %s", _name.c_str(), _event->_name.c_str());
 				_running.termkill(TERMINATE_TIMEOUT);
 			}
@@ -910,7 +1446,7 @@ namespace koi {
 		if (_state >= Svc_Starting) {
 			if (_service_flags & HAS_STOP) {
 				transition(Svc_Stopping);
-				if (!launch_command("stop", inpipe)) {
+				if (!launch_command("stop", log)) {
 					LOG_WARN("Failed to execute %s%s", _path.c_str(), "/stop");
 					return false;
 				}
@@ -921,17 +1457,17 @@ namespace koi {
 		}
 		return true;
 	}
-	bool service_manager::service::status(int inpipe) {
+	bool service_manager::service::status(logging::logproxy* log) {
 		if (_running.is_active()) {
 			LOG_WARN("%s:status(): action running: %s", _name.c_str(), _event->_name.c_str());
 			return true; // defer action
 		}
 		if (_state >= Svc_Started) {
 			if (is_disabled())
-				return stop(inpipe);
+				return stop(log);
 
 			if (_service_flags & HAS_STATUS) {
-				if (!launch_command("status", inpipe)) {
+				if (!launch_command("status", log)) {
 					LOG_WARN("Failed to execute %s%s", _path.c_str(), "/status");
 					return false;
 				}
@@ -939,7 +1475,7 @@ namespace koi {
 		}
 		return true;
 	}
-	bool service_manager::service::promote(int inpipe) {
+	bool service_manager::service::promote(logging::logproxy* log) {
 		if (_running.is_active()) {
 			LOG_WARN("%s:promote(): action running: %s", _name.c_str(), _event->_name.c_str());
 			return true; // defer action
@@ -951,7 +1487,7 @@ namespace koi {
 		if (_state == Svc_Started) {
 			if (_service_flags & HAS_PROMOTE) {
 				transition(Svc_Promoting);
-				if (!launch_command("promote", inpipe)) {
+				if (!launch_command("promote", log)) {
 					LOG_WARN("Failed to execute %s%s", _path.c_str(), "/promote");
 					return false;
 				}
@@ -962,7 +1498,7 @@ namespace koi {
 		}
 		return true;
 	}
-	bool service_manager::service::demote(int inpipe) {
+	bool service_manager::service::demote(logging::logproxy* log) {
 		if (_running.is_active()) {
 			LOG_WARN("%s:demote(): action running: %s", _name.c_str(), _event->_name.c_str());
 			return true; // defer action
@@ -970,7 +1506,7 @@ namespace koi {
 		if (_state == Svc_Promoted) {
 			if (_service_flags & HAS_DEMOTE) {
 				transition(Svc_Demoting);
-				if (!launch_command("demote", inpipe)) {
+				if (!launch_command("demote", log)) {
 					LOG_WARN("Failed to execute %s%s", _path.c_str(), "/demote");
 					return false;
 				}
@@ -982,7 +1518,20 @@ namespace koi {
 		return true;
 	}
 
-	bool service_manager::service::fail(int inpipe) {
+	// single scripts are not prepared, since they may not
+	// expect the event
+	bool service_manager::service::prepare(logging::logproxy* log) {
+		if (_running.is_active() || is_disabled())
+			return true; // defer action
+
+		if (_state == Svc_Started && (_service_flags & HAS_PREPARE)) {
+			if (!launch_command("prepare", log))
+				LOG_WARN("Failed to execute %s%s", _path.c_str(), "/prepare");
+		}
+		return true;
+	}
+
+	bool service_manager::service::fail(logging::logproxy* log) {
 		if (_running.is_active()) {
 			LOG_WARN("%s:fail(): action running: %s", _name.c_str(), _event->_name.c_str());
 		}
@@ -991,20 +1540,20 @@ namespace koi {
 				bool was_started = (_state > Svc_Stopped);
 
 				transition(Svc_Failing);
-				if (!launch_command("failed", inpipe)) {
+				if (!launch_command("failed", log)) {
 					LOG_WARN("Failed to execute %s%s", _path.c_str(), "/failed");
 					return false;
 				}
 				if (was_started &&
 				    (_service_flags & HAS_STOP) &&
-				    (!launch_command("stop", inpipe))) {
+				    (!launch_command("stop", log))) {
 					LOG_WARN("Failed to execute %s%s", _path.c_str(), "/stop");
 					return false;
 				}
 
 			}
 			else if (_state > Svc_Stopped) {
-				return stop(inpipe);
+				return stop(log);
 			}
 			else {
 				transition(Svc_Failed);
@@ -1016,7 +1565,10 @@ namespace koi {
 	void service_manager::service::transition(ServiceState state) {
 		if (_state != state) {
 			LOG_INFO("%s[%s->%s]", _name.c_str(), service_state_string(_state), service_state_string(state));
+			if (_events._journal)
+				_events._journal->append(journal::Ev_Service, _events._settings->_uuid, _state, state, _name);
 			_state = state;
+			_prepared = false;
 
 			if (!(_state == Svc_Started ||
 			      _state == Svc_Demoting ||
@@ -25,16 +25,22 @@
  *
  * each folder can contain one of each of these commands
  * command is given as first parameter to service
- * start, stop, status, promote, demote, failed
+ * start, stop, status, promote, demote, failed, prepare
  *
  * script should return 0 on success, 1 on failure
  * the scripts are executed as root with $KOI_SERVICE_HOME as homedir
  *
  * start is executed in order: 00, then 01... if one fails, the node is taken out of the cluster
  * stop is executed in reverse order: 01, then 00...
- * status is executed in parallell / order independent
+ * status is executed in parallell / order independent, spread over
+ * the status interval and limited by service.max_concurrency
  * promote is executed in order: 00, then 01...
  * demote is executed in reverse order: 01, then 00...
+ * prepare is executed in parallel on the runner the elector expects
+ * to promote next, to warm up before the promotion. It is optional,
+ * and a failing prepare only means the service isn't prepared
+ *
+ * priorities only order services within the same resource group
  */
 
 #include "cmd.hpp"
@@ -42,15 +48,75 @@
 #include "service_info.hpp"
 
 #include <set>
+#include <deque>
 
 namespace koi {
+	struct journal;
+
 	struct service_events {
-		service_events() : _settings(0) {}
-		service_events(const settings& s) : _settings(&s) {}
+		service_events() : _settings(0), _journal(0) {}
+		service_events(const settings& s, journal* j = 0) : _settings(&s), _journal(j) {}
 		const service_event* operator()(const char* n) const {
 			return _settings->svc(n);
 		}
 		const settings* _settings;
+		journal* _journal; // service transitions are recorded here, if set
+	};
+
+	// Durations of completed service commands in power-of-two
+	// millisecond buckets: bucket 0 is < 1ms, bucket i is < 2^i ms.
+	// Counts are halved once HALVE_AT is reached so that old samples
+	// fade out as scripts change behaviour.
+	struct duration_histogram {
+		static const int BUCKETS = 24;
+		static const uint32_t HALVE_AT = 1024;
+
+		duration_histogram();
+
+		void add(uint64_t usec);
+		uint64_t percentile(int p) const; // upper bound in usecs, 0 if empty
+		string to_string() const;
+
+		uint32_t _buckets[BUCKETS];
+		uint32_t _count;
+		uint64_t _max; // usecs
+	};
+
+	// Resources used by the completed runs of a service command,
+	// summed from the rusage of each reaped process.
+	struct resource_usage {
+		resource_usage();
+
+		void add(const struct rusage& ru);
+		uint64_t cpu() const { return _utime + _stime; }
+		string to_string() const;
+
+		uint32_t _runs;
+		uint64_t _utime; // usecs
+		uint64_t _stime; // usecs
+		long     _maxrss; // largest seen, KB
+		uint64_t _nvcsw; // voluntary context switches
+		uint64_t _nivcsw; // involuntary context switches
+	};
+
+	// The last lines printed by the service commands, kept per
+	// service:event. Lines are added from the log proxy thread and
+	// read by RPCs, so both take the lock.
+	struct output_buffer {
+		static const size_t MARKER_LEN = 32; // kept for the "... N earlier lines" marker
+
+		output_buffer();
+		~output_buffer();
+
+		void add(const string& tag, const char* line);
+		void set_limit(size_t lines); // per service:event, 0 keeps nothing
+		std::vector<string> lines(const string& service, const string& event, size_t max_bytes) const; // "" for all
+
+		typedef std::map<string, std::deque<string> > buffers;
+
+		buffers _buffers; // by service:event
+		size_t _limit;
+		mutable pthread_mutex_t _lock;
 	};
 
 	enum ServicesStatus {
@@ -68,33 +134,49 @@ namespace koi {
 			service();
 			service(service_events const& events, const char* name, const char* path);
 
-			bool start(int inpipe);
-			bool stop(int inpipe);
-			bool status(int inpipe);
-			bool promote(int inpipe);
-			bool demote(int inpipe);
-			bool fail(int inpipe);
+			bool start(logging::logproxy* log);
+			bool stop(logging::logproxy* log);
+			bool status(logging::logproxy* log);
+			bool promote(logging::logproxy* log);
+			bool demote(logging::logproxy* log);
+			bool fail(logging::logproxy* log);
+			bool prepare(logging::logproxy* log);
 
 			void transition(ServiceState state);
 			bool in_transition() const;
 			void complete_transition();
 
-			bool launch_command(const char* c, int inpipe = -1);
+			bool launch_command(const char* c, logging::logproxy* log = 0);
 
 			void unrun();
+			void record_run(); // account for the reaped command
+			void record(const service_event* event, command& c);
+			void reap_killed(); // account for killed commands that have exited since
+			uint64_t timeout() const; // for the running event
+			uint64_t timeout_for(const service_event* event) const;
 			void report_fail();
 			void report_timeout();
 			bool update_info(); // returns false if service is gone or broken
 			ServiceState closest(ServiceState state) const;
+			const string& group() const { return _group; }
 
 			service_events _events;
 			command      _running; // currently executing command
 			const service_event* _event; // currently executing event
 			string       _name; // echo if $KOISERVICES/00-echo/start is the start script
 			string       _path; // full path to service
+			string       _group; // resource group, "" for the default group
 			int          _priority; // if script has a prio prefix, else NO_PRIO
 			bool         _promotable;
+			bool         _prepared; // prepare has completed since the service was last started
+			bool         _queued; // waiting in the run queue for a status check
+			ptime        _next_status; // when the next status check is due
 			ServiceState _state;
+			std::map<string, duration_histogram> _durations; // by event name
+			std::map<string, resource_usage> _usage; // by event name
+			// commands that were killed but had not exited yet, e.g.
+			// stuck in uninterruptible sleep
+			std::vector<std::pair<const service_event*, command>> _killed;
 
 			enum ServiceFlags {
 				HAS_START     = 1,
@@ -103,6 +185,7 @@ namespace koi {
 				HAS_PROMOTE   = 1<<3,
 				HAS_DEMOTE    = 1<<4,
 				HAS_FAIL      = 1<<5,
+				HAS_PREPARE   = 1<<6,
 				SINGLE_SCRIPT = 1<<7,
 				IS_FAILED     = 1<<8,
 				IS_DISABLED   = 1<<9
@@ -130,9 +213,17 @@ namespace koi {
 		void promote();
 		void demote();
 		void fail();
+		void prepare(bool enable);
+		bool prepared() const;
 
 		bool status(service_events const& events);
 
+		// resource groups
+		ServiceAction target_for(const service& s) const;
+		bool set_promoted_groups(const std::set<string>& groups); // true if changed
+		void update_groups(const settings& cfg); // after the groups are reconfigured
+		void _set_service_env(const service& s) const;
+
 		// priority allow/disallow
 		bool allow_start(const service& s) const;
 		bool allow_stop(const service& s) const;
@@ -146,10 +237,17 @@ namespace koi {
 		string to_string() const;
 
 		string status_summary(const ptime& now, bool details=true) const;
+		std::vector<string> timeouts(size_t max_bytes) const; // per service:event durations and timeouts
+		std::vector<string> usage(size_t max_bytes) const; // per service:event resource usage
+		std::vector<string> output(const string& name, const string& event, size_t max_bytes) const;
 
 		void _remove_services();
 		void update_list(service_events const& events);
 		bool verify_states(ptime now);
+		void _queue_status(service& s);
+		void _run_status_queue(const ptime& now);
+		size_t _running_commands() const;
+		uint64_t _jittered(uint64_t interval) const;
 		bool update_states(uint64_t state_update_interval, bool force = false);
 		ServicesStatus _calculate_service_status() const;
 		bool _update_failed_service(service& s);
@@ -158,6 +256,8 @@ namespace koi {
 		bool _update_promoted_service(service& s);
 		bool _update_service_state(service& s);
 		bool _update_service(const ptime& now, service& s);
+		bool _update_prepare(const ptime& now, service& s);
+		bool _should_prepare(const service& s) const;
 
 		void _service_failed(service& s);
 
@@ -169,17 +269,26 @@ namespace koi {
 		void wait_for_stop(bool maintenance_mode);
 		bool complete_transition(ptime now, service& s);
 		bool check_exitcode(service& s, bool& spawned_action);
-		void toggle_logproxy();
+		void toggle_logproxy(); // restart the output logging thread
 		bool is_disabled();
+		bool promoted() const;
+		uint32_t digest() const;
 
 		bool resolves(ServiceState state, ServiceAction action) const;
 		bool matches(ServiceState state, ServiceAction action) const;
 
 		services                  _services;
 		ServiceAction             _target_action;
+		std::set<string>          _promoted_groups; // groups this runner is master of
+		bool                      _prepare; // the elector expects to promote this runner next
+		std::deque<string>        _run_queue; // services waiting for a status check
+		uint64_t                  _status_interval;
+		size_t                    _max_concurrency; // running commands before status checks wait, 0 for no limit
+		int                       _status_jitter; // percent of the status interval
 		ptime                     _last_update_states;
 		ptime                     _last_check;
 		std::set<string>          _ignored_services;
+		output_buffer             _output; // recent script output, before the proxy that adds to it
 		logging::logproxy         _logproxy;
 		mutable std::stringstream _summary; // cache for status summary
 	};
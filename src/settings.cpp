@@ -17,6 +17,7 @@
 #include "koi.hpp"
 
 #include "file.hpp"
+#include "os.hpp"
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/ini_parser.hpp>
 #include <boost/property_tree/info_parser.hpp>
@@ -27,6 +28,7 @@
 #include <boost/uuid/uuid_generators.hpp>
 #include <boost/uuid/uuid_io.hpp>
 #include "stringutil.hpp"
+#include "clock.hpp"
 
 using namespace std;
 using namespace boost;
@@ -133,6 +135,62 @@ namespace koi {
 		return "Unknown";
 	}
 
+	// memory size with an optional K, M or G suffix
+	void readsize(const boost::property_tree::ptree& tr, uint64_t& t, const char* s) {
+		string val = tr.get<string>(s, lexical_cast<string>(t));
+		uint64_t scale = 1;
+		if (endswith(val, "K") || endswith(val, "k"))
+			scale = UINT64_C(1) << 10;
+		else if (endswith(val, "M") || endswith(val, "m"))
+			scale = UINT64_C(1) << 20;
+		else if (endswith(val, "G") || endswith(val, "g"))
+			scale = UINT64_C(1) << 30;
+		if (scale != 1)
+			val = val.substr(0, val.length()-1);
+		t = lexical_cast<uint64_t>(val)*scale;
+	}
+
+	void readtime(const boost::property_tree::ptree& tr, uint64_t& t, const char* s);
+
+	bool is_event(const string& name) {
+		const char* events[] = { "start", "stop", "status", "promote", "demote", "failed", "prepare" };
+		for (size_t i = 0; i < ASIZE(events); ++i)
+			if (name == events[i])
+				return true;
+		return false;
+	}
+
+	// limits for service scripts:
+	// limits { nice 10; ionice idle; cpu 30s; memory 512M; affinity "1-3" }
+	// ionice is idle, best-effort[:level] or realtime[:level]
+	void readlimits(const boost::property_tree::ptree& tr, process_limits& l) {
+		l._nice = tr.get<int>("nice", l._nice);
+		if (l._nice != process_limits::NICE_UNSET)
+			l._nice = clamp(l._nice, -20, 19);
+
+		const string ionice = tr.get<string>("ionice", "");
+		if (!ionice.empty()) {
+			const stringvec io = split(ionice, ":");
+			const char* classes[] = { "none", "realtime", "best-effort", "idle" };
+			for (size_t i = 1; i < ASIZE(classes); ++i)
+				if (io[0] == classes[i])
+					l._ionice_class = (int)i;
+			l._ionice_level = (io.size() > 1) ? clamp(lexical_cast<int>(io[1]), 0, 7) : 4;
+			if (l._ionice_class == 0)
+				LOG_WARN("Unknown ionice class: %s", ionice.c_str());
+		}
+
+		uint64_t cpu = l._cpu_seconds*units::micro;
+		readtime(tr, cpu, "cpu");
+		l._cpu_seconds = (cpu + units::micro - 1) / units::micro;
+
+		readsize(tr, l._address_space, "memory");
+
+		const string affinity = tr.get<string>("affinity", "");
+		if (!affinity.empty() && !os::parse_cpu_list(affinity, l._affinity))
+			LOG_WARN("Bad cpu list for affinity: %s", affinity.c_str());
+	}
+
 	void readtime(const boost::property_tree::ptree& tr, uint64_t& t, const char* s) {
 		string val = tr.get<string>(s, lexical_cast<string>((uint32_t)(t/units::milli))+"ms");
 		if (endswith(val, "ms")) {
@@ -165,10 +223,24 @@ namespace koi {
 
 		_reuse_address(true),
 		_incremental_port(false),
+		_io_thread(false),
 
 		_loglevel(logging::Trace),
+		_log_rate(20),
+		_log_burst(100),
 		_cluster_id(13),
 		_cluster_quorum(0),
+		_node_weight(100),
+		_reserve_cpu(-1),
+		_journal_size(16384),
+		_metrics_interval(15*units::micro),
+		_stall_percent(25),
+		_realtime(false),
+		_realtime_policy("fifo"),
+		_realtime_priority(10),
+		_socket_priority(6),
+		_busy_poll(0),
+		_election_scoring("uptime"),
 
 		_pass("secret"),
 		_transport(),
@@ -184,11 +256,22 @@ namespace koi {
 		     _on_promote("promote", 30*units::micro),
 		     _on_demote("demote", 30*units::micro),
 		     _on_failed("failed", 20*units::micro),
+		     _on_prepare("prepare", uint64_t(360)*units::micro),
+		     _service_max_concurrency(8),
+		     _service_status_jitter(10),
+		     _service_output_lines(100),
+		     _service_log_output(true),
+		     _adaptive_timeouts(false),
+		     _adaptive_timeout_percentile(99),
+		     _adaptive_timeout_factor(3),
+		     _adaptive_timeout_samples(20),
+		     _adaptive_timeout_min(5*units::micro),
 
 		     _status_interval(10*units::micro),
 		     _cluster_update_interval(units::micro),
 		     _state_update_interval(units::micro/3),
 		     _runner_tick_interval(1*units::micro),
+		     _runner_report_holdoff(50*units::milli),
 		     _elector_tick_interval(1*units::micro),
 		     _runner_elector_lost_time(3*units::micro),
 		     _runner_elector_gone_time(60*8*units::micro), //8 minutes
@@ -230,6 +313,9 @@ namespace koi {
 		  else if (strcmp(name, "failed") == 0) {
 		  return &_on_failed;
 		  }
+		  else if (strcmp(name, "prepare") == 0) {
+		  return &_on_prepare;
+		  }
 		  else {
 		  return &_on_none;
 		  }
@@ -237,7 +323,7 @@ namespace koi {
 		switch (name[3]) {
 		case 'e': return &_on_none;
 		case 'r': return &_on_start;
-		case 'p': return &_on_stop;
+		case 'p': return (name[0] == 'p') ? &_on_prepare : &_on_stop;
 		case 't': return &_on_status;
 		case 'm': return &_on_promote;
 		case 'o': return &_on_demote;
@@ -247,6 +333,91 @@ namespace koi {
 		return &_on_none;
 	}
 
+	process_limits::process_limits()
+		: _nice(NICE_UNSET), _ionice_class(0), _ionice_level(0),
+		  _cpu_seconds(0), _address_space(0) {
+	}
+
+	bool process_limits::empty() const {
+		return _nice == NICE_UNSET && _ionice_class == 0 &&
+			_cpu_seconds == 0 && _address_space == 0 && _affinity.empty();
+	}
+
+	void process_limits::merge(const process_limits& o) {
+		if (o._nice != NICE_UNSET)
+			_nice = o._nice;
+		if (o._ionice_class != 0) {
+			_ionice_class = o._ionice_class;
+			_ionice_level = o._ionice_level;
+		}
+		if (o._cpu_seconds != 0)
+			_cpu_seconds = o._cpu_seconds;
+		if (o._address_space != 0)
+			_address_space = o._address_space;
+		if (!o._affinity.empty())
+			_affinity = o._affinity;
+	}
+
+	string process_limits::to_string() const {
+		stringstream ss;
+		if (_nice != NICE_UNSET)
+			ss << " nice=" << _nice;
+		if (_ionice_class != 0)
+			ss << " ionice=" << _ionice_class << ":" << _ionice_level;
+		if (_cpu_seconds != 0)
+			ss << " cpu=" << _cpu_seconds << "s";
+		if (_address_space != 0)
+			ss << " memory=" << (_address_space >> 20) << "M";
+		if (!_affinity.empty()) {
+			ss << " affinity=";
+			for (size_t i = 0; i < _affinity.size(); ++i)
+				ss << (i ? "," : "") << _affinity[i];
+		}
+		const string r = ss.str();
+		return r.empty() ? r : r.substr(1);
+	}
+
+	bool group_config::avoids(const string& group) const {
+		return find(_avoid.begin(), _avoid.end(), group) != _avoid.end();
+	}
+
+	const group_config* settings::group(const string& name) const {
+		FOREACH(const auto& g, _groups)
+			if (g._name == name)
+				return &g;
+		return 0;
+	}
+
+	string settings::group_for(const string& service) const {
+		FOREACH(const auto& g, _groups)
+			if (find(g._services.begin(), g._services.end(), service) != g._services.end())
+				return g._name;
+		return string();
+	}
+
+	process_limits settings::limits_for(const string& service, const string& event) const {
+		process_limits l;
+		const string keys[] = { "", event, service, service + ":" + event };
+		for (size_t i = 0; i < ASIZE(keys); ++i) {
+			auto j = _script_limits.find(keys[i]);
+			if (j != _script_limits.end())
+				l.merge(j->second);
+		}
+		// keep scripts off the cpu reserved for koinode
+		if (l._affinity.empty() && _reserve_cpu >= 0) {
+			for (int cpu = 0; cpu < os::cpu_count(); ++cpu)
+				if (cpu != _reserve_cpu)
+					l._affinity.push_back(cpu);
+		}
+		return l;
+	}
+
+	// a runner that misses its elector for _runner_elector_lost_time,
+	// or a master silent for _master_dead_time, is acted on
+	uint64_t settings::stall_threshold() const {
+		return std::min(_runner_elector_lost_time, _master_dead_time) * _stall_percent / 100;
+	}
+
 	bool settings::read_config(const vector<string>& configs, bool verbose) {
 		using namespace property_tree;
 		ptree pt;
@@ -281,6 +452,7 @@ namespace koi {
 
 			_reuse_address = pt.get<bool>("node.reuse_address", _reuse_address);
 			_incremental_port = pt.get<bool>("node.increment_port", _incremental_port);
+			_io_thread = pt.get<bool>("node.io_thread", _io_thread);
 
 			{
 				const char* loglevels[] = {"trace", "info", "warn", "error"};
@@ -290,15 +462,49 @@ namespace koi {
 					if (loglevel_name == loglevels[i])
 						_loglevel = (LogLevel)i;
 			}
+			_log_rate = pt.get<uint32_t>("node.log_rate", _log_rate);
+			_log_burst = std::max(pt.get<uint32_t>("node.log_burst", _log_burst), 1u);
 
 			_cluster_id = pt.get<int32_t>("cluster.id", _cluster_id);
 			_cluster_quorum = pt.get<int32_t>("cluster.quorum", _cluster_quorum);
+			_node_weight = pt.get<uint32_t>("node.weight", _node_weight);
+			_election_scoring = pt.get<string>("cluster.election_scoring", _election_scoring);
+			_realtime = pt.get<bool>("node.realtime", _realtime);
+			_realtime_policy = pt.get<string>("node.realtime_policy", _realtime_policy);
+			if (_realtime_policy != "fifo" && _realtime_policy != "rr") {
+				LOG_WARN("Unknown real-time policy %s, using fifo.", _realtime_policy.c_str());
+				_realtime_policy = "fifo";
+			}
+			_realtime_priority = clamp(pt.get<int>("node.realtime_priority", _realtime_priority), 1, 99);
+			_socket_priority = pt.get<int>("node.socket_priority", _socket_priority);
+			_busy_poll = std::max(pt.get<int>("node.busy_poll", _busy_poll), 0);
+			_reserve_cpu = pt.get<int>("node.reserve_cpu", _reserve_cpu);
+			if (_reserve_cpu >= os::cpu_count()) {
+				LOG_WARN("No cpu %d to reserve, ignored.", _reserve_cpu);
+				_reserve_cpu = -1;
+			}
+			_journal = pt.get<string>("node.journal", _journal);
+			_journal_size = pt.get<uint32_t>("node.journal_size", _journal_size);
+			_metrics_file = pt.get<string>("node.metrics_file", _metrics_file);
+			readtime(pt, _metrics_interval, "node.metrics_interval");
+			_metrics_interval = std::max(_metrics_interval, units::micro);
+			_stall_percent = clamp(pt.get<int>("node.stall_percent", _stall_percent), 0, 100);
 
 			readtime(pt, _on_start._timeout, "service.start_timeout");
 			readtime(pt, _on_stop._timeout, "service.stop_timeout");
 			readtime(pt, _on_status._timeout, "service.status_timeout");
 			readtime(pt, _on_promote._timeout, "service.promote_timeout");
 			readtime(pt, _on_demote._timeout, "service.demote_timeout");
+			readtime(pt, _on_prepare._timeout, "service.prepare_timeout");
+			_service_max_concurrency = pt.get<uint32_t>("service.max_concurrency", _service_max_concurrency);
+			_service_status_jitter = clamp(pt.get<int>("service.status_jitter", _service_status_jitter), 0, 50);
+			_service_output_lines = pt.get<uint32_t>("service.output_lines", _service_output_lines);
+			_service_log_output = pt.get<bool>("service.log_output", _service_log_output);
+			_adaptive_timeouts = pt.get<bool>("service.adaptive_timeouts", _adaptive_timeouts);
+			_adaptive_timeout_percentile = clamp(pt.get<int>("service.adaptive_percentile", _adaptive_timeout_percentile), 50, 100);
+			_adaptive_timeout_factor = std::max(pt.get<int>("service.adaptive_factor", _adaptive_timeout_factor), 1);
+			_adaptive_timeout_samples = pt.get<uint32_t>("service.adaptive_samples", _adaptive_timeout_samples);
+			readtime(pt, _adaptive_timeout_min, "service.adaptive_min_timeout");
 			_service_auto_recover = pt.get<uint32_t>("service.auto_recover", (uint32_t)_service_auto_recover);
 			_auto_recover_wait_factor = pt.get<int>("service.auto_recover_wait_factor", _auto_recover_wait_factor);
 			if (_auto_recover_wait_factor < 1 || _auto_recover_wait_factor > AUTO_RECOVER_MAX_FACTOR) {
@@ -314,11 +520,47 @@ namespace koi {
 			_services_folder = pt.get<string>("service.folder", _services_folder);
 			_services_workingdir = pt.get<string>("service.workingdir", _services_workingdir);
 
+			// starts over, so that removing the section removes the groups
+			_groups.clear();
+			if (auto groups = pt.get_child_optional("groups")) {
+				FOREACH(const auto& g, *groups) {
+					group_config gc;
+					gc._name = g.first;
+					gc._services = split(g.second.get<string>("services", ""), ",; ");
+					gc._avoid = split(g.second.get<string>("avoid", ""), ",; ");
+					if (gc._name == "master") {
+						LOG_WARN("Resource group name 'master' is reserved, ignored.");
+						continue;
+					}
+					_groups.push_back(gc);
+				}
+			}
+
+			// limits { ...; status { ... }; 00-psm { ...; start { ... } } }
+			// sections named after an event apply to that event,
+			// anything else is a service name
+			_script_limits.clear();
+			if (auto limits = pt.get_child_optional("limits")) {
+				readlimits(*limits, _script_limits[""]);
+				FOREACH(const auto& c, *limits) {
+					if (c.second.empty())
+						continue;
+					readlimits(c.second, _script_limits[c.first]);
+					if (is_event(c.first))
+						continue;
+					FOREACH(const auto& e, c.second) {
+						if (!e.second.empty() && is_event(e.first))
+							readlimits(e.second, _script_limits[c.first + ":" + e.first]);
+					}
+				}
+			}
+
 			readtime(pt, _status_interval, "time.status_interval");
 			readtime(pt, _cluster_update_interval, "time.cluster_update_interval");
 			readtime(pt, _state_update_interval, "time.state_update_interval");
 			readtime(pt, _elector_tick_interval, "time.elector_tick_interval");
 			readtime(pt, _runner_tick_interval, "time.runner_tick_interval");
+			readtime(pt, _runner_report_holdoff, "time.runner_report_holdoff");
 			readtime(pt, _runner_elector_lost_time, "time.elector_lost_time");
 			readtime(pt, _runner_elector_gone_time, "time.elector_gone_time");
 			readtime(pt, _quorum_demote_time, "time.quorum_demote_time");
@@ -332,6 +574,7 @@ namespace koi {
 			readtime(pt, _runner_failure_promotion_timeout, "time.failure_promotion_timeout");
 
 			logging::set_log_level(_loglevel);
+			logging::set_rate_limit(_log_rate, _log_burst);
 		}
 		catch (const ptree_error& e) {
 			LOG_ERROR("Configuration error: %s", e.what());
@@ -347,7 +590,7 @@ namespace koi {
 		// setup basic environment
 		// verify machine
 		if (_starttime == posix_time::ptime(posix_time::not_a_date_time)) {
-			_starttime = posix_time::microsec_clock::universal_time();
+			_starttime = clock::wall();
 		}
 
 		_uuid = boost::uuids::random_generator()();
@@ -30,6 +30,37 @@ namespace koi {
 
     static const int AUTO_RECOVER_MAX_FACTOR = 8;
 
+    // Scheduling class and resource limits for a child process,
+    // applied between fork and exec. Unset fields leave the child
+    // with whatever it inherited from koinode.
+    struct process_limits {
+        static const int NICE_UNSET = 100;
+
+        process_limits();
+
+        bool empty() const;
+        void merge(const process_limits& o); // fields set in o override ours
+        string to_string() const;
+
+        int _nice; // -20..19, NICE_UNSET if unset
+        int _ionice_class; // 1 realtime, 2 best-effort, 3 idle, 0 if unset
+        int _ionice_level; // 0..7
+        uint64_t _cpu_seconds; // RLIMIT_CPU, 0 if unset
+        uint64_t _address_space; // RLIMIT_AS in bytes, 0 if unset
+        std::vector<int> _affinity; // allowed cpus, empty if unset
+    };
+
+    // A resource group is a set of services with its own elected
+    // master. Services not in any group belong to the default group,
+    // which follows the runner master.
+    struct group_config {
+        string _name;
+        std::vector<string> _services;
+        std::vector<string> _avoid; // groups whose master we'd rather not share a node with ("master" for the default group)
+
+        bool avoids(const string& group) const;
+    };
+
     struct settings {
         typedef logging::LogLevels LogLevel;
 
@@ -37,6 +68,10 @@ namespace koi {
         bool  boot(std::vector<string> const& configs, bool verbose = true);
         bool  read_config(const std::vector<string>& configs, bool verbose = true);
         const service_event* svc(const char* name) const;
+        const group_config* group(const string& name) const;
+        string group_for(const string& service) const; // "" for the default group
+        process_limits limits_for(const string& service, const string& event) const;
+        uint64_t stall_threshold() const; // usecs a main loop phase may take, 0 for no limit
 
         // node
         ptime       _starttime;
@@ -53,9 +88,27 @@ namespace koi {
         uint64_t    _boot_count;
         bool        _reuse_address; // set SO_REUSEADDR option
         bool        _incremental_port; // use port+1 if port is busy (mostly good for runners)
+        bool        _io_thread; // receive, decode, encode and send on a separate thread
         LogLevel    _loglevel; // trace / info / warn / error
+        uint32_t    _log_rate; // messages per second from one log call site, 0 for no limit
+        uint32_t    _log_burst; // messages one log call site may send at once
         int         _cluster_id;
         int         _cluster_quorum; // if > 0, only promote (/stay promoted) if nnodes >= _cluster_quorum
+        uint32_t    _node_weight; // relative preference when electing a master
+        int         _reserve_cpu; // cpu kept for the koinode main loop, -1 for none
+        string      _journal; // state transition journal, KOI_VARLIB/<name>.journal if empty
+        uint32_t    _journal_size; // records per journal file, 0 for no journal
+        string      _metrics_file; // Prometheus textfile written every _metrics_interval, "" for none
+        uint64_t    _metrics_interval;
+        int         _stall_percent; // of the shortest failure timeout, before a main loop phase is flagged as a stall
+
+        // real-time mode, see realtime.hpp
+        bool        _realtime;
+        string      _realtime_policy; // "fifo" or "rr"
+        int         _realtime_priority; // 1..99
+        int         _socket_priority; // SO_PRIORITY for the cluster socket, -1 to leave as is
+        int         _busy_poll; // SO_BUSY_POLL in usecs, 0 for off
+        string      _election_scoring; // "uptime" or "load", see elector::scoring
 
         // cluster
         string        _pass;
@@ -71,6 +124,27 @@ namespace koi {
         service_event _on_promote;
         service_event _on_demote;
         service_event _on_failed;
+        service_event _on_prepare;
+        uint32_t      _service_max_concurrency; // running service commands before status checks wait, 0 for no limit
+        int           _service_status_jitter; // status checks vary by +/- this percent of the interval
+        uint32_t      _service_output_lines; // recent output lines kept per service:event, 0 to keep none
+        bool          _service_log_output; // also write service script output to the log
+
+        // adaptive timeouts: once enough durations are known for a
+        // service event, time out at factor * percentile of them,
+        // no lower than the minimum and no higher than the event timeout
+        bool          _adaptive_timeouts;
+        int           _adaptive_timeout_percentile;
+        int           _adaptive_timeout_factor;
+        uint32_t      _adaptive_timeout_samples;
+        uint64_t      _adaptive_timeout_min;
+
+        // scheduling and resource limits for service scripts, by
+        // "" (all scripts), event, service or service:event
+        std::map<string, process_limits> _script_limits;
+
+        // resource groups
+        std::vector<group_config> _groups;
 
         // timeouts and intervals
         // all in microseconds
@@ -87,6 +161,10 @@ namespace koi {
         // how often the runner sends health reports
         uint64_t _runner_tick_interval;
 
+        // minimum time between event-triggered health reports;
+        // events within the window are sent as one report
+        uint64_t _runner_report_holdoff;
+
         // how often the elector sends state updates
         uint64_t _elector_tick_interval;
 
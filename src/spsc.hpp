@@ -0,0 +1,65 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+namespace koi {
+	// Single producer, single consumer ring buffer. One thread may
+	// push and one other thread may pop without any locking; N must
+	// be a power of two.
+	template <typename T, size_t N>
+	struct spsc_ring {
+		static_assert((N & (N - 1)) == 0, "spsc_ring size must be a power of two");
+
+		spsc_ring() : _head(0), _tail(0) {}
+
+		// producer: false if the ring is full
+		bool push(const T& item) {
+			const size_t tail = _tail.load(std::memory_order_relaxed);
+			if (tail - _head.load(std::memory_order_acquire) >= N)
+				return false;
+			_items[tail & (N - 1)] = item;
+			_tail.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+
+		// consumer: false if the ring is empty
+		bool pop(T& item) {
+			const size_t head = _head.load(std::memory_order_relaxed);
+			if (head == _tail.load(std::memory_order_acquire))
+				return false;
+			item = std::move(_items[head & (N - 1)]);
+			_head.store(head + 1, std::memory_order_release);
+			return true;
+		}
+
+		bool empty() const {
+			return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+		}
+
+		size_t size() const {
+			return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire);
+		}
+
+		T _items[N];
+		std::atomic<size_t> _head; // next slot to pop
+		char _pad[64]; // keep producer and consumer off the same cache line
+		std::atomic<size_t> _tail; // next slot to push
+	};
+}
@@ -0,0 +1,188 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "koi.hpp"
+#include "timer_wheel.hpp"
+
+namespace koi {
+	const uint64_t timer_wheel::TICK;
+	const int timer_wheel::LEVELS;
+	const int timer_wheel::SLOT_BITS;
+	const uint64_t timer_wheel::SLOTS;
+	const uint64_t timer_wheel::NEVER;
+
+	namespace {
+		uint64_t ticks_up(uint64_t usec) {
+			return (usec + timer_wheel::TICK - 1) / timer_wheel::TICK;
+		}
+
+		// jumps further than this re-sort the timers instead of
+		// stepping through every tick
+		const uint64_t MAX_STEP = timer_wheel::SLOTS * timer_wheel::SLOTS;
+	}
+
+	timer_wheel::timer_wheel(uint64_t now)
+		: _tick(now / TICK), _next_id(1) {
+	}
+
+	timer_wheel::timer_id timer_wheel::schedule(uint64_t delay, const callback& fn) {
+		return schedule_at(now() + delay, fn);
+	}
+
+	timer_wheel::timer_id timer_wheel::schedule_at(uint64_t when, const callback& fn) {
+		const timer_id id = _next_id++;
+		timer& t = _timers[id];
+		t._expires = std::max(ticks_up(when), _tick + 1);
+		t._interval = 0;
+		t._fn = fn;
+		_insert(id, t._expires);
+		return id;
+	}
+
+	timer_wheel::timer_id timer_wheel::schedule_every(uint64_t interval, const callback& fn, uint64_t first) {
+		const timer_id id = schedule((first == NEVER) ? interval : first, fn);
+		_timers[id]._interval = std::max(ticks_up(interval), UINT64_C(1));
+		return id;
+	}
+
+	bool timer_wheel::cancel(timer_id id) {
+		return _timers.erase(id) > 0;
+	}
+
+	bool timer_wheel::pending(timer_id id) const {
+		return _timers.find(id) != _timers.end();
+	}
+
+	void timer_wheel::_insert(timer_id id, uint64_t expires) {
+		const uint64_t delta = (expires > _tick) ? expires - _tick : 0;
+		for (int level = 0; level < LEVELS; ++level) {
+			if (delta < (SLOTS << (level * SLOT_BITS))) {
+				const uint64_t s = (expires >> (level * SLOT_BITS)) & (SLOTS - 1);
+				_wheel[level][s].push_back(id);
+				return;
+			}
+		}
+		_overflow.push_back(id);
+	}
+
+	// move the timers in the slot of this level that just came up
+	// down to where they belong now
+	void timer_wheel::_cascade(int level) {
+		slot moving;
+		if (level < LEVELS) {
+			const uint64_t s = (_tick >> (level * SLOT_BITS)) & (SLOTS - 1);
+			moving.swap(_wheel[level][s]);
+		}
+		else {
+			moving.swap(_overflow);
+		}
+		FOREACH(timer_id id, moving) {
+			auto t = _timers.find(id);
+			if (t != _timers.end())
+				_insert(id, t->second._expires);
+		}
+	}
+
+	void timer_wheel::_rebase(uint64_t tick) {
+		for (int level = 0; level < LEVELS; ++level)
+			for (uint64_t s = 0; s < SLOTS; ++s)
+				_wheel[level][s].clear();
+		_overflow.clear();
+		// keep the time left on each timer if the clock went backwards
+		if (tick < _tick) {
+			FOREACH(auto& t, _timers)
+				t.second._expires = tick + (t.second._expires > _tick ? t.second._expires - _tick : 0);
+		}
+		_tick = tick;
+		FOREACH(const auto& t, _timers)
+			_insert(t.first, t.second._expires);
+	}
+
+	void timer_wheel::_fire(slot& due, size_t& count) {
+		FOREACH(timer_id id, due) {
+			auto t = _timers.find(id);
+			if (t == _timers.end())
+				continue;
+			if (t->second._expires > _tick) {
+				_insert(id, t->second._expires);
+				continue;
+			}
+			const callback fn = t->second._fn;
+			if (t->second._interval) {
+				t->second._expires = _tick + t->second._interval;
+				_insert(id, t->second._expires);
+			}
+			else {
+				_timers.erase(t);
+			}
+			++count;
+			fn();
+		}
+	}
+
+	size_t timer_wheel::advance(uint64_t now) {
+		const uint64_t target = now / TICK;
+		size_t count = 0;
+
+		if (_timers.empty()) {
+			_tick = std::max(_tick, target);
+			return 0;
+		}
+
+		if (target < _tick || target - _tick > MAX_STEP) {
+			_rebase(target);
+			// everything that expired during the jump is in level 0 now
+			slot due;
+			for (uint64_t s = 0; s < SLOTS; ++s)
+				due.splice(due.end(), _wheel[0][s]);
+			_fire(due, count);
+			return count;
+		}
+
+		while (_tick < target) {
+			++_tick;
+			for (int level = 1; level <= LEVELS; ++level) {
+				if ((_tick & ((UINT64_C(1) << (level * SLOT_BITS)) - 1)) != 0)
+					break;
+				_cascade(level);
+			}
+			slot due;
+			due.swap(_wheel[0][_tick & (SLOTS - 1)]);
+			_fire(due, count);
+		}
+		return count;
+	}
+
+	uint64_t timer_wheel::next_deadline() const {
+		if (_timers.empty())
+			return NEVER;
+
+		// timers in the higher levels expire at the next level 0 wrap
+		// or later, so until then the level 0 slots are exact
+		const uint64_t wrap = (_tick | (SLOTS - 1)) + 1;
+		for (uint64_t t = _tick + 1; t <= wrap; ++t) {
+			FOREACH(timer_id id, _wheel[0][t & (SLOTS - 1)]) {
+				if (_timers.find(id) != _timers.end())
+					return t * TICK;
+			}
+		}
+
+		uint64_t earliest = NEVER;
+		FOREACH(const auto& t, _timers)
+			earliest = std::min(earliest, t.second._expires);
+		return earliest * TICK;
+	}
+}
@@ -0,0 +1,81 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <boost/function.hpp>
+
+namespace koi {
+	/*
+	 * Hierarchical timer wheel for periodic work on the main loop.
+	 *
+	 * Times are absolute, in microseconds as from clock::usecs(),
+	 * rounded up to TICK.
+	 * Level 0 has one slot per tick; each higher level has slots
+	 * SLOTS times as wide, and its timers cascade down a level as
+	 * their slot comes up. advance() only touches the slots it
+	 * passes, so a main loop iteration pays for the timers that
+	 * expired, and next_deadline() says how long it may sleep.
+	 *
+	 * Cancelled timers are dropped lazily when their slot comes up.
+	 */
+	struct timer_wheel {
+		typedef boost::function<void()> callback;
+		typedef uint64_t timer_id; // 0 is never a valid id
+
+		static const uint64_t TICK = 1000; // usecs
+		static const int LEVELS = 4;
+		static const int SLOT_BITS = 6;
+		static const uint64_t SLOTS = 1 << SLOT_BITS;
+		static const uint64_t NEVER = ~UINT64_C(0);
+
+		timer_wheel(uint64_t now);
+
+		timer_id schedule(uint64_t delay, const callback& fn);
+		timer_id schedule_at(uint64_t when, const callback& fn);
+		// first call after one interval, unless first is given
+		timer_id schedule_every(uint64_t interval, const callback& fn, uint64_t first = NEVER);
+		bool cancel(timer_id id); // false if not pending
+		bool pending(timer_id id) const;
+
+		size_t advance(uint64_t now); // run expired timers, returns how many ran
+		uint64_t next_deadline() const; // NEVER if nothing is scheduled
+		uint64_t now() const { return _tick * TICK; }
+		size_t size() const { return _timers.size(); }
+
+		struct timer {
+			uint64_t _expires; // in ticks
+			uint64_t _interval; // in ticks, 0 for one-shot
+			callback _fn;
+		};
+		typedef std::map<timer_id, timer> timers;
+		typedef std::list<timer_id> slot;
+
+		void _insert(timer_id id, uint64_t expires);
+		void _cascade(int level);
+		void _rebase(uint64_t tick);
+		void _fire(slot& due, size_t& count);
+
+		uint64_t _tick; // current time in ticks
+		timer_id _next_id;
+		timers   _timers;
+		slot     _wheel[LEVELS][SLOTS];
+		slot     _overflow; // beyond the top level
+	};
+}
@@ -0,0 +1,160 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "koi.hpp"
+#include "trace.hpp"
+#include "msg.hpp"
+#include "strfmt.hpp"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <sstream>
+
+namespace koi {
+	const size_t failover_trace::LIMIT;
+
+	namespace {
+		const char* phase_names[] = {
+			"report_lost",
+			"disconnected",
+			"elected",
+			"stateupdate",
+			"promoted"
+		};
+
+		bool earlier(const failover_trace::mark& a, const failover_trace::mark& b) {
+			if (a._epoch != b._epoch)
+				return a._epoch < b._epoch;
+			if (a._time != b._time)
+				return a._time < b._time;
+			if (a._phase != b._phase)
+				return a._phase < b._phase;
+			return a._node < b._node;
+		}
+
+		bool same(const failover_trace::mark& a, const failover_trace::mark& b) {
+			return a._epoch == b._epoch && a._time == b._time &&
+				a._phase == b._phase && a._node == b._node;
+		}
+
+		string quoted(const string& s) {
+			string ret("\"");
+			FOREACH(char c, s) {
+				if (c == '"' || c == '\\')
+					ret += '\\';
+				if ((unsigned char)c >= 0x20)
+					ret += c;
+			}
+			return ret + "\"";
+		}
+	}
+
+	string failover_trace::mark::to_string() const {
+		return strfmt<256>("%llu %s %llu %s",
+		                   (unsigned long long)_epoch, phase_name(_phase),
+		                   (unsigned long long)_time, _node.c_str()).str();
+	}
+
+	bool failover_trace::mark::parse(const string& s, mark& to) {
+		std::istringstream ss(s);
+		string phase;
+		if (!(ss >> to._epoch >> phase >> to._time >> to._node))
+			return false;
+		for (int i = 0; i < Ph_NumPhases; ++i) {
+			if (phase == phase_names[i]) {
+				to._phase = i;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void failover_trace::add(uint64_t epoch, Phase phase, uint64_t time, const string& node) {
+		mark m;
+		m._epoch = epoch;
+		m._phase = phase;
+		m._time = time;
+		m._node = node;
+		_marks.push_back(m);
+		while (_marks.size() > LIMIT)
+			_marks.pop_front();
+		LOG_TRACE("Failover %llu: %s", (unsigned long long)epoch, m.to_string().c_str());
+	}
+
+	std::vector<string> failover_trace::marks(uint64_t epoch, size_t max_bytes) const {
+		std::vector<string> ret;
+		size_t bytes = 0;
+		for (auto m = _marks.rbegin(); m != _marks.rend(); ++m) {
+			if (epoch != 0 && m->_epoch != epoch)
+				continue;
+			string s = m->to_string();
+			if (bytes + s.size() + msg::LIST_ITEM_OVERHEAD > max_bytes)
+				break;
+			bytes += s.size() + msg::LIST_ITEM_OVERHEAD;
+			ret.push_back(s);
+		}
+		std::reverse(ret.begin(), ret.end());
+		return ret;
+	}
+
+	const char* failover_trace::phase_name(int phase) {
+		if (phase < 0 || phase >= Ph_NumPhases)
+			return "unknown";
+		return phase_names[phase];
+	}
+
+	string failover_trace::chrome_json(std::vector<mark> marks) {
+		std::sort(marks.begin(), marks.end(), earlier);
+		marks.erase(std::unique(marks.begin(), marks.end(), same), marks.end());
+
+		std::map<string, int> tids;
+		FOREACH(const mark& m, marks)
+			tids.insert(std::make_pair(m._node, 0));
+		int tid = 0;
+		for (auto i = tids.begin(); i != tids.end(); ++i)
+			i->second = ++tid;
+
+		std::ostringstream out;
+		out << "{\"traceEvents\":[";
+		const char* sep = "\n";
+		int pid = 0;
+		for (size_t i = 0; i < marks.size(); ) {
+			const uint64_t epoch = marks[i]._epoch;
+			++pid;
+			out << sep << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid
+			    << ",\"args\":{\"name\":\"failover " << epoch << "\"}}";
+			sep = ",\n";
+
+			std::set<string> named;
+			uint64_t prev = marks[i]._time;
+			for (; i < marks.size() && marks[i]._epoch == epoch; ++i) {
+				const mark& m = marks[i];
+				if (named.insert(m._node).second)
+					out << sep << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+					    << ",\"tid\":" << tids[m._node]
+					    << ",\"args\":{\"name\":" << quoted(m._node) << "}}";
+				out << sep << "{\"name\":\"" << phase_name(m._phase) << "\",\"cat\":\"failover\",\"ph\":\"X\""
+				    << ",\"pid\":" << pid << ",\"tid\":" << tids[m._node]
+				    << ",\"ts\":" << prev << ",\"dur\":" << (m._time - prev)
+				    << ",\"args\":{\"epoch\":" << epoch << "}}";
+				prev = m._time;
+			}
+		}
+		out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+		return out.str();
+	}
+}
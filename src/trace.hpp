@@ -0,0 +1,72 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+namespace koi {
+	/*
+	 * Failover timelines.
+	 *
+	 * A failover passes through the phases below on two nodes: the
+	 * elector notices that the master is gone and elects another
+	 * runner, and the new master hears about it and promotes its
+	 * services. Each node marks the phases it sees with the time and
+	 * the election epoch, which the elector sends in its state
+	 * updates, so that `koi trace` can collect the marks from all
+	 * nodes and line them up. Epochs are the clock::usecs() time the
+	 * election began, so they keep increasing when the elector moves
+	 * to another node.
+	 */
+	struct failover_trace {
+		enum Phase {
+			Ph_ReportLost, // the last health report from the old master
+			Ph_Disconnected, // the elector marked the old master disconnected or failed
+			Ph_Elected, // the elector picked the new master
+			Ph_StateUpdate, // the new master got the state update naming it
+			Ph_Promoted, // the new master's promote scripts finished
+			Ph_NumPhases
+		};
+
+		struct mark {
+			uint64_t _epoch;
+			int      _phase;
+			uint64_t _time; // usecs
+			string   _node; // where the mark was made
+
+			string to_string() const; // "<epoch> <phase> <time> <node>"
+			static bool parse(const string& s, mark& to);
+		};
+
+		static const size_t LIMIT = 64 * Ph_NumPhases; // marks kept
+
+		void add(uint64_t epoch, Phase phase, uint64_t time, const string& node);
+		// the newest marks that fit in max_bytes of a chive list,
+		// oldest first; only those of the epoch unless it is 0
+		std::vector<string> marks(uint64_t epoch, size_t max_bytes) const;
+
+		static const char* phase_name(int phase);
+
+		// Chrome trace event JSON with one process per epoch and one
+		// thread per node; each phase is a span from the mark before it
+		static string chrome_json(std::vector<mark> marks);
+
+		std::deque<mark> _marks;
+	};
+}
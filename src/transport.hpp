@@ -0,0 +1,43 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#pragma once
+
+#include <vector>
+#include <boost/function.hpp>
+#include "net.hpp"
+
+namespace koi {
+	/*
+	 * Carries the datagrams of a nexus in place of its UDP socket,
+	 * so that many nodes can run in one process; see test/sim.hpp.
+	 *
+	 * open() binds a port and returns the address the node is known
+	 * by. What arrives for that address is passed to the receiver,
+	 * from the thread that drives the transport, with the time it
+	 * arrived in usecs since the epoch (0 if unknown). The receiver
+	 * may change the data, it decrypts it in place.
+	 */
+	struct transport {
+		typedef boost::function<void (std::vector<uint8_t>& data, const net::endpoint& from, uint64_t rx_time)> receiver;
+
+		virtual ~transport() {}
+
+		virtual net::endpoint open(uint16_t port, const receiver& fn) = 0; // port 0 if it is taken
+		virtual void close(const net::endpoint& local) = 0;
+		virtual void send(const net::endpoint& from, const net::endpoint& to, const std::vector<uint8_t>& data) = 0;
+	};
+}
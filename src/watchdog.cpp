@@ -0,0 +1,204 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "koi.hpp"
+#include "watchdog.hpp"
+#include "metrics.hpp"
+#include "clock.hpp"
+#include "strfmt.hpp"
+
+#include <pthread.h>
+#include <unistd.h>
+#include <atomic>
+
+// Stub is needed since pthreads
+// don't know about C++ objects
+extern "C" void* watchdog_run(void* p);
+
+namespace koi {
+	namespace watchdog {
+		namespace {
+			__thread phase* current = 0; // innermost phase of this thread
+			__thread bool watched = false;
+
+			std::atomic<uint64_t> g_threshold(0);
+			std::atomic<uint64_t> g_stalls(0);
+
+			// innermost phase of the watched thread, for the watchdog
+			// thread; the two may be read from different phases,
+			// which only affects the warning text
+			std::atomic<const char*> g_site(0);
+			std::atomic<uint64_t> g_since(0);
+
+			pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER; // guards g_last
+			string g_last; // the last stall
+
+			pthread_t g_thread;
+			bool g_running = false;
+			std::atomic<bool> g_stop(false);
+
+			uint64_t read_usecs() {
+				return clock::usecs(clock::read());
+			}
+
+			void publish(const char* site, uint64_t since) {
+				if (!watched)
+					return;
+				g_site = site;
+				g_since = since;
+			}
+
+			string path(const phase* p) {
+				string s = p->_site._name;
+				for (p = p->_outer; p; p = p->_outer)
+					s = string(p->_site._name) + " > " + s;
+				return s;
+			}
+
+			metrics::histogram& receive_delay() {
+				static metrics::histogram& h =
+					metrics::get_histogram("koi_receive_delay_seconds",
+					                       "Time from the kernel receiving a message to the main loop handling it.");
+				return h;
+			}
+		}
+
+		site::site(const char* name)
+			: _name(name),
+			  _durations(&metrics::get_histogram("koi_mainloop_phase_seconds",
+			                                     "Time spent in each phase of the main loop.",
+			                                     metrics::label("phase", name))),
+			  _stalls(&metrics::get_counter("koi_mainloop_stalls_total",
+			                                "Main loop phases that ran longer than the stall threshold.",
+			                                metrics::label("phase", name))) {
+		}
+
+		phase::phase(site& s) : _site(s), _outer(current), _start(read_usecs()), _stalled(false) {
+			current = this;
+			publish(_site._name, _start);
+		}
+
+		phase::~phase() {
+			const uint64_t now = read_usecs();
+			const uint64_t took = (now > _start) ? now - _start : 0;
+			const uint64_t limit = g_threshold;
+			const bool over = limit > 0 && took > limit;
+
+			current = _outer;
+			_site._durations->observe(took);
+
+			// an outer phase is not blamed for a stall that a nested
+			// phase has already been blamed for
+			if (over && !_stalled) {
+				_site._stalls->add();
+				++g_stalls;
+				const string where = path(this);
+				LOG_WARN("Main loop stalled for %.3fs in %s.", took/1e6, where.c_str());
+				pthread_mutex_lock(&g_lock);
+				g_last = strfmt<256>("%.3fs in %s", took/1e6, where.c_str()).str();
+				pthread_mutex_unlock(&g_lock);
+			}
+			if (_outer) {
+				if (over || _stalled)
+					_outer->_stalled = true;
+				// the stall has been reported, so the watchdog thread
+				// times the outer phase from here
+				publish(_outer->_site._name, over ? now : _outer->_start);
+			}
+			else {
+				publish(0, 0);
+			}
+		}
+
+		void set_threshold(uint64_t usecs) {
+			g_threshold = usecs;
+		}
+
+		uint64_t threshold() {
+			return g_threshold;
+		}
+
+		// warns once per stall, while the watched thread is still in it
+		void run() {
+			uint64_t warned = 0; // since of the last stall warned about
+			while (!g_stop) {
+				const uint64_t limit = g_threshold;
+				usleep((useconds_t)(limit ? std::max<uint64_t>(1000, std::min<uint64_t>(limit/4, 100000)) : 100000));
+				const uint64_t since = g_since;
+				const char* site = g_site;
+				if (!limit || !since || !site || since <= warned)
+					continue;
+				const uint64_t now = read_usecs();
+				if (now > since && now - since > limit) {
+					LOG_WARN("Main loop stalled for %.3fs so far in %s.", (now - since)/1e6, site);
+					warned = since;
+				}
+			}
+		}
+
+		void start() {
+			watched = true;
+			if (g_running)
+				return;
+			g_stop = false;
+			if (pthread_create(&g_thread, 0, &watchdog_run, 0) != 0) {
+				LOG_ERROR("Failed to start the watchdog thread, stalls are reported when they end.");
+				return;
+			}
+			g_running = true;
+		}
+
+		void stop() {
+			if (g_running) {
+				g_stop = true;
+				pthread_join(g_thread, 0);
+				g_running = false;
+			}
+			watched = false;
+			g_site = 0;
+			g_since = 0;
+		}
+
+		void received(uint64_t kernel_time) {
+			if (!kernel_time)
+				return;
+			const uint64_t now = clock::usecs(clock::wall());
+			receive_delay().observe((now > kernel_time) ? now - kernel_time : 0);
+		}
+
+		uint64_t stalls() {
+			return g_stalls;
+		}
+
+		string summary() {
+			const uint64_t limit = g_threshold;
+			if (!limit)
+				return "off";
+			pthread_mutex_lock(&g_lock);
+			const string last = g_last;
+			pthread_mutex_unlock(&g_lock);
+			string s = strfmt<64>("%u over %.3fs", (unsigned)g_stalls, limit/1e6).str();
+			if (!last.empty())
+				s += ", last " + last;
+			return s;
+		}
+	}
+}
+
+extern "C" void* watchdog_run(void*) {
+	koi::watchdog::run();
+	return 0;
+}
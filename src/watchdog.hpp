@@ -0,0 +1,86 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#pragma once
+
+#include <stdint.h>
+
+namespace koi {
+	namespace metrics {
+		struct counter;
+		struct histogram;
+	}
+
+	/*
+	 * Stall detection for the main loop.
+	 *
+	 * The main loop, and the calls in it that can block (service
+	 * commands, the wait_for_* loops), are split into phases with
+	 * WATCHDOG_PHASE. Each phase has a histogram of how long it took.
+	 * A phase that runs longer than the threshold is logged and
+	 * counted as a stall of the innermost phase that ran too long,
+	 * which names the call that blocked. The threshold is
+	 * node.stall_percent of the shortest failure timeout, see
+	 * settings::stall_threshold(): a main loop that stalls for that
+	 * long is close to missing its health reports and state updates.
+	 *
+	 * start() runs a thread that warns while the main loop is still
+	 * stalled, so a call that never returns is reported as well.
+	 * Phases are timed on any thread, but only those of the thread
+	 * that called start() are watched.
+	 *
+	 * received() measures the queueing delay of incoming messages,
+	 * from the kernel receive timestamp (SO_TIMESTAMPNS) to the main
+	 * loop handling them.
+	 */
+	namespace watchdog {
+		// a phase name with its metrics, one per call site
+		struct site {
+			site(const char* name);
+
+			const char* _name;
+			metrics::histogram* _durations;
+			metrics::counter* _stalls;
+		};
+
+		// times the enclosing scope as a phase of the calling thread
+		struct phase {
+			phase(site& s);
+			~phase();
+
+			site& _site;
+			phase* _outer;
+			uint64_t _start; // usecs
+			bool _stalled; // this or a nested phase was flagged
+		};
+
+		void set_threshold(uint64_t usecs); // 0 turns stall detection off
+		uint64_t threshold();
+
+		void start(); // watch the calling thread
+		void stop();
+
+		void received(uint64_t kernel_time); // usecs since the epoch, 0 if unknown
+
+		uint64_t stalls();
+		string summary(); // stall count and the last stall
+	}
+}
+
+// one phase per scope
+#define WATCHDOG_PHASE(name) \
+	static koi::watchdog::site _koi_watchdog_site(name); \
+	koi::watchdog::phase _koi_watchdog_phase(_koi_watchdog_site)
@@ -25,6 +25,7 @@ using namespace boost::property_tree;
 namespace koi {
 	net::endpoint parse_endpoint(const char* str, uint16_t port);
 	void readtime(const ptree& tr, uint64_t& t, const char* s);
+	void readlimits(const ptree& tr, process_limits& l);
 }
 
 using namespace koi;
@@ -82,3 +83,39 @@ TEST_CASE("boot/readtime", "test for time suffix parsing") {
 	readtime(pt, t, "e");
 	REQUIRE(t == (uint64_t)3*60*60*units::micro);
 }
+
+TEST_CASE("boot/limits", "service script limits by service and event") {
+	ptree pt;
+	std::stringstream ss(
+	                     "nice 5\n"
+	                     "ionice best-effort:6\n"
+	                     "cpu 1500ms\n"
+	                     "memory 512M\n"
+	                     "affinity 0-1,3\n");
+	info_parser::read_info(ss, pt);
+	process_limits l;
+	REQUIRE(l.empty());
+	readlimits(pt, l);
+	REQUIRE(l._nice == 5);
+	REQUIRE(l._ionice_class == 2);
+	REQUIRE(l._ionice_level == 6);
+	REQUIRE(l._cpu_seconds == 2);
+	REQUIRE(l._address_space == (uint64_t)512*1024*1024);
+	REQUIRE(l._affinity.size() == 3);
+	REQUIRE(l._affinity[2] == 3);
+
+	settings cfg;
+	cfg._script_limits[""]._nice = 5;
+	cfg._script_limits["status"]._nice = 10;
+	cfg._script_limits["status"]._cpu_seconds = 30;
+	cfg._script_limits["00-psm"]._nice = 0;
+	cfg._script_limits["00-psm:status"]._cpu_seconds = 5;
+
+	REQUIRE(cfg.limits_for("01-vip", "start")._nice == 5);
+	REQUIRE(cfg.limits_for("01-vip", "status")._nice == 10);
+	REQUIRE(cfg.limits_for("01-vip", "status")._cpu_seconds == 30);
+	REQUIRE(cfg.limits_for("00-psm", "status")._nice == 0);
+	REQUIRE(cfg.limits_for("00-psm", "status")._cpu_seconds == 5);
+	REQUIRE(cfg.limits_for("00-psm", "start")._cpu_seconds == 0);
+	REQUIRE(cfg.limits_for("00-psm", "start")._affinity.empty());
+}
@@ -0,0 +1,85 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "test.hpp"
+
+#include <pthread.h>
+#include <unistd.h>
+
+using namespace koi;
+using namespace boost::posix_time;
+
+namespace {
+	// tick() caches the time for the calling thread only,
+	// so keep it off the thread running the other tests
+	void* iteration(void* p) {
+		bool* ok = static_cast<bool*>(p);
+		clock::tick();
+		const ptime t0 = clock::now();
+		usleep(2000);
+		*ok = clock::now() == t0 && clock::read() > t0;
+		clock::refresh();
+		*ok = *ok && clock::now() > t0;
+		return 0;
+	}
+}
+
+TEST_CASE("clock/monotonic", "the clock never runs backwards and is close to the wall clock") {
+	REQUIRE(!clock::is_virtual());
+	ptime prev = clock::now();
+	for (int i = 0; i < 1000; ++i) {
+		const ptime t = clock::now();
+		REQUIRE(t >= prev);
+		prev = t;
+	}
+	REQUIRE(abs((clock::now() - clock::wall()).total_seconds()) < 5);
+}
+
+TEST_CASE("clock/tick", "the time is cached for a main loop iteration") {
+	bool ok = false;
+	pthread_t thread;
+	REQUIRE(pthread_create(&thread, 0, iteration, &ok) == 0);
+	pthread_join(thread, 0);
+	REQUIRE(ok);
+}
+
+TEST_CASE("clock/virtual", "a virtual clock only moves when advanced") {
+	const ptime t0(boost::gregorian::date(2012, 6, 1));
+	{
+		virtual_clock vc;
+		clock::set(t0);
+		usleep(1000);
+		REQUIRE(clock::now() == t0);
+		REQUIRE(clock::read() == t0);
+		clock::advance(1500*units::milli);
+		REQUIRE(clock::now() == t0 + milliseconds(1500));
+		REQUIRE(clock::usecs() == clock::usecs(t0) + 1500*units::milli);
+	}
+	REQUIRE(!clock::is_virtual());
+	REQUIRE(clock::now() > t0);
+}
+
+TEST_CASE("clock/wall", "times sent to other nodes convert to and from the wall clock") {
+	const ptime t = clock::now() - seconds(10);
+	const ptime w = clock::to_wall(t);
+	REQUIRE(abs((clock::wall() - w).total_milliseconds() - 10000) < 100);
+	REQUIRE(abs((clock::from_wall(w) - t).total_milliseconds()) < 100);
+
+	const ptime never(boost::date_time::min_date_time);
+	REQUIRE(clock::to_wall(never) == never);
+	REQUIRE(clock::from_wall(never) == never);
+	REQUIRE(clock::to_wall(ptime(not_a_date_time)).is_not_a_date_time());
+}
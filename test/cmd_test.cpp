@@ -0,0 +1,35 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "test.hpp"
+#include "cmd.hpp"
+
+using namespace std;
+using namespace koi;
+
+TEST_CASE("cmd/termkill", "a command that ignores SIGTERM is killed and reaped") {
+	char sh[] = "/bin/sh";
+	char c[] = "-c";
+	char script[] = "trap '' TERM; exec sleep 10";
+	char* av[] = { sh, c, script, 0 };
+	command cmd;
+	cmd.begin(av, "/tmp");
+	REQUIRE(cmd.is_active());
+	REQUIRE(cmd.termkill(100000));
+	REQUIRE(!cmd.is_active());
+	REQUIRE(!cmd.exited);
+	REQUIRE(cmd.finished_at != ptime(boost::date_time::min_date_time));
+}
@@ -42,7 +42,7 @@ TEST_CASE("elector/promote", "test successful node promotion") {
 	nexus ro(io_service, cfg);
 
 	elector a(ro);
-	ok = a.init(microsec_clock::universal_time());
+	ok = a.init(clock::now());
 	REQUIRE(ok);
 
 	a.start();
@@ -50,7 +50,7 @@ TEST_CASE("elector/promote", "test successful node promotion") {
 	a.update();
 
 	elector::runner_info r;
-	ptime now = microsec_clock::universal_time();
+	ptime now = clock::now();
 	r._last_seen = now;
 	r._last_failed = ptime(min_date_time);
 	r._name = "test";
@@ -69,3 +69,345 @@ TEST_CASE("elector/promote", "test successful node promotion") {
 	a.stop();
 }
 
+
+TEST_CASE("elector/handoff", "promote the new master when the old master acknowledges demotion") {
+	using namespace koi;
+	using namespace std;
+	using namespace boost;
+	using namespace boost::posix_time;
+
+	std::vector<std::string> configs;
+	configs << "../test/test.conf";
+	settings cfg;
+	bool ok = cfg.boot(configs, false);
+	REQUIRE(ok);
+
+	net::io_service io_service;
+
+	nexus ro(io_service, cfg);
+
+	elector a(ro);
+	ok = a.init(clock::now());
+	REQUIRE(ok);
+
+	a.start();
+
+	ptime now = clock::now();
+	elector::runner_info r;
+	r._last_seen = now;
+	r._last_failed = ptime(min_date_time);
+	r._uptime = 20000;
+	r._mode = R_Active;
+	r._maintenance = false;
+
+	r._name = "old";
+	r._uuid = uuids::random_generator()();
+	r._state = S_Master;
+	r._services.push_back(service_info("svc", "none", Svc_Promoted, false));
+	r._endpoints.insert(net::endpoint(net::ipaddr(), 6666));
+	auto old_master = a._runners.insert(make_pair(r._uuid, r)).first;
+
+	r._name = "new";
+	r._uuid = uuids::random_generator()();
+	r._state = S_Slave;
+	r._services.clear();
+	r._services.push_back(service_info("svc", "none", Svc_Started, false));
+	r._endpoints.insert(net::endpoint(net::ipaddr(), 6667));
+	auto new_master = a._runners.insert(make_pair(r._uuid, r)).first;
+
+	a._master = old_master;
+
+	ok = a.promote_node("new");
+	REQUIRE(ok);
+	REQUIRE(a._handoff._active);
+	REQUIRE(a._master == a._runners.end());
+
+	// old master still demoting
+	message m(old_master->first, cfg._cluster_id, msg::base::HealthReport);
+	m._from = net::endpoint(net::ipaddr(), 6666);
+	auto hr = m.set_body<msg::healthreport>();
+	hr->_name = "old";
+	hr->_uptime = 20000;
+	hr->_state = S_Slave;
+	hr->_mode = R_Active;
+	hr->_maintenance = false;
+	hr->_service_action = Svc_Demote;
+	hr->_services.push_back(service_info("svc", "demote", Svc_Demoting, false));
+	a.handle(m);
+	REQUIRE(a._handoff._active);
+	REQUIRE(a._master == a._runners.end());
+
+	// demotion acknowledged
+	hr->_services[0] = service_info("svc", "none", Svc_Started, false);
+	a.handle(m);
+	REQUIRE(!a._handoff._active);
+	REQUIRE(a._master == new_master);
+
+	a.stop();
+}
+
+TEST_CASE("elector/dirty", "only evaluate the election when an input changes") {
+	using namespace koi;
+	using namespace std;
+	using namespace boost;
+	using namespace boost::posix_time;
+
+	std::vector<std::string> configs;
+	configs << "../test/test.conf";
+	settings cfg;
+	bool ok = cfg.boot(configs, false);
+	REQUIRE(ok);
+
+	net::io_service io_service;
+
+	nexus ro(io_service, cfg);
+
+	elector a(ro);
+	ok = a.init(clock::now());
+	REQUIRE(ok);
+
+	a.start();
+
+	a.update();
+	const uint64_t evaluations = a._stats._evaluations;
+	REQUIRE(evaluations > 0);
+
+	// nothing has changed
+	a.update();
+	a.update();
+	REQUIRE(a._stats._evaluations == evaluations);
+	REQUIRE(a._stats._passes == 3);
+
+	// a new runner reports in
+	uuid other = uuids::random_generator()();
+	message m(other, cfg._cluster_id, msg::base::HealthReport);
+	m._from = net::endpoint(net::ipaddr(), 6666);
+	auto hr = m.set_body<msg::healthreport>();
+	hr->_name = "other";
+	hr->_uptime = 20000;
+	hr->_state = S_Slave;
+	hr->_mode = R_Active;
+	hr->_maintenance = false;
+	hr->_service_action = Svc_Start;
+	a.handle(m);
+	a.update();
+	REQUIRE(a._stats._evaluations == evaluations + 1);
+	REQUIRE(a._stats._decisions > 0);
+
+	// the same report again is not an input change
+	hr->_uptime = 21000;
+	a.handle(m);
+	a.update();
+	REQUIRE(a._stats._evaluations == evaluations + 1);
+
+	a.stop();
+}
+
+TEST_CASE("elector/load_scoring", "elect the least loaded runner") {
+	using namespace koi;
+	using namespace std;
+	using namespace boost;
+	using namespace boost::posix_time;
+
+	std::vector<std::string> configs;
+	configs << "../test/test.conf";
+	settings cfg;
+	bool ok = cfg.boot(configs, false);
+	REQUIRE(ok);
+	cfg._cluster_maintenance = false;
+	cfg._election_scoring = "load";
+
+	net::io_service io_service;
+
+	nexus ro(io_service, cfg);
+
+	ptime now = clock::now();
+	elector a(ro);
+	ok = a.init(now - hours(1));
+	REQUIRE(ok);
+	a._leadertime = now - hours(1);
+
+	elector::runner_info r;
+	r._last_seen = now;
+	r._last_failed = ptime(min_date_time);
+	r._mode = R_Active;
+	r._maintenance = false;
+	r._state = S_Slave;
+	r._load._valid = true;
+	r._load._memfree = 4096;
+	r._endpoints.insert(net::endpoint(net::ipaddr(), 6666));
+
+	// longest uptime, but overloaded
+	r._name = "busy";
+	r._uuid = uuids::random_generator()();
+	r._uptime = 50000;
+	r._load._loadavg = 300;
+	auto busy = a._runners.insert(make_pair(r._uuid, r)).first;
+
+	r._name = "idle";
+	r._uuid = uuids::random_generator()();
+	r._uptime = 20000;
+	r._load._loadavg = 10;
+	auto idle = a._runners.insert(make_pair(r._uuid, r)).first;
+
+	a._election(now, 0);
+	REQUIRE(a._master == idle);
+
+	// uptime scoring keeps the old behavior
+	a._master = a._runners.end();
+	a._set_scoring("uptime");
+	a._election(now, 0);
+	REQUIRE(a._master == busy);
+
+	// low on memory
+	a._master = a._runners.end();
+	a._set_scoring("load");
+	idle->second._load._memfree = 16;
+	a._election(now, 0);
+	REQUIRE(a._master == busy);
+
+	elector::scoring_fn fn;
+	REQUIRE(!elector::scoring("nonsense", fn));
+}
+
+TEST_CASE("elector/groups", "spread resource group masters over the runners") {
+	using namespace koi;
+	using namespace std;
+	using namespace boost;
+	using namespace boost::posix_time;
+
+	std::vector<std::string> configs;
+	configs << "../test/test.conf";
+	settings cfg;
+	bool ok = cfg.boot(configs, false);
+	REQUIRE(ok);
+	cfg._cluster_maintenance = false;
+
+	group_config db;
+	db._name = "db";
+	db._services.push_back("pg");
+	cfg._groups.push_back(db);
+
+	group_config web;
+	web._name = "web";
+	web._services.push_back("nginx");
+	web._avoid.push_back("db");
+	cfg._groups.push_back(web);
+
+	net::io_service io_service;
+
+	nexus ro(io_service, cfg);
+
+	ptime now = clock::now();
+	elector a(ro);
+	ok = a.init(now - hours(1));
+	REQUIRE(ok);
+	a._leadertime = now - hours(1);
+
+	elector::runner_info r;
+	r._last_seen = now;
+	r._last_failed = ptime(min_date_time);
+	r._mode = R_Active;
+	r._maintenance = false;
+	r._uptime = 20000;
+	r._endpoints.insert(net::endpoint(net::ipaddr(), 6666));
+	r._services.push_back(service_info("svc", "none", Svc_Promoted, false));
+	r._services.push_back(service_info("pg", "none", Svc_Started, false, "db"));
+	r._services.push_back(service_info("nginx", "none", Svc_Started, false, "web"));
+
+	r._name = "a";
+	r._uuid = uuids::random_generator()();
+	r._state = S_Master;
+	auto ra = a._runners.insert(make_pair(r._uuid, r)).first;
+
+	r._name = "b";
+	r._uuid = uuids::random_generator()();
+	r._state = S_Slave;
+	r._services[0]._state = Svc_Started;
+	auto rb = a._runners.insert(make_pair(r._uuid, r)).first;
+
+	a._master = ra;
+
+	ok = a._elect_groups(now);
+	REQUIRE(ok);
+	// db goes to the runner without masterships, web avoids db
+	REQUIRE(a._group_masters["db"] == rb);
+	REQUIRE(a._group_masters["web"] == ra);
+
+	// stable when nothing changes
+	REQUIRE(!a._elect_groups(now));
+
+	// db fails over when its services fail on b
+	rb->second._services[1]._failed = true;
+	ok = a._elect_groups(now);
+	REQUIRE(ok);
+	REQUIRE(a._group_masters["db"] == ra);
+
+	message m;
+	a.on_tick(&m);
+	REQUIRE(m.body<msg::stateupdate>()->_groups.size() == 2);
+}
+
+TEST_CASE("elector/prepare", "prepare the next master and prefer prepared runners") {
+	using namespace koi;
+	using namespace std;
+	using namespace boost;
+	using namespace boost::posix_time;
+
+	std::vector<std::string> configs;
+	configs << "../test/test.conf";
+	settings cfg;
+	bool ok = cfg.boot(configs, false);
+	REQUIRE(ok);
+	cfg._cluster_maintenance = false;
+
+	net::io_service io_service;
+
+	nexus ro(io_service, cfg);
+
+	ptime now = clock::now();
+	elector a(ro);
+	ok = a.init(now - hours(1));
+	REQUIRE(ok);
+	a._leadertime = now - hours(1);
+
+	elector::runner_info r;
+	r._last_seen = now;
+	r._last_failed = ptime(min_date_time);
+	r._mode = R_Active;
+	r._maintenance = false;
+	r._state = S_Slave;
+	r._endpoints.insert(net::endpoint(net::ipaddr(), 6666));
+
+	r._name = "master";
+	r._uuid = uuids::random_generator()();
+	r._uptime = 90000;
+	r._state = S_Master;
+	auto master = a._runners.insert(make_pair(r._uuid, r)).first;
+
+	r._state = S_Slave;
+	r._name = "old";
+	r._uuid = uuids::random_generator()();
+	r._uptime = 50000;
+	auto old = a._runners.insert(make_pair(r._uuid, r)).first;
+
+	r._name = "young";
+	r._uuid = uuids::random_generator()();
+	r._uptime = 20000;
+	auto young = a._runners.insert(make_pair(r._uuid, r)).first;
+
+	a._master = master;
+	REQUIRE(a._choose_prepare_target(now));
+	REQUIRE(a._prepare_target == old);
+
+	message m;
+	a.on_tick(&m);
+	REQUIRE(m.body<msg::stateupdate>()->_prepare_uuid == old->first);
+
+	// the prepared runner wins the election
+	young->second._prepared = true;
+	a._master = a._runners.end();
+	master->second._state = S_Disconnected;
+	a._election(now, 0);
+	REQUIRE(a._master == young);
+}
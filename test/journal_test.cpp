@@ -0,0 +1,126 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "test.hpp"
+#include "journal.hpp"
+#include "service_info.hpp"
+
+#include <boost/uuid/nil_generator.hpp>
+#include <unistd.h>
+
+using namespace koi;
+
+namespace {
+	struct journal_dir {
+		journal_dir() {
+			char tmpl[] = "/tmp/koi-journal-XXXXXX";
+			_dir = mkdtemp(tmpl);
+			_path = _dir + "/node.journal";
+		}
+		~journal_dir() {
+			unlink(_path.c_str());
+			unlink((_path + ".1").c_str());
+			rmdir(_dir.c_str());
+		}
+		string _dir;
+		string _path;
+	};
+
+	void append_runner(journal& j, int n) {
+		for (int i = 0; i < n; ++i)
+			j.append(journal::Ev_Runner, boost::uuids::nil_uuid(), S_Live, S_Slave, "node");
+	}
+}
+
+TEST_CASE("journal/query", "records are returned in order and filtered by time") {
+	journal_dir dir;
+	virtual_clock vc;
+	journal j;
+	REQUIRE(j.open(dir._path, 16));
+
+	const uint64_t t0 = clock::usecs();
+	j.append(journal::Ev_Runner, boost::uuids::nil_uuid(), S_Live, S_Slave, "node");
+	clock::advance(units::micro);
+	j.append(journal::Ev_Service, boost::uuids::nil_uuid(), Svc_Stopped, Svc_Starting, "00-a-service-with-a-very-long-name");
+	clock::advance(units::micro);
+	j.append(journal::Ev_Cluster, boost::uuids::nil_uuid(), 0, 2);
+
+	std::vector<journal::record> all = j.query(0, ~UINT64_C(0));
+	REQUIRE(all.size() == 3);
+	REQUIRE(all[0]._seq == 0);
+	REQUIRE(all[2]._seq == 2);
+	REQUIRE(all[0]._time == t0);
+	REQUIRE(all[1]._event == journal::Ev_Service);
+	REQUIRE(all[1]._from == Svc_Stopped);
+	REQUIRE(all[1]._to == Svc_Starting);
+
+	const string runner = journal::to_string(all[0]);
+	REQUIRE(runner.find("runner") != string::npos);
+	REQUIRE(runner.find("node: Live -> Slave") != string::npos);
+	REQUIRE(journal::to_string(all[1]).find("00-a-service-with-a-ver") != string::npos);
+	REQUIRE(journal::to_string(all[2]).find("Servant -> Leader") != string::npos);
+
+	std::vector<journal::record> some = j.query(t0 + 1, t0 + 2*units::micro);
+	REQUIRE(some.size() == 1);
+	REQUIRE(some[0]._seq == 1);
+}
+
+TEST_CASE("journal/rotate", "a full journal is rotated and the previous one is kept") {
+	journal_dir dir;
+	journal j;
+	REQUIRE(j.open(dir._path, 4));
+
+	append_runner(j, 6);
+	std::vector<journal::record> r = j.query(0, ~UINT64_C(0));
+	REQUIRE(r.size() == 6);
+	REQUIRE(r.front()._seq == 0);
+	REQUIRE(r.back()._seq == 5);
+
+	append_runner(j, 4);
+	r = j.query(0, ~UINT64_C(0));
+	REQUIRE(r.size() == 6);
+	REQUIRE(r.front()._seq == 4);
+	REQUIRE(r.back()._seq == 9);
+}
+
+TEST_CASE("journal/reopen", "a journal continues where the last run stopped") {
+	journal_dir dir;
+	{
+		journal j;
+		REQUIRE(j.open(dir._path, 8));
+		append_runner(j, 3);
+	}
+	{
+		journal j;
+		REQUIRE(j.open(dir._path, 8));
+		append_runner(j, 1);
+		std::vector<journal::record> r = j.query(0, ~UINT64_C(0));
+		REQUIRE(r.size() == 4);
+		REQUIRE(r.back()._seq == 3);
+	}
+	{
+		// a new size starts a new file, keeping the old one
+		journal j;
+		REQUIRE(j.open(dir._path, 16));
+		std::vector<journal::record> r = j.query(0, ~UINT64_C(0));
+		REQUIRE(r.size() == 4);
+		append_runner(j, 1);
+		REQUIRE(j.query(0, ~UINT64_C(0)).size() == 5);
+	}
+	journal off;
+	REQUIRE(!off.open(dir._path, 0));
+	REQUIRE(!off.is_open());
+}
@@ -0,0 +1,131 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "test.hpp"
+
+#include <pthread.h>
+#include <unistd.h>
+
+using namespace koi;
+
+namespace {
+	const uint32_t THREADS = 4;
+	const uint32_t LINES = 200; // per thread
+
+	void* log_lines(void* p) {
+		for (uint32_t i = 0; i < LINES; ++i)
+			LOG_TRACE("logging/writer %u", i);
+		return 0;
+	}
+
+	bool wait_for_sources(const logging::logproxy& proxy, size_t n) {
+		for (int i = 0; i < 1000 && proxy.sources() != n; ++i)
+			usleep(1000);
+		return proxy.sources() == n;
+	}
+}
+
+TEST_CASE("logging/writer", "messages from several threads all reach the writer") {
+	logging::start_writer();
+	const logging::writer_stats before = logging::stats();
+	REQUIRE(before._running);
+
+	pthread_t threads[THREADS];
+	for (uint32_t i = 0; i < THREADS; ++i)
+		REQUIRE(pthread_create(&threads[i], 0, &log_lines, 0) == 0);
+	for (uint32_t i = 0; i < THREADS; ++i)
+		pthread_join(threads[i], 0);
+	logging::flush();
+
+	const logging::writer_stats after = logging::stats();
+	REQUIRE(after._queued == 0);
+	REQUIRE(after._written + after._dropped + after._suppressed -
+	        before._written - before._dropped - before._suppressed == THREADS * LINES);
+
+	logging::stop_writer();
+	REQUIRE(!logging::stats()._running);
+}
+
+TEST_CASE("logging/ratelimit", "a log call site gets a burst, then its rate") {
+	logging::set_rate_limit(1, 5);
+	logging::rate_limit site;
+	for (int i = 0; i < 5; ++i)
+		REQUIRE(site.allow());
+	REQUIRE(!site.allow());
+	REQUIRE(!site.allow());
+	REQUIRE(site.take_suppressed() == 2);
+	REQUIRE(site.take_suppressed() == 0);
+
+	// both call sites are limited on their own
+	logging::rate_limit other;
+	REQUIRE(other.allow());
+
+	logging::set_rate_limit(0, 0);
+	for (int i = 0; i < 100; ++i)
+		REQUIRE(site.allow());
+
+	// errors get through a site that is over its limit
+	logging::set_rate_limit(1, 1);
+	logging::rate_limit errors;
+	const uint64_t before = logging::stats()._suppressed;
+	logging::log_context(__FILE__, __LINE__, __FUNCTION__, &errors).warn("logging/ratelimit warning");
+	logging::log_context(__FILE__, __LINE__, __FUNCTION__, &errors).warn("logging/ratelimit warning");
+	REQUIRE(logging::stats()._suppressed == before + 1);
+	logging::log_context(__FILE__, __LINE__, __FUNCTION__, &errors).error("logging/ratelimit error");
+	REQUIRE(logging::stats()._suppressed == before + 1);
+
+	logging::set_rate_limit(20, 100);
+}
+
+TEST_CASE("logging/proxy", "one thread logs every pipe until its writers are gone") {
+	logging::logproxy proxy;
+	const int a = proxy.open("00-test:status");
+	const int b = proxy.open("01-test:start");
+	REQUIRE(a >= 0);
+	REQUIRE(b >= 0);
+	REQUIRE(proxy._running);
+	REQUIRE(proxy.sources() == 2);
+
+	const char out[] = "logging/proxy line one\nlogging/proxy line ";
+	REQUIRE(write(a, out, sizeof(out) - 1) == (ssize_t)sizeof(out) - 1);
+	close(a);
+	REQUIRE(wait_for_sources(proxy, 1));
+
+	// restarting the thread keeps the open pipes
+	proxy.restart();
+	REQUIRE(proxy._running);
+	REQUIRE(proxy.sources() == 1);
+	REQUIRE(write(b, "after restart\n", 14) == 14);
+	close(b);
+	REQUIRE(wait_for_sources(proxy, 0));
+
+	// a daemon holding on to the output of each start doesn't pile
+	// up pipes, the oldest is retired
+	std::vector<int> held;
+	for (size_t i = 0; i <= logging::logproxy::MAX_SOURCES_PER_TAG; ++i)
+		held.push_back(proxy.open("02-test:start"));
+	REQUIRE(wait_for_sources(proxy, logging::logproxy::MAX_SOURCES_PER_TAG));
+	const int other = proxy.open("03-test:start");
+	REQUIRE(other >= 0);
+	REQUIRE(proxy.sources() == logging::logproxy::MAX_SOURCES_PER_TAG + 1);
+	held.push_back(other);
+	FOREACH(int fd, held)
+		close(fd);
+
+	proxy.close();
+	REQUIRE(!proxy._running);
+	REQUIRE(proxy._epoll == -1);
+}
@@ -0,0 +1,89 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "test.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+using namespace koi;
+
+namespace {
+	bool has_line(const std::vector<string>& lines, const string& line) {
+		return std::find(lines.begin(), lines.end(), line) != lines.end();
+	}
+
+	int collected = 0;
+
+	void collect() {
+		++collected;
+		metrics::get_gauge("koitest_collected", "Collector calls.").set(collected);
+	}
+}
+
+TEST_CASE("metrics/registry", "metrics are registered once and exported in the text format") {
+	metrics::counter& c = metrics::get_counter("koitest_requests_total", "Requests.", metrics::label("type", "a\"b"));
+	REQUIRE(&c == &metrics::get_counter("koitest_requests_total", "Requests.", metrics::label("type", "a\"b")));
+	c.add();
+	c.add(2);
+	metrics::get_gauge("koitest_level", "Level.").set(-4);
+
+	metrics::histogram& h = metrics::get_histogram("koitest_latency_seconds", "Latency.", metrics::label("event", "status"));
+	h.observe(3);
+	h.observe(700);
+	h.observe(400000000); // beyond the last bound
+
+	std::vector<string> lines = metrics::prometheus("koitest_");
+	REQUIRE(has_line(lines, "# TYPE koitest_requests_total counter"));
+	REQUIRE(has_line(lines, "koitest_requests_total{type=\"a\\\"b\"} 3"));
+	REQUIRE(has_line(lines, "koitest_level -4"));
+	REQUIRE(has_line(lines, "# TYPE koitest_latency_seconds histogram"));
+	REQUIRE(has_line(lines, "koitest_latency_seconds_bucket{event=\"status\",le=\"1e-06\"} 0"));
+	REQUIRE(has_line(lines, "koitest_latency_seconds_bucket{event=\"status\",le=\"5e-06\"} 1"));
+	REQUIRE(has_line(lines, "koitest_latency_seconds_bucket{event=\"status\",le=\"0.001\"} 2"));
+	REQUIRE(has_line(lines, "koitest_latency_seconds_bucket{event=\"status\",le=\"300\"} 2"));
+	REQUIRE(has_line(lines, "koitest_latency_seconds_bucket{event=\"status\",le=\"+Inf\"} 3"));
+	REQUIRE(has_line(lines, "koitest_latency_seconds_count{event=\"status\"} 3"));
+	FOREACH(const string& line, lines)
+		REQUIRE((line.compare(0, 8, "koitest_") == 0 || line[0] == '#'));
+}
+
+TEST_CASE("metrics/textfile", "collectors run before the textfile is written") {
+	const int id = metrics::on_collect(collect);
+	char tmpl[] = "/tmp/koi-metrics-XXXXXX";
+	const string dir = mkdtemp(tmpl);
+	const string path = dir + "/koi.prom";
+
+	REQUIRE(metrics::write_textfile(path));
+	REQUIRE(collected == 1);
+	REQUIRE(access((path + ".tmp").c_str(), F_OK) != 0);
+	{
+		std::ifstream f(path.c_str());
+		std::stringstream text;
+		text << f.rdbuf();
+		REQUIRE(text.str().find("\nkoitest_collected 1\n") != string::npos);
+	}
+
+	metrics::remove_collector(id);
+	metrics::prometheus();
+	REQUIRE(collected == 1);
+	REQUIRE(!metrics::write_textfile(dir + "/missing/koi.prom"));
+
+	unlink(path.c_str());
+	rmdir(dir.c_str());
+}
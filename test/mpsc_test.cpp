@@ -0,0 +1,90 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "test.hpp"
+#include "mpsc.hpp"
+
+#include <pthread.h>
+
+using namespace koi;
+
+namespace {
+	typedef mpsc_ring<uint32_t, 64> ring;
+
+	const uint32_t PRODUCERS = 4;
+	const uint32_t COUNT = 50000; // per producer
+
+	struct producer {
+		ring* _r;
+		uint32_t _id;
+	};
+
+	// items are tagged with the producer in the top byte
+	void* produce(void* p) {
+		producer* pr = static_cast<producer*>(p);
+		for (uint32_t i = 0; i < COUNT; ++i)
+			while (!pr->_r->push((pr->_id << 24) | i))
+				;
+		return 0;
+	}
+
+}
+
+TEST_CASE("mpsc/basic", "push and pop on one thread") {
+	mpsc_ring<int, 4> r;
+	int v = 0;
+	REQUIRE(r.size() == 0);
+	REQUIRE(!r.pop(v));
+	for (int i = 0; i < 4; ++i)
+		REQUIRE(r.push(i));
+	REQUIRE(!r.push(4));
+	REQUIRE(r.size() == 4);
+	REQUIRE(r.pop(v));
+	REQUIRE(v == 0);
+	REQUIRE(r.push(4));
+	for (int i = 1; i <= 4; ++i) {
+		REQUIRE(r.pop(v));
+		REQUIRE(v == i);
+	}
+	REQUIRE(r.size() == 0);
+}
+
+TEST_CASE("mpsc/threads", "every item arrives once, in order per producer") {
+	ring r;
+	pthread_t threads[PRODUCERS];
+	producer producers[PRODUCERS];
+	for (uint32_t i = 0; i < PRODUCERS; ++i) {
+		producers[i]._r = &r;
+		producers[i]._id = i;
+		REQUIRE(pthread_create(&threads[i], 0, &produce, &producers[i]) == 0);
+	}
+
+	uint32_t expected[PRODUCERS] = { 0 };
+	bool ordered = true;
+	for (uint32_t received = 0; received < PRODUCERS * COUNT; ) {
+		uint32_t v;
+		if (r.pop(v)) {
+			const uint32_t id = v >> 24;
+			ordered = ordered && id < PRODUCERS && (v & 0xffffff) == expected[id];
+			++expected[id % PRODUCERS];
+			++received;
+		}
+	}
+	for (uint32_t i = 0; i < PRODUCERS; ++i)
+		pthread_join(threads[i], 0);
+	REQUIRE(ordered);
+	REQUIRE(r.size() == 0);
+}
@@ -63,6 +63,12 @@ TEST_CASE("messages/hrpingpong", "tests encoding, then decoding a health report"
 	hr->_services.push_back(service_info("vip", "", Svc_Started, false));
 	hr->_services.push_back(service_info("dbcleaner", "", Svc_Started, false));
 
+	hr->_load._valid = true;
+	hr->_load._loadavg = 150;
+	hr->_load._steal = 3;
+	hr->_load._memfree = 2048;
+	hr->_load._weight = 200;
+
 	std::vector<uint8_t> to;
 	bool enc = encode(to, &m, "testpass");
 	REQUIRE(enc);
@@ -73,6 +79,13 @@ TEST_CASE("messages/hrpingpong", "tests encoding, then decoding a health report"
 	REQUIRE(dec);
 	REQUIRE(out._sender_uuid == test_uuid);
 	REQUIRE(out._op == base::HealthReport);
+	const healthreport* ohr = out.body<healthreport>();
+	REQUIRE(ohr->_services.size() == 3);
+	REQUIRE(ohr->_load._valid);
+	REQUIRE(ohr->_load._loadavg == 150);
+	REQUIRE(ohr->_load._steal == 3);
+	REQUIRE(ohr->_load._memfree == 2048);
+	REQUIRE(ohr->_load._weight == 200);
 
 	LOG_TRACE("hrpingpong succeeded\n");
 }
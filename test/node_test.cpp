@@ -22,11 +22,14 @@
 #include "clusterstate.hpp"
 #include "cluster.hpp"
 #include "settings.hpp"
+#include "nexus.hpp"
 
 #include <boost/uuid/name_generator.hpp>
+#include <boost/uuid/random_generator.hpp>
 
 using namespace koi;
 using namespace boost;
+using namespace std;
 using namespace boost::uuids;
 
 TEST_CASE("node/clusterstate", "updating cluster state") {
@@ -49,3 +52,74 @@ TEST_CASE("node/clusterstate", "updating cluster state") {
 	REQUIRE(changed == false);
 
 }
+
+TEST_CASE("node/reconfigure", "apply transport and port changes without restart") {
+	vector<string> configs;
+	configs << "../test/test.conf";
+	settings cfg;
+	bool ok = cfg.boot(configs, false);
+	REQUIRE(ok);
+	cfg._transport = "127.0.0.1:4001";
+	net::io_service io_service;
+	nexus nex(io_service, cfg);
+	REQUIRE(nex.init());
+	REQUIRE(nex.links().size() == 1);
+
+	settings newcfg(cfg);
+	newcfg._transport = "127.0.0.1:4002, 127.0.0.1:4003";
+	newcfg._port = cfg._port + 1;
+	REQUIRE(nex.settings_changed(newcfg));
+	REQUIRE(nex.cfg()._port == newcfg._port);
+	REQUIRE(nex.links().size() == 2);
+	REQUIRE(nex.links()[0] == parse_endpoint("127.0.0.1", 4002));
+
+	newcfg._uuid = boost::uuids::random_generator()();
+	REQUIRE(nex.settings_changed(newcfg) == false);
+}
+
+TEST_CASE("node/iothread", "receive and send heartbeats on the I/O thread") {
+	vector<string> configs;
+	configs << "../test/test.conf";
+	settings acfg;
+	REQUIRE(acfg.boot(configs, false));
+	acfg._port = 4011;
+	acfg._transport = "127.0.0.1:4012";
+	acfg._runner = false;
+	acfg._cluster_update_interval = 10*units::milli;
+
+	settings bcfg;
+	REQUIRE(bcfg.boot(configs, false));
+	bcfg._port = 4012;
+	bcfg._transport = "127.0.0.1:4011";
+	bcfg._runner = false;
+	bcfg._cluster_update_interval = 10*units::milli;
+	bcfg._io_thread = true;
+
+	net::io_service aio, bio;
+	nexus a(aio, acfg);
+	nexus b(bio, bcfg);
+	REQUIRE(a.init());
+	REQUIRE(b.init());
+
+	// both directions: a polls its socket, b's thread owns its socket
+	bool seen = false;
+	for (int i = 0; i < 300 && !seen; ++i) {
+		aio.poll();
+		a.update();
+		b.update();
+		bool a_sees_b = false, b_sees_a = false;
+		FOREACH(const auto& n, a.nodes())
+			a_sees_b = a_sees_b || n._id == b.cfg()._uuid;
+		FOREACH(const auto& n, b.nodes())
+			b_sees_a = b_sees_a || n._id == a.cfg()._uuid;
+		seen = a_sees_b && b_sees_a;
+		usleep(10*1000);
+	}
+	REQUIRE(seen);
+
+	// sockets can still be replaced while the thread runs
+	settings newcfg(b.cfg());
+	newcfg._port = 4013;
+	REQUIRE(b.settings_changed(newcfg));
+	REQUIRE(b.cfg()._port == 4013);
+}
@@ -19,6 +19,8 @@
 #include "file.hpp"
 #include "strfmt.hpp"
 
+#include <sched.h>
+
 using namespace std;
 using namespace koi;
 
@@ -48,3 +50,23 @@ TEST_CASE("os/random", "these are a bit system dependant..") {
 	REQUIRE(makepath(dnam));
 	REQUIRE(isdir(dnam));
 }
+
+TEST_CASE("os/cpulist", "parse cpu lists for affinity masks") {
+	std::vector<int> cpus;
+	REQUIRE(os::parse_cpu_list("0-3,6", cpus));
+	REQUIRE(cpus.size() == 5);
+	REQUIRE(cpus[3] == 3);
+	REQUIRE(cpus[4] == 6);
+	REQUIRE(os::parse_cpu_list("2", cpus));
+	REQUIRE(cpus.size() == 1);
+	REQUIRE(!os::parse_cpu_list("", cpus));
+	REQUIRE(!os::parse_cpu_list("3-1", cpus));
+	REQUIRE(!os::parse_cpu_list("a", cpus));
+
+	// pinning applies to the test process, so put the old mask back
+	cpu_set_t saved;
+	REQUIRE(sched_getaffinity(0, sizeof(saved), &saved) == 0);
+	REQUIRE(os::set_cpu_affinity(std::vector<int>(1, 0)));
+	REQUIRE(!os::set_cpu_affinity(std::vector<int>()));
+	REQUIRE(sched_setaffinity(0, sizeof(saved), &saved) == 0);
+}
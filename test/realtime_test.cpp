@@ -0,0 +1,86 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "test.hpp"
+#include "realtime.hpp"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace koi;
+
+TEST_CASE("realtime/status", "real-time mode is opt-in and reports what was applied") {
+	settings cfg;
+	REQUIRE(!cfg._realtime);
+	REQUIRE(realtime::enter(cfg));
+	REQUIRE(realtime::current().to_string() == "off");
+	REQUIRE(realtime::check());
+
+	// socket options only need privileges above priority 6
+	cfg._realtime = true;
+	const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	REQUIRE(fd >= 0);
+	REQUIRE(realtime::apply_socket(fd, cfg));
+	int prio = -1;
+	socklen_t len = sizeof(prio);
+	REQUIRE(getsockopt(fd, SOL_SOCKET, SO_PRIORITY, &prio, &len) == 0);
+	REQUIRE(prio == cfg._socket_priority);
+	close(fd);
+
+	// locking memory and real-time scheduling depend on privileges,
+	// but check() must agree with what enter() managed to apply. As
+	// root they take effect, so try them in a child process.
+	const pid_t pid = fork();
+	REQUIRE(pid >= 0);
+	if (pid == 0) {
+		int rc = 0;
+		const bool entered = realtime::enter(cfg);
+		if (!realtime::current()._requested)
+			rc = 1;
+		else if (realtime::check() != (entered && realtime::current()._socket))
+			rc = 2;
+		else if (realtime::current().to_string() == "off")
+			rc = 3;
+		realtime::leave();
+		if (realtime::current().to_string() != "off" || !realtime::check())
+			rc = 4;
+		_exit(rc);
+	}
+	int status = 0;
+	REQUIRE(waitpid(pid, &status, 0) == pid);
+	REQUIRE(WIFEXITED(status));
+	REQUIRE(WEXITSTATUS(status) == 0);
+
+	realtime::leave();
+	REQUIRE(realtime::current().to_string() == "off");
+	REQUIRE(realtime::check());
+}
+
+TEST_CASE("realtime/changed", "any real-time setting needs a restart to change") {
+	settings a;
+	settings b(a);
+	REQUIRE(!realtime::changed(a, b));
+	b._realtime_priority = a._realtime_priority + 1;
+	REQUIRE(realtime::changed(a, b));
+	b = a;
+	b._busy_poll = 50;
+	REQUIRE(realtime::changed(a, b));
+	b = a;
+	b._mainloop_sleep_time = a._mainloop_sleep_time + 1;
+	REQUIRE(!realtime::changed(a, b));
+}
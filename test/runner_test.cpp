@@ -142,7 +142,7 @@ TEST_CASE("runner/check_timeouts", "Test timeout state transitions") {
 	REQUIRE(ok);
 	r.start();
 
-	ptime t0 = microsec_clock::universal_time();
+	ptime t0 = clock::now();
 	ptime t1 = t0 + milliseconds(10);
 	ptime t2 = t0 + milliseconds(70);
 	ptime t3 = t0 + milliseconds(150);
@@ -163,3 +163,40 @@ TEST_CASE("runner/check_timeouts", "Test timeout state transitions") {
 	REQUIRE(r._state == S_Slave);
 
 }
+
+TEST_CASE("runner/report_holdoff", "Transitions trigger rate limited health reports") {
+	virtual_clock vc;
+	vector<string> configs;
+	configs << "../test/test.conf";
+	settings cfg;
+	bool ok = cfg.boot(configs, false);
+	REQUIRE(ok);
+	cfg._runner_tick_interval = 60*units::micro;
+	cfg._runner_report_holdoff = 50*units::milli;
+	net::io_service io_service;
+	nexus nex(io_service, cfg);
+	runner r(nex);
+	ok = r.init();
+	REQUIRE(ok);
+	r.start();
+	r._emitter.add_receiver(net::endpoint(net::ipaddr::from_string("127.0.0.1"), nex.cfg()._port));
+
+	const ptime t0 = r._emitter._last_tick;
+	r.transition(S_Live, "test");
+	const ptime t1 = r._emitter._last_tick;
+	REQUIRE(t1 > t0);
+
+	// within the holdoff: coalesced into one delayed report
+	r.transition(S_Slave, "test");
+	r.transition(S_Live, "test");
+	REQUIRE(r._emitter._last_tick == t1);
+	REQUIRE(r._emitter._holdoff_pending);
+
+	clock::advance(40*units::milli);
+	nex.timers().advance(clock::usecs());
+	REQUIRE(r._emitter._holdoff_pending);
+	clock::advance(20*units::milli);
+	nex.timers().advance(clock::usecs());
+	REQUIRE(!r._emitter._holdoff_pending);
+	REQUIRE(r._emitter._last_tick > t1);
+}
@@ -17,6 +17,8 @@
 #include "test.hpp"
 #include "servicemgr.hpp"
 
+#include <boost/bind.hpp>
+
 TEST_CASE("servicemgr/init", "a very basic set of initial tests") {
 	using namespace koi;
 
@@ -50,6 +52,367 @@ TEST_CASE("servicemgr/init", "a very basic set of initial tests") {
 }
 
 
+TEST_CASE("servicemgr/groups", "services in a resource group follow the group master") {
+	using namespace koi;
+
+	std::vector<std::string> configs;
+	configs << "../test/test.conf";
+	settings cfg;
+	bool ok = cfg.boot(configs, false);
+	REQUIRE(ok);
+
+	group_config g;
+	g._name = "g";
+	g._services.push_back("svc");
+	cfg._groups.push_back(g);
+
+	service_manager sm;
+	sm.init("../test/s1", "../test");
+	sm.update_list(service_events(cfg));
+	REQUIRE(sm._services.size() == 1);
+	const service_manager::service& svc = sm._services.begin()->second;
+	REQUIRE(svc.group() == "g");
+	settings moved = cfg;
+	moved._groups[0]._name = "h";
+	sm.update_groups(moved);
+	REQUIRE(svc.group() == "h");
+	sm.update_groups(cfg);
+
+	sm.start();
+	REQUIRE(sm.target_for(svc) == Svc_Start);
+
+	// runner master, but not group master
+	sm.promote();
+	REQUIRE(sm.target_for(svc) == Svc_Demote);
+
+	std::set<std::string> groups;
+	groups.insert("g");
+	REQUIRE(sm.set_promoted_groups(groups));
+	REQUIRE(!sm.set_promoted_groups(groups));
+	REQUIRE(sm.target_for(svc) == Svc_Promote);
+
+	// group master on a slave runner
+	sm.demote();
+	REQUIRE(sm.target_for(svc) == Svc_Promote);
+	REQUIRE(!sm.promoted());
+
+	sm.stop();
+	REQUIRE(sm.target_for(svc) == Svc_Stop);
+}
+
+
+TEST_CASE("servicemgr/prepare", "prepare a started service for promotion") {
+	using namespace koi;
+
+	int status_interval = 10*1000*1000;
+
+	std::vector<std::string> configs;
+	configs << "../test/test.conf";
+	settings cfg;
+	bool ok = cfg.boot(configs, false);
+	REQUIRE(ok);
+	REQUIRE(cfg.svc("prepare") == &cfg._on_prepare);
+	REQUIRE(cfg.svc("stop") == &cfg._on_stop);
+
+	// directory services run in their own folder
+	char folder[PATH_MAX];
+	REQUIRE(realpath("../test/prepare", folder) != 0);
+
+	service_manager sm;
+	sm.init(folder, "../test");
+	ok = sm.update(service_events(cfg), S_Slave, status_interval, 0, false);
+	REQUIRE(ok);
+
+	REQUIRE(sm._services.size() == 1);
+	service_manager::service& svc = sm._services.begin()->second;
+	REQUIRE((svc._service_flags & service_manager::service::HAS_PREPARE) != 0);
+
+	sm.start();
+
+	timespec t = {0, 10*1000*1000};
+
+	int timeout = 100;
+	while (timeout && (svc._state != Svc_Started || svc._running.is_active())) {
+		ok = sm.update(service_events(cfg), S_Slave, status_interval, 0, false);
+		REQUIRE(ok);
+		nanosleep(&t, 0);
+		timeout--;
+	}
+	REQUIRE(svc._state == Svc_Started);
+	REQUIRE(!sm.prepared());
+
+	sm.prepare(true);
+
+	timeout = 100;
+	while (timeout && !sm.prepared()) {
+		ok = sm.update(service_events(cfg), S_Slave, status_interval, 0, false);
+		REQUIRE(ok);
+		nanosleep(&t, 0);
+		timeout--;
+	}
+	REQUIRE(sm.prepared());
+	REQUIRE(svc._state == Svc_Started);
+
+	sm.prepare(false);
+	REQUIRE(!sm.prepared());
+}
+
+
+TEST_CASE("servicemgr/runqueue", "status checks wait for a free slot") {
+	using namespace koi;
+	using namespace boost::posix_time;
+
+	int status_interval = 10*1000*1000;
+
+	std::vector<std::string> configs;
+	configs << "../test/test.conf";
+	settings cfg;
+	bool ok = cfg.boot(configs, false);
+	REQUIRE(ok);
+	cfg._service_max_concurrency = 1;
+
+	service_manager sm;
+	sm.init("../test/queue", "../test");
+	sm.start();
+
+	timespec t = {0, 10*1000*1000};
+
+	// everything started and idle
+	int timeout = 300;
+	bool idle = false;
+	while (timeout && !idle) {
+		ok = sm.update(service_events(cfg), S_Slave, status_interval, 0, false);
+		REQUIRE(ok);
+		idle = sm._services.size() == 3;
+		FOREACH(const auto& s, sm._services)
+			idle = idle && s.second._state == Svc_Started && !s.second._running.is_active();
+		nanosleep(&t, 0);
+		timeout--;
+	}
+	REQUIRE(idle);
+
+	// all checks due at once: one runs, the others queue up
+	FOREACH(auto& s, sm._services)
+		s.second._next_status = ptime(min_date_time);
+	ok = sm.verify_states(clock::now());
+	REQUIRE(ok);
+	REQUIRE(sm._running_commands() == 1);
+	REQUIRE(sm._run_queue.size() == 2);
+
+	// next checks are spread over the interval
+	const ptime now = clock::now();
+	FOREACH(const auto& s, sm._services) {
+		if (s.second._queued)
+			continue;
+		REQUIRE(s.second._next_status > now + microseconds(status_interval*8/10));
+		REQUIRE(s.second._next_status < now + microseconds(status_interval*12/10));
+	}
+}
+
+TEST_CASE("servicemgr/cascade", "start the next priority in the same pass") {
+	using namespace koi;
+
+	std::vector<std::string> configs;
+	configs << "../test/test.conf";
+	settings cfg;
+	bool ok = cfg.boot(configs, false);
+	REQUIRE(ok);
+
+	char folder[PATH_MAX];
+	REQUIRE(realpath("../test/cascade", folder) != 0);
+
+	service_manager sm;
+	sm.init(folder, "../test");
+	sm.update_list(service_events(cfg));
+	REQUIRE(sm._services.size() == 2);
+	REQUIRE(sm._services["a"]._priority == 1);
+
+	// neither service has a start script, so both start within one pass
+	sm.start();
+	ok = sm.update_states(0, true);
+	REQUIRE(ok);
+	REQUIRE(sm._services["z"]._state == Svc_Started);
+	REQUIRE(sm._services["a"]._state == Svc_Started);
+}
+
+
+TEST_CASE("servicemgr/timeouts", "adaptive timeouts from script durations") {
+	using namespace koi;
+
+	duration_histogram h;
+	REQUIRE(h.percentile(99) == 0);
+	for (int i = 0; i < 99; ++i)
+		h.add(3*1000); // 3ms, in the < 4ms bucket
+	h.add(900*1000);
+	REQUIRE(h._count == 100);
+	REQUIRE(h._max == 900*1000);
+	REQUIRE(h.percentile(50) == 4*1000);
+	REQUIRE(h.percentile(99) == 4*1000);
+	REQUIRE(h.percentile(100) == 900*1000);
+
+	std::vector<std::string> configs;
+	configs << "../test/test.conf";
+	settings cfg;
+	bool ok = cfg.boot(configs, false);
+	REQUIRE(ok);
+	cfg._adaptive_timeout_min = 1000*1000;
+	cfg._adaptive_timeout_samples = 10;
+
+	service_manager::service s(service_events(cfg), "00-test", "/nonexistent");
+	const service_event* start = cfg.svc("start");
+
+	// fixed until adaptive mode is on and there are enough samples
+	REQUIRE(s.timeout_for(start) == start->_timeout);
+	for (int i = 0; i < 10; ++i)
+		s._durations["start"].add(1500*1000);
+	REQUIRE(s.timeout_for(start) == start->_timeout);
+	cfg._adaptive_timeouts = true;
+	REQUIRE(s.timeout_for(start) == (uint64_t)1500*1000*cfg._adaptive_timeout_factor);
+
+	// never below the minimum or above the configured timeout
+	s._durations["start"] = duration_histogram();
+	for (int i = 0; i < 10; ++i)
+		s._durations["start"].add(10);
+	REQUIRE(s.timeout_for(start) == cfg._adaptive_timeout_min);
+	for (int i = 0; i < 10; ++i)
+		s._durations["start"].add(start->_timeout);
+	REQUIRE(s.timeout_for(start) == start->_timeout);
+
+	// a command killed on timeout counts as taking the whole timeout
+	s._durations["start"] = duration_histogram();
+	for (int i = 0; i < 10; ++i)
+		s._durations["start"].add(10);
+	s._event = start;
+	s._running.started_at = clock::now();
+	s._running.finished_at = s._running.started_at + boost::posix_time::microseconds(cfg._adaptive_timeout_min + 1000*1000);
+	s._running.exited = false;
+	s.record_run();
+	REQUIRE(s._durations["start"]._count == 11);
+	REQUIRE(s._durations["start"]._max == cfg._adaptive_timeout_min);
+}
+
+TEST_CASE("servicemgr/usage", "account for the resources used by service commands") {
+	using namespace koi;
+
+	std::vector<std::string> configs;
+	configs << "../test/test.conf";
+	settings cfg;
+	bool ok = cfg.boot(configs, false);
+	REQUIRE(ok);
+
+	service_manager::service s(service_events(cfg), "00-test", "/nonexistent");
+	s._event = cfg.svc("status");
+
+	char av0[] = "/bin/sh";
+	char av1[] = "-c";
+	char av2[] = "i=0; while [ $i -lt 20000 ]; do i=$((i+1)); done";
+	char* av[] = { av0, av1, av2, 0 };
+	s._running.begin(av, "/");
+	REQUIRE(s._running.wait());
+	REQUIRE(s._running.exited);
+	REQUIRE(s._running.usage.ru_maxrss > 0);
+
+	s.unrun();
+	REQUIRE(s._usage.size() == 1);
+	const resource_usage& u = s._usage["status"];
+	REQUIRE(u._runs == 1);
+	REQUIRE(u._maxrss > 0);
+	REQUIRE(u.cpu() > 0);
+	REQUIRE(s._durations["status"]._count == 1);
+
+	// a command is only accounted for once
+	s.unrun();
+	REQUIRE(s._usage["status"]._runs == 1);
+
+	// one that is still running when it is given up on is accounted
+	// for once it has exited
+	char sleeper[] = "sleep 0.2";
+	av[2] = sleeper;
+	s._event = cfg.svc("status");
+	s._running.begin(av, "/");
+	s.unrun();
+	REQUIRE(!s._running.is_active());
+	REQUIRE(s._killed.size() == 1);
+	for (int i = 0; i < 100 && !s._killed.empty(); ++i) {
+		usleep(10*1000);
+		s.reap_killed();
+	}
+	REQUIRE(s._killed.empty());
+	REQUIRE(s._usage["status"]._runs == 2);
+}
+
+TEST_CASE("servicemgr/limits", "apply limits to service commands") {
+	using namespace koi;
+
+	char av0[] = "/bin/sh";
+	char av1[] = "-c";
+	char av2[] = "exit $(nice)";
+	char* av[] = { av0, av1, av2, 0 };
+
+	command cmd;
+	cmd.limits._nice = 7;
+	cmd.limits._cpu_seconds = 10;
+	cmd.begin(av, "/");
+	REQUIRE(cmd.wait());
+	REQUIRE(cmd.exitcode == 7);
+
+	// a script killed at its cpu limit fails
+	char busy[] = "while :; do :; done";
+	av[2] = busy;
+	command runaway;
+	runaway.limits._cpu_seconds = 1;
+	runaway.begin(av, "/");
+	REQUIRE(runaway.wait());
+	REQUIRE(!runaway.exited);
+	REQUIRE(runaway.exitcode == 128 + SIGXCPU);
+}
+
+TEST_CASE("servicemgr/output", "keep the recent output of service commands") {
+	using namespace koi;
+
+	output_buffer out;
+	out.set_limit(3);
+	logging::logproxy proxy;
+	proxy._log_lines = false;
+	proxy._on_line = boost::bind(&output_buffer::add, &out, _1, _2);
+
+	command c;
+	char av0[] = "/bin/sh";
+	char av1[] = "-c";
+	char av2[] = "for i in 1 2 3 4 5; do echo line $i; done; echo oops >&2";
+	char* av[] = { av0, av1, av2, 0 };
+	const int pipe = proxy.open("00-test:status");
+	REQUIRE(pipe >= 0);
+	c.begin_pipe_stdout_to(av, "/", pipe);
+	close(pipe);
+	REQUIRE(c.wait());
+	for (int i = 0; i < 1000 && proxy.sources() > 0; ++i)
+		usleep(1000);
+	REQUIRE(proxy.sources() == 0);
+	out.add("01-other:start", "started");
+
+	std::vector<string> lines = out.lines("00-test", "status", 10000);
+	REQUIRE(lines.size() == 4);
+	REQUIRE(lines[0] == "== 00-test:status ==");
+	REQUIRE(lines[1].find("line 4") != string::npos);
+	REQUIRE(lines[3].find("oops") != string::npos);
+
+	REQUIRE(out.lines("", "", 10000).size() == 6);
+	REQUIRE(out.lines("01-other", "", 10000).size() == 2);
+	REQUIRE(out.lines("00-test", "start", 10000).empty());
+	REQUIRE(out.lines("00-tes", "", 10000).empty());
+
+	// the newest lines that fit, and a count of what was left out
+	lines = out.lines("00-test", "", lines[0].size() + output_buffer::MARKER_LEN + lines[3].size() + 3*msg::LIST_ITEM_OVERHEAD);
+	REQUIRE(lines.size() == 3);
+	REQUIRE(lines[1] == "... 2 earlier lines");
+	REQUIRE(lines[2].find("oops") != string::npos);
+
+	out.set_limit(0);
+	out.add("00-test:status", "dropped");
+	REQUIRE(out.lines("", "", 10000).empty());
+}
+
 TEST_CASE("servicemgr/fsm", "test sequence for the service state machine") {
 	using namespace koi;
 
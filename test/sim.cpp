@@ -0,0 +1,292 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "sim.hpp"
+#include "nexus.hpp"
+#include "runner.hpp"
+#include "masterstate.hpp"
+#include "network.hpp"
+#include "timer_wheel.hpp"
+#include "clock.hpp"
+#include "strfmt.hpp"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <boost/random/uniform_01.hpp>
+#include <boost/random/uniform_int.hpp>
+#include <boost/uuid/name_generator.hpp>
+
+namespace koi {
+	sim_network::sim_network(uint32_t seed)
+		: _latency(200),
+		  _jitter(100),
+		  _loss(0),
+		  _sent(0),
+		  _lost(0),
+		  _blocked(0),
+		  _seq(0),
+		  _rng(seed) {
+	}
+
+	net::endpoint sim_network::open(uint16_t port, const receiver& fn) {
+		const net::endpoint ep(net::ipaddr::from_string("127.0.0.1"), port);
+		if (_receivers.count(ep))
+			return net::endpoint();
+		_receivers[ep] = fn;
+		return ep;
+	}
+
+	void sim_network::close(const net::endpoint& local) {
+		_receivers.erase(local);
+	}
+
+	void sim_network::send(const net::endpoint& from, const net::endpoint& to, const std::vector<uint8_t>& data) {
+		std::vector<net::endpoint> dests;
+		if (net::is_multicast(to.address())) {
+			FOREACH(const auto& r, _receivers)
+				dests.push_back(r.first);
+		}
+		else {
+			dests.push_back(to);
+		}
+
+		boost::uniform_01<boost::mt19937&> chance(_rng);
+		boost::uniform_int<uint64_t> jitter(0, _jitter);
+		FOREACH(const net::endpoint& dest, dests) {
+			++_sent;
+			if (_loss > 0 && chance() < _loss) {
+				++_lost;
+				continue;
+			}
+			packet p;
+			p._at = clock::usecs() + _latency + jitter(_rng);
+			p._seq = _seq++;
+			p._from = from;
+			p._to = dest;
+			p._data = data;
+			_in_flight.push(p);
+		}
+	}
+
+	// partitions are checked on delivery, so that a partition also
+	// stops what is already in flight
+	void sim_network::deliver(uint64_t now) {
+		while (!_in_flight.empty() && _in_flight.top()._at <= now) {
+			packet p = _in_flight.top();
+			_in_flight.pop();
+			auto r = _receivers.find(p._to);
+			if (r == _receivers.end())
+				continue;
+			const auto from_side = _sides.find(p._from), to_side = _sides.find(p._to);
+			if ((from_side == _sides.end() ? 0 : from_side->second) !=
+			    (to_side == _sides.end() ? 0 : to_side->second)) {
+				++_blocked;
+				continue;
+			}
+			// the kernel timestamp would be wall time, which the
+			// virtual clock doesn't follow
+			r->second(p._data, p._from, 0);
+		}
+	}
+
+	uint64_t sim_network::next_delivery() const {
+		return _in_flight.empty() ? timer_wheel::NEVER : _in_flight.top()._at;
+	}
+
+	void sim_network::set_side(const net::endpoint& ep, int side) {
+		_sides[ep] = side;
+	}
+
+	void sim_network::heal() {
+		_sides.clear();
+	}
+
+	const uint16_t sim_cluster::BASE_PORT;
+
+	sim_cluster::sim_cluster(size_t nodes, uint32_t seed)
+		: _net(seed),
+		  _nodes(nodes) {
+		char tmpl[] = "/tmp/koi-sim-XXXXXX";
+		if (!mkdtemp(tmpl))
+			throw std::runtime_error("Failed to create the services folder.");
+		_services = tmpl;
+
+		string transport;
+		for (size_t i = 0; i < nodes; ++i)
+			transport += strfmt<32>("%s127.0.0.1:%d", i ? "," : "", BASE_PORT + (int)i).str();
+
+		boost::uuids::name_generator gen(boost::uuids::nil_uuid());
+		for (size_t i = 0; i < nodes; ++i) {
+			settings& cfg = _nodes[i]._cfg;
+			cfg._name = strfmt<32>("sim%02d", (int)i).str();
+			cfg._uuid = gen(cfg._name);
+			cfg._port = BASE_PORT + i;
+			cfg._transport = transport;
+			cfg._runner = true;
+			cfg._elector = true;
+			cfg._journal_size = 0;
+			cfg._services_folder = _services;
+			cfg._services_workingdir = _services;
+		}
+		_sleep_time = _nodes.empty() ? units::micro : _nodes[0]._cfg._mainloop_sleep_time;
+	}
+
+	sim_cluster::~sim_cluster() {
+		FOREACH(node& n, _nodes) {
+			n._nexus.reset();
+			n._io.reset();
+		}
+		rmdir(_services.c_str());
+	}
+
+	void sim_cluster::start(size_t i) {
+		node& n = _nodes[i];
+		n._nexus.reset();
+		n._cfg._starttime = clock::now();
+		n._io.reset(new net::io_service);
+		n._nexus.reset(new nexus(*n._io, n._cfg, &_net));
+		if (!n._nexus->init())
+			throw std::runtime_error("Failed to initialize a simulated node.");
+		_net.set_side(address(i), 0);
+		n._up = true;
+		n._side = 0;
+	}
+
+	// the node keeps its state, as a hung process would
+	void sim_cluster::crash(size_t i) {
+		node& n = _nodes[i];
+		n._up = false;
+		_net.set_side(address(i), -1 - (int)i);
+	}
+
+	void sim_cluster::partition(const std::vector<size_t>& side) {
+		FOREACH(size_t i, side) {
+			_nodes[i]._side = 1;
+			_net.set_side(address(i), 1);
+		}
+	}
+
+	void sim_cluster::heal() {
+		_net.heal();
+		for (size_t i = 0; i < _nodes.size(); ++i) {
+			_nodes[i]._side = 0;
+			if (_nodes[i]._nexus && !_nodes[i]._up)
+				crash(i);
+		}
+	}
+
+	void sim_cluster::step() {
+		clock::tick();
+		_net.deliver(clock::usecs());
+		FOREACH(node& n, _nodes) {
+			if (!n._up)
+				continue;
+			n._io->poll();
+			n._nexus->update();
+		}
+
+		const uint64_t now = clock::usecs();
+		uint64_t next = std::min(now + _sleep_time, _net.next_delivery());
+		FOREACH(const node& n, _nodes)
+			if (n._up)
+				next = std::min(next, n._nexus->timers().next_deadline());
+		clock::advance(next > now ? next - now : 1);
+	}
+
+	void sim_cluster::run_for(uint64_t usecs) {
+		const uint64_t until = clock::usecs() + usecs;
+		while (clock::usecs() < until)
+			step();
+	}
+
+	bool sim_cluster::run_until(const boost::function<bool ()>& done, uint64_t timeout) {
+		const uint64_t until = clock::usecs() + timeout;
+		while (!done()) {
+			if (clock::usecs() >= until)
+				return false;
+			step();
+		}
+		return true;
+	}
+
+	net::endpoint sim_cluster::address(size_t i) const {
+		return net::endpoint(net::ipaddr::from_string("127.0.0.1"), _nodes[i]._cfg._port);
+	}
+
+	int sim_cluster::index_of(const net::endpoint& ep) const {
+		const int i = (int)ep.port() - BASE_PORT;
+		return (i >= 0 && i < (int)_nodes.size()) ? i : -1;
+	}
+
+	bool sim_cluster::counted(size_t i) const {
+		return _nodes[i]._up && _nodes[i]._side == 0;
+	}
+
+	size_t sim_cluster::live() const {
+		size_t count = 0;
+		for (size_t i = 0; i < _nodes.size(); ++i)
+			count += counted(i) ? 1 : 0;
+		return count;
+	}
+
+	int sim_cluster::elector() const {
+		int found = -1;
+		for (size_t i = 0; i < _nodes.size(); ++i) {
+			if (!counted(i))
+				continue;
+			const int e = index_of(_nodes[i]._nexus->get_elector());
+			if (e < 0 || (found >= 0 && e != found))
+				return -1;
+			found = e;
+		}
+		return found;
+	}
+
+	int sim_cluster::master() const {
+		int found = -1;
+		for (size_t i = 0; i < _nodes.size(); ++i) {
+			const runner* r = counted(i) ? _nodes[i]._nexus->get_runner() : 0;
+			if (r && r->_state == S_Master) {
+				if (found >= 0)
+					return -1;
+				found = (int)i;
+			}
+		}
+		return found;
+	}
+
+	bool sim_cluster::converged() const {
+		const int m = master();
+		if (m < 0 || elector() < 0)
+			return false;
+		const uuid& master_id = _nodes[m]._cfg._uuid;
+		for (size_t i = 0; i < _nodes.size(); ++i) {
+			if (!counted(i))
+				continue;
+			const nexus& n = *_nodes[i]._nexus;
+			if (n.nodes().size() != live())
+				return false;
+			FOREACH(const auto& peer, n.nodes()) {
+				const int p = index_of(peer._addrs.get());
+				if (p < 0 || !counted(p))
+					return false;
+			}
+			if (n.get_masterstate()._uuid != master_id)
+				return false;
+		}
+		return true;
+	}
+}
@@ -0,0 +1,132 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#pragma once
+
+#include "koi.hpp"
+#include "settings.hpp"
+#include "transport.hpp"
+#include <map>
+#include <queue>
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace koi {
+	struct nexus;
+
+	/*
+	 * A cluster of nexus instances in one process, on the virtual
+	 * clock and an in-memory network.
+	 *
+	 * sim_network stands in for the UDP sockets. Every datagram is
+	 * delayed by the latency plus a random jitter, lost with the
+	 * given probability, and dropped between nodes on different
+	 * sides of a partition. A multicast destination reaches every
+	 * open address.
+	 *
+	 * sim_cluster steps each node the way the koinode main loop
+	 * does, then moves the clock straight to the next timer, the next
+	 * delivery or the end of mainloop_sleep_time, whichever is first.
+	 * A minute of cluster time passes in well under a second of real
+	 * time. The random source is seeded, so a scenario plays out the
+	 * same way every time it is run.
+	 *
+	 * The runners have no services, so they are promotable as soon
+	 * as they are live.
+	 */
+	struct sim_network : public transport {
+		struct packet {
+			uint64_t _at; // delivery time, usecs
+			uint64_t _seq; // send order, for packets due at the same time
+			net::endpoint _from;
+			net::endpoint _to;
+			std::vector<uint8_t> _data;
+
+			bool operator>(const packet& o) const {
+				return _at != o._at ? _at > o._at : _seq > o._seq;
+			}
+		};
+
+		sim_network(uint32_t seed = 1);
+
+		virtual net::endpoint open(uint16_t port, const receiver& fn);
+		virtual void close(const net::endpoint& local);
+		virtual void send(const net::endpoint& from, const net::endpoint& to, const std::vector<uint8_t>& data);
+
+		void deliver(uint64_t now); // everything due by now
+		uint64_t next_delivery() const; // timer_wheel::NEVER if nothing is in flight
+
+		void set_side(const net::endpoint& ep, int side); // addresses on different sides can't reach each other
+		void heal(); // everyone back on side 0
+
+		uint64_t _latency; // usecs, one way
+		uint64_t _jitter; // usecs, up to this much is added at random
+		double   _loss; // probability that a datagram is lost
+
+		uint64_t _sent;
+		uint64_t _lost; // at random
+		uint64_t _blocked; // by a partition
+
+		std::map<net::endpoint, receiver> _receivers;
+		std::map<net::endpoint, int> _sides; // 0 if not listed
+		std::priority_queue<packet, std::vector<packet>, std::greater<packet> > _in_flight;
+		uint64_t _seq;
+		boost::mt19937 _rng;
+	};
+
+	struct sim_cluster {
+		static const uint16_t BASE_PORT = 20000; // node i listens on BASE_PORT + i
+
+		struct node {
+			node() : _up(false), _side(0) {}
+
+			settings _cfg;
+			boost::shared_ptr<net::io_service> _io;
+			boost::shared_ptr<nexus> _nexus;
+			bool _up; // stepped, and reachable
+			int _side; // of a partition, only side 0 is counted as the cluster
+		};
+
+		sim_cluster(size_t nodes, uint32_t seed = 1);
+		~sim_cluster();
+
+		void start(size_t i);
+		void crash(size_t i); // stops stepping the node and cuts it off, without a shutdown
+		void partition(const std::vector<size_t>& side); // cuts these nodes off from the rest
+		void heal(); // reconnects the partitioned nodes, crashed nodes stay cut off
+
+		void step(); // one main loop iteration of every live node, then moves the clock
+		void run_for(uint64_t usecs);
+		bool run_until(const boost::function<bool ()>& done, uint64_t timeout); // false on timeout
+
+		// what the live nodes on side 0 agree on, -1 if they don't
+		int elector() const; // the node they all follow as elector
+		int master() const; // the only runner among them that is master
+		bool converged() const; // they see each other, the same elector and master
+
+		net::endpoint address(size_t i) const;
+		int index_of(const net::endpoint& ep) const;
+		bool counted(size_t i) const; // live and on side 0
+		size_t live() const; // counted nodes
+
+		sim_network _net;
+		std::vector<node> _nodes;
+		string _services; // empty services folder for the runners
+		uint64_t _sleep_time; // mainloop_sleep_time of the nodes
+	};
+}
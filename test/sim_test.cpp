@@ -0,0 +1,57 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "test.hpp"
+#include "sim.hpp"
+#include "logging.hpp"
+
+#include <boost/bind.hpp>
+
+using namespace koi;
+
+namespace {
+	bool has_master(const sim_cluster& c) {
+		return c.master() >= 0;
+	}
+
+	bool converged(const sim_cluster& c) {
+		return c.converged();
+	}
+
+	struct quiet_log {
+		quiet_log() : _level(logging::loglevel) { logging::set_log_level(logging::Error); }
+		~quiet_log() { logging::set_log_level(_level); }
+		logging::LogLevels _level;
+	};
+}
+
+TEST_CASE("sim/failover", "a simulated cluster elects a master and fails over when it crashes") {
+	virtual_clock vc;
+	quiet_log ql;
+	sim_cluster c(5);
+	for (size_t i = 0; i < c._nodes.size(); ++i)
+		c.start(i);
+
+	REQUIRE(c.run_until(boost::bind(converged, boost::cref(c)), 120*units::micro));
+	const int first = c.master();
+	REQUIRE(first >= 0);
+
+	c.crash(first);
+	REQUIRE(c.run_until(boost::bind(has_master, boost::cref(c)), 120*units::micro));
+	REQUIRE(c.master() != first);
+	REQUIRE(c.run_until(boost::bind(converged, boost::cref(c)), 120*units::micro));
+	REQUIRE(c.live() == 4);
+}
@@ -0,0 +1,74 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "test.hpp"
+#include "spsc.hpp"
+
+#include <pthread.h>
+
+using namespace koi;
+
+namespace {
+	typedef spsc_ring<uint32_t, 64> ring;
+
+	const uint32_t COUNT = 100000;
+
+	void* produce(void* p) {
+		ring* r = static_cast<ring*>(p);
+		for (uint32_t i = 0; i < COUNT; ++i)
+			while (!r->push(i))
+				;
+		return 0;
+	}
+}
+
+TEST_CASE("spsc/basic", "push and pop on one thread") {
+	spsc_ring<int, 4> r;
+	int v = 0;
+	REQUIRE(r.empty());
+	REQUIRE(!r.pop(v));
+	for (int i = 0; i < 4; ++i)
+		REQUIRE(r.push(i));
+	REQUIRE(!r.push(4));
+	REQUIRE(r.size() == 4);
+	REQUIRE(r.pop(v));
+	REQUIRE(v == 0);
+	REQUIRE(r.push(4));
+	for (int i = 1; i <= 4; ++i) {
+		REQUIRE(r.pop(v));
+		REQUIRE(v == i);
+	}
+	REQUIRE(r.empty());
+}
+
+TEST_CASE("spsc/threads", "items arrive in order across threads") {
+	ring r;
+	pthread_t producer;
+	REQUIRE(pthread_create(&producer, 0, &produce, &r) == 0);
+
+	uint32_t expected = 0;
+	bool ordered = true;
+	while (expected < COUNT) {
+		uint32_t v;
+		if (r.pop(v)) {
+			ordered = ordered && (v == expected);
+			++expected;
+		}
+	}
+	pthread_join(producer, 0);
+	REQUIRE(ordered);
+	REQUIRE(r.empty());
+}
@@ -17,6 +17,13 @@
 #pragma once
 
 #include "koi.hpp"
+#include "clock.hpp"
 #include <vector>
 #include <exception>
 #include "catch.hpp"
+
+// stops the clock for the lifetime of the object, see clock::set
+struct virtual_clock {
+	virtual_clock() { koi::clock::set(koi::clock::read()); }
+	~virtual_clock() { koi::clock::reset(); }
+};
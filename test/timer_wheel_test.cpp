@@ -0,0 +1,102 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "test.hpp"
+#include "timer_wheel.hpp"
+
+#include <boost/bind.hpp>
+
+using namespace koi;
+
+namespace {
+	const uint64_t MS = 1000;
+	const uint64_t T0 = 1000000 * MS;
+
+	void record(std::vector<int>* fired, int which) {
+		fired->push_back(which);
+	}
+}
+
+TEST_CASE("timerwheel/order", "timers fire once, in deadline order") {
+	timer_wheel w(T0);
+	std::vector<int> fired;
+	w.schedule(30*MS, boost::bind(record, &fired, 3));
+	w.schedule(10*MS, boost::bind(record, &fired, 1));
+	w.schedule(200*MS, boost::bind(record, &fired, 4)); // level 2
+	w.schedule(20*MS, boost::bind(record, &fired, 2));
+	REQUIRE(w.size() == 4);
+	REQUIRE(w.next_deadline() == T0 + 10*MS);
+
+	REQUIRE(w.advance(T0 + 9*MS) == 0);
+	REQUIRE(w.advance(T0 + 25*MS) == 2);
+	REQUIRE(w.next_deadline() == T0 + 30*MS);
+	REQUIRE(w.advance(T0 + 199*MS) == 1);
+	REQUIRE(w.next_deadline() == T0 + 200*MS);
+	REQUIRE(w.advance(T0 + 300*MS) == 1);
+	REQUIRE(w.size() == 0);
+	REQUIRE(w.next_deadline() == timer_wheel::NEVER);
+	REQUIRE(w.advance(T0 + 400*MS) == 0);
+
+	REQUIRE(fired.size() == 4);
+	for (int i = 0; i < 4; ++i)
+		REQUIRE(fired[i] == i + 1);
+}
+
+TEST_CASE("timerwheel/cancel", "cancelled timers never fire, periodic timers repeat") {
+	timer_wheel w(T0);
+	std::vector<int> fired;
+	timer_wheel::timer_id a = w.schedule(5*MS, boost::bind(record, &fired, 1));
+	timer_wheel::timer_id b = w.schedule_every(10*MS, boost::bind(record, &fired, 2));
+	REQUIRE(w.pending(a));
+	REQUIRE(w.cancel(a));
+	REQUIRE(!w.cancel(a));
+	REQUIRE(!w.pending(a));
+	REQUIRE(w.next_deadline() == T0 + 10*MS);
+
+	for (uint64_t t = 1; t <= 50; ++t)
+		w.advance(T0 + t*MS);
+	REQUIRE(fired.size() == 5);
+	REQUIRE(fired[0] == 2);
+	REQUIRE(w.pending(b));
+	REQUIRE(w.next_deadline() == T0 + 60*MS);
+
+	w.cancel(b);
+	w.advance(T0 + 100*MS);
+	REQUIRE(fired.size() == 5);
+	REQUIRE(w.size() == 0);
+}
+
+TEST_CASE("timerwheel/jumps", "clock jumps neither lose nor stall timers") {
+	timer_wheel w(T0);
+	std::vector<int> fired;
+	w.schedule(50*MS, boost::bind(record, &fired, 1));
+	w.schedule(3600*1000*MS, boost::bind(record, &fired, 2)); // overflow
+	w.schedule_every(1000*MS, boost::bind(record, &fired, 3));
+
+	// forward past everything but the hour: each timer fires once
+	REQUIRE(w.advance(T0 + 20000*MS) == 2);
+	REQUIRE(w.now() == T0 + 20000*MS);
+	REQUIRE(w.next_deadline() == T0 + 21000*MS);
+
+	// backwards: the periodic timer keeps its remaining second
+	REQUIRE(w.advance(T0 + 10000*MS) == 0);
+	REQUIRE(w.next_deadline() == T0 + 11000*MS);
+	REQUIRE(w.advance(T0 + 11000*MS) == 1);
+
+	REQUIRE(w.advance(T0 + 3700*1000*MS) == 2);
+	REQUIRE(fired.size() == 5);
+	REQUIRE(w.size() == 1);
+}
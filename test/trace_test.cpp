@@ -0,0 +1,143 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "test.hpp"
+#include "trace.hpp"
+#include "elector.hpp"
+#include "nexus.hpp"
+#include <boost/uuid/uuid_generators.hpp>
+
+using namespace koi;
+
+TEST_CASE("trace/marks", "marks are kept, parsed and exported as spans") {
+	failover_trace t;
+	t.add(100, failover_trace::Ph_ReportLost, 1000, "elector");
+	t.add(100, failover_trace::Ph_Disconnected, 4000, "elector");
+	t.add(100, failover_trace::Ph_Elected, 4500, "elector");
+
+	std::vector<string> lines = t.marks(0, msg::MAX_LIST_LEN);
+	REQUIRE(lines.size() == 3);
+	REQUIRE(lines[1] == "100 disconnected 4000 elector");
+
+	std::vector<failover_trace::mark> marks;
+	FOREACH(const string& s, lines) {
+		failover_trace::mark m;
+		REQUIRE(failover_trace::mark::parse(s, m));
+		marks.push_back(m);
+	}
+	failover_trace::mark m;
+	REQUIRE(!failover_trace::mark::parse("100 nonsense 4000 elector", m));
+
+	// the new master reports from another node; duplicates collapse
+	m._epoch = 100;
+	m._phase = failover_trace::Ph_StateUpdate;
+	m._time = 4700;
+	m._node = "runner";
+	marks.push_back(m);
+	marks.push_back(m);
+
+	const string json = failover_trace::chrome_json(marks);
+	REQUIRE(json.find("\"name\":\"failover 100\"") != string::npos);
+	REQUIRE(json.find("\"name\":\"disconnected\",\"cat\":\"failover\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":1000,\"dur\":3000") != string::npos);
+	REQUIRE(json.find("\"name\":\"stateupdate\",\"cat\":\"failover\",\"ph\":\"X\",\"pid\":1,\"tid\":2,\"ts\":4500,\"dur\":200") != string::npos);
+	REQUIRE(json.find("stateupdate") == json.rfind("stateupdate"));
+
+	for (size_t i = 0; i < failover_trace::LIMIT; ++i)
+		t.add(200, failover_trace::Ph_Elected, i, "elector");
+	REQUIRE(t._marks.size() == failover_trace::LIMIT);
+	REQUIRE(t._marks.front()._epoch == 200);
+
+	// the reply keeps the newest marks that fit in a list
+	t.add(300, failover_trace::Ph_Elected, 9999, "elector");
+	lines = t.marks(0, msg::MAX_LIST_LEN);
+	REQUIRE(lines.size() < failover_trace::LIMIT);
+	size_t bytes = 0;
+	FOREACH(const string& s, lines)
+		bytes += s.size() + msg::LIST_ITEM_OVERHEAD;
+	REQUIRE(bytes <= (size_t)msg::MAX_LIST_LEN);
+	REQUIRE(lines.back() == "300 elected 9999 elector");
+	lines = t.marks(300, msg::MAX_LIST_LEN);
+	REQUIRE(lines.size() == 1);
+}
+
+TEST_CASE("trace/failover", "the elector marks a lost master and the election under one epoch") {
+	using namespace boost::posix_time;
+
+	std::vector<std::string> configs;
+	configs << "../test/test.conf";
+	settings cfg;
+	REQUIRE(cfg.boot(configs, false));
+
+	virtual_clock vc;
+	net::io_service io_service;
+	nexus ro(io_service, cfg);
+	elector a(ro);
+	REQUIRE(a.init(clock::now()));
+	a.start();
+
+	elector::runner_info r;
+	r._last_failed = ptime(min_date_time);
+	r._uptime = 20000;
+	r._mode = R_Active;
+	r._maintenance = false;
+
+	r._name = "old";
+	r._uuid = boost::uuids::random_generator()();
+	r._state = S_Master;
+	r._last_seen = clock::now();
+	r._endpoints.insert(net::endpoint(net::ipaddr(), 6666));
+	auto old_master = a._runners.insert(std::make_pair(r._uuid, r)).first;
+	a._master = old_master;
+	const uint64_t lost_at = clock::usecs();
+
+	clock::advance(3600*units::micro);
+
+	r._name = "new";
+	r._uuid = boost::uuids::random_generator()();
+	r._state = S_Slave;
+	r._last_seen = clock::now();
+	r._endpoints.insert(net::endpoint(net::ipaddr(), 6667));
+	auto new_master = a._runners.insert(std::make_pair(r._uuid, r)).first;
+
+	int npromoted = 0, nfailed = 0;
+	REQUIRE(a._check_runner_health(clock::now(), npromoted, nfailed));
+	REQUIRE(old_master->second._state == S_Disconnected);
+	REQUIRE(a._failing_over);
+	const uint64_t epoch = a._epoch;
+	REQUIRE(epoch == clock::usecs());
+
+	a._master = a._runners.end(); // _check_master_health, outside maintenance mode
+	clock::advance(5*units::milli);
+	REQUIRE(a.elect_node(new_master));
+	REQUIRE(!a._failing_over);
+	REQUIRE(a._epoch == epoch);
+
+	const std::deque<failover_trace::mark>& marks = ro.get_trace()._marks;
+	REQUIRE(marks.size() == 3);
+	REQUIRE(marks[0]._phase == failover_trace::Ph_ReportLost);
+	REQUIRE(marks[0]._time == lost_at);
+	REQUIRE(marks[1]._phase == failover_trace::Ph_Disconnected);
+	REQUIRE(marks[2]._phase == failover_trace::Ph_Elected);
+	REQUIRE(marks[2]._time == epoch + 5*units::milli);
+	FOREACH(const failover_trace::mark& m, marks)
+		REQUIRE(m._epoch == epoch);
+
+	message m(cfg._uuid, cfg._cluster_id);
+	a.on_tick(&m);
+	REQUIRE(m.body<msg::stateupdate>()->_epoch == epoch);
+
+	a.stop();
+}
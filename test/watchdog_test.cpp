@@ -0,0 +1,65 @@
+/*
+  Copyright (c) 2012 by Procera Networks, Inc. ("PROCERA")
+
+  Permission to use, copy, modify, and/or distribute this software for
+  any purpose with or without fee is hereby granted, provided that the
+  above copyright notice and this permission notice appear in all
+  copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND PROCERA DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL PROCERA BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+  OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+#include "test.hpp"
+#include "watchdog.hpp"
+#include "metrics.hpp"
+#include "clock.hpp"
+#include <algorithm>
+
+using namespace koi;
+
+namespace {
+	bool has_line(const std::vector<string>& lines, const string& line) {
+		return std::find(lines.begin(), lines.end(), line) != lines.end();
+	}
+
+	void blocking_call(uint64_t usec) {
+		WATCHDOG_PHASE("koitest.blocking");
+		clock::advance(usec);
+	}
+
+	void update(uint64_t usec) {
+		WATCHDOG_PHASE("koitest.update");
+		clock::advance(100);
+		blocking_call(usec);
+	}
+}
+
+TEST_CASE("watchdog/stall", "a stall is blamed on the innermost phase that ran too long") {
+	virtual_clock vc;
+	watchdog::set_threshold(500*units::milli);
+	const uint64_t before = watchdog::stalls();
+
+	update(1000);
+	REQUIRE(watchdog::stalls() == before);
+
+	update(800*units::milli);
+	REQUIRE(watchdog::stalls() == before + 1);
+	REQUIRE(watchdog::summary().find("0.800s in koitest.update > koitest.blocking") != string::npos);
+
+	std::vector<string> lines = metrics::prometheus("koi_mainloop_");
+	REQUIRE(has_line(lines, "koi_mainloop_phase_seconds_count{phase=\"koitest.update\"} 2"));
+	REQUIRE(has_line(lines, "koi_mainloop_phase_seconds_count{phase=\"koitest.blocking\"} 2"));
+	REQUIRE(has_line(lines, "koi_mainloop_stalls_total{phase=\"koitest.blocking\"} 1"));
+	REQUIRE(has_line(lines, "koi_mainloop_stalls_total{phase=\"koitest.update\"} 0"));
+
+	// off
+	watchdog::set_threshold(0);
+	update(800*units::milli);
+	REQUIRE(watchdog::stalls() == before + 1);
+	REQUIRE(watchdog::summary() == "off");
+}